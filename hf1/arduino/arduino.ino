@@ -34,6 +34,7 @@
 #include "create_head_mixed_trajectory_view_action_handler.h"
 #include "execute_base_trajectory_view_action_handler.h"
 #include "execute_head_trajectory_view_action_handler.h"
+#include "get_link_stats_action_handler.h"
 
 // Maximum time during which communication can be processed without
 // yielding time to other tasks.
@@ -56,7 +57,7 @@ HeadTrajectoryController head_trajectory_controller("HeadTrajectoryController");
 
 TrajectoryStore trajectory_store;
 
-P2PActionServer p2p_action_server(&p2p_stream);
+P2PActionServer p2p_action_server(&p2p_stream, &timer);
 SetHeadPoseActionHandler set_head_pose_action_handler(&p2p_stream);
 SetBaseVelocityActionHandler set_base_velocity_action_handler(&p2p_stream, &base_speed_controller);
 SyncTimeActionHandler sync_time_action_handler(&p2p_stream, &timer);
@@ -73,6 +74,7 @@ CreateBaseMixedTrajectoryViewActionHandler create_base_mixed_trajectory_view_act
 CreateHeadMixedTrajectoryViewActionHandler create_head_mixed_trajectory_view_action_handler(&p2p_stream, &trajectory_store);
 ExecuteBaseTrajectoryViewActionHandler execute_base_trajectory_view_action_handler(&p2p_stream, &trajectory_store, &base_trajectory_controller);
 ExecuteHeadTrajectoryViewActionHandler execute_head_trajectory_view_action_handler(&p2p_stream, &trajectory_store, &head_trajectory_controller);
+GetLinkStatsActionHandler get_link_stats_action_handler(&p2p_stream);
 
 void setup() {
   // Open serial port before anything else, as it enables showing logs and asserts in the console.
@@ -122,6 +124,7 @@ void setup() {
   p2p_action_server.Register(&create_head_mixed_trajectory_view_action_handler);
   p2p_action_server.Register(&execute_base_trajectory_view_action_handler);
   p2p_action_server.Register(&execute_head_trajectory_view_action_handler);
+  p2p_action_server.Register(&get_link_stats_action_handler);
 
   LOG_INFO("Ready.");
 
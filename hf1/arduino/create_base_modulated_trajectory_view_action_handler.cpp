@@ -146,6 +146,5 @@ bool CreateBaseModulatedTrajectoryViewActionHandler::TrySendingReply() {
   }
   P2PActionPacketAdapter<P2PCreateBaseModulatedTrajectoryViewReply> reply = *maybe_reply;
   reply->status_code = LocalToNetwork<kP2PLocalEndianness>(result_);
-  reply.Commit(/*guarantee_delivery=*/true);
-  return true;
+  return reply.Commit(/*guarantee_delivery=*/true);
 }
@@ -1,36 +1,76 @@
 #include "create_base_trajectory_action_handler.h"
 #include "trajectory_store.h"
 
+bool CreateBaseTrajectoryActionHandler::OnRequestFragment(int offset, int, const uint8_t *data, int length) {
+  // Keep the fields before the waypoints, which fit in the request buffer.
+  CopyRequestFragment(offset, data, length);
+  if (offset == 0) {
+    if (length < RequestParser::kWaypointsOffset) {
+      return false;
+    }
+    BeginTrajectory(*reinterpret_cast<const P2PCreateBaseTrajectoryRequest *>(GetRequestCopyBuffer()));
+  }
+  // Waypoints go straight into the trajectory, so it can have more than fit in the request.
+  request_parser_.Feed(offset, data, length);
+  AddWaypoints();
+  return true;
+}
+
+void CreateBaseTrajectoryActionHandler::BeginTrajectory(const P2PCreateBaseTrajectoryRequest &request) {
+  trajectory_id_ = static_cast<int>(NetworkToLocal<kP2PLocalEndianness>(request.id));
+  num_waypoints_ = static_cast<int>(NetworkToLocal<kP2PLocalEndianness>(request.trajectory.num_waypoints));
+  num_inserted_waypoints_ = 0;
+  request_parser_.Reset();
+
+  auto &maybe_trajectory = trajectory_store_.base_trajectories()[trajectory_id_];
+  if (maybe_trajectory.status() == Status::kDoesNotExistError) {
+    result_ = maybe_trajectory.status();
+  } else if (num_waypoints_ < 0 || num_waypoints_ > kMaxNumWaypointsPerStoredTrajectory) {
+    result_ = Status::kUnavailableError;
+  } else {
+    result_ = Status::kSuccess;
+    maybe_trajectory = Trajectory<BaseTargetState, kMaxNumWaypointsPerStoredTrajectory>();
+  }
+}
+
+void CreateBaseTrajectoryActionHandler::AddWaypoints() {
+  if (result_ != Status::kSuccess) {
+    return;
+  }
+  auto &maybe_trajectory = trajectory_store_.base_trajectories()[trajectory_id_];
+  P2PBaseWaypoint waypoint;
+  while (num_inserted_waypoints_ < num_waypoints_ && request_parser_.NextWaypoint(&waypoint)) {
+    const auto waypoint_seconds = NetworkToLocal<kP2PLocalEndianness>(waypoint.seconds);
+    const auto &target_state_msg = waypoint.target_state.location;
+    const BaseTargetState target_state({
+      BaseStateVars{
+        Point(NetworkToLocal<kP2PLocalEndianness>(target_state_msg.x_meters), NetworkToLocal<kP2PLocalEndianness>(target_state_msg.y_meters)), 
+        NetworkToLocal<kP2PLocalEndianness>(target_state_msg.yaw_radians)
+      }
+    });
+    maybe_trajectory->Insert(BaseWaypoint(waypoint_seconds, target_state));
+    ++num_inserted_waypoints_;
+  }
+}
+
 bool CreateBaseTrajectoryActionHandler::Run() {
   switch(state_) {
     case kProcessingRequest: {
-      const P2PCreateBaseTrajectoryRequest &request = GetRequest();
-
-      const int trajectory_id = static_cast<int>(NetworkToLocal<kP2PLocalEndianness>(request.id));
-      const int num_waypoints = static_cast<int>(NetworkToLocal<kP2PLocalEndianness>(request.trajectory.num_waypoints));
+      if (request_bytes() != GetRequestCopyBuffer()) {
+        // The request came in a single packet, rather than streamed in fragments.
+        BeginTrajectory(GetRequest());
+        request_parser_.Feed(0, request_bytes(), request_length());
+        AddWaypoints();
+      }
+      if (result_ == Status::kSuccess && num_inserted_waypoints_ < num_waypoints_) {
+        // The request is shorter than its number of waypoints.
+        result_ = Status::kMalformedError;
+      }
       
       char str[80];
-      sprintf(str, "create_base_trajectory(id=%d, num_waypoints=%d)", trajectory_id, num_waypoints);
+      sprintf(str, "create_base_trajectory(id=%d, num_waypoints=%d)", trajectory_id_, num_waypoints_);
       LOG_INFO(str);
 
-      auto &maybe_trajectory = trajectory_store_.base_trajectories()[trajectory_id];
-      if (maybe_trajectory.status() == Status::kDoesNotExistError) {
-        result_ = maybe_trajectory.status();
-      } else {
-        result_ = Status::kSuccess;
-        maybe_trajectory = Trajectory<BaseTargetState, kP2PMaxNumWaypointsPerTrajectory>();
-        for (int i = 0; i < num_waypoints; ++i) {
-          const auto waypoint_seconds = NetworkToLocal<kP2PLocalEndianness>(request.trajectory.waypoints[i].seconds);
-          const auto &target_state_msg = request.trajectory.waypoints[i].target_state.location;
-          const BaseTargetState target_state({
-            BaseStateVars{
-              Point(NetworkToLocal<kP2PLocalEndianness>(target_state_msg.x_meters), NetworkToLocal<kP2PLocalEndianness>(target_state_msg.y_meters)), 
-              NetworkToLocal<kP2PLocalEndianness>(target_state_msg.yaw_radians)
-            }
-          });
-          maybe_trajectory->Insert(BaseWaypoint(waypoint_seconds, target_state));
-        }
-      }
       if (TrySendingReply()) {
         return false; // Reply sent; do not call Run() again.
       }
@@ -56,6 +96,5 @@ bool CreateBaseTrajectoryActionHandler::TrySendingReply() {
   }
   P2PActionPacketAdapter<P2PCreateBaseTrajectoryReply> reply = *maybe_reply;
   reply->status_code = LocalToNetwork<kP2PLocalEndianness>(result_);
-  reply.Commit(/*guarantee_delivery=*/true);
-  return true;
+  return reply.Commit(/*guarantee_delivery=*/true);
 }
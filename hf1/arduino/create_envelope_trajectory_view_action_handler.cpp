@@ -63,6 +63,5 @@ bool CreateEnvelopeTrajectoryViewActionHandler::TrySendingReply() {
   }
   P2PActionPacketAdapter<P2PCreateEnvelopeTrajectoryViewReply> reply = *maybe_reply;
   reply->status_code = LocalToNetwork<kP2PLocalEndianness>(result_);
-  reply.Commit(/*guarantee_delivery=*/true);
-  return true;
+  return reply.Commit(/*guarantee_delivery=*/true);
 }
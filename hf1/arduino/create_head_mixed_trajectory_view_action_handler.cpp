@@ -146,6 +146,5 @@ bool CreateHeadMixedTrajectoryViewActionHandler::TrySendingReply() {
   }
   P2PActionPacketAdapter<P2PCreateHeadMixedTrajectoryViewReply> reply = *maybe_reply;
   reply->status_code = LocalToNetwork<kP2PLocalEndianness>(result_);
-  reply.Commit(/*guarantee_delivery=*/true);
-  return true;
+  return reply.Commit(/*guarantee_delivery=*/true);
 }
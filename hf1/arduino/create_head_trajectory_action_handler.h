@@ -3,6 +3,7 @@
 
 #include "p2p_action_server.h"
 #include "trajectory_store.h"
+#include "trajectory_request_parser.h"
 #include "logger_interface.h"
 
 class CreateHeadTrajectoryActionHandler : public P2PActionHandler<P2PCreateHeadTrajectoryRequest, P2PCreateHeadTrajectoryReply> {
@@ -12,12 +13,24 @@ public:
     : P2PActionHandler<P2PCreateHeadTrajectoryRequest, P2PCreateHeadTrajectoryReply>(P2PAction::kCreateHeadTrajectory, p2p_stream), 
       trajectory_store_(*ASSERT_NOT_NULL(trajectory_store)) {}
 
+  int GetMinRequestSize() const override { return RequestParser::kWaypointsOffset; }
+  bool OnRequestFragment(int offset, int total_length, const uint8_t *data, int length) override;
   bool Run() override;
 
 private:
+  using RequestParser = TrajectoryRequestParser<P2PCreateHeadTrajectoryRequest, P2PHeadWaypoint>;
+
+  // Validates the request and clears the trajectory where its waypoints are inserted.
+  void BeginTrajectory(const P2PCreateHeadTrajectoryRequest &request);
+  // Inserts the waypoints parsed so far in the trajectory.
+  void AddWaypoints();
   bool TrySendingReply();
 
   TrajectoryStore &trajectory_store_;  
+  RequestParser request_parser_;
+  int trajectory_id_;
+  int num_waypoints_;
+  int num_inserted_waypoints_;
   Status result_;
   enum { kProcessingRequest, kSendingReply } state_ = kProcessingRequest;  
 };
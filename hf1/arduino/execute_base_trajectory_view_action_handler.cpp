@@ -120,8 +120,7 @@ bool ExecuteBaseTrajectoryViewActionHandler::TrySendingReply() {
   last_progress_update_ns_ = GetTimerNanoseconds();
   P2PActionPacketAdapter<P2PExecuteBaseTrajectoryViewReply> reply = *maybe_reply;
   reply->status_code = LocalToNetwork<kP2PLocalEndianness>(result_);
-  reply.Commit(/*guarantee_delivery=*/true);
-  return true;
+  return reply.Commit(/*guarantee_delivery=*/true);
 }
 
 bool ExecuteBaseTrajectoryViewActionHandler::TrySendingProgress() {
@@ -132,8 +131,7 @@ bool ExecuteBaseTrajectoryViewActionHandler::TrySendingProgress() {
   last_progress_update_ns_ = GetTimerNanoseconds();
   P2PActionPacketAdapter<P2PExecuteBaseTrajectoryViewProgress> progress = *maybe_progress;
   progress->num_completed_laps = LocalToNetwork<kP2PLocalEndianness>(base_trajectory_controller_.NumCompletedLaps());
-  progress.Commit(/*guarantee_delivery=*/false);
-  return true;
+  return progress.Commit(/*guarantee_delivery=*/false);
 }
 
 void ExecuteBaseTrajectoryViewActionHandler::OnCancel() {
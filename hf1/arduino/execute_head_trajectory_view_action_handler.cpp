@@ -120,8 +120,7 @@ bool ExecuteHeadTrajectoryViewActionHandler::TrySendingReply() {
   last_progress_update_ns_ = GetTimerNanoseconds();
   P2PActionPacketAdapter<P2PExecuteHeadTrajectoryViewReply> reply = *maybe_reply;
   reply->status_code = LocalToNetwork<kP2PLocalEndianness>(result_);
-  reply.Commit(/*guarantee_delivery=*/true);
-  return true;
+  return reply.Commit(/*guarantee_delivery=*/true);
 }
 
 bool ExecuteHeadTrajectoryViewActionHandler::TrySendingProgress() {
@@ -132,8 +131,7 @@ bool ExecuteHeadTrajectoryViewActionHandler::TrySendingProgress() {
   last_progress_update_ns_ = GetTimerNanoseconds();
   P2PActionPacketAdapter<P2PExecuteHeadTrajectoryViewProgress> progress = *maybe_progress;
   progress->num_completed_laps = LocalToNetwork<kP2PLocalEndianness>(head_trajectory_controller_.NumCompletedLaps());
-  progress.Commit(/*guarantee_delivery=*/false);
-  return true;
+  return progress.Commit(/*guarantee_delivery=*/false);
 }
 
 void ExecuteHeadTrajectoryViewActionHandler::OnCancel() {
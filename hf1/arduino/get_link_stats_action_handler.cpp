@@ -0,0 +1,58 @@
+#include "get_link_stats_action_handler.h"
+
+namespace {
+
+uint32_t SaturateToUint32(uint64_t value) {
+  return value < UINT32_MAX ? static_cast<uint32_t>(value) : UINT32_MAX;
+}
+
+P2PLatencySummary Summarize(const P2PLatencyHistogram &histogram) {
+  P2PLatencySummary summary;
+  summary.p50_us = LocalToNetwork<kP2PLocalEndianness>(SaturateToUint32(histogram.Quantile(0.5f) / 1000));
+  summary.p99_us = LocalToNetwork<kP2PLocalEndianness>(SaturateToUint32(histogram.Quantile(0.99f) / 1000));
+  summary.max_us = LocalToNetwork<kP2PLocalEndianness>(SaturateToUint32(histogram.max_ns() / 1000));
+  return summary;
+}
+
+}  // namespace
+
+bool GetLinkStatsActionHandler::OnRequest() {
+  return GetRequest().priority < P2PPriority::kNumLevels;
+}
+
+bool GetLinkStatsActionHandler::Run() {
+  StatusOr<P2PActionPacketAdapter<P2PGetLinkStatsReply>> maybe_reply = NewReply();
+  if (!maybe_reply.ok()) {
+    // Output buffer is full: keep trying.
+    return true;
+  }
+  const P2PPriority priority = GetRequest().priority;
+  const auto &rx_stats = p2p_stream().input().stats();
+  const auto &tx_stats = p2p_stream().output().stats();
+  P2PActionPacketAdapter<P2PGetLinkStatsReply> reply = *maybe_reply;
+  reply->rx_delay = Summarize(rx_stats.packet_delay_histogram(priority));
+  reply->rx_packets = LocalToNetwork<kP2PLocalEndianness>(SaturateToUint32(rx_stats.total_packets(priority)));
+  reply->rx_dropped_packets = LocalToNetwork<kP2PLocalEndianness>(SaturateToUint32(rx_stats.total_dropped_packets(priority)));
+  reply->rx_checksum_errors = LocalToNetwork<kP2PLocalEndianness>(SaturateToUint32(rx_stats.total_checksum_errors(priority)));
+  reply->rx_malformed_continuations = LocalToNetwork<kP2PLocalEndianness>(SaturateToUint32(rx_stats.total_malformed_continuations(priority)));
+  reply->rx_queue_high_watermark = rx_stats.queue_high_watermark(priority);
+  reply->tx_delay = Summarize(tx_stats.packet_delay_histogram(priority));
+  reply->tx_packets = LocalToNetwork<kP2PLocalEndianness>(SaturateToUint32(tx_stats.total_packets(priority)));
+  reply->tx_retransmissions = LocalToNetwork<kP2PLocalEndianness>(SaturateToUint32(tx_stats.total_retransmissions(priority)));
+  reply->tx_rejected_packets = LocalToNetwork<kP2PLocalEndianness>(SaturateToUint32(tx_stats.total_rejected_packets(priority)));
+  reply->tx_queue_high_watermark = tx_stats.queue_high_watermark(priority);
+  reply->rx_resyncs = LocalToNetwork<kP2PLocalEndianness>(SaturateToUint32(rx_stats.total_resyncs()));
+  reply->handshake_resets = LocalToNetwork<kP2PLocalEndianness>(SaturateToUint32(p2p_stream().num_handshake_resets()));
+  reply->rx_packets_per_second = LocalToNetwork<kP2PLocalEndianness>(SaturateToUint32(rx_stats.packets_per_second()));
+  reply->rx_bytes_per_second = LocalToNetwork<kP2PLocalEndianness>(SaturateToUint32(rx_stats.bytes_per_second()));
+  reply->tx_packets_per_second = LocalToNetwork<kP2PLocalEndianness>(SaturateToUint32(tx_stats.packets_per_second()));
+  reply->tx_bytes_per_second = LocalToNetwork<kP2PLocalEndianness>(SaturateToUint32(tx_stats.bytes_per_second()));
+  const float utilization = tx_stats.link_utilization();
+  const uint16_t utilization_permille = utilization < 0 ? UINT16_MAX : static_cast<uint16_t>(std::min(utilization * 1000, 1000.0f));
+  reply->tx_link_utilization_permille = LocalToNetwork<kP2PLocalEndianness>(utilization_permille);
+  if (!reply.Commit(/*guarantee_delivery=*/true)) {
+    // Output buffer is full: keep trying.
+    return true;
+  }
+  return false;   // The action is complete: do not call Run() again.
+}
@@ -0,0 +1,17 @@
+#ifndef GET_LINK_STATS_ACTION_HANDLER_
+#define GET_LINK_STATS_ACTION_HANDLER_
+
+#include "p2p_action_server.h"
+
+// Replies with the statistics of this end of the P2P link.
+class GetLinkStatsActionHandler : public P2PActionHandler<P2PGetLinkStatsRequest, P2PGetLinkStatsReply> {
+public:
+  // Does not take ownsership of the pointee, which must outlive this object.
+  GetLinkStatsActionHandler(P2PPacketStreamArduino *p2p_stream)
+    : P2PActionHandler<P2PGetLinkStatsRequest, P2PGetLinkStatsReply>(P2PAction::kGetLinkStats, p2p_stream) {}
+
+  bool OnRequest() override;
+  bool Run() override;
+};
+
+#endif  // GET_LINK_STATS_ACTION_HANDLER_
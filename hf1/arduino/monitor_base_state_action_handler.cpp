@@ -92,8 +92,7 @@ bool MonitorBaseStateActionHandler::TrySendingReply() {
   reply->position_x = LocalToNetwork<kP2PLocalEndianness>(base_state.location().position().x);
   reply->position_y = LocalToNetwork<kP2PLocalEndianness>(base_state.location().position().y);
   reply->yaw = LocalToNetwork<kP2PLocalEndianness>(base_state.location().yaw());
-  reply.Commit(/*guarantee_delivery=*/true);
-  return true;
+  return reply.Commit(/*guarantee_delivery=*/true);
 }
 
 bool MonitorBaseStateActionHandler::TrySendingProgress() {
@@ -108,6 +107,5 @@ bool MonitorBaseStateActionHandler::TrySendingProgress() {
   progress->position_x = LocalToNetwork<kP2PLocalEndianness>(base_state.location().position().x);
   progress->position_y = LocalToNetwork<kP2PLocalEndianness>(base_state.location().position().y);
   progress->yaw = LocalToNetwork<kP2PLocalEndianness>(base_state.location().yaw());
-  progress.Commit(/*guarantee_delivery=*/false);
-  return true;
+  return progress.Commit(/*guarantee_delivery=*/false);
 }
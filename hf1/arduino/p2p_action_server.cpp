@@ -3,17 +3,37 @@
 #include "logger_interface.h"
 #include <cstring>
 
-P2PActionServer::P2PActionServer(P2PPacketStreamArduino *p2p_stream)
-  : p2p_stream_(*ASSERT_NOT_NULL(p2p_stream)) {
+P2PActionServer::P2PActionServer(P2PPacketStreamArduino *p2p_stream, TimerInterface *timer)
+  : p2p_stream_(*ASSERT_NOT_NULL(p2p_stream)), aggregator_(&p2p_stream->output(), timer) {
+  for (int i = 0; i < P2PPriority::kNumLevels; ++i) {
+    message_offset_[i] = 0;
+    p2p_stream_.output().queue_watermarks(i, kP2PProgressLowWatermark, kP2PProgressHighWatermark);
+  }
   p2p_stream_.other_end_started_callback(P2POtherEndStartedCallback(&P2PActionServer::OnOtherEndStarted, this));
 }
 
 P2PActionServer::~P2PActionServer() {
 }
 
+bool P2PActionHandlerBase::OnRequestFragment(int offset, int total_length, const uint8_t *data, int length) {
+  if (total_length > GetExpectedRequestSize()) {
+    return false;
+  }
+  CopyRequestFragment(offset, data, length);
+  return true;
+}
+
+void P2PActionHandlerBase::CopyRequestFragment(int offset, const uint8_t *data, int length) {
+  const int num_bytes = std::min(length, GetExpectedRequestSize() - offset);
+  if (num_bytes > 0) {
+    memcpy(GetRequestCopyBuffer() + offset, data, num_bytes);
+  }
+}
+
 void P2PActionServer::Register(P2PActionHandlerBase *handler) {
   ASSERT(!handler->is_registered());
   handlers_[static_cast<int>(handler->action())] = handler;
+  handler->aggregator(&aggregator_);
   handler->is_registered(true);
 }
 
@@ -41,83 +61,102 @@ void P2PActionServer::InitActionsIfNeeded() {
   }
 }
 
-StatusOr<const P2PPacketView> P2PActionServer::GetRequestOrCancellation() const {
+void P2PActionServer::ConsumeMessage(const P2PApplicationMessageView &message) {
+  message_offset_[message.priority()] = message.next_offset();
+  if (message.next_offset() == 0) {
+    p2p_stream_.input().Consume(static_cast<P2PPriority>(message.priority()));
+  }
+}
+
+StatusOr<P2PApplicationMessageView> P2PActionServer::GetRequestOrCancellation() {
   // Check if we got a new action request.
   const auto maybe_oldest_packet_view = p2p_stream_.input().OldestPacket();
   if (!maybe_oldest_packet_view.ok()) {
     // All input packets have been processed.
-    return maybe_oldest_packet_view;
+    return maybe_oldest_packet_view.status();
   }
 
-  ASSERT(maybe_oldest_packet_view->length() >= sizeof(P2PApplicationPacketHeader));
+  const int priority = maybe_oldest_packet_view->priority();
+  const auto maybe_message = P2PGetApplicationMessage(*maybe_oldest_packet_view, message_offset_[priority]);
+  if (!maybe_message.ok()) {
+    LOG_WARNING("Received malformed application packet.");
+    message_offset_[priority] = 0;
+    p2p_stream_.input().Consume(static_cast<P2PPriority>(priority));
+    return maybe_message.status();
+  }
 
-  const auto app_header = reinterpret_cast<const P2PApplicationPacketHeader *>(maybe_oldest_packet_view->content()); 
+  const auto app_header = maybe_message->header();
   if (app_header->stage != P2PActionStage::kRequest &&
     app_header->stage != P2PActionStage::kCancel) {
     LOG_WARNING("Received packet that is neither a request nor a cancellation.");
-    p2p_stream_.input().Consume(maybe_oldest_packet_view->priority());
+    ConsumeMessage(*maybe_message);
     return Status::kMalformedError;
   }
 
+  if (app_header->action == kP2PFragmentAction) {
+    // Fragments are validated as they are processed.
+    return maybe_message;
+  }
+
   if (app_header->action >= P2PAction::kCount) {
     LOG_WARNING("Received unsupported action.");
-    p2p_stream_.input().Consume(maybe_oldest_packet_view->priority());
+    ConsumeMessage(*maybe_message);
     return Status::kMalformedError;
   }
 
   P2PActionHandlerBase *handler = handlers_[app_header->action];
   if (handler == NULL) {
     LOG_ERROR("No handler registered for action.");
-    p2p_stream_.input().Consume(maybe_oldest_packet_view->priority());
+    ConsumeMessage(*maybe_message);
     return Status::kMalformedError;
   }
 
   if (app_header->stage == P2PActionStage::kRequest) {
-    ASSERT(maybe_oldest_packet_view->length() == sizeof(P2PApplicationPacketHeader) + handler->GetExpectedRequestSize());
+    ASSERT(maybe_message->length() >= static_cast<int>(sizeof(P2PApplicationPacketHeader)) + handler->GetMinRequestSize());
+    ASSERT(maybe_message->length() <= static_cast<int>(sizeof(P2PApplicationPacketHeader)) + handler->GetExpectedRequestSize());
   } else {
-    ASSERT(maybe_oldest_packet_view->length() == sizeof(P2PApplicationPacketHeader));
+    ASSERT(maybe_message->length() == sizeof(P2PApplicationPacketHeader));
   }
 
-  return maybe_oldest_packet_view;
+  return maybe_message;
 }
 
 void P2PActionServer::Run() {
   InitActionsIfNeeded();
   RunActions();
+  RunRequestOrCancellation();
+  // Send the messages of this iteration right away if the link is idle.
+  aggregator_.Run();
+}
 
+void P2PActionServer::RunRequestOrCancellation() {
   // Handle action requests and cancellations.
-  StatusOr<const P2PPacketView> maybe_packet = GetRequestOrCancellation();
-  if (!maybe_packet.ok()) {
+  StatusOr<P2PApplicationMessageView> maybe_message = GetRequestOrCancellation();
+  if (!maybe_message.ok()) {
+    return;
+  }
+  const auto app_header = maybe_message->header();
+  if (app_header->action == kP2PFragmentAction) {
+    RunRequestFragment(*maybe_message);
+    ConsumeMessage(*maybe_message);
     return;
   }
-  const auto app_header = reinterpret_cast<const P2PApplicationPacketHeader *>(maybe_packet->content());
   P2PActionHandlerBase *handler = handlers_[app_header->action];
   switch(app_header->stage) {
     case P2PActionStage::kRequest: {
-      if (handler->run_state() == P2PActionHandlerBase::RunState::kRunning) {
-        LOG_ERROR("Cannot start action when it's already running.");
-        break;
-      }
-      handler->run_state(P2PActionHandlerBase::RunState::kIdle);
-      // The handler can first retrieve the request directly from the input stream.
-      handler->request_bytes(maybe_packet->content() + sizeof(P2PApplicationPacketHeader));
       // The request determines the action's priority. This affects the reply and progress 
       // priorities, not the action's scheduling.
-      handler->request_priority(maybe_packet->priority());
+      handler->request_priority(static_cast<P2PPriority>(maybe_message->priority()));
       handler->request_id(app_header->request_id);
-      if (handler->OnRequest()) {
-        if (handler->Run()) {
-          // The action goes on. Further calls to run will operate on a copy, as the input 
-          // packet must be consumed for other packets to be processed.
-          memcpy(handler->GetRequestCopyBuffer(), maybe_packet->content() + sizeof(P2PApplicationPacketHeader), handler->GetExpectedRequestSize());
-          handler->request_bytes(handler->GetRequestCopyBuffer());    
-          handler->run_state(P2PActionHandlerBase::RunState::kRunning);
-        }
-      }      
+      handler->request_fragment_offset(-1);
+      // The handler can first retrieve the request directly from the input stream.
+      StartAction(handler, maybe_message->content() + sizeof(P2PApplicationPacketHeader), maybe_message->length() - sizeof(P2PApplicationPacketHeader));
       break;
     }
     
     case P2PActionStage::kCancel: {
+      // Fragments of the cancelled request are ignored from now on.
+      handler->request_fragment_offset(-1);
       if (handler->run_state() != P2PActionHandlerBase::RunState::kRunning) {
         LOG_WARNING("Trying to cancel an action that was not running.");
         break;
@@ -127,17 +166,79 @@ void P2PActionServer::Run() {
       break;
     }
   }
-  // The action either ended or the packet was copied to the handler, so it's ok to consume
-  // it from the input stream for other packets to be processed.
-  p2p_stream_.input().Consume(maybe_packet->priority());
+  // The action either ended or the message was copied to the handler, so it's ok to consume
+  // it from the input stream for other messages to be processed.
+  ConsumeMessage(*maybe_message);
+}
+
+void P2PActionServer::StartAction(P2PActionHandlerBase *handler, const uint8_t *request_bytes, int request_length) {
+  if (handler->run_state() == P2PActionHandlerBase::RunState::kRunning) {
+    LOG_ERROR("Cannot start action when it's already running.");
+    return;
+  }
+  handler->run_state(P2PActionHandlerBase::RunState::kIdle);
+  handler->request_bytes(request_bytes);
+  handler->request_length(request_length);
+  if (handler->OnRequest()) {
+    if (handler->Run()) {
+      // The action goes on. Further calls to run will operate on a copy, as the input 
+      // packet must be consumed for other packets to be processed.
+      if (request_bytes != handler->GetRequestCopyBuffer()) {
+        memcpy(handler->GetRequestCopyBuffer(), request_bytes, std::min(request_length, handler->GetExpectedRequestSize()));
+        handler->request_bytes(handler->GetRequestCopyBuffer());
+      }
+      handler->run_state(P2PActionHandlerBase::RunState::kRunning);
+    }
+  }
+}
+
+void P2PActionServer::RunRequestFragment(const P2PApplicationMessageView &message) {
+  const auto maybe_fragment = P2PGetFragment<kP2PLocalEndianness>(message);
+  if (!maybe_fragment.ok() || message.header()->stage != P2PActionStage::kRequest ||
+      maybe_fragment->action >= P2PAction::kCount || handlers_[maybe_fragment->action] == NULL) {
+    LOG_WARNING("Received malformed or unsupported request fragment.");
+    return;
+  }
+  P2PActionHandlerBase *handler = handlers_[maybe_fragment->action];
+  if (maybe_fragment->offset == 0) {
+    if (handler->run_state() == P2PActionHandlerBase::RunState::kRunning) {
+      LOG_ERROR("Cannot start action when it's already running.");
+      return;
+    }
+    handler->request_priority(static_cast<P2PPriority>(message.priority()));
+    handler->request_id(message.header()->request_id);
+    handler->request_fragment_offset(0);
+  }
+  if (maybe_fragment->offset != handler->request_fragment_offset() ||
+      message.header()->request_id != handler->request_id()) {
+    // The request was rejected or cancelled, or a fragment is missing.
+    return;
+  }
+  if (!handler->OnRequestFragment(maybe_fragment->offset, maybe_fragment->total_length, maybe_fragment->data, maybe_fragment->length)) {
+    LOG_ERROR("Request fragment rejected by handler.");
+    handler->request_fragment_offset(-1);
+    return;
+  }
+  const int next_offset = maybe_fragment->offset + maybe_fragment->length;
+  if (next_offset < maybe_fragment->total_length) {
+    handler->request_fragment_offset(next_offset);
+    return;
+  }
+  handler->request_fragment_offset(-1);
+  StartAction(handler, handler->GetRequestCopyBuffer(), maybe_fragment->total_length);
 }
 
 void P2PActionServer::OnOtherEndStarted(void *self_p) {
   ASSERT(self_p);
   P2PActionServer &self = *reinterpret_cast<P2PActionServer *>(self_p);
+  // The input stream was reset, so no packet is partially processed.
+  for (int i = 0; i < P2PPriority::kNumLevels; ++i) {
+    self.message_offset_[i] = 0;
+  }
   for (int i = 0; i < P2PAction::kCount; ++i) {
     P2PActionHandlerBase *handler = self.handlers_[i];
     if (handler != NULL) {
+      handler->request_fragment_offset(-1);
       handler->OnCancel();
       handler->run_state(P2PActionHandlerBase::RunState::kIdle);
     }
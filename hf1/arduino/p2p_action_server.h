@@ -3,8 +3,16 @@
 
 #include "p2p_packet_stream_arduino.h"
 #include "p2p_application_protocol.h"
+#include "p2p_message_fragmenter.h"
+#include "timer_interface.h"
 #include "utils.h"
 
+// Number of packets in the output queue of a priority at which its progress updates are held
+// back, and number to which the queue must drain for them to resume. Replies are never held
+// back, so they keep the room left.
+#define kP2PProgressHighWatermark (kP2POutputCapacity - 2)
+#define kP2PProgressLowWatermark (kP2POutputCapacity / 2 - 1)
+
 class P2PActionHandlerBase;
 
 // Provides typed access to an action packet payload.
@@ -17,7 +25,8 @@ public:
     : action_handler_(ASSERT_NOT_NULL(action_handler)), packet_view_(packet_view) {}
 
   TPacket *operator->();
-  void Commit(bool guarantee_delivery = false);
+  // Returns false if there was no space to send the packet. It must be created again to retry.
+  bool Commit(bool guarantee_delivery = false);
 
 protected:
   P2PActionHandlerBase *action_handler_;
@@ -31,7 +40,7 @@ public:
   typedef enum { kIdle, kRunning } RunState;
 
   P2PActionHandlerBase(P2PAction action, P2PPacketStreamArduino *p2p_stream)
-    : is_registered_(false), is_initialized_(false), action_(action), request_priority_(P2PPriority::kMedium), p2p_stream_(p2p_stream), run_state_(RunState::kIdle) {}
+    : is_registered_(false), is_initialized_(false), action_(action), request_priority_(P2PPriority::kMedium), p2p_stream_(p2p_stream), aggregator_(nullptr), run_state_(RunState::kIdle), request_length_(0), request_fragment_offset_(-1) {}
 
   bool is_registered() const { return is_registered_; }
   void is_registered(bool ir) { is_registered_ = ir; }
@@ -45,9 +54,18 @@ public:
   P2PActionRequestID request_id() const { return request_id_; }
   void request_id(P2PActionRequestID rid) { request_id_ = rid; }
   P2PPacketStreamArduino &p2p_stream() { return *p2p_stream_; }
+  // Replies and progress updates go through the server's aggregator, which is set when the
+  // handler is registered.
+  P2PMessageAggregatorArduino &aggregator() { return *ASSERT_NOT_NULL(aggregator_); }
+  void aggregator(P2PMessageAggregatorArduino *aggregator) { aggregator_ = aggregator; }
 
   const uint8_t *request_bytes() const { return request_bytes_; }
   void request_bytes(const uint8_t *request_bytes) { request_bytes_ = request_bytes; }
+  int request_length() const { return request_length_; }
+  void request_length(int length) { request_length_ = length; }
+  // Number of bytes received of a fragmented request, or -1 if none is being received.
+  int request_fragment_offset() const { return request_fragment_offset_; }
+  void request_fragment_offset(int offset) { request_fragment_offset_ = offset; }
 
   // Returns a pointer to a buffer where to copy the request when the action takes longer than a call to Run().
   virtual uint8_t *GetRequestCopyBuffer() = 0;
@@ -55,6 +73,19 @@ public:
   // Returns the expected request size.
   virtual int GetExpectedRequestSize() const = 0;
 
+  // Returns the minimum request size. Shorter requests than expected are those whose last
+  // fields are variable-length, e.g. trajectories without their unused waypoints.
+  virtual int GetMinRequestSize() const { return GetExpectedRequestSize(); }
+
+  // Called with every fragment of a request that does not fit in a packet, in order, before
+  // OnRequest(). The `length` bytes in `data` start at `offset` in the request, whose length
+  // is `total_length`. Returns false if the request cannot be received, in which case the rest
+  // of its fragments are ignored.
+  // By default, the request is reassembled in the buffer of GetRequestCopyBuffer(), so it
+  // cannot be longer than GetExpectedRequestSize(). Handlers of longer requests must override
+  // this to process the fragments as they arrive, e.g. streaming them to their destination.
+  virtual bool OnRequestFragment(int offset, int total_length, const uint8_t *data, int length);
+
   // Called once from the server's Run() before any other callbacks.
   virtual void Init() {}
 
@@ -78,6 +109,10 @@ public:
   // stopping.
   virtual void OnCancel() {}
 
+protected:
+  // Copies the part of a request fragment that fits in the buffer of GetRequestCopyBuffer().
+  void CopyRequestFragment(int offset, const uint8_t *data, int length);
+
 private:
   bool is_registered_;
   bool is_initialized_;
@@ -85,9 +120,12 @@ private:
   P2PPriority request_priority_;
   P2PActionRequestID request_id_;
   P2PPacketStreamArduino *p2p_stream_;
+  P2PMessageAggregatorArduino *aggregator_;
   RunState run_state_;
   P2PPacketView app_packet_view_;
   const uint8_t *request_bytes_;
+  int request_length_;
+  int request_fragment_offset_;
 };
 
 typedef struct {} VoidPacket;
@@ -102,10 +140,13 @@ public:
   // but it should not be cached across callbacks as it might change over time.
   const TRequest &GetRequest() const;
 
-  // Creates a TReply in a new output stream packet or returns an error status.
+  // Creates a TReply in a new output message or returns an error status. Messages of the
+  // same priority may share a packet.
   StatusOr<P2PActionPacketAdapter<TReply>> NewReply();
 
-  // Creates a TProgress in a new output packet or returns an error status.
+  // Creates a TProgress in a new output message or returns an error status. Returns
+  // kUnavailableError while the output queue of the request's priority is congested (see
+  // kP2PProgressHighWatermark), as progress updates are superseded by the next ones anyway.
   StatusOr<P2PActionPacketAdapter<TProgress>> NewProgress();
 
   int GetExpectedRequestSize() const override {
@@ -122,8 +163,8 @@ private:
 
 class P2PActionServer {
 public:
-  // Does not take ownership of the pointee, which must outlive this object.
-  P2PActionServer(P2PPacketStreamArduino *p2p_stream);
+  // Does not take ownership of the pointees, which must outlive this object.
+  P2PActionServer(P2PPacketStreamArduino *p2p_stream, TimerInterface *timer);
   virtual ~P2PActionServer();
 
   // Registers an action handler.
@@ -136,11 +177,21 @@ public:
 private:
   void InitActionsIfNeeded();
   void RunActions();
-  StatusOr<const P2PPacketView> GetRequestOrCancellation() const;
+  void RunRequestOrCancellation();
+  void RunRequestFragment(const P2PApplicationMessageView &message);
+  // Starts the action of `handler` with the request in `request_bytes`.
+  void StartAction(P2PActionHandlerBase *handler, const uint8_t *request_bytes, int request_length);
+  StatusOr<P2PApplicationMessageView> GetRequestOrCancellation();
+  // Moves on to the next message in the packet of `message`, and consumes the packet after
+  // its last message.
+  void ConsumeMessage(const P2PApplicationMessageView &message);
   static void OnOtherEndStarted(void *self_p);
 
   P2PPacketStreamArduino &p2p_stream_;
+  P2PMessageAggregatorArduino aggregator_;
   P2PActionHandlerBase *handlers_[P2PAction::kCount];
+  // Offset of the next message to process in the oldest input packet of each priority.
+  int message_offset_[P2PPriority::kNumLevels];
 };
 
 #include "p2p_action_server.hh"
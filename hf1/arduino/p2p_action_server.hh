@@ -1,6 +1,6 @@
 template<typename TPacket>
-void P2PActionPacketAdapter<TPacket>::Commit(bool guarantee_delivery) {
-  action_handler_->p2p_stream().output().Commit(packet_view_.priority(), guarantee_delivery);
+bool P2PActionPacketAdapter<TPacket>::Commit(bool guarantee_delivery) {
+  return action_handler_->aggregator().Commit(packet_view_.priority(), guarantee_delivery);
 }
 
 template<typename TPacket>
@@ -15,11 +15,10 @@ const TRequest &P2PActionHandler<TRequest, TReply, TProgress>::GetRequest() cons
 
 template<typename TRequest, typename TReply, typename TProgress>
 StatusOr<P2PActionPacketAdapter<TReply>> P2PActionHandler<TRequest, TReply, TProgress>::NewReply() {
-  StatusOr<P2PMutablePacketView> maybe_packet = p2p_stream().output().NewPacket(request_priority());
+  StatusOr<P2PMutablePacketView> maybe_packet = aggregator().NewMessage(request_priority(), sizeof(P2PApplicationPacketHeader) + sizeof(TReply));
   if (!maybe_packet.ok()) {
     return maybe_packet.status();
   }
-  maybe_packet->length() = sizeof(P2PApplicationPacketHeader) + sizeof(TReply);
   P2PApplicationPacketHeader *header = reinterpret_cast<P2PApplicationPacketHeader *>(maybe_packet->content());
   header->action = action();
   header->stage = P2PActionStage::kReply;
@@ -29,11 +28,13 @@ StatusOr<P2PActionPacketAdapter<TReply>> P2PActionHandler<TRequest, TReply, TPro
 
 template<typename TRequest, typename TReply, typename TProgress>
 StatusOr<P2PActionPacketAdapter<TProgress>> P2PActionHandler<TRequest, TReply, TProgress>::NewProgress() {
-  StatusOr<P2PMutablePacketView> maybe_packet = p2p_stream().output().NewPacket(request_priority());
+  if (p2p_stream().output().is_queue_congested(request_priority())) {
+    return Status::kUnavailableError;
+  }
+  StatusOr<P2PMutablePacketView> maybe_packet = aggregator().NewMessage(request_priority(), sizeof(P2PApplicationPacketHeader) + sizeof(TProgress));
   if (!maybe_packet.ok()) {
     return maybe_packet.status();
   }
-  maybe_packet->length() = sizeof(P2PApplicationPacketHeader) + sizeof(TProgress);
   P2PApplicationPacketHeader *header = reinterpret_cast<P2PApplicationPacketHeader *>(maybe_packet->content());
   header->action = action();
   header->stage = P2PActionStage::kProgress;
@@ -21,15 +21,3 @@ int P2PByteStreamArduino::Read(void *buffer, int length) {
   interrupts();
   return stream().readBytes(static_cast<uint8_t *>(buffer), std::min(length, stream().available()));
 }
-
-int P2PByteStreamArduino::GetBurstMaxLength() {
-  return 1024;
-}
-
-int P2PByteStreamArduino::GetBurstIngestionNanosecondsPerByte() {
-  return 0;
-}
-
-int P2PByteStreamArduino::GetAtomicSendMaxLength() {
-  return 4;
-}
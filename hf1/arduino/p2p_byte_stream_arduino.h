@@ -1,10 +1,14 @@
-// #ifndef P2P_BYTE_STREAM_ARDUINO_
-// #define P2P_BYTE_STREAM_ARDUINO_
+#ifndef P2P_BYTE_STREAM_ARDUINO_
+#define P2P_BYTE_STREAM_ARDUINO_
 
 #include "p2p_byte_stream_interface.h"
 #include "Stream.h"
 
-class P2PByteStreamArduino : public P2PByteStreamInterface<kLittleEndian> {
+// Size of the receive buffer of the hardware serial ports in the Teensy 3.x cores.
+#define kP2PSerialReceiveBufferLength 64
+
+// Final, so that the packet streams that take it as their ByteStream type call it directly.
+class P2PByteStreamArduino final : public P2PByteStreamInterface<kLittleEndian> {
 public:
   // Does not take ownership of the stream, which must outlive this object.
   P2PByteStreamArduino(Stream *stream) 
@@ -12,12 +16,14 @@ public:
 
   virtual int Write(const void *buffer, int length);
   virtual int Read(void *buffer, int length);
-  virtual int GetBurstMaxLength();
-  virtual int GetBurstIngestionNanosecondsPerByte();
-  virtual int GetAtomicSendMaxLength();
+  // The link constants are defined here, so that they are folded into the packet streams.
+  virtual int GetBurstMaxLength() { return 1024; }
+  virtual int GetBurstIngestionNanosecondsPerByte() { return 0; }
+  virtual int GetAtomicSendMaxLength() { return 4; }
+  virtual int GetReceiveBufferLength() { return kP2PSerialReceiveBufferLength; }
 
 protected:
   Stream &stream() const;
 };
 
-// #endif  // P2P_BYTE_STREAM_ARDUINO_
\ No newline at end of file
+#endif  // P2P_BYTE_STREAM_ARDUINO_
\ No newline at end of file
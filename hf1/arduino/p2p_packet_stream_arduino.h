@@ -2,11 +2,24 @@
 #define P2P_PACKET_STREAM_ARDUINO_
 
 #include "p2p_packet_stream.h"
+#include "p2p_message_aggregator.h"
 
-#define kP2PInputCapacity 4
-#define kP2POutputCapacity 2
+// Queues only take the bytes of the packets that they store, so these capacities take about
+// the RAM that 4 input and 2 output full-size packets per priority used to.
+#define kP2PInputCapacity 10
+#define kP2POutputCapacity 5
 #define kP2PLocalEndianness kLittleEndian
 
-using P2PPacketStreamArduino = P2PPacketStream<kP2PInputCapacity, kP2POutputCapacity, kP2PLocalEndianness>;
+#ifdef ARDUINO
+#include "p2p_byte_stream_arduino.h"
+// The streams call the byte stream of the board directly.
+using P2PLinkByteStreamArduino = P2PByteStreamArduino;
+#else
+// The host tests build this code without the Arduino core.
+using P2PLinkByteStreamArduino = P2PByteStreamInterface<kP2PLocalEndianness>;
+#endif
+
+using P2PPacketStreamArduino = P2PPacketStream<kP2PInputCapacity, kP2POutputCapacity, kP2PLocalEndianness, P2PLinkByteStreamArduino>;
+using P2PMessageAggregatorArduino = P2PMessageAggregator<kP2POutputCapacity, kP2PLocalEndianness, P2PLinkByteStreamArduino>;
 
 #endif  // P2P_PACKET_STREAM_ARDUINO_
\ No newline at end of file
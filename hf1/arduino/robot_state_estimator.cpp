@@ -1,5 +1,6 @@
 #include "utility/vector.h"
 #include "ring_buffer.h"
+#include "spsc_ring_buffer.h"
 #include "timer.h"
 #include "encoders.h"
 #include "body_imu.h"
@@ -32,17 +33,28 @@ typedef struct {
 } Event;
 
 static BodyIMU body_imu;
-static RingBuffer<Event, kEventRingBufferCapacity> event_buffer;
+// Events from the encoder ISR. The ISR is the only producer and the main loop the only
+// consumer, so neither needs to mask the other.
+static SPSCRingBuffer<Event, kEventRingBufferCapacity> isr_event_buffer;
+// Events from the main loop, which also consumes them.
+static FIFORingBuffer<Event, kEventRingBufferCapacity> loop_event_buffer;
 static BaseStateFilter base_state_filter;
 
+static void WriteIsrEvent(const Event &event) {
+  // If the main loop is late and the buffer is full, the tick is lost.
+  Event *new_event = isr_event_buffer.NewValue();
+  if (new_event != NULL) {
+    *new_event = event;
+    isr_event_buffer.Commit();
+  }
+}
+
 static void LeftEncoderIsr(TimerTicksType timer_ticks) {
-  // We have exclusive access to the event buffer while in the ISR.
-  event_buffer.Write(Event{ .type = kLeftWheelTick, .timer_ticks = timer_ticks });
+  WriteIsrEvent(Event{ .type = kLeftWheelTick, .timer_ticks = timer_ticks });
 }
 
 static void RightEncoderIsr(TimerTicksType timer_ticks) {
-  // We have exclusive access to the event buffer while in the ISR.
-  event_buffer.Write(Event{ .type = kRightWheelTick, .timer_ticks = timer_ticks });
+  WriteIsrEvent(Event{ .type = kRightWheelTick, .timer_ticks = timer_ticks });
 }
 
 TimerNanosType last_imu_poll_time_ns;
@@ -58,46 +70,40 @@ void InitRobotStateEstimator() {
 static void RegisterIMUEvent() {  
   const auto attitude = body_imu.GetYawPitchRoll();
   const auto accels = body_imu.GetLinearAccelerations();
-  NO_TIMER_IRQ {
-    event_buffer.Write(Event{ 
-      .type = kIMUReading, 
-      .timer_ticks = GetTimerTicks(), 
-      .payload = {
-        .imu = { 
-          .position_acceleration = { static_cast<float>(accels.x()), static_cast<float>(accels.y()), static_cast<float>(accels.z()) },
-          .attitude = { static_cast<float>(attitude.x()), static_cast<float>(attitude.y()), static_cast<float>(attitude.z()) },
-        }
+  loop_event_buffer.Write(Event{ 
+    .type = kIMUReading, 
+    .timer_ticks = GetTimerTicks(), 
+    .payload = {
+      .imu = { 
+        .position_acceleration = { static_cast<float>(accels.x()), static_cast<float>(accels.y()), static_cast<float>(accels.z()) },
+        .attitude = { static_cast<float>(attitude.x()), static_cast<float>(attitude.y()), static_cast<float>(attitude.z()) },
       }
-    });
-  }
+    }
+  });
 }
 
 void NotifyLeftMotorDirection(TimerTicksType timer_ticks, bool forward) {
-  NO_TIMER_IRQ {
-    event_buffer.Write(Event{ 
-      .type = kLeftWheelDirectionCommand, 
-      .timer_ticks = timer_ticks,
-      .payload = {
-        .wheel_direction = {
-          .is_forward = forward
-        }
+  loop_event_buffer.Write(Event{ 
+    .type = kLeftWheelDirectionCommand, 
+    .timer_ticks = timer_ticks,
+    .payload = {
+      .wheel_direction = {
+        .is_forward = forward
       }
-    });
-  }
+    }
+  });
 }
 
 void NotifyRightMotorDirection(TimerTicksType timer_ticks, bool forward) {
-  NO_TIMER_IRQ {
-    event_buffer.Write(Event{ 
-      .type = kRightWheelDirectionCommand, 
-      .timer_ticks = timer_ticks,
-      .payload = {
-        .wheel_direction = {
-          .is_forward = forward
-        }
+  loop_event_buffer.Write(Event{ 
+    .type = kRightWheelDirectionCommand, 
+    .timer_ticks = timer_ticks,
+    .payload = {
+      .wheel_direction = {
+        .is_forward = forward
       }
-    });
-  }
+    }
+  });
 }
 
 static int CompareEventPointers(const void *p1, const void *p2) {
@@ -115,16 +121,12 @@ void RunRobotStateEstimator() {
     RegisterIMUEvent();
   }
 
-  // Copy all queue events to a separate buffer as processing them might take time  
-  // and we don't want to block the queue to new events for too long.
-  Event events[kEventRingBufferCapacity];
-  int num_events;
-  NO_TIMER_IRQ {
-    num_events = event_buffer.Size();
-    int i = 0;
-    while(event_buffer.Size() > 0) {
-      events[i++] = event_buffer.Read();
-    }
+  // Copy all queue events to a separate buffer as processing them might take time, and the
+  // ISR keeps queuing new events meanwhile.
+  Event events[2 * kEventRingBufferCapacity];
+  int num_events = isr_event_buffer.ReadN(events, kEventRingBufferCapacity);
+  while (loop_event_buffer.Size() > 0) {
+    events[num_events++] = loop_event_buffer.Read();
   }
   if (num_events == 0) {
     base_state_filter.EstimateState(GetTimerTicks());
@@ -8,6 +8,7 @@ void InitRobotStateEstimator();
 void RunRobotStateEstimator();
 BaseState GetBaseState();
 TimerNanosType GetBaseStateUpdateNanos();
+// Must be called from the main loop, like RunRobotStateEstimator(), and not from ISRs.
 void NotifyLeftMotorDirection(TimerTicksType timer_ticks, bool forward);
 void NotifyRightMotorDirection(TimerTicksType timer_ticks, bool forward);
 
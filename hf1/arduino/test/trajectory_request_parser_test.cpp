@@ -0,0 +1,53 @@
+#include <gtest/gtest.h>
+#include <vector>
+#include "trajectory_request_parser.h"
+#include "p2p_application_protocol.h"
+
+using EnvelopeRequestParser = TrajectoryRequestParser<P2PCreateEnvelopeTrajectoryRequest, P2PEnvelopeWaypoint>;
+
+// Returns a request with `num_waypoints` whose values are their indices, laid out past the
+// declared waypoints as if it was received in fragments.
+std::vector<uint8_t> CreateEnvelopeRequest(int num_waypoints) {
+  std::vector<uint8_t> bytes(EnvelopeRequestParser::kWaypointsOffset + num_waypoints * sizeof(P2PEnvelopeWaypoint));
+  for (int i = 0; i < num_waypoints; ++i) {
+    P2PEnvelopeWaypoint waypoint;
+    waypoint.seconds = i;
+    waypoint.target_state.location.value = i;
+    memcpy(&bytes[EnvelopeRequestParser::kWaypointsOffset + i * sizeof(P2PEnvelopeWaypoint)], &waypoint, sizeof(waypoint));
+  }
+  return bytes;
+}
+
+TEST(TrajectoryRequestParserTest, WaypointsInSingleChunkAreParsed) {
+  const std::vector<uint8_t> request = CreateEnvelopeRequest(3);
+  EnvelopeRequestParser parser;
+  parser.Feed(0, request.data(), request.size());
+
+  P2PEnvelopeWaypoint waypoint;
+  for (int i = 0; i < 3; ++i) {
+    ASSERT_TRUE(parser.NextWaypoint(&waypoint));
+    EXPECT_EQ(waypoint.seconds, i);
+    EXPECT_EQ(waypoint.target_state.location.value, i);
+  }
+  EXPECT_FALSE(parser.NextWaypoint(&waypoint));
+}
+
+TEST(TrajectoryRequestParserTest, WaypointsSplitAcrossChunksAreParsed) {
+  const std::vector<uint8_t> request = CreateEnvelopeRequest(50);
+  EnvelopeRequestParser parser;
+
+  // Chunks whose boundaries fall in the fields before the waypoints and in the middle of them.
+  const int chunk_length = 7;
+  int num_waypoints = 0;
+  P2PEnvelopeWaypoint waypoint;
+  for (size_t offset = 0; offset < request.size(); offset += chunk_length) {
+    const int length = std::min(chunk_length, static_cast<int>(request.size() - offset));
+    parser.Feed(offset, &request[offset], length);
+    while (parser.NextWaypoint(&waypoint)) {
+      EXPECT_EQ(waypoint.seconds, num_waypoints);
+      EXPECT_EQ(waypoint.target_state.location.value, num_waypoints);
+      ++num_waypoints;
+    }
+  }
+  EXPECT_EQ(num_waypoints, 50);
+}
@@ -0,0 +1,65 @@
+#ifndef TRAJECTORY_REQUEST_PARSER_
+#define TRAJECTORY_REQUEST_PARSER_
+
+#include <algorithm>
+#include <stddef.h>
+#include <string.h>
+#include "logger_interface.h"
+
+// Extracts the waypoints of a trajectory request received in consecutive chunks, e.g. the
+// fragments of a request too long for a packet. Waypoints split across chunks are buffered
+// until complete, so that they can be inserted in a trajectory without reassembling the
+// whole request.
+template<typename TRequest, typename TP2PWaypoint> class TrajectoryRequestParser {
+public:
+  // Offset of the first waypoint in the request. The bytes before are not parsed.
+  static constexpr int kWaypointsOffset = offsetof(TRequest, trajectory.waypoints);
+
+  TrajectoryRequestParser() { Reset(); }
+
+  // Prepares the parser for a new request.
+  void Reset() {
+    offset_ = 0;
+    data_ = nullptr;
+    length_ = 0;
+    num_buffered_bytes_ = 0;
+  }
+
+  // Feeds the `length` bytes in `data`, which start at `offset` in the request. Chunks must be
+  // fed in order, and the waypoints in the previous one must have been retrieved.
+  // Does not take ownership of `data`, which must not change until NextWaypoint() returns false.
+  void Feed(int offset, const uint8_t *data, int length) {
+    ASSERT(offset == offset_);
+    offset_ = offset + length;
+    const int num_skipped_bytes = std::max(0, std::min(length, kWaypointsOffset - offset));
+    data_ = data + num_skipped_bytes;
+    length_ = length - num_skipped_bytes;
+  }
+
+  // Copies the next complete waypoint into `waypoint`. Returns false if the bytes fed so far
+  // do not complete one.
+  bool NextWaypoint(TP2PWaypoint *waypoint) {
+    // Waypoints are copied byte-wise, as they may not be aligned in the chunks.
+    const int num_bytes = std::min(length_, static_cast<int>(sizeof(TP2PWaypoint)) - num_buffered_bytes_);
+    memcpy(&buffer_[num_buffered_bytes_], data_, num_bytes);
+    num_buffered_bytes_ += num_bytes;
+    data_ += num_bytes;
+    length_ -= num_bytes;
+    if (num_buffered_bytes_ < static_cast<int>(sizeof(TP2PWaypoint))) {
+      return false;
+    }
+    memcpy(waypoint, buffer_, sizeof(TP2PWaypoint));
+    num_buffered_bytes_ = 0;
+    return true;
+  }
+
+private:
+  // Offset in the request of the byte after the last chunk.
+  int offset_;
+  const uint8_t *data_;
+  int length_;
+  uint8_t buffer_[sizeof(TP2PWaypoint)];
+  int num_buffered_bytes_;
+};
+
+#endif  // TRAJECTORY_REQUEST_PARSER_
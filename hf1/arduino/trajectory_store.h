@@ -11,6 +11,13 @@
 #include "head_trajectory.h"
 #include "p2p_application_protocol.h"
 
+// Number of trajectories of each type that can be stored.
+#define kMaxNumTrajectoriesPerType 16
+
+// Number of waypoints that a stored trajectory can have. Trajectories with more waypoints than
+// fit in a packet are received in fragments (see kP2PFragmentAction).
+#define kMaxNumWaypointsPerStoredTrajectory 100
+
 template<int MaxNumTrajectoriesPerType, int MaxNumWaypointsPerTrajectory> 
 class TrajectoryStore_ {
 public:
@@ -44,6 +51,6 @@ private:
   Store<MixedTrajectoryView<HeadTargetState>, MaxNumTrajectoriesPerType> head_mixed_trajectory_views_;
 };
 
-using TrajectoryStore = TrajectoryStore_</*MaxNumTrajectoriesPerType=*/32, kP2PMaxNumWaypointsPerTrajectory>;
+using TrajectoryStore = TrajectoryStore_<kMaxNumTrajectoriesPerType, kMaxNumWaypointsPerStoredTrajectory>;
 
 #endif
\ No newline at end of file
@@ -0,0 +1,117 @@
+#include <benchmark/benchmark.h>
+#include <atomic>
+#include <mutex>
+#include <string.h>
+#include <thread>
+#include "mpsc_ring_buffer.h"
+#include "ring_buffer.h"
+
+namespace {
+
+// Message that application threads submit to the link thread, like a short action request.
+typedef struct {
+  int length;
+  uint8_t content[60];
+} Message;
+
+#define kSubmissionQueueCapacity 64
+
+// Drains `queue` from a consumer thread, as the link thread does, while the benchmark threads
+// submit messages to it.
+template<typename Queue> class Consumer {
+public:
+  Consumer(Queue *queue) : queue_(*queue), stop_(false), thread_(&Consumer::Run, this) {}
+  ~Consumer() {
+    stop_ = true;
+    thread_.join();
+  }
+
+private:
+  void Run() {
+    while (!stop_) {
+      while (queue_.Drain()) {}
+      std::this_thread::yield();
+    }
+  }
+
+  Queue &queue_;
+  std::atomic<bool> stop_;
+  std::thread thread_;
+};
+
+class LockFreeQueue {
+public:
+  bool Submit(const Message &message) {
+    Message *slot = buffer_.NewValue();
+    if (slot == NULL) { return false; }
+    memcpy(slot, &message, sizeof(message));
+    buffer_.Commit(slot);
+    return true;
+  }
+  bool Drain() {
+    const Message *message = buffer_.OldestValue();
+    if (message == NULL) { return false; }
+    benchmark::DoNotOptimize(message->content[0]);
+    buffer_.Consume();
+    return true;
+  }
+
+private:
+  MPSCRingBuffer<Message, kSubmissionQueueCapacity> buffer_;
+};
+
+// The former submission path: a ring buffer shared under a mutex.
+class LockedQueue {
+public:
+  bool Submit(const Message &message) {
+    std::lock_guard<std::mutex> guard(mutex_);
+    if (buffer_.IsFull()) { return false; }
+    memcpy(&buffer_.NewValue(), &message, sizeof(message));
+    buffer_.Commit();
+    return true;
+  }
+  bool Drain() {
+    std::lock_guard<std::mutex> guard(mutex_);
+    const Message *message = buffer_.OldestValue();
+    if (message == NULL) { return false; }
+    benchmark::DoNotOptimize(message->content[0]);
+    buffer_.Consume();
+    return true;
+  }
+
+private:
+  std::mutex mutex_;
+  RingBuffer<Message, kSubmissionQueueCapacity> buffer_;
+};
+
+template<typename Queue> Queue *queue = nullptr;
+template<typename Queue> Consumer<Queue> *consumer = nullptr;
+
+// Submits messages from state.threads() producer threads while one consumer thread drains
+// them. Submissions that find the queue full are retried, and counted as rejected.
+template<typename Queue> void BM_SubmissionQueue(benchmark::State &state) {
+  if (state.thread_index() == 0) {
+    queue<Queue> = new Queue();
+    consumer<Queue> = new Consumer<Queue>(queue<Queue>);
+  }
+  Message message;
+  message.length = sizeof(message.content);
+  memset(message.content, state.thread_index(), sizeof(message.content));
+  int64_t num_rejected = 0;
+  for (auto _ : state) {
+    while (!queue<Queue>->Submit(message)) {
+      ++num_rejected;
+      std::this_thread::yield();
+    }
+  }
+  state.SetItemsProcessed(state.iterations());
+  state.counters["rejected"] = benchmark::Counter(num_rejected, benchmark::Counter::kAvgThreads);
+  if (state.thread_index() == 0) {
+    delete consumer<Queue>;
+    delete queue<Queue>;
+  }
+}
+BENCHMARK_TEMPLATE(BM_SubmissionQueue, LockFreeQueue)->Threads(1)->Threads(8)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_SubmissionQueue, LockedQueue)->Threads(1)->Threads(8)->UseRealTime();
+
+}  // namespace
@@ -0,0 +1,113 @@
+#include <benchmark/benchmark.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include "p2p_codec.h"
+#include "p2p_packet_stream.h"
+
+namespace {
+
+enum Payload { kAllStartTokens, kRandom, kFloats };
+
+// Fills a packet's worth of content. All start tokens is the worst case for stuffing; random
+// bytes have a token every 128 bytes on average; floats are typical of trajectory requests.
+std::vector<uint8_t> MakePayload(Payload payload) {
+  std::vector<uint8_t> bytes(kP2PMaxContentLength);
+  srand(1);
+  unsigned int i = 0;
+  if (payload == kFloats) {
+    for (; i + sizeof(float) <= bytes.size(); i += sizeof(float)) {
+      const float value = (rand() % 2000 - 1000) / 100.0f;
+      memcpy(&bytes[i], &value, sizeof(float));
+    }
+  }
+  // The bytes of the other payloads, and the tail that is too short for a float.
+  for (; i < bytes.size(); ++i) {
+    bytes[i] = payload == kAllStartTokens ? kP2PStartToken : rand();
+  }
+  return bytes;
+}
+
+// Escapes the tokens in `content` into `output` scanning one byte at a time, and returns the
+// encoded length. This is what the output stream did before the kernels.
+int StuffBytesScalar(const uint8_t *content, int length, uint8_t *output, P2PChecksumType *checksum) {
+  int output_length = 0;
+  for (int i = 0; i < length; ++i) {
+    output[output_length++] = content[i];
+    if (content[i] == kP2PStartToken || content[i] == kP2PSpecialToken) { output[output_length++] = kP2PSpecialToken; }
+    *checksum += content[i];
+  }
+  return output_length;
+}
+
+// Same as StuffBytesScalar(), copying runs without tokens in one go, as the output stream does.
+int StuffBytesWithKernels(const uint8_t *content, int length, uint8_t *output, P2PChecksumType *checksum) {
+  int output_length = 0;
+  int i = 0;
+  while (i < length) {
+    if (content[i] == kP2PStartToken || content[i] == kP2PSpecialToken) {
+      output[output_length++] = content[i];
+      output[output_length++] = kP2PSpecialToken;
+      *checksum += content[i++];
+      continue;
+    }
+    const int run_length = P2PFindToken(&content[i], length - i);
+    memcpy(&output[output_length], &content[i], run_length);
+    *checksum += P2PSumBytes(&content[i], run_length);
+    output_length += run_length;
+    i += run_length;
+  }
+  return output_length;
+}
+
+template<int (*StuffBytes)(const uint8_t *, int, uint8_t *, P2PChecksumType *)>
+void BM_StuffBytes(benchmark::State &state) {
+  const std::vector<uint8_t> content = MakePayload(static_cast<Payload>(state.range(0)));
+  uint8_t output[2 * kP2PMaxContentLength];
+  P2PChecksumType checksum = 0;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(StuffBytes(content.data(), content.size(), output, &checksum));
+    benchmark::ClobberMemory();
+  }
+  state.SetBytesProcessed(state.iterations() * content.size());
+}
+BENCHMARK_TEMPLATE(BM_StuffBytes, StuffBytesScalar)->ArgName("payload")->DenseRange(kAllStartTokens, kFloats);
+BENCHMARK_TEMPLATE(BM_StuffBytes, StuffBytesWithKernels)->ArgName("payload")->DenseRange(kAllStartTokens, kFloats);
+
+template<P2PChecksumType (*SumBytes)(const uint8_t *, int)>
+void BM_SumBytes(benchmark::State &state) {
+  const std::vector<uint8_t> content = MakePayload(kRandom);
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(SumBytes(content.data(), content.size()));
+  }
+  state.SetBytesProcessed(state.iterations() * content.size());
+}
+BENCHMARK_TEMPLATE(BM_SumBytes, P2PSumBytesScalar);
+BENCHMARK_TEMPLATE(BM_SumBytes, P2PSumBytes);
+
+template<int (*FindToken)(const uint8_t *, int)>
+void BM_FindToken(benchmark::State &state) {
+  std::vector<uint8_t> content(kP2PMaxContentLength, 0);
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(FindToken(content.data(), content.size()));
+  }
+  state.SetBytesProcessed(state.iterations() * content.size());
+}
+BENCHMARK_TEMPLATE(BM_FindToken, P2PFindTokenScalar);
+BENCHMARK_TEMPLATE(BM_FindToken, P2PFindToken);
+
+// Computes the checksum of a whole packet with state.range(0) content bytes, as the streams do
+// for every packet sent and received.
+void BM_PacketChecksum(benchmark::State &state) {
+  const std::vector<uint8_t> content = MakePayload(kRandom);
+  P2PPacket packet;
+  memcpy(packet.content(), content.data(), state.range(0));
+  packet.length() = state.range(0);
+  for (auto _ : state) {
+    benchmark::DoNotOptimize((packet.HeaderChecksum() + P2PSumBytes(packet.content(), state.range(0))) % kP2PChecksumModulo);
+  }
+  state.SetBytesProcessed(state.iterations() * (sizeof(P2PHeader) + state.range(0)));
+}
+BENCHMARK(BM_PacketChecksum)->ArgName("content_length")->Arg(8)->Arg(32)->Arg(kP2PMaxContentLength);
+
+}  // namespace
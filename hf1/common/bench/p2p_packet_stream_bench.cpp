@@ -0,0 +1,495 @@
+#include <benchmark/benchmark.h>
+#include <stdlib.h>
+#include <deque>
+#include <vector>
+#include "p2p_application_protocol.h"
+#include "p2p_link_emulator.h"
+#include "p2p_link_stats.h"
+#include "p2p_message_aggregator.h"
+#include "p2p_packet_stream.h"
+
+namespace {
+
+class FakeGUIDFactory : public GUIDFactoryInterface {
+public:
+  FakeGUIDFactory(uint8_t seed) : seed_(seed) {}
+  virtual void CreateGUID(int len, uint8_t *buffer, uint8_t max_byte_value) {
+    for (int i = 0; i < len; ++i) { buffer[i] = (seed_ + i) % max_byte_value; }
+  }
+
+private:
+  uint8_t seed_;
+};
+
+// Byte stream that records written bytes and replays them when read. Every call to Read()
+// is counted, as it would be a system call on Linux.
+class ReplayByteStream : public P2PByteStreamInterface<kLittleEndian> {
+public:
+  ReplayByteStream()
+    : P2PByteStreamInterface<kLittleEndian>(Handler{ .object = nullptr }), read_offset_(0), num_reads_(0) {}
+
+  virtual int Write(const void *buffer, int length) {
+    const uint8_t *bytes = static_cast<const uint8_t *>(buffer);
+    recording_.insert(recording_.end(), bytes, bytes + length);
+    return length;
+  }
+
+  virtual int Read(void *buffer, int length) {
+    ++num_reads_;
+    const int num_bytes = std::min(length, static_cast<int>(recording_.size()) - read_offset_);
+    memcpy(buffer, &recording_[read_offset_], num_bytes);
+    read_offset_ += num_bytes;
+    return num_bytes;
+  }
+
+  virtual int GetBurstMaxLength() { return 1024; }
+  virtual int GetBurstIngestionNanosecondsPerByte() { return 0; }
+  virtual int GetAtomicSendMaxLength() { return 4; }
+  virtual int GetReceiveBufferLength() { return 0; }
+
+  void Rewind() { read_offset_ = 0; }
+  void Clear() { recording_.clear(); read_offset_ = 0; }
+  int recording_length() const { return recording_.size(); }
+  uint64_t num_reads() const { return num_reads_; }
+
+private:
+  std::vector<uint8_t> recording_;
+  int read_offset_;
+  uint64_t num_reads_;
+};
+
+// ReplayByteStream as a final type, so that the streams that take it as their ByteStream type
+// call it without the vtable, as they call P2PByteStreamArduino and P2PByteStreamLinux.
+class FinalReplayByteStream final : public ReplayByteStream {};
+
+class FakeTimer : public TimerInterface {
+public:
+  virtual uint64_t GetLocalNanoseconds() const { return 0; }
+};
+
+// Byte stream whose written bytes are read at the other end right away.
+class PipeByteStream : public P2PByteStreamInterface<kLittleEndian> {
+public:
+  PipeByteStream(std::deque<uint8_t> *rx, std::deque<uint8_t> *tx)
+    : P2PByteStreamInterface<kLittleEndian>(Handler{ .object = nullptr }), rx_(*rx), tx_(*tx) {}
+
+  virtual int Write(const void *buffer, int length) {
+    const uint8_t *bytes = static_cast<const uint8_t *>(buffer);
+    tx_.insert(tx_.end(), bytes, bytes + length);
+    return length;
+  }
+
+  virtual int Read(void *buffer, int length) {
+    const int num_bytes = std::min(length, static_cast<int>(rx_.size()));
+    std::copy(rx_.begin(), rx_.begin() + num_bytes, static_cast<uint8_t *>(buffer));
+    rx_.erase(rx_.begin(), rx_.begin() + num_bytes);
+    return num_bytes;
+  }
+
+  virtual int GetBurstMaxLength() { return 1024; }
+  virtual int GetBurstIngestionNanosecondsPerByte() { return 0; }
+  virtual int GetAtomicSendMaxLength() { return 4; }
+  virtual int GetReceiveBufferLength() { return 0; }
+
+private:
+  std::deque<uint8_t> &rx_;
+  std::deque<uint8_t> &tx_;
+};
+
+using BenchInputStream = P2PPacketInputStream<16, kLittleEndian>;
+using BenchOutputStream = P2PPacketOutputStream<16, kLittleEndian>;
+
+// Fills `length` bytes of `content` with random bytes. If `token_percent` is not negative,
+// that percentage of the bytes are tokens, and the rest are never tokens.
+void FillContent(uint8_t *content, int length, int token_percent) {
+  for (int i = 0; i < length; ++i) {
+    if (token_percent < 0) {
+      content[i] = rand();
+    } else if (rand() % 100 < token_percent) {
+      content[i] = rand() % 2 ? kP2PStartToken : kP2PSpecialToken;
+    } else {
+      content[i] = rand() % kP2PLowestToken;
+    }
+  }
+}
+
+// Records the wire bytes of `num_packets` packets with `length` content bytes, filled as in
+// FillContent(), and sent with `framing`.
+void RecordPackets(int num_packets, int length, ReplayByteStream *byte_stream, TimerInterface *timer, int token_percent = -1, P2PFraming framing = kEscapedFraming) {
+  BenchOutputStream output(byte_stream, timer);
+  output.framing(framing);
+  srand(1);
+  for (int i = 0; i < num_packets; ++i) {
+    StatusOr<P2PMutablePacketView> view = output.NewPacket(P2PPriority::kMedium);
+    FillContent(view->content(), length, token_percent);
+    view->length() = length;
+    output.Commit(P2PPriority::kMedium, /*guarantee_delivery=*/false);
+    while (output.NumCommittedPackets() > 0) { output.Run(); }
+  }
+}
+
+// Receives a recording of packets with the input stream reading up to state.range(0)
+// bytes per Run(). An argument of 1 is the per-byte path.
+// Bytes are always available in the replay, so this measures the upper bound of the
+// block-read gains; on a real link, the number of bytes per read depends on how often
+// Run() is called.
+void BM_InputStreamRun(benchmark::State &state) {
+  const int kNumPackets = 100;
+  FakeTimer timer;
+  ReplayByteStream byte_stream;
+  RecordPackets(kNumPackets, /*length=*/state.range(1), &byte_stream, &timer);
+  BenchInputStream input(&byte_stream, &timer);
+  input.read_block_length(state.range(0));
+
+  uint64_t num_received_packets = 0;
+  for (auto _ : state) {
+    byte_stream.Rewind();
+    while (input.Run() > 0) {
+      while (input.NumAvailablePackets(P2PPriority::kMedium) > 0) {
+        input.Consume(P2PPriority::kMedium);
+        ++num_received_packets;
+      }
+    }
+  }
+
+  state.SetBytesProcessed(state.iterations() * byte_stream.recording_length());
+  state.counters["reads_per_packet"] = byte_stream.num_reads() / static_cast<double>(state.iterations() * kNumPackets);
+  state.counters["packets"] = benchmark::Counter(num_received_packets, benchmark::Counter::kIsRate);
+}
+BENCHMARK(BM_InputStreamRun)
+  ->ArgNames({"read_block_length", "content_length"})
+  ->ArgsProduct({{1, kP2PInputStagingBufferLength}, {8, 32, 160}});
+
+// Encodes packets with state.range(1) content bytes, of which a state.range(2) percentage are
+// tokens, with the framing in state.range(0), from commit until their last byte is written.
+void BM_OutputStreamEncode(benchmark::State &state) {
+  const int content_length = state.range(1);
+  FakeTimer timer;
+  ReplayByteStream byte_stream;
+  BenchOutputStream output(&byte_stream, &timer);
+  output.framing(static_cast<P2PFraming>(state.range(0)));
+  srand(1);
+  uint8_t content[kP2PMaxContentLength];
+  FillContent(content, content_length, state.range(2));
+
+  for (auto _ : state) {
+    byte_stream.Clear();
+    StatusOr<P2PMutablePacketView> view = output.NewPacket(P2PPriority::kMedium);
+    memcpy(view->content(), content, content_length);
+    view->length() = content_length;
+    output.Commit(P2PPriority::kMedium, /*guarantee_delivery=*/false);
+    while (output.NumCommittedPackets() > 0) { output.Run(); }
+  }
+  state.SetBytesProcessed(state.iterations() * content_length);
+  state.counters["wire_bytes"] = byte_stream.recording_length();
+}
+BENCHMARK(BM_OutputStreamEncode)
+  ->ArgNames({"cobs", "content_length", "token_percent"})
+  ->ArgsProduct({{kEscapedFraming, kCOBSFraming}, {8, 32, 160}, {0, 1, 50}});
+
+// Decodes packets encoded as in BM_OutputStreamEncode with the input stream.
+void BM_InputStreamDecode(benchmark::State &state) {
+  const int kNumPackets = 100;
+  FakeTimer timer;
+  ReplayByteStream byte_stream;
+  RecordPackets(kNumPackets, /*length=*/state.range(1), &byte_stream, &timer, /*token_percent=*/state.range(2), static_cast<P2PFraming>(state.range(0)));
+  BenchInputStream input(&byte_stream, &timer);
+
+  for (auto _ : state) {
+    byte_stream.Rewind();
+    while (input.Run() > 0) {
+      while (input.NumAvailablePackets(P2PPriority::kMedium) > 0) {
+        input.Consume(P2PPriority::kMedium);
+      }
+    }
+  }
+  state.SetBytesProcessed(state.iterations() * kNumPackets * state.range(1));
+}
+BENCHMARK(BM_InputStreamDecode)
+  ->ArgNames({"cobs", "content_length", "token_percent"})
+  ->ArgsProduct({{kEscapedFraming, kCOBSFraming}, {8, 32, 160}, {0, 1, 50}});
+
+// Receives a recording of packets reading one byte per Read(), and encodes packets whose
+// bytes are written in GetAtomicSendMaxLength() chunks, with the calls to the byte stream
+// dispatched through P2PByteStreamInterface's vtable or resolved at compile time for the final
+// FinalReplayByteStream. The replayed bytes are the same in both cases.
+template<typename ByteStream> void BM_InputStreamByteStreamDispatch(benchmark::State &state) {
+  const int kNumPackets = 100;
+  FakeTimer timer;
+  FinalReplayByteStream byte_stream;
+  RecordPackets(kNumPackets, /*length=*/state.range(0), &byte_stream, &timer);
+  P2PPacketInputStream<16, kLittleEndian, ByteStream> input(&byte_stream, &timer);
+  input.read_block_length(1);
+
+  for (auto _ : state) {
+    byte_stream.Rewind();
+    while (input.Run() > 0) {
+      while (input.NumAvailablePackets(P2PPriority::kMedium) > 0) {
+        input.Consume(P2PPriority::kMedium);
+      }
+    }
+  }
+  state.SetBytesProcessed(state.iterations() * byte_stream.recording_length());
+}
+BENCHMARK_TEMPLATE(BM_InputStreamByteStreamDispatch, P2PByteStreamInterface<kLittleEndian>)->ArgName("content_length")->Arg(8)->Arg(160);
+BENCHMARK_TEMPLATE(BM_InputStreamByteStreamDispatch, FinalReplayByteStream)->ArgName("content_length")->Arg(8)->Arg(160);
+
+template<typename ByteStream> void BM_OutputStreamByteStreamDispatch(benchmark::State &state) {
+  const int content_length = state.range(0);
+  FakeTimer timer;
+  FinalReplayByteStream byte_stream;
+  P2PPacketOutputStream<16, kLittleEndian, ByteStream> output(&byte_stream, &timer);
+  srand(1);
+  uint8_t content[kP2PMaxContentLength];
+  FillContent(content, content_length, /*token_percent=*/-1);
+
+  for (auto _ : state) {
+    byte_stream.Clear();
+    StatusOr<P2PMutablePacketView> view = output.NewPacket(P2PPriority::kMedium);
+    memcpy(view->content(), content, content_length);
+    view->length() = content_length;
+    output.Commit(P2PPriority::kMedium, /*guarantee_delivery=*/false);
+    while (output.NumCommittedPackets() > 0) { output.Run(); }
+  }
+  state.SetBytesProcessed(state.iterations() * byte_stream.recording_length());
+}
+BENCHMARK_TEMPLATE(BM_OutputStreamByteStreamDispatch, P2PByteStreamInterface<kLittleEndian>)->ArgName("content_length")->Arg(8)->Arg(160);
+BENCHMARK_TEMPLATE(BM_OutputStreamByteStreamDispatch, FinalReplayByteStream)->ArgName("content_length")->Arg(8)->Arg(160);
+
+// Sends reliable packets with state.range(0) random content bytes between two packet streams
+// through an in-memory pipe, from commit until retrieval at the other end, ACKs included.
+void BM_PacketStreamRoundTrip(benchmark::State &state) {
+  const int content_length = state.range(0);
+  // Time must advance for ACKs that cannot be piggybacked to be sent after their holdoff.
+  P2PVirtualTimer timer;
+  std::deque<uint8_t> a_to_b;
+  std::deque<uint8_t> b_to_a;
+  PipeByteStream byte_stream_a(&b_to_a, &a_to_b);
+  PipeByteStream byte_stream_b(&a_to_b, &b_to_a);
+  FakeGUIDFactory guid_factory_a(1);
+  FakeGUIDFactory guid_factory_b(7);
+  P2PPacketStream<16, 16, kLittleEndian> a(&byte_stream_a, &timer, guid_factory_a);
+  P2PPacketStream<16, 16, kLittleEndian> b(&byte_stream_b, &timer, guid_factory_b);
+  auto run_link = [&]() {
+    a.output().Run();
+    b.output().Run();
+    a.input().Run();
+    b.input().Run();
+    timer.Advance(10000);
+  };
+  // Handshake.
+  for (int i = 0; i < 100; ++i) { run_link(); }
+  srand(1);
+  uint8_t content[kP2PMaxContentLength];
+  FillContent(content, content_length, /*token_percent=*/-1);
+
+  for (auto _ : state) {
+    StatusOr<P2PMutablePacketView> view = a.output().NewPacket(P2PPriority::kMedium);
+    if (!view.ok()) {
+      state.SkipWithError("No space in the output stream.");
+      break;
+    }
+    memcpy(view->content(), content, content_length);
+    view->length() = content_length;
+    a.output().Commit(P2PPriority::kMedium, /*guarantee_delivery=*/true);
+    while (b.input().NumAvailablePackets(P2PPriority::kMedium) == 0) { run_link(); }
+    b.input().Consume(P2PPriority::kMedium);
+    // Let the ACK free the slot in the sender.
+    while (a.output().NumCommittedPackets(P2PPriority::kMedium) > 0) { run_link(); }
+  }
+  state.SetBytesProcessed(state.iterations() * content_length);
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_PacketStreamRoundTrip)->ArgName("content_length")->Arg(8)->Arg(32)->Arg(160);
+
+// Fills `request` with a trajectory of waypoints along a random walk, as the planner would.
+// If `token_heavy`, the coordinates are rounded to the float closest to 2 below, whose bytes
+// are mostly tokens (0x3fffffff); this is the worst case for the escaped framing.
+void MakeBaseTrajectoryRequest(bool token_heavy, P2PCreateBaseTrajectoryRequest *request) {
+  request->id = rand() % 256;
+  request->trajectory.num_waypoints = kP2PMaxNumWaypointsPerTrajectory;
+  float x = 0, y = 0, yaw = 0;
+  for (int i = 0; i < kP2PMaxNumWaypointsPerTrajectory; ++i) {
+    x += (rand() % 1000) / 1000.0f;
+    y += (rand() % 1000 - 500) / 1000.0f;
+    yaw += (rand() % 1000 - 500) / 1000.0f;
+    if (token_heavy) { x = y = yaw = 1.99999988f; }
+    request->trajectory.waypoints[i] = { .seconds = 0.5f * (i + 1), .target_state = { .location = { x, y, yaw } } };
+  }
+}
+
+// Sends base trajectory requests with the framing in state.range(0) (0 = escaped, 1 = COBS),
+// and reports the bytes on the wire per packet. state.range(1) selects token-heavy content.
+void BM_CreateBaseTrajectoryWireBytes(benchmark::State &state) {
+  const int kNumRequests = 100;
+  FakeTimer timer;
+  ReplayByteStream byte_stream;
+  BenchOutputStream output(&byte_stream, &timer);
+  output.framing(static_cast<P2PFraming>(state.range(0)));
+  srand(1);
+  struct {
+    P2PApplicationPacketHeader header;
+    P2PCreateBaseTrajectoryRequest request;
+  } __attribute__((packed)) requests[kNumRequests];
+  static_assert(sizeof(requests[0]) <= kP2PMaxContentLength, "The request does not fit in a packet.");
+  for (int i = 0; i < kNumRequests; ++i) {
+    requests[i].header = { .action = kCreateBaseTrajectory, .stage = kRequest, .request_id = static_cast<P2PActionRequestID>(i) };
+    MakeBaseTrajectoryRequest(state.range(1), &requests[i].request);
+  }
+
+  uint64_t num_packets = 0;
+  int max_wire_bytes = 0;
+  uint64_t total_wire_bytes = 0;
+  for (auto _ : state) {
+    byte_stream.Clear();
+    StatusOr<P2PMutablePacketView> view = output.NewPacket(P2PPriority::kMedium);
+    if (!view.ok() || view->content() == nullptr) {
+      state.SkipWithError("No space in the output stream.");
+      break;
+    }
+    const uint8_t *request_bytes = reinterpret_cast<const uint8_t *>(&requests[num_packets % kNumRequests]);
+    std::copy(request_bytes, request_bytes + sizeof(requests[0]), view->content());
+    view->length() = sizeof(requests[0]);
+    output.Commit(P2PPriority::kMedium, /*guarantee_delivery=*/false);
+    while (output.NumCommittedPackets() > 0) { output.Run(); }
+    ++num_packets;
+    max_wire_bytes = std::max(max_wire_bytes, byte_stream.recording_length());
+    total_wire_bytes += byte_stream.recording_length();
+  }
+
+  state.SetBytesProcessed(state.iterations() * sizeof(requests[0]));
+  state.counters["content_bytes"] = sizeof(requests[0]);
+  state.counters["wire_bytes"] = total_wire_bytes / static_cast<double>(num_packets);
+  state.counters["max_wire_bytes"] = max_wire_bytes;
+}
+BENCHMARK(BM_CreateBaseTrajectoryWireBytes)
+  ->ArgNames({"cobs", "token_heavy"})
+  ->ArgsProduct({{kEscapedFraming, kCOBSFraming}, {0, 1}});
+
+// Sends base state progress messages, as monitoring does, in rounds of state.range(1) messages
+// between which the output stream is drained, as if the link were busy meanwhile. Reports the
+// packets and bytes on the wire per message. If state.range(0), messages go through an
+// aggregator; otherwise, each message takes its own packet.
+void BM_ProgressMessageWireBytes(benchmark::State &state) {
+  const int kNumMessages = 60;
+  FakeTimer timer;
+  ReplayByteStream byte_stream;
+  BenchOutputStream output(&byte_stream, &timer);
+  P2PMessageAggregator<16, kLittleEndian> aggregator(&output, &timer);
+  struct {
+    P2PApplicationPacketHeader header;
+    P2PMonitorBaseStateProgress progress;
+  } __attribute__((packed)) message = {};
+  message.header = { .action = kMonitorBaseState, .stage = kProgress, .request_id = 1 };
+
+  uint64_t num_messages = 0;
+  uint64_t num_packets = 0;
+  uint64_t total_wire_bytes = 0;
+  for (auto _ : state) {
+    byte_stream.Clear();
+    for (int i = 0; i < kNumMessages; ++i) {
+      if (state.range(0)) {
+        StatusOr<P2PMutablePacketView> view = aggregator.NewMessage(P2PPriority::kMedium, sizeof(message));
+        memcpy(view->content(), &message, sizeof(message));
+        aggregator.Commit(P2PPriority::kMedium, /*guarantee_delivery=*/false);
+      } else {
+        StatusOr<P2PMutablePacketView> view = output.NewPacket(P2PPriority::kMedium);
+        memcpy(view->content(), &message, sizeof(message));
+        view->length() = sizeof(message);
+        output.Commit(P2PPriority::kMedium, /*guarantee_delivery=*/false);
+      }
+      if ((i + 1) % state.range(1) == 0) {
+        aggregator.Flush();
+        num_packets += output.NumCommittedPackets();
+        while (output.NumCommittedPackets() > 0) { output.Run(); }
+      }
+    }
+    num_messages += kNumMessages;
+    total_wire_bytes += byte_stream.recording_length();
+  }
+
+  state.counters["packets_per_message"] = num_packets / static_cast<double>(num_messages);
+  state.counters["wire_bytes_per_message"] = total_wire_bytes / static_cast<double>(num_messages);
+  state.counters["messages"] = benchmark::Counter(num_messages, benchmark::Counter::kIsRate);
+}
+BENCHMARK(BM_ProgressMessageWireBytes)
+  ->ArgNames({"aggregate", "messages_per_round"})
+  ->ArgsProduct({{0, 1}, {1, 6}});
+
+// Streams reliable packets with state.range(1) content bytes for one virtual second over an
+// emulated 1 Mbaud UART with state.range(2) bit errors per million, and reports the goodput
+// and the latency from commit until retrieval at the receiver, in virtual time, as well as
+// the packets delivered with errors that the checksum did not catch. The sender
+// has the Linux stream capacities (16/16) and the receiver the Arduino ones (4/2) if
+// state.range(0) is 0, and the other way around otherwise.
+template<int kSenderInputCapacity, int kSenderOutputCapacity, int kReceiverInputCapacity, int kReceiverOutputCapacity>
+void RunEmulatedLink(benchmark::State &state) {
+  const uint64_t kDurationNs = 1000000000ULL;
+  const uint64_t kTimeStepNs = 10000;
+  const int content_length = state.range(1);
+  P2PLinkEmulatorConfig config = P2PLinkEmulator::UARTConfig();
+  config.bit_error_rate = state.range(2) * 1e-6;
+
+  uint64_t total_received_bytes = 0;
+  uint64_t total_virtual_ns = 0;
+  P2PLatencyHistogram latencies;
+  uint64_t num_undetected_errors = 0;
+  uint32_t seed = 1;
+  for (auto _ : state) {
+    P2PLinkEmulator link(config, config, seed++);
+    FakeGUIDFactory guid_factory_sender(1);
+    FakeGUIDFactory guid_factory_receiver(7);
+    P2PPacketStream<kSenderInputCapacity, kSenderOutputCapacity, kLittleEndian> sender(&link.end_a(), &link.timer(), guid_factory_sender);
+    P2PPacketStream<kReceiverInputCapacity, kReceiverOutputCapacity, kLittleEndian> receiver(&link.end_b(), &link.timer(), guid_factory_receiver);
+    const uint64_t start_ns = link.timer().GetLocalNanoseconds();
+    while (link.timer().GetLocalNanoseconds() - start_ns < kDurationNs) {
+      StatusOr<P2PMutablePacketView> view = sender.output().NewPacket(P2PPriority::kMedium);
+      if (view.ok()) {
+        const uint64_t commit_ns = link.timer().GetLocalNanoseconds();
+        memset(view->content(), 0, content_length);
+        memcpy(view->content(), &commit_ns, std::min<int>(content_length, sizeof(commit_ns)));
+        view->length() = content_length;
+        sender.output().Commit(P2PPriority::kMedium, /*guarantee_delivery=*/true);
+      }
+      sender.output().Run();
+      receiver.output().Run();
+      sender.input().Run();
+      receiver.input().Run();
+      while (receiver.input().NumAvailablePackets(P2PPriority::kMedium) > 0) {
+        StatusOr<const P2PPacketView> packet = receiver.input().OldestPacket();
+        uint64_t commit_ns = 0;
+        memcpy(&commit_ns, packet->content(), std::min<int>(packet->length(), sizeof(commit_ns)));
+        if (commit_ns <= link.timer().GetLocalNanoseconds()) {
+          latencies.Add(link.timer().GetLocalNanoseconds() - commit_ns);
+        } else {
+          // Corrupted with a valid checksum.
+          ++num_undetected_errors;
+        }
+        total_received_bytes += packet->length();
+        receiver.input().Consume(P2PPriority::kMedium);
+      }
+      link.Advance(kTimeStepNs);
+    }
+    total_virtual_ns += link.timer().GetLocalNanoseconds() - start_ns;
+  }
+
+  state.counters["goodput_bytes_per_virtual_second"] = total_received_bytes * 1e9 / total_virtual_ns;
+  state.counters["p50_latency_us"] = latencies.Quantile(0.5f) / 1000.0;
+  state.counters["p99_latency_us"] = latencies.Quantile(0.99f) / 1000.0;
+  state.counters["max_latency_us"] = latencies.max_ns() / 1000.0;
+  state.counters["undetected_errors"] = num_undetected_errors;
+}
+
+void BM_EmulatedLink(benchmark::State &state) {
+  if (state.range(0) == 0) {
+    RunEmulatedLink<16, 16, 4, 2>(state);
+  } else {
+    RunEmulatedLink<4, 2, 16, 16>(state);
+  }
+}
+BENCHMARK(BM_EmulatedLink)
+  ->ArgNames({"from_arduino", "content_length", "bit_errors_per_million"})
+  ->ArgsProduct({{0, 1}, {32, 160}, {0, 10}})
+  ->Unit(benchmark::kMillisecond);
+
+}  // namespace
@@ -0,0 +1,175 @@
+#include <benchmark/benchmark.h>
+#include "p2p_packet_stream.h"
+#include "packed_number.h"
+#include "priority_ring_buffer.h"
+#include "ring_buffer.h"
+
+namespace {
+
+// Writes and reads one packet, as the streams do for every packet.
+void BM_RingBufferWriteRead(benchmark::State &state) {
+  RingBuffer<P2PPacket, 16> buffer;
+  P2PPacket packet;
+  for (auto _ : state) {
+    buffer.NewValue() = packet;
+    buffer.Commit();
+    benchmark::DoNotOptimize(buffer.OldestValue());
+    buffer.Consume();
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_RingBufferWriteRead);
+
+// Consumes the state.range(0)-th oldest value of a full buffer, as when the oldest packets in
+// flight are acknowledged out of order, and writes a new one in its place.
+void BM_RingBufferConsumeAt(benchmark::State &state) {
+  RingBuffer<uint64_t, 16> buffer;
+  while (!buffer.IsFull()) { buffer.Write(0); }
+  for (auto _ : state) {
+    buffer.Consume(state.range(0));
+    buffer.Write(1);
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_RingBufferConsumeAt)->ArgName("index")->Arg(0)->Arg(7)->Arg(14);
+
+// The former RingBuffer, which wrapped its indices with a division, to compare with the
+// current one. Only the methods used below are kept.
+template<typename ValueType, int kCapacity> class ModuloRingBuffer {
+public:
+  ModuloRingBuffer() : read_index_(0), write_index_(0), size_(0) {
+    for (int i = 0; i < kCapacity; ++i) { indices_[i] = i; }
+  }
+  ValueType *OldestValue(int i = 0) {
+    if (size_ <= i) { return NULL; }
+    return &values_[indices_[(read_index_ + i) % kCapacity]];
+  }
+  bool Consume(int i = 0) {
+    if (size_ <= i) { return false; }
+    for (int k = 0, j = (read_index_ + i) % kCapacity; k < i; ++k, j = IndexMod(j - 1, kCapacity)) {
+      indices_[j] = indices_[IndexMod(j - 1, kCapacity)];
+    }
+    read_index_ = (read_index_ + 1) % kCapacity;
+    --size_;
+    return true;
+  }
+  ValueType &NewValue() { return values_[indices_[write_index_]]; }
+  void Commit() {
+    write_index_ = (write_index_ + 1) % kCapacity;
+    if (size_ < kCapacity - 1) { ++size_; }
+    if (write_index_ == read_index_) { read_index_ = (read_index_ + 1) % kCapacity; }
+  }
+
+private:
+  ValueType values_[kCapacity];
+  int indices_[kCapacity];
+  int read_index_;
+  int write_index_;
+  volatile int size_;
+};
+
+// Fills a buffer and drains it in order, as the estimator does with its event buffer, with
+// the former RingBuffer, RingBuffer and FIFORingBuffer, and power-of-two and other capacities.
+// To count the cache misses as well, run with --benchmark_perf_counters=CACHE-MISSES if Google
+// Benchmark was built with libpfm.
+template<template<typename, int> class BufferType, int kCapacity> void BM_RingBufferPushPop(benchmark::State &state) {
+  BufferType<uint32_t, kCapacity> buffer;
+  uint32_t n = 0;
+  for (auto _ : state) {
+    for (int i = 0; i < kCapacity - 1; ++i) {
+      buffer.NewValue() = n++;
+      buffer.Commit();
+    }
+    for (int i = 0; i < kCapacity - 1; ++i) {
+      benchmark::DoNotOptimize(*buffer.OldestValue());
+      buffer.Consume();
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * (kCapacity - 1));
+}
+BENCHMARK_TEMPLATE(BM_RingBufferPushPop, ModuloRingBuffer, 16);
+BENCHMARK_TEMPLATE(BM_RingBufferPushPop, RingBuffer, 16);
+BENCHMARK_TEMPLATE(BM_RingBufferPushPop, FIFORingBuffer, 16);
+BENCHMARK_TEMPLATE(BM_RingBufferPushPop, ModuloRingBuffer, 15);
+BENCHMARK_TEMPLATE(BM_RingBufferPushPop, RingBuffer, 15);
+BENCHMARK_TEMPLATE(BM_RingBufferPushPop, FIFORingBuffer, 15);
+
+// Priority with as many levels as fit in the occupancy bitmap.
+class WidePriority {
+public:
+  enum Level { kNumLevels = 32 };
+  WidePriority(int level) : level_(level) {}
+  operator int() const { return level_; }
+
+private:
+  int level_;
+};
+
+// Finds the oldest value across priorities when only the lowest priority has values, which was
+// the longest scan before the levels with values were tracked in a bitmap.
+template<typename PriorityType> void BM_PriorityRingBufferOldestValue(benchmark::State &state) {
+  PriorityRingBuffer<P2PPacket, 16, PriorityType> buffer;
+  buffer.Commit(PriorityType::kNumLevels - 1);
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(buffer.OldestValue());
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK_TEMPLATE(BM_PriorityRingBufferOldestValue, P2PPriority);
+BENCHMARK_TEMPLATE(BM_PriorityRingBufferOldestValue, WidePriority);
+
+// The former OldestValue(), which scanned the levels in order of priority.
+template<typename PriorityType> void BM_PriorityRingBufferOldestValueScan(benchmark::State &state) {
+  PriorityRingBuffer<P2PPacket, 16, PriorityType> buffer;
+  buffer.Commit(PriorityType::kNumLevels - 1);
+  for (auto _ : state) {
+    const P2PPacket *value = NULL;
+    for (int i = 0; i < PriorityType::kNumLevels && value == NULL; ++i) {
+      benchmark::DoNotOptimize(buffer);
+      value = buffer.OldestValue(i);
+    }
+    benchmark::DoNotOptimize(value);
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK_TEMPLATE(BM_PriorityRingBufferOldestValueScan, P2PPriority);
+BENCHMARK_TEMPLATE(BM_PriorityRingBufferOldestValueScan, WidePriority);
+
+void BM_PriorityRingBufferWriteRead(benchmark::State &state) {
+  PriorityRingBuffer<P2PPacket, 16, P2PPriority> buffer;
+  int priority = 0;
+  for (auto _ : state) {
+    const P2PPriority p = priority;
+    buffer.NewValue(p).length() = 1;
+    buffer.Commit(p);
+    benchmark::DoNotOptimize(buffer.OldestValue());
+    buffer.Consume(p);
+    priority = (priority + 1) % P2PPriority::kNumLevels;
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_PriorityRingBufferWriteRead);
+
+// Encodes and decodes sequence numbers, as every packet header and ACK does.
+void BM_PackedIntegerEncode(benchmark::State &state) {
+  P2PSequenceNumberType packed;
+  uint64_t n = 0;
+  for (auto _ : state) {
+    packed = n++;
+    benchmark::DoNotOptimize(packed);
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_PackedIntegerEncode);
+
+void BM_PackedIntegerDecode(benchmark::State &state) {
+  P2PSequenceNumberType packed(123456789);
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(packed);
+    benchmark::DoNotOptimize(static_cast<uint64_t>(packed));
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_PackedIntegerDecode);
+
+}  // namespace
@@ -0,0 +1,86 @@
+#ifndef MPSC_RING_BUFFER_
+#define MPSC_RING_BUFFER_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+
+// A zero-copy ring buffer for many producer threads and one consumer thread, which never
+// locks.
+// Producers claim a slot with NewValue(), fill it in place, and publish it with Commit(). The
+// consumer sees the values in the order in which their slots were claimed. A value claimed
+// but not committed yet holds back the ones claimed after it, so producers should fill their
+// values without waiting for anything.
+// Each slot carries a sequence number that tells whether it is free for the producer of a
+// given turn, or published for the consumer.
+template<typename ValueType, int kCapacity> class MPSCRingBuffer {
+public:
+  static_assert(kCapacity > 1 && (kCapacity & (kCapacity - 1)) == 0, "The capacity must be a power of two.");
+
+  MPSCRingBuffer() : write_index_(0), read_index_(0) {
+    for (int i = 0; i < kCapacity; ++i) {
+      sequence_numbers_[i].store(i, std::memory_order_relaxed);
+    }
+  }
+
+  int Capacity() const { return kCapacity; }
+
+  // Returns a pointer to a new slot for the calling producer, or NULL if the buffer is full.
+  // The value is not visible to the consumer until it is passed to Commit().
+  // Can be called from any thread.
+  ValueType *NewValue() {
+    uint64_t index = write_index_.load(std::memory_order_relaxed);
+    while (true) {
+      const uint64_t sequence_number = sequence_numbers_[index % kCapacity].load(std::memory_order_acquire);
+      const int64_t distance = static_cast<int64_t>(sequence_number - index);
+      if (distance == 0) {
+        // The slot is free for this turn: claim it, unless another producer did first.
+        if (write_index_.compare_exchange_weak(index, index + 1, std::memory_order_relaxed)) {
+          return &values_[index % kCapacity];
+        }
+      } else if (distance < 0) {
+        // The consumer has not released the slot from the previous turn yet.
+        return NULL;
+      } else {
+        // Another producer claimed the slot.
+        index = write_index_.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  // Makes a value returned by NewValue() visible to the consumer.
+  // Can be called from any thread.
+  void Commit(ValueType *value) {
+    const int i = value - values_;
+    sequence_numbers_[i].store(sequence_numbers_[i].load(std::memory_order_relaxed) + 1, std::memory_order_release);
+  }
+
+  // Returns a pointer to the oldest committed value, or NULL if there is none.
+  // Must only be called from the consumer thread.
+  ValueType *OldestValue() {
+    const int i = read_index_ % kCapacity;
+    if (sequence_numbers_[i].load(std::memory_order_acquire) != read_index_ + 1) { return NULL; }
+    return &values_[i];
+  }
+
+  // Releases the oldest value. Returns false if there is no committed value to consume.
+  // Invalidates the pointer obtained with OldestValue().
+  // Must only be called from the consumer thread.
+  bool Consume() {
+    if (OldestValue() == NULL) { return false; }
+    // The slot is free for the producer of the next turn.
+    sequence_numbers_[read_index_ % kCapacity].store(read_index_ + kCapacity, std::memory_order_release);
+    ++read_index_;
+    return true;
+  }
+
+private:
+  ValueType values_[kCapacity];
+  std::atomic<uint64_t> sequence_numbers_[kCapacity];
+  // Producers and the consumer write their indices from different cores: keep them in
+  // separate cache lines.
+  alignas(64) std::atomic<uint64_t> write_index_;
+  alignas(64) uint64_t read_index_;
+};
+
+#endif  // MPSC_RING_BUFFER_
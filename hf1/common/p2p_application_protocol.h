@@ -2,9 +2,14 @@
 #define P2P_APPLICATION_PROTOCOL_
 
 #include <stdint.h>
-
-// A trajectory must fit in a P2P packet. Set the maximum number of waypoints taking
-// this into account and the size of the largest waypoint type.
+#include <stddef.h>
+#include "network.h"
+#include "p2p_packet_protocol.h"
+
+// Number of waypoints declared in trajectory requests, so that a request with all of them
+// fits in a P2P packet. Requests are sent up to their last waypoint (see
+// P2PGetRequestLength()), and requests with more waypoints than declared here continue past
+// the declared array and are sent in fragments (see kP2PFragmentAction).
 #define kP2PMaxNumWaypointsPerTrajectory 10
 
 // Action identifiers go in the 6 upper bits of the command field. The 2 lower bits indicate
@@ -37,10 +42,25 @@ typedef enum {
   kCreateHeadMixedTrajectoryView,
   kExecuteBaseTrajectoryView,
   kExecuteHeadTrajectoryView,
+  kGetLinkStats,
 
   kCount  // Must be the last entry in the enum.
 } P2PAction;
 
+// Action of the packets that carry several application messages of the same priority.
+// It is above the range of P2PAction, so that ends that do not aggregate messages reject these
+// packets as unknown actions. The stage and request ID of the bundle header are 0, and the
+// header is followed by one record per message: a P2PBundledMessageLength with the length of
+// the message, and the message itself (P2PApplicationPacketHeader and payload).
+#define kP2PBundleAction 63
+
+// Action of the messages that carry a fragment of an application message longer than a
+// packet. The stage and request ID are those of the fragmented message, and the header is
+// followed by a P2PFragmentHeader and the fragment bytes. Fragments are sent in order with
+// guaranteed delivery, so the receiver reassembles the message, or streams it to its
+// destination, as fragments arrive.
+#define kP2PFragmentAction 62
+
 // The stage at which the action is at.
 // There can be a maximum of 4 possible stages, as the stage is represented with 2 bits.
 typedef enum {
@@ -53,6 +73,13 @@ typedef enum {
 #pragma pack(push, 1)
 
 typedef uint8_t P2PActionRequestID;
+typedef uint8_t P2PBundledMessageLength;
+
+typedef struct {
+  uint8_t action;         // The action of the fragmented message [P2PAction].
+  uint16_t offset;        // Position of the fragment in the payload of the message.
+  uint16_t total_length;  // Length of the payload of the message.
+} P2PFragmentHeader;
 
 typedef struct {
     uint8_t action : 6;   // The type of action [P2PAction].
@@ -385,8 +412,71 @@ typedef struct {
   uint8_t status_code;
 } P2PExecuteHeadTrajectoryViewReply;
 
+// --- Get link stats ---
+// Statistics of the P2P link at the end that serves the request. Counters are totals since
+// the end started, saturated to their field size.
+typedef struct {
+  uint8_t priority;   // Priority level of the per-priority statistics [P2PPriority].
+} P2PGetLinkStatsRequest;
+
+typedef struct {
+  uint32_t p50_us;
+  uint32_t p99_us;
+  uint32_t max_us;
+} P2PLatencySummary;
+
+typedef struct {
+  // Packets received with the requested priority.
+  P2PLatencySummary rx_delay;   // From reception until retrieval by the application.
+  uint32_t rx_packets;
+  uint32_t rx_dropped_packets;
+  uint32_t rx_checksum_errors;
+  uint32_t rx_malformed_continuations;
+  uint8_t rx_queue_high_watermark;
+  // Packets sent with the requested priority.
+  P2PLatencySummary tx_delay;   // From commit until sent.
+  uint32_t tx_packets;
+  uint32_t tx_retransmissions;
+  uint32_t tx_rejected_packets;
+  uint8_t tx_queue_high_watermark;
+  // All priorities.
+  uint32_t rx_resyncs;
+  uint32_t handshake_resets;
+  uint32_t rx_packets_per_second;
+  uint32_t rx_bytes_per_second;
+  uint32_t tx_packets_per_second;
+  uint32_t tx_bytes_per_second;
+  uint16_t tx_link_utilization_permille;  // UINT16_MAX if unknown.
+} P2PGetLinkStatsReply;
+
 #pragma pack(pop)
 
+// Maximum number of payload bytes in a fragment, so that a fragment fills a P2P packet.
+#define kP2PMaxFragmentLength static_cast<int>(kP2PMaxContentLength - sizeof(P2PApplicationPacketHeader) - sizeof(P2PFragmentHeader))
+
 const char *GetTrajectoryViewTypeName(P2PTrajectoryViewType type);
 
+// Returns the number of waypoints of a trajectory request that fit in its struct.
+template<Endianness LocalEndianness, typename TNumWaypoints> int P2PNumDeclaredWaypoints(TNumWaypoints num_waypoints) {
+  const int local_num_waypoints = NetworkToLocal<LocalEndianness>(num_waypoints);
+  return local_num_waypoints < kP2PMaxNumWaypointsPerTrajectory ? local_num_waypoints : kP2PMaxNumWaypointsPerTrajectory;
+}
+
+// Returns the number of bytes of `request` that are sent. Requests are sent whole, except
+// for trajectories, which are sent up to their last waypoint. The request structs hold up to
+// kP2PMaxNumWaypointsPerTrajectory waypoints; longer trajectories must be laid out in a
+// buffer by the caller.
+template<Endianness LocalEndianness, typename TRequest> int P2PGetRequestLength(const TRequest &request) {
+  return sizeof(TRequest);
+}
+template<Endianness LocalEndianness> int P2PGetRequestLength(const P2PCreateBaseTrajectoryRequest &request) {
+  return offsetof(P2PCreateBaseTrajectoryRequest, trajectory.waypoints) + P2PNumDeclaredWaypoints<LocalEndianness>(request.trajectory.num_waypoints) * sizeof(P2PBaseWaypoint);
+}
+template<Endianness LocalEndianness> int P2PGetRequestLength(const P2PCreateHeadTrajectoryRequest &request) {
+  return offsetof(P2PCreateHeadTrajectoryRequest, trajectory.waypoints) + P2PNumDeclaredWaypoints<LocalEndianness>(request.trajectory.num_waypoints) * sizeof(P2PHeadWaypoint);
+}
+template<Endianness LocalEndianness> int P2PGetRequestLength(const P2PCreateEnvelopeTrajectoryRequest &request) {
+  return offsetof(P2PCreateEnvelopeTrajectoryRequest, trajectory.waypoints) + P2PNumDeclaredWaypoints<LocalEndianness>(request.trajectory.num_waypoints) * sizeof(P2PEnvelopeWaypoint);
+}
+
 #endif  // P2P_APPLICATION_PROTOCOL_
\ No newline at end of file
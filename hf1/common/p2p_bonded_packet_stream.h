@@ -0,0 +1,192 @@
+#ifndef P2P_BONDED_PACKET_STREAM_
+#define P2P_BONDED_PACKET_STREAM_
+
+#include "p2p_packet_stream.h"
+#include "priority_ring_buffer.h"
+#include "status_or.h"
+#include "timer_interface.h"
+
+// Number of bytes that a bonded stream prepends to the content of the packets it sends through
+// its links, with the sequence number that orders the packets of a priority across links.
+#define kP2PBondHeaderLength static_cast<int>(sizeof(uint16_t))
+
+// Maximum content length of the packets sent through a bonded stream.
+#define kP2PBondedMaxContentLength (kP2PMaxContentLength - kP2PBondHeaderLength)
+
+// Time that a link can hold packets without releasing any of them (see
+// P2PPacketOutputStream::packet_released_callback()) before it is considered stalled.
+#define kP2PDefaultBondStallTimeoutNs 50000000ULL
+
+// Time that the packets received after a missing one wait for it before it is given up.
+#define kP2PDefaultBondReorderTimeoutNs 200000000ULL
+
+// A packet stream striped across several links, e.g. one for each UART that connects the two
+// ends, so that the bandwidth of the links adds up. Each link is a P2PPacketStream with its own
+// byte stream, handshake, retransmissions and flow control.
+// Each packet is handed to the link with the fewest packets pending, and the packets of each
+// priority are numbered, so that the other end delivers them in order regardless of the link
+// they arrive through.
+// A link is stalled when it has packets pending and has not released any of them for the stall
+// timeout, e.g. because its cable is disconnected. Its pending packets are then sent again
+// through the other links, and it gets no new packets until it releases one. The other end
+// discards the copies that arrive more than once.
+// A packet that never arrives (e.g. a best-effort one lost in transmission) holds back the
+// following packets of its priority for the reorder timeout.
+// The input capacity of the other end must not be lower than the output capacity of this end,
+// so that all the packets in flight fit in its reorder window. Both ends must be Reset() when
+// either of them restarts.
+template<int kNumLinks, int kInputCapacity, int kOutputCapacity, Endianness LocalEndianness> class P2PBondedPacketStream {
+public:
+  typedef P2PPacketStream<kInputCapacity, kOutputCapacity, LocalEndianness> LinkStream;
+
+  // Does not take ownership of the link streams or the timer, which must outlive this object.
+  // The link streams must not be used directly to send or receive packets while bonded.
+  P2PBondedPacketStream(LinkStream *const links[kNumLinks], const TimerInterface *timer);
+
+  // Discards the packets to send and the packets received.
+  void Reset();
+
+  // Returns the number of packet slots available for writing with `priority`.
+  int NumAvailableSlots(P2PPriority priority) const { return output_buffer_.NumAvailableSlots(priority); }
+
+  // Returns the number of committed packets with `priority` that the links have not released
+  // yet.
+  int NumCommittedPackets(P2PPriority priority) const { return output_buffer_.Size(priority); }
+
+  // Returns a view to a new packet with `priority`, or kUnavailableError if there is no space.
+  // The content can be up to kP2PBondedMaxContentLength bytes. Commit() must be called with
+  // the same `priority` for the packet to be sent.
+  StatusOr<P2PMutablePacketView> NewPacket(P2PPriority priority);
+
+  // Commits the new packet to be sent through the links. See P2PPacketOutputStream::Commit().
+  // Returns false if the content is too long.
+  bool Commit(P2PPriority priority, bool guarantee_delivery);
+
+  // Returns the number of packets with `priority` received in order and ready to be read.
+  int NumAvailablePackets(P2PPriority priority) const;
+
+  // Returns the oldest packet ready to be read with the highest priority, or
+  // kUnavailableError if there is none.
+  StatusOr<const P2PPacketView> OldestPacket();
+
+  // Consumes the oldest packet ready to be read with `priority`.
+  bool Consume(P2PPriority priority);
+
+  // Runs the links, hands them the pending packets and collects the packets they receive.
+  // Returns the minimum number of nanoseconds the caller may wait until calling Run() again.
+  uint64_t Run();
+
+  // Returns true if `link` is stalled.
+  bool is_stalled(int link) const { return is_stalled_[link]; }
+
+  uint64_t stall_timeout_ns() const { return stall_timeout_ns_; }
+  void stall_timeout_ns(uint64_t timeout_ns) { stall_timeout_ns_ = timeout_ns; }
+
+  uint64_t reorder_timeout_ns() const { return reorder_timeout_ns_; }
+  void reorder_timeout_ns(uint64_t timeout_ns) { reorder_timeout_ns_ = timeout_ns; }
+
+  class Stats {
+    friend class P2PBondedPacketStream;
+  public:
+    Stats() : total_stalls_(0), total_resent_packets_(0), total_duplicate_packets_(0), total_skipped_packets_(0), total_malformed_packets_(0) {
+      for (int i = 0; i < kNumLinks; ++i) {
+        total_link_packets_[i] = 0;
+      }
+    }
+
+    // Packets handed to each link, including the ones sent again after a stall.
+    uint64_t total_link_packets(int link) const { return total_link_packets_[link]; }
+
+    // Times that a link has stalled.
+    uint64_t total_stalls() const { return total_stalls_; }
+
+    // Packets handed to a link after another one stalled with them.
+    uint64_t total_resent_packets() const { return total_resent_packets_; }
+
+    // Packets received more than once, or after they were given up.
+    uint64_t total_duplicate_packets() const { return total_duplicate_packets_; }
+
+    // Packets given up after the reorder timeout.
+    uint64_t total_skipped_packets() const { return total_skipped_packets_; }
+
+    // Packets received without a bond header.
+    uint64_t total_malformed_packets() const { return total_malformed_packets_; }
+
+  private:
+    uint64_t total_link_packets_[kNumLinks];
+    uint64_t total_stalls_;
+    uint64_t total_resent_packets_;
+    uint64_t total_duplicate_packets_;
+    uint64_t total_skipped_packets_;
+    uint64_t total_malformed_packets_;
+  };
+
+  const Stats &stats() const { return stats_; }
+
+private:
+  // Packet committed to the bonded stream, until a link releases it.
+  typedef struct {
+    P2PPacket packet;
+    // Link that the packet was last handed to, or -1 if it must be handed to one.
+    int link;
+    bool is_released;
+    bool is_resent;
+  } OutputEntry;
+
+  // Argument of the packet released callback of each link.
+  typedef struct {
+    P2PBondedPacketStream *bond;
+    int link;
+  } LinkContext;
+
+  static void OnPacketReleased(const P2PPacket &packet, void *arg);
+  void ReleasePacket(int link, const P2PPacket &packet);
+
+  // Moves the packets received by the links to the reorder window of their priority.
+  void ReceivePackets();
+  // Gives up the missing packets that have held back the following ones for the reorder
+  // timeout.
+  void SkipMissingPackets(uint64_t timestamp_ns);
+  // Marks the links that have stalled, and takes their pending packets back to be sent again.
+  void DetectStalledLinks(uint64_t timestamp_ns);
+  // Consumes the oldest packets that the links have released.
+  void ConsumeReleasedPackets();
+  // Hands the packets that are not in any link to the least busy ones.
+  void HandOverPackets(uint64_t timestamp_ns);
+  // Returns the link to hand the next packet with `priority` to, or -1 if none can take it.
+  int SelectLink(P2PPriority priority);
+
+  LinkStream *links_[kNumLinks];
+  LinkContext link_contexts_[kNumLinks];
+  const TimerInterface &timer_;
+  uint64_t stall_timeout_ns_;
+  uint64_t reorder_timeout_ns_;
+
+  PriorityRingBuffer<OutputEntry, kOutputCapacity, P2PPriority, FIFORingBuffer> output_buffer_;
+  // Sequence number of the oldest packet in the output buffer of each priority.
+  uint16_t output_sequence_number_[P2PPriority::kNumLevels];
+  // Packets handed to each link with each priority, and not released yet.
+  int num_pending_packets_[kNumLinks][P2PPriority::kNumLevels];
+  // Last time that each link released a packet, or was handed one with none pending.
+  uint64_t last_progress_ns_[kNumLinks];
+  bool is_stalled_[kNumLinks];
+  // Link to start the search from in the next SelectLink(), so that ties are spread.
+  int next_link_;
+
+  // Reorder window of each priority. It starts at the oldest packet not read yet, with
+  // sequence number input_sequence_number_ in slot input_index_.
+  P2PPacket input_packets_[P2PPriority::kNumLevels][kInputCapacity];
+  bool is_received_[P2PPriority::kNumLevels][kInputCapacity];
+  uint16_t input_sequence_number_[P2PPriority::kNumLevels];
+  int input_index_[P2PPriority::kNumLevels];
+  int num_received_packets_[P2PPriority::kNumLevels];
+  // Time since the oldest packet of the window is missing while later ones were received, or
+  // -1.
+  uint64_t gap_start_ns_[P2PPriority::kNumLevels];
+
+  Stats stats_;
+};
+
+#include "p2p_bonded_packet_stream.hh"
+
+#endif  // P2P_BONDED_PACKET_STREAM_
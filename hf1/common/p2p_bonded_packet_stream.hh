@@ -0,0 +1,305 @@
+#include <string.h>
+
+template<int kNumLinks, int kInputCapacity, int kOutputCapacity, Endianness LocalEndianness>
+P2PBondedPacketStream<kNumLinks, kInputCapacity, kOutputCapacity, LocalEndianness>::P2PBondedPacketStream(LinkStream *const links[kNumLinks], const TimerInterface *timer)
+  : timer_(*ASSERT_NOT_NULL(timer)), stall_timeout_ns_(kP2PDefaultBondStallTimeoutNs), reorder_timeout_ns_(kP2PDefaultBondReorderTimeoutNs) {
+  for (int i = 0; i < kNumLinks; ++i) {
+    links_[i] = ASSERT_NOT_NULL(links[i]);
+    link_contexts_[i].bond = this;
+    link_contexts_[i].link = i;
+    links_[i]->output().packet_released_callback(P2PPacketReleasedCallback(&OnPacketReleased, &link_contexts_[i]));
+  }
+  Reset();
+}
+
+template<int kNumLinks, int kInputCapacity, int kOutputCapacity, Endianness LocalEndianness>
+void P2PBondedPacketStream<kNumLinks, kInputCapacity, kOutputCapacity, LocalEndianness>::Reset() {
+  output_buffer_.Clear();
+  const uint64_t timestamp_ns = timer_.GetLocalNanoseconds();
+  for (int i = 0; i < kNumLinks; ++i) {
+    for (int p = 0; p < P2PPriority::kNumLevels; ++p) {
+      num_pending_packets_[i][p] = 0;
+    }
+    last_progress_ns_[i] = timestamp_ns;
+    is_stalled_[i] = false;
+  }
+  next_link_ = 0;
+  for (int p = 0; p < P2PPriority::kNumLevels; ++p) {
+    output_sequence_number_[p] = 0;
+    for (int i = 0; i < kInputCapacity; ++i) {
+      is_received_[p][i] = false;
+    }
+    input_sequence_number_[p] = 0;
+    input_index_[p] = 0;
+    num_received_packets_[p] = 0;
+    gap_start_ns_[p] = -1ULL;
+  }
+}
+
+template<int kNumLinks, int kInputCapacity, int kOutputCapacity, Endianness LocalEndianness>
+StatusOr<P2PMutablePacketView> P2PBondedPacketStream<kNumLinks, kInputCapacity, kOutputCapacity, LocalEndianness>::NewPacket(P2PPriority priority) {
+  // The highest priority is reserved for the signaling of the links.
+  ASSERT(static_cast<int>(priority) != P2PPriority::kReserved);
+  if (output_buffer_.IsFull(priority)) {
+    return Status::kUnavailableError;
+  }
+  P2PPacket &packet = output_buffer_.NewValue(priority).packet;
+  packet.header()->priority = priority;
+  packet.length() = 0;
+  return P2PMutablePacketView(&packet);
+}
+
+template<int kNumLinks, int kInputCapacity, int kOutputCapacity, Endianness LocalEndianness>
+bool P2PBondedPacketStream<kNumLinks, kInputCapacity, kOutputCapacity, LocalEndianness>::Commit(P2PPriority priority, bool guarantee_delivery) {
+  OutputEntry &entry = output_buffer_.NewValue(priority);
+  if (entry.packet.length() > kP2PBondedMaxContentLength) { return false; }
+  entry.packet.header()->requires_ack = guarantee_delivery;
+  entry.link = -1;
+  entry.is_released = false;
+  entry.is_resent = false;
+  output_buffer_.Commit(priority);
+  return true;
+}
+
+template<int kNumLinks, int kInputCapacity, int kOutputCapacity, Endianness LocalEndianness>
+int P2PBondedPacketStream<kNumLinks, kInputCapacity, kOutputCapacity, LocalEndianness>::NumAvailablePackets(P2PPriority priority) const {
+  int num_packets = 0;
+  while (num_packets < num_received_packets_[priority] && is_received_[priority][(input_index_[priority] + num_packets) % kInputCapacity]) {
+    ++num_packets;
+  }
+  return num_packets;
+}
+
+template<int kNumLinks, int kInputCapacity, int kOutputCapacity, Endianness LocalEndianness>
+StatusOr<const P2PPacketView> P2PBondedPacketStream<kNumLinks, kInputCapacity, kOutputCapacity, LocalEndianness>::OldestPacket() {
+  for (int p = P2PPriority::kReserved + 1; p < P2PPriority::kNumLevels; ++p) {
+    if (is_received_[p][input_index_[p]]) {
+      return P2PPacketView(&input_packets_[p][input_index_[p]]);
+    }
+  }
+  return Status::kUnavailableError;
+}
+
+template<int kNumLinks, int kInputCapacity, int kOutputCapacity, Endianness LocalEndianness>
+bool P2PBondedPacketStream<kNumLinks, kInputCapacity, kOutputCapacity, LocalEndianness>::Consume(P2PPriority priority) {
+  if (!is_received_[priority][input_index_[priority]]) {
+    return false;
+  }
+  is_received_[priority][input_index_[priority]] = false;
+  --num_received_packets_[priority];
+  ++input_sequence_number_[priority];
+  input_index_[priority] = (input_index_[priority] + 1) % kInputCapacity;
+  gap_start_ns_[priority] = -1ULL;
+  return true;
+}
+
+template<int kNumLinks, int kInputCapacity, int kOutputCapacity, Endianness LocalEndianness>
+uint64_t P2PBondedPacketStream<kNumLinks, kInputCapacity, kOutputCapacity, LocalEndianness>::Run() {
+  for (int i = 0; i < kNumLinks; ++i) {
+    links_[i]->input().Run();
+  }
+  const uint64_t timestamp_ns = timer_.GetLocalNanoseconds();
+  ReceivePackets();
+  SkipMissingPackets(timestamp_ns);
+  DetectStalledLinks(timestamp_ns);
+  ConsumeReleasedPackets();
+  HandOverPackets(timestamp_ns);
+  uint64_t wait_ns = -1ULL;
+  for (int i = 0; i < kNumLinks; ++i) {
+    wait_ns = std::min(wait_ns, links_[i]->output().Run());
+  }
+  return wait_ns;
+}
+
+template<int kNumLinks, int kInputCapacity, int kOutputCapacity, Endianness LocalEndianness>
+void P2PBondedPacketStream<kNumLinks, kInputCapacity, kOutputCapacity, LocalEndianness>::OnPacketReleased(const P2PPacket &packet, void *arg) {
+  LinkContext &context = *static_cast<LinkContext *>(arg);
+  context.bond->ReleasePacket(context.link, packet);
+}
+
+template<int kNumLinks, int kInputCapacity, int kOutputCapacity, Endianness LocalEndianness>
+void P2PBondedPacketStream<kNumLinks, kInputCapacity, kOutputCapacity, LocalEndianness>::ReleasePacket(int link, const P2PPacket &packet) {
+  const P2PHeader &header = *packet.header();
+  // Only the packets handed by the bond carry a bond header.
+  if (header.is_ack || header.is_init || num_pending_packets_[link][header.priority] <= 0) {
+    return;
+  }
+  --num_pending_packets_[link][header.priority];
+  last_progress_ns_[link] = timer_.GetLocalNanoseconds();
+  is_stalled_[link] = false;
+  uint16_t sequence_number;
+  memcpy(&sequence_number, packet.content(), sizeof(sequence_number));
+  const int offset = static_cast<uint16_t>(NetworkToLocal<LocalEndianness>(sequence_number) - output_sequence_number_[header.priority]);
+  OutputEntry *entry = output_buffer_.OldestValue(header.priority, offset);
+  if (entry != NULL) {
+    entry->is_released = true;
+  }
+}
+
+template<int kNumLinks, int kInputCapacity, int kOutputCapacity, Endianness LocalEndianness>
+void P2PBondedPacketStream<kNumLinks, kInputCapacity, kOutputCapacity, LocalEndianness>::ReceivePackets() {
+  for (int i = 0; i < kNumLinks; ++i) {
+    auto &input = links_[i]->input();
+    while (true) {
+      StatusOr<const P2PPacketView> packet = input.OldestPacket();
+      if (!packet.ok()) {
+        break;
+      }
+      const int priority = packet->priority();
+      if (priority == P2PPriority::kReserved || packet->length() < kP2PBondHeaderLength) {
+        ++stats_.total_malformed_packets_;
+        input.Consume(priority);
+        continue;
+      }
+      uint16_t sequence_number;
+      memcpy(&sequence_number, packet->content(), sizeof(sequence_number));
+      const int offset = static_cast<int16_t>(NetworkToLocal<LocalEndianness>(sequence_number) - input_sequence_number_[priority]);
+      if (offset >= kInputCapacity) {
+        // No space in the reorder window: leave the packet in the link until some are read.
+        break;
+      }
+      const int index = (input_index_[priority] + offset) % kInputCapacity;
+      if (offset < 0 || is_received_[priority][index]) {
+        ++stats_.total_duplicate_packets_;
+      } else {
+        P2PPacket &received_packet = input_packets_[priority][index];
+        received_packet.header()->priority = priority;
+        received_packet.length() = packet->length() - kP2PBondHeaderLength;
+        memcpy(received_packet.content(), packet->content() + kP2PBondHeaderLength, received_packet.length());
+        received_packet.commit_time_ns() = packet->reception_local_time_ns();
+        is_received_[priority][index] = true;
+        ++num_received_packets_[priority];
+      }
+      input.Consume(priority);
+    }
+  }
+}
+
+template<int kNumLinks, int kInputCapacity, int kOutputCapacity, Endianness LocalEndianness>
+void P2PBondedPacketStream<kNumLinks, kInputCapacity, kOutputCapacity, LocalEndianness>::SkipMissingPackets(uint64_t timestamp_ns) {
+  for (int p = P2PPriority::kReserved + 1; p < P2PPriority::kNumLevels; ++p) {
+    if (num_received_packets_[p] == 0 || is_received_[p][input_index_[p]]) {
+      gap_start_ns_[p] = -1ULL;
+      continue;
+    }
+    if (gap_start_ns_[p] == -1ULL) {
+      gap_start_ns_[p] = timestamp_ns;
+    }
+    if (timestamp_ns - gap_start_ns_[p] < reorder_timeout_ns_) {
+      continue;
+    }
+    while (!is_received_[p][input_index_[p]]) {
+      ++input_sequence_number_[p];
+      input_index_[p] = (input_index_[p] + 1) % kInputCapacity;
+      ++stats_.total_skipped_packets_;
+    }
+    gap_start_ns_[p] = -1ULL;
+  }
+}
+
+template<int kNumLinks, int kInputCapacity, int kOutputCapacity, Endianness LocalEndianness>
+void P2PBondedPacketStream<kNumLinks, kInputCapacity, kOutputCapacity, LocalEndianness>::DetectStalledLinks(uint64_t timestamp_ns) {
+  for (int i = 0; i < kNumLinks; ++i) {
+    if (is_stalled_[i] || timestamp_ns - last_progress_ns_[i] < stall_timeout_ns_) {
+      continue;
+    }
+    bool has_pending_packets = false;
+    for (int p = 0; p < P2PPriority::kNumLevels; ++p) {
+      has_pending_packets = has_pending_packets || num_pending_packets_[i][p] > 0;
+    }
+    if (!has_pending_packets) {
+      continue;
+    }
+    is_stalled_[i] = true;
+    ++stats_.total_stalls_;
+    // Hand the packets pending in the link to other links. The link keeps its copies, in case it
+    // recovers before.
+    for (int p = P2PPriority::kReserved + 1; p < P2PPriority::kNumLevels; ++p) {
+      for (int k = 0; k < output_buffer_.Size(p); ++k) {
+        OutputEntry *entry = output_buffer_.OldestValue(p, k);
+        if (entry->link == i && !entry->is_released) {
+          entry->link = -1;
+          entry->is_resent = true;
+        }
+      }
+    }
+  }
+}
+
+template<int kNumLinks, int kInputCapacity, int kOutputCapacity, Endianness LocalEndianness>
+void P2PBondedPacketStream<kNumLinks, kInputCapacity, kOutputCapacity, LocalEndianness>::ConsumeReleasedPackets() {
+  for (int p = P2PPriority::kReserved + 1; p < P2PPriority::kNumLevels; ++p) {
+    const OutputEntry *entry = output_buffer_.OldestValue(p);
+    while (entry != NULL && entry->is_released) {
+      output_buffer_.Consume(p);
+      ++output_sequence_number_[p];
+      entry = output_buffer_.OldestValue(p);
+    }
+  }
+}
+
+template<int kNumLinks, int kInputCapacity, int kOutputCapacity, Endianness LocalEndianness>
+void P2PBondedPacketStream<kNumLinks, kInputCapacity, kOutputCapacity, LocalEndianness>::HandOverPackets(uint64_t timestamp_ns) {
+  for (int p = P2PPriority::kReserved + 1; p < P2PPriority::kNumLevels; ++p) {
+    for (int k = 0; k < output_buffer_.Size(p); ++k) {
+      OutputEntry &entry = *output_buffer_.OldestValue(p, k);
+      if (entry.link >= 0 || entry.is_released) {
+        continue;
+      }
+      const int link = SelectLink(p);
+      if (link < 0) {
+        break;
+      }
+      auto &output = links_[link]->output();
+      StatusOr<P2PMutablePacketView> view = output.NewPacket(p);
+      ASSERT(view.ok());
+      const uint16_t sequence_number = LocalToNetwork<LocalEndianness>(static_cast<uint16_t>(output_sequence_number_[p] + k));
+      memcpy(view->content(), &sequence_number, sizeof(sequence_number));
+      memcpy(view->content() + kP2PBondHeaderLength, entry.packet.content(), entry.packet.length());
+      view->length() = kP2PBondHeaderLength + entry.packet.length();
+      output.Commit(p, entry.packet.header()->requires_ack);
+
+      bool had_pending_packets = false;
+      for (int q = 0; q < P2PPriority::kNumLevels; ++q) {
+        had_pending_packets = had_pending_packets || num_pending_packets_[link][q] > 0;
+      }
+      if (!had_pending_packets) {
+        // The stall timeout counts from the oldest pending packet.
+        last_progress_ns_[link] = timestamp_ns;
+      }
+      ++num_pending_packets_[link][p];
+      entry.link = link;
+      ++stats_.total_link_packets_[link];
+      if (entry.is_resent) {
+        ++stats_.total_resent_packets_;
+      }
+    }
+  }
+}
+
+template<int kNumLinks, int kInputCapacity, int kOutputCapacity, Endianness LocalEndianness>
+int P2PBondedPacketStream<kNumLinks, kInputCapacity, kOutputCapacity, LocalEndianness>::SelectLink(P2PPriority priority) {
+  int selected_link = -1;
+  int selected_num_pending_packets = 0;
+  for (int k = 0; k < kNumLinks; ++k) {
+    const int link = (next_link_ + k) % kNumLinks;
+    auto &output = links_[link]->output();
+    // Do not queue more packets than the link can have in flight, so that the rest can go
+    // through a link that frees up sooner.
+    if (is_stalled_[link] || output.NumAvailableSlots(priority) <= 0 || num_pending_packets_[link][priority] >= output.window_size()) {
+      continue;
+    }
+    int num_pending_packets = 0;
+    for (int p = 0; p < P2PPriority::kNumLevels; ++p) {
+      num_pending_packets += num_pending_packets_[link][p];
+    }
+    if (selected_link < 0 || num_pending_packets < selected_num_pending_packets) {
+      selected_link = link;
+      selected_num_pending_packets = num_pending_packets;
+    }
+  }
+  if (selected_link >= 0) {
+    next_link_ = (selected_link + 1) % kNumLinks;
+  }
+  return selected_link;
+}
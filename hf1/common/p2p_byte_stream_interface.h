@@ -46,6 +46,12 @@ public:
   // this value, the less overhead in calls to the Write(), which might be considerable
   // in some platforms (higher throughput).
   virtual int GetAtomicSendMaxLength() = 0;
+
+  // Returns the number of bytes that this end can receive while they are not read, e.g. the
+  // size of a UART's receive buffer, or 0 if it is unknown. It is advertised to the other end,
+  // so that it sends as many bytes as fit instead of pacing its bursts with
+  // GetBurstIngestionNanosecondsPerByte().
+  virtual int GetReceiveBufferLength() = 0;
   
   uint8_t ReadByteOrDefault(uint8_t default_output = 0xff) { 
     uint8_t c;
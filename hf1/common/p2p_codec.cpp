@@ -0,0 +1,159 @@
+#include "p2p_codec.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+int P2PFindTokenScalar(const uint8_t *data, int length) {
+  for (int i = 0; i < length; ++i) {
+    if (data[i] == kP2PStartToken || data[i] == kP2PSpecialToken) { return i; }
+  }
+  return length;
+}
+
+int P2PFindStartTokenScalar(const uint8_t *data, int length) {
+  for (int i = 0; i < length; ++i) {
+    if (data[i] == kP2PStartToken) { return i; }
+  }
+  return length;
+}
+
+P2PChecksumType P2PSumBytesScalar(const uint8_t *data, int length) {
+  P2PChecksumType sum = 0;
+  for (int i = 0; i < length; ++i) { sum += data[i]; }
+  return sum;
+}
+
+#if defined(__AVX2__)
+
+int P2PFindToken(const uint8_t *data, int length) {
+  const __m256i start_token = _mm256_set1_epi8(static_cast<char>(kP2PStartToken));
+  const __m256i special_token = _mm256_set1_epi8(static_cast<char>(kP2PSpecialToken));
+  int i = 0;
+  for (; i + 32 <= length; i += 32) {
+    const __m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(&data[i]));
+    const __m256i matches = _mm256_or_si256(_mm256_cmpeq_epi8(bytes, start_token), _mm256_cmpeq_epi8(bytes, special_token));
+    const uint32_t mask = _mm256_movemask_epi8(matches);
+    if (mask != 0) { return i + __builtin_ctz(mask); }
+  }
+  return i + P2PFindTokenScalar(&data[i], length - i);
+}
+
+int P2PFindStartToken(const uint8_t *data, int length) {
+  const __m256i start_token = _mm256_set1_epi8(static_cast<char>(kP2PStartToken));
+  int i = 0;
+  for (; i + 32 <= length; i += 32) {
+    const __m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(&data[i]));
+    const uint32_t mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(bytes, start_token));
+    if (mask != 0) { return i + __builtin_ctz(mask); }
+  }
+  return i + P2PFindStartTokenScalar(&data[i], length - i);
+}
+
+P2PChecksumType P2PSumBytes(const uint8_t *data, int length) {
+  // Sum of absolute differences against zero adds up groups of 8 bytes into 64-bit lanes.
+  __m256i sums = _mm256_setzero_si256();
+  int i = 0;
+  for (; i + 32 <= length; i += 32) {
+    const __m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(&data[i]));
+    sums = _mm256_add_epi64(sums, _mm256_sad_epu8(bytes, _mm256_setzero_si256()));
+  }
+  const __m128i half_sums = _mm_add_epi64(_mm256_castsi256_si128(sums), _mm256_extracti128_si256(sums, 1));
+  const uint64_t sum = _mm_cvtsi128_si64(half_sums) + _mm_cvtsi128_si64(_mm_unpackhi_epi64(half_sums, half_sums));
+  return static_cast<P2PChecksumType>(sum) + P2PSumBytesScalar(&data[i], length - i);
+}
+
+#elif defined(__SSE2__)
+
+int P2PFindToken(const uint8_t *data, int length) {
+  const __m128i start_token = _mm_set1_epi8(static_cast<char>(kP2PStartToken));
+  const __m128i special_token = _mm_set1_epi8(static_cast<char>(kP2PSpecialToken));
+  int i = 0;
+  for (; i + 16 <= length; i += 16) {
+    const __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(&data[i]));
+    const __m128i matches = _mm_or_si128(_mm_cmpeq_epi8(bytes, start_token), _mm_cmpeq_epi8(bytes, special_token));
+    const uint32_t mask = _mm_movemask_epi8(matches);
+    if (mask != 0) { return i + __builtin_ctz(mask); }
+  }
+  return i + P2PFindTokenScalar(&data[i], length - i);
+}
+
+int P2PFindStartToken(const uint8_t *data, int length) {
+  const __m128i start_token = _mm_set1_epi8(static_cast<char>(kP2PStartToken));
+  int i = 0;
+  for (; i + 16 <= length; i += 16) {
+    const __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(&data[i]));
+    const uint32_t mask = _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, start_token));
+    if (mask != 0) { return i + __builtin_ctz(mask); }
+  }
+  return i + P2PFindStartTokenScalar(&data[i], length - i);
+}
+
+P2PChecksumType P2PSumBytes(const uint8_t *data, int length) {
+  // Sum of absolute differences against zero adds up groups of 8 bytes into 64-bit lanes.
+  __m128i sums = _mm_setzero_si128();
+  int i = 0;
+  for (; i + 16 <= length; i += 16) {
+    const __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(&data[i]));
+    sums = _mm_add_epi64(sums, _mm_sad_epu8(bytes, _mm_setzero_si128()));
+  }
+  const uint64_t sum = _mm_cvtsi128_si64(sums) + _mm_cvtsi128_si64(_mm_unpackhi_epi64(sums, sums));
+  return static_cast<P2PChecksumType>(sum) + P2PSumBytesScalar(&data[i], length - i);
+}
+
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+
+int P2PFindToken(const uint8_t *data, int length) {
+  const uint8x16_t start_token = vdupq_n_u8(kP2PStartToken);
+  const uint8x16_t special_token = vdupq_n_u8(kP2PSpecialToken);
+  int i = 0;
+  for (; i + 16 <= length; i += 16) {
+    const uint8x16_t bytes = vld1q_u8(&data[i]);
+    const uint8x16_t matches = vorrq_u8(vceqq_u8(bytes, start_token), vceqq_u8(bytes, special_token));
+    // Narrow each matching byte to a nibble of a 64-bit mask, as there is no movemask.
+    const uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(matches), 4)), 0);
+    if (mask != 0) { return i + (__builtin_ctzll(mask) >> 2); }
+  }
+  return i + P2PFindTokenScalar(&data[i], length - i);
+}
+
+int P2PFindStartToken(const uint8_t *data, int length) {
+  const uint8x16_t start_token = vdupq_n_u8(kP2PStartToken);
+  int i = 0;
+  for (; i + 16 <= length; i += 16) {
+    const uint8x16_t matches = vceqq_u8(vld1q_u8(&data[i]), start_token);
+    const uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(matches), 4)), 0);
+    if (mask != 0) { return i + (__builtin_ctzll(mask) >> 2); }
+  }
+  return i + P2PFindStartTokenScalar(&data[i], length - i);
+}
+
+P2PChecksumType P2PSumBytes(const uint8_t *data, int length) {
+  P2PChecksumType sum = 0;
+  int i = 0;
+  for (; i + 16 <= length; i += 16) {
+    // The long horizontal add cannot overflow 16 bits; the result is truncated anyway.
+    sum += static_cast<P2PChecksumType>(vaddlvq_u8(vld1q_u8(&data[i])));
+  }
+  return sum + P2PSumBytesScalar(&data[i], length - i);
+}
+
+#else
+
+int P2PFindToken(const uint8_t *data, int length) {
+  return P2PFindTokenScalar(data, length);
+}
+
+int P2PFindStartToken(const uint8_t *data, int length) {
+  return P2PFindStartTokenScalar(data, length);
+}
+
+P2PChecksumType P2PSumBytes(const uint8_t *data, int length) {
+  return P2PSumBytesScalar(data, length);
+}
+
+#endif
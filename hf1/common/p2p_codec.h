@@ -0,0 +1,39 @@
+// Kernels to encode and decode the content of P2P packets.
+//
+// They are vectorized on platforms with SSE2, AVX2 or NEON (AArch64), and fall back to
+// portable scalar code otherwise (e.g. in microcontrollers).
+
+#ifndef P2P_CODEC_
+#define P2P_CODEC_
+
+#include <stdint.h>
+#include "p2p_packet_protocol.h"
+
+// Returns the index of the first byte in `data` that matches kP2PStartToken or
+// kP2PSpecialToken, or `length` if there is none.
+int P2PFindToken(const uint8_t *data, int length);
+
+// Returns the index of the first byte in `data` that matches kP2PStartToken, or `length` if
+// there is none. It delimits the blocks of the COBS framing.
+int P2PFindStartToken(const uint8_t *data, int length);
+
+// Returns the sum of the `length` bytes in `data`, modulo the range of P2PChecksumType.
+// As kP2PChecksumModulo divides that range, the result can be accumulated into a checksum.
+P2PChecksumType P2PSumBytes(const uint8_t *data, int length);
+
+// Portable implementations of the kernels above. The vectorized implementations use them
+// for the bytes that do not fill a vector.
+int P2PFindTokenScalar(const uint8_t *data, int length);
+int P2PFindStartTokenScalar(const uint8_t *data, int length);
+P2PChecksumType P2PSumBytesScalar(const uint8_t *data, int length);
+
+// Maximum number of content bytes in a block of the COBS framing.
+#define kP2PCOBSMaxBlockLength 254
+
+// Converts between the length of a COBS block and its code byte on the wire.
+// The block code is the block length plus one, as in regular COBS. It is XOR'ed with the start
+// token, so that the code on the wire is never a start token, like the content bytes.
+inline uint8_t P2PCOBSBlockCode(int block_length) { return (block_length + 1) ^ kP2PStartToken; }
+inline int P2PCOBSBlockLength(uint8_t block_code) { return (block_code ^ kP2PStartToken) - 1; }
+
+#endif  // P2P_CODEC_
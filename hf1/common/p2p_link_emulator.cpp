@@ -0,0 +1,112 @@
+#include "p2p_link_emulator.h"
+#include <algorithm>
+#include <math.h>
+#include "logger_interface.h"
+
+int P2PEmulatedByteStream::Write(const void *buffer, int length) {
+  return link_.Write(tx_direction_, static_cast<const uint8_t *>(buffer), length);
+}
+
+int P2PEmulatedByteStream::Read(void *buffer, int length) {
+  return link_.Read(1 - tx_direction_, static_cast<uint8_t *>(buffer), length);
+}
+
+int P2PEmulatedByteStream::GetBurstMaxLength() {
+  return link_.directions_[tx_direction_].config.burst_max_length;
+}
+
+int P2PEmulatedByteStream::GetBurstIngestionNanosecondsPerByte() {
+  return link_.directions_[tx_direction_].config.burst_ingestion_ns_per_byte;
+}
+
+int P2PEmulatedByteStream::GetReceiveBufferLength() {
+  const P2PLinkEmulatorConfig &rx_config = link_.directions_[1 - tx_direction_].config;
+  return rx_config.advertise_rx_buffer_length ? rx_config.rx_buffer_length : 0;
+}
+
+P2PLinkEmulator::P2PLinkEmulator(const P2PLinkEmulatorConfig &a_to_b, const P2PLinkEmulatorConfig &b_to_a, uint32_t seed)
+  : end_a_(this, kAToB), end_b_(this, kBToA), random_generator_(seed), uniform_(0.0, 1.0) {
+  directions_[kAToB].config = a_to_b;
+  directions_[kBToA].config = b_to_a;
+  for (Direction &direction : directions_) {
+    ASSERT(direction.config.bytes_per_second > 0 && direction.config.tx_fifo_length > 0 && direction.config.rx_buffer_length > 0);
+    direction.tx_busy_until_ns = 0;
+    direction.stats = {};
+  }
+}
+
+P2PLinkEmulatorConfig P2PLinkEmulator::UARTConfig() {
+  P2PLinkEmulatorConfig config;
+  config.bytes_per_second = 100000;
+  config.tx_fifo_length = 64;
+  config.propagation_delay_ns = 0;
+  config.bit_error_rate = 0;
+  config.byte_drop_rate = 0;
+  config.rx_buffer_length = 64;
+  config.burst_max_length = 64;
+  config.burst_ingestion_ns_per_byte = 10000;
+  config.advertise_rx_buffer_length = false;
+  return config;
+}
+
+void P2PLinkEmulator::Advance(uint64_t ns) {
+  timer_.Advance(ns);
+  Update(kAToB);
+  Update(kBToA);
+}
+
+void P2PLinkEmulator::Update(int direction_index) {
+  Direction &direction = directions_[direction_index];
+  const uint64_t now_ns = timer_.GetLocalNanoseconds();
+  const uint64_t byte_ns = 1000000000ULL / direction.config.bytes_per_second;
+  // Probability that a byte gets at least one bit flipped.
+  const double byte_error_rate = 1.0 - pow(1.0 - direction.config.bit_error_rate, 8);
+
+  // Serialize the bytes in the UART FIFO back to back, from when the UART was free.
+  while (!direction.tx_fifo.empty() && direction.tx_busy_until_ns + byte_ns <= now_ns) {
+    direction.tx_busy_until_ns += byte_ns;
+    uint8_t byte = direction.tx_fifo.front();
+    direction.tx_fifo.pop_front();
+    ++direction.stats.num_sent_bytes;
+    if (direction.config.byte_drop_rate > 0 && uniform_(random_generator_) < direction.config.byte_drop_rate) {
+      ++direction.stats.num_dropped_bytes;
+      continue;
+    }
+    if (byte_error_rate > 0 && uniform_(random_generator_) < byte_error_rate) {
+      byte ^= 1 << (random_generator_() % 8);
+      ++direction.stats.num_corrupted_bytes;
+    }
+    direction.wire.push_back({ direction.tx_busy_until_ns + direction.config.propagation_delay_ns, byte });
+  }
+  if (direction.tx_fifo.empty()) {
+    // The UART idles until the next write.
+    direction.tx_busy_until_ns = std::max(direction.tx_busy_until_ns, now_ns);
+  }
+
+  while (!direction.wire.empty() && direction.wire.front().arrival_ns <= now_ns) {
+    if (static_cast<int>(direction.rx_buffer.size()) < direction.config.rx_buffer_length) {
+      direction.rx_buffer.push_back(direction.wire.front().byte);
+    } else {
+      ++direction.stats.num_overrun_bytes;
+    }
+    direction.wire.pop_front();
+  }
+}
+
+int P2PLinkEmulator::Write(int direction_index, const uint8_t *bytes, int length) {
+  Update(direction_index);
+  Direction &direction = directions_[direction_index];
+  const int num_bytes = std::max(0, std::min(length, direction.config.tx_fifo_length - static_cast<int>(direction.tx_fifo.size())));
+  direction.tx_fifo.insert(direction.tx_fifo.end(), bytes, bytes + num_bytes);
+  return num_bytes;
+}
+
+int P2PLinkEmulator::Read(int direction_index, uint8_t *bytes, int length) {
+  Update(direction_index);
+  Direction &direction = directions_[direction_index];
+  const int num_bytes = std::min(length, static_cast<int>(direction.rx_buffer.size()));
+  std::copy(direction.rx_buffer.begin(), direction.rx_buffer.begin() + num_bytes, bytes);
+  direction.rx_buffer.erase(direction.rx_buffer.begin(), direction.rx_buffer.begin() + num_bytes);
+  direction.stats.num_received_bytes += num_bytes;
+  return num_bytes;
+}
@@ -0,0 +1,130 @@
+#ifndef P2P_LINK_EMULATOR_
+#define P2P_LINK_EMULATOR_
+
+#include <deque>
+#include <random>
+#include "p2p_byte_stream_interface.h"
+#include "timer_interface.h"
+
+// Timer whose time only moves when the caller advances it, so that emulated links run faster
+// than real time and reproducibly.
+class P2PVirtualTimer : public TimerInterface {
+public:
+  P2PVirtualTimer() : ns_(0) {}
+  virtual uint64_t GetLocalNanoseconds() const { return ns_; }
+  void Advance(uint64_t ns) { ns_ += ns; }
+
+private:
+  uint64_t ns_;
+};
+
+// One direction of an emulated link, from the UART of the sender to the receive buffer of the
+// receiver.
+typedef struct {
+  // Bytes per second on the wire, e.g. 100000 for 1 Mbaud with 8N1 framing.
+  int bytes_per_second;
+  // Bytes that the sender's UART FIFO can hold. Write() accepts no more than fit.
+  int tx_fifo_length;
+  // Time from a byte leaves the sender's UART until it reaches the receiver's.
+  uint64_t propagation_delay_ns;
+  // Probability that each bit on the wire is flipped.
+  double bit_error_rate;
+  // Probability that each byte is lost on the wire.
+  double byte_drop_rate;
+  // Bytes that the receiver buffers until they are read. Bytes arriving at a full buffer are
+  // lost, as in a UART overrun.
+  int rx_buffer_length;
+  // Ingestion limits of the receiver, as reported to the sender's output stream (see
+  // P2PByteStreamInterface).
+  int burst_max_length;
+  int burst_ingestion_ns_per_byte;
+  // Whether the receiver advertises rx_buffer_length as credit to the sender.
+  bool advertise_rx_buffer_length;
+} P2PLinkEmulatorConfig;
+
+// Counters of one direction of an emulated link.
+typedef struct {
+  uint64_t num_sent_bytes;        // Bytes that left the sender's UART.
+  uint64_t num_corrupted_bytes;   // Bytes with flipped bits.
+  uint64_t num_dropped_bytes;     // Bytes lost on the wire.
+  uint64_t num_overrun_bytes;     // Bytes lost at the receiver's full buffer.
+  uint64_t num_received_bytes;    // Bytes read by the receiver.
+} P2PLinkEmulatorStats;
+
+class P2PLinkEmulator;
+
+// End of an emulated link, for the packet stream of one of the computers.
+class P2PEmulatedByteStream : public P2PByteStreamInterface<kLittleEndian> {
+public:
+  virtual int Write(const void *buffer, int length);
+  virtual int Read(void *buffer, int length);
+  virtual int GetBurstMaxLength();
+  virtual int GetBurstIngestionNanosecondsPerByte();
+  virtual int GetAtomicSendMaxLength() { return 4; }
+  virtual int GetReceiveBufferLength();
+
+private:
+  friend class P2PLinkEmulator;
+  P2PEmulatedByteStream(P2PLinkEmulator *link, int tx_direction)
+    : P2PByteStreamInterface<kLittleEndian>(Handler{ .object = link }), link_(*link), tx_direction_(tx_direction) {}
+
+  P2PLinkEmulator &link_;
+  // Direction of the link in which this end sends.
+  int tx_direction_;
+};
+
+// In-memory point-to-point link between ends A and B, driven by a virtual timer. Each
+// direction emulates the bandwidth, UART FIFO, propagation delay, bit errors, byte losses and
+// receive buffer of its P2PLinkEmulatorConfig. Errors are drawn from a generator with the
+// given seed, so runs are reproducible.
+// The link moves bytes when the time advances, or when an end writes or reads.
+class P2PLinkEmulator {
+public:
+  P2PLinkEmulator(const P2PLinkEmulatorConfig &a_to_b, const P2PLinkEmulatorConfig &b_to_a, uint32_t seed = 1);
+
+  P2PEmulatedByteStream &end_a() { return end_a_; }
+  P2PEmulatedByteStream &end_b() { return end_b_; }
+  P2PVirtualTimer &timer() { return timer_; }
+
+  // Advances the virtual time by `ns`, moving the bytes along the link.
+  void Advance(uint64_t ns);
+
+  const P2PLinkEmulatorStats &a_to_b_stats() const { return directions_[kAToB].stats; }
+  const P2PLinkEmulatorStats &b_to_a_stats() const { return directions_[kBToA].stats; }
+
+  // Link of a UART at 1 Mbaud with 8N1 framing and no errors, as between the robot computers.
+  static P2PLinkEmulatorConfig UARTConfig();
+
+private:
+  friend class P2PEmulatedByteStream;
+  enum { kAToB = 0, kBToA = 1 };
+
+  typedef struct {
+    uint64_t arrival_ns;
+    uint8_t byte;
+  } InFlightByte;
+
+  typedef struct {
+    P2PLinkEmulatorConfig config;
+    std::deque<uint8_t> tx_fifo;
+    // Time when the UART is done with the byte it is sending, if any.
+    uint64_t tx_busy_until_ns;
+    std::deque<InFlightByte> wire;
+    std::deque<uint8_t> rx_buffer;
+    P2PLinkEmulatorStats stats;
+  } Direction;
+
+  // Moves the bytes of `direction` that are done with each stage at the current time.
+  void Update(int direction);
+  int Write(int direction, const uint8_t *bytes, int length);
+  int Read(int direction, uint8_t *bytes, int length);
+
+  P2PVirtualTimer timer_;
+  Direction directions_[2];
+  P2PEmulatedByteStream end_a_;
+  P2PEmulatedByteStream end_b_;
+  std::mt19937 random_generator_;
+  std::uniform_real_distribution<double> uniform_;
+};
+
+#endif  // P2P_LINK_EMULATOR_
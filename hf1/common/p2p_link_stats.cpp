@@ -0,0 +1,74 @@
+#include "p2p_link_stats.h"
+#include <algorithm>
+#include <math.h>
+
+void P2PLatencyHistogram::Clear() {
+  for (int i = 0; i < kP2PLatencyHistogramNumBuckets; ++i) { buckets_[i] = 0; }
+  count_ = 0;
+  max_ns_ = 0;
+}
+
+void P2PLatencyHistogram::Add(uint64_t latency_ns) {
+  uint32_t &bucket = buckets_[BucketIndex(latency_ns)];
+  // Saturate instead of wrapping around, so that quantiles stay sensible.
+  if (bucket < UINT32_MAX) { ++bucket; }
+  ++count_;
+  max_ns_ = std::max(max_ns_, latency_ns);
+}
+
+int P2PLatencyHistogram::BucketIndex(uint64_t latency_ns) {
+  if (latency_ns < (1ULL << kP2PLatencyHistogramMinOctave)) {
+    // The linear buckets have the width of the sub-buckets of the first octave.
+    return latency_ns >> (kP2PLatencyHistogramMinOctave - kP2PLatencyHistogramSubBucketBits);
+  }
+  const int octave = 63 - __builtin_clzll(latency_ns);
+  if (octave > kP2PLatencyHistogramMaxOctave) {
+    return kP2PLatencyHistogramNumBuckets - 1;
+  }
+  // The bits right after the most significant one select the sub-bucket.
+  const int sub_bucket = (latency_ns >> (octave - kP2PLatencyHistogramSubBucketBits)) & ((1 << kP2PLatencyHistogramSubBucketBits) - 1);
+  return ((octave - kP2PLatencyHistogramMinOctave + 1) << kP2PLatencyHistogramSubBucketBits) + sub_bucket;
+}
+
+uint64_t P2PLatencyHistogram::BucketEndNs(int index) {
+  const int num_sub_buckets = 1 << kP2PLatencyHistogramSubBucketBits;
+  if (index < num_sub_buckets) {
+    return static_cast<uint64_t>(index + 1) << (kP2PLatencyHistogramMinOctave - kP2PLatencyHistogramSubBucketBits);
+  }
+  if (index >= kP2PLatencyHistogramNumBuckets - 1) {
+    return -1ULL;
+  }
+  const int octave = index / num_sub_buckets - 1 + kP2PLatencyHistogramMinOctave;
+  const int sub_bucket = index % num_sub_buckets;
+  return static_cast<uint64_t>(num_sub_buckets + sub_bucket + 1) << (octave - kP2PLatencyHistogramSubBucketBits);
+}
+
+uint64_t P2PLatencyHistogram::Quantile(float quantile) const {
+  if (count_ == 0) {
+    return 0;
+  }
+  // Number of latencies at or below the quantile, at least 1.
+  const uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(ceilf(quantile * count_)));
+  uint64_t num_latencies = 0;
+  for (int i = 0; i < kP2PLatencyHistogramNumBuckets; ++i) {
+    num_latencies += buckets_[i];
+    if (num_latencies >= rank) {
+      return std::min(BucketEndNs(i), max_ns_);
+    }
+  }
+  return max_ns_;
+}
+
+void P2PRateMeter::Update(uint64_t timestamp_ns) {
+  if (window_start_ns_ == -1ULL) {
+    window_start_ns_ = timestamp_ns;
+    return;
+  }
+  const uint64_t elapsed_ns = timestamp_ns - window_start_ns_;
+  if (elapsed_ns < kP2PStatsRateWindowNs) {
+    return;
+  }
+  rate_per_second_ = window_count_ * 1000000000ULL / elapsed_ns;
+  window_count_ = 0;
+  window_start_ns_ = timestamp_ns;
+}
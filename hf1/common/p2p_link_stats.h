@@ -0,0 +1,69 @@
+#ifndef P2P_LINK_STATS_
+#define P2P_LINK_STATS_
+
+#include <stdint.h>
+
+// Latencies below 2^kP2PLatencyHistogramMinOctave ns share linear buckets; above, each octave
+// is split in 2^kP2PLatencyHistogramSubBucketBits buckets, up to the last bucket, which holds
+// all latencies of 2^kP2PLatencyHistogramMaxOctave ns or more.
+#define kP2PLatencyHistogramMinOctave 10
+#define kP2PLatencyHistogramMaxOctave 33
+#define kP2PLatencyHistogramSubBucketBits 2
+#define kP2PLatencyHistogramNumBuckets (((kP2PLatencyHistogramMaxOctave - kP2PLatencyHistogramMinOctave + 1) << kP2PLatencyHistogramSubBucketBits) + 1)
+
+// Length of the windows over which P2PRateMeter measures rates.
+#define kP2PStatsRateWindowNs 1000000000ULL
+
+// Histogram of latencies in logarithmic buckets, with a relative error of 1 / 4 of the value
+// at most, in fixed memory.
+class P2PLatencyHistogram {
+public:
+  P2PLatencyHistogram() { Clear(); }
+
+  void Clear();
+  void Add(uint64_t latency_ns);
+
+  // Number of latencies added.
+  uint64_t count() const { return count_; }
+
+  // Maximum latency added, or 0 if none.
+  uint64_t max_ns() const { return max_ns_; }
+
+  // Returns an upper bound of the latency below which a `quantile` in [0, 1] of the latencies
+  // are, e.g. 0.99 for the 99th percentile. Returns 0 if no latency has been added.
+  uint64_t Quantile(float quantile) const;
+
+  // Index of the bucket of `latency_ns`, and the latency right after the bucket.
+  static int BucketIndex(uint64_t latency_ns);
+  static uint64_t BucketEndNs(int index);
+
+private:
+  uint32_t buckets_[kP2PLatencyHistogramNumBuckets];
+  uint64_t count_;
+  uint64_t max_ns_;
+};
+
+// Measures the rate of a quantity over windows of kP2PStatsRateWindowNs.
+class P2PRateMeter {
+public:
+  P2PRateMeter() : window_start_ns_(-1ULL), window_count_(0), rate_per_second_(0) {}
+
+  // Adds `count` to the current window at `timestamp_ns`.
+  void Add(uint64_t count, uint64_t timestamp_ns) {
+    Update(timestamp_ns);
+    window_count_ += count;
+  }
+
+  // Closes the current window if it has lasted long enough.
+  void Update(uint64_t timestamp_ns);
+
+  // Rate over the last closed window.
+  uint64_t rate_per_second() const { return rate_per_second_; }
+
+private:
+  uint64_t window_start_ns_;
+  uint64_t window_count_;
+  uint64_t rate_per_second_;
+};
+
+#endif  // P2P_LINK_STATS_
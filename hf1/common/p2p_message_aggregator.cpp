@@ -0,0 +1,26 @@
+#include "p2p_message_aggregator.h"
+
+StatusOr<P2PApplicationMessageView> P2PGetApplicationMessage(const P2PPacketView &packet, int offset) {
+  if (packet.length() < sizeof(P2PApplicationPacketHeader)) {
+    return Status::kMalformedError;
+  }
+  const auto packet_header = reinterpret_cast<const P2PApplicationPacketHeader *>(packet.content());
+  if (packet_header->action != kP2PBundleAction) {
+    // A message alone in its packet.
+    if (offset != 0) { return Status::kMalformedError; }
+    return P2PApplicationMessageView(packet.priority(), packet.content(), packet.length(), 0);
+  }
+
+  const int record_offset = offset == 0 ? kP2PBundleRecordsOffset : offset;
+  const int message_offset = record_offset + sizeof(P2PBundledMessageLength);
+  if (record_offset < kP2PBundleRecordsOffset || message_offset > packet.length()) {
+    return Status::kMalformedError;
+  }
+  const int message_length = *reinterpret_cast<const P2PBundledMessageLength *>(packet.content() + record_offset);
+  const int next_offset = message_offset + message_length;
+  if (message_length < static_cast<int>(sizeof(P2PApplicationPacketHeader)) || next_offset > packet.length()) {
+    return Status::kMalformedError;
+  }
+  return P2PApplicationMessageView(packet.priority(), packet.content() + message_offset, message_length,
+                                   next_offset < packet.length() ? next_offset : 0);
+}
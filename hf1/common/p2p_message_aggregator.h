@@ -0,0 +1,106 @@
+#ifndef P2P_MESSAGE_AGGREGATOR_
+#define P2P_MESSAGE_AGGREGATOR_
+
+#include "p2p_application_protocol.h"
+#include "p2p_packet_stream.h"
+#include "timer_interface.h"
+#include "status_or.h"
+
+static_assert(kCount <= kP2PFragmentAction && kP2PFragmentAction < kP2PBundleAction, "Bundles and fragments must not collide with other actions.");
+
+// Maximum time that an application message can wait for others to share its packet.
+#define kP2PMaxAggregationDelayNs 1000000ULL
+
+// Offset of the first record in a bundle packet.
+#define kP2PBundleRecordsOffset static_cast<int>(sizeof(P2PApplicationPacketHeader))
+
+// Aggregates application messages of the same priority in P2P packets, so that small messages
+// share the header, footer, sequence number and ACK of a packet, and a single slot in the
+// output stream.
+// The messages of a priority are kept in a bundle until one of these happens:
+// - The next message does not fit in the bundle.
+// - There are no packets of the bundle's priority waiting in the output stream, as the bundle
+//   would only be delayed for nothing.
+// - The oldest message in the bundle has waited for kP2PMaxAggregationDelayNs.
+// A bundle with a single message is sent as a regular application packet, so the other end
+// only needs to understand bundles if there is actually aggregation.
+template<int kCapacity, Endianness LocalEndianness, typename ByteStream = P2PByteStreamInterface<LocalEndianness>> class P2PMessageAggregator {
+public:
+  // Does not take ownership of the output stream or timer, which must outlive this object.
+  P2PMessageAggregator(P2PPacketOutputStream<kCapacity, LocalEndianness, ByteStream> *output, const TimerInterface *timer);
+
+  // Returns a view to a new application message with `priority` and `length` bytes, including
+  // the P2PApplicationPacketHeader, or kUnavailableError if the output stream has no space
+  // for the packets needed to send it. Commit() must be called with the same `priority` for
+  // the message to be sent.
+  StatusOr<P2PMutablePacketView> NewMessage(P2PPriority priority, int length);
+
+  // Adds the new message to the bundle of its priority, flushing the bundle beforehand if the
+  // message does not fit. The bundle is delivered reliably if any of its messages must be.
+  // Returns false if the output stream ran out of space, in which case the message was not
+  // sent and must be created again with NewMessage() to retry.
+  bool Commit(P2PPriority priority, bool guarantee_delivery);
+
+  // Sends the bundles that should not wait any longer. Must be called from a run loop.
+  void Run();
+
+  // Sends the bundles of all priorities. Returns false if any of them could not be sent for
+  // lack of space in the output stream.
+  bool Flush();
+
+  // Discards the bundles without sending them.
+  void Reset();
+
+  // Number of messages waiting in the bundle of `priority`.
+  int NumBundledMessages(P2PPriority priority) const { return num_bundled_messages_[priority]; }
+
+private:
+  bool Flush(P2PPriority priority);
+  // Returns whether a new message of `length` bytes fits in the current bundle of `priority`.
+  bool FitsInBundle(P2PPriority priority, int length) const;
+  // Returns whether a message of `length` bytes is too long to be bundled at all.
+  static bool IsTooLongForBundle(int length);
+
+  P2PPacketOutputStream<kCapacity, LocalEndianness, ByteStream> &output_;
+  const TimerInterface &timer_;
+  // Message in construction for each priority, between NewMessage() and Commit().
+  P2PPacket new_message_[P2PPriority::kNumLevels];
+  // Content of the bundle packet for each priority, with the bundle header and records.
+  uint8_t bundle_[P2PPriority::kNumLevels][kP2PMaxContentLength];
+  int bundle_length_[P2PPriority::kNumLevels];
+  int num_bundled_messages_[P2PPriority::kNumLevels];
+  bool bundle_requires_ack_[P2PPriority::kNumLevels];
+  uint64_t bundle_start_time_ns_[P2PPriority::kNumLevels];
+};
+
+// View of an application message received in a P2P packet, either alone or in a bundle.
+class P2PApplicationMessageView {
+public:
+  P2PApplicationMessageView() : P2PApplicationMessageView(0, nullptr, 0, 0) {}
+  P2PApplicationMessageView(int priority, const uint8_t *content, int length, int next_offset)
+    : priority_(priority), content_(content), length_(length), next_offset_(next_offset) {}
+
+  int priority() const { return priority_; }
+  const P2PApplicationPacketHeader *header() const { return reinterpret_cast<const P2PApplicationPacketHeader *>(content_); }
+  // The message, starting with its P2PApplicationPacketHeader.
+  const uint8_t *content() const { return content_; }
+  int length() const { return length_; }
+  // Offset to pass to P2PGetApplicationMessage() for the next message in the same packet,
+  // or 0 if this is the last one.
+  int next_offset() const { return next_offset_; }
+
+private:
+  int priority_;
+  const uint8_t *content_;
+  int length_;
+  int next_offset_;
+};
+
+// Returns the application message at `offset` in `packet`. Offset 0 is the first message in
+// the packet; the following ones are at the offsets returned by next_offset().
+// Returns kMalformedError if the packet is not a well-formed application packet or bundle.
+StatusOr<P2PApplicationMessageView> P2PGetApplicationMessage(const P2PPacketView &packet, int offset = 0);
+
+#include "p2p_message_aggregator.hh"
+
+#endif  // P2P_MESSAGE_AGGREGATOR_
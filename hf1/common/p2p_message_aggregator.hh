@@ -0,0 +1,116 @@
+#include <string.h>
+
+template<int kCapacity, Endianness LocalEndianness, typename ByteStream>
+P2PMessageAggregator<kCapacity, LocalEndianness, ByteStream>::P2PMessageAggregator(P2PPacketOutputStream<kCapacity, LocalEndianness, ByteStream> *output, const TimerInterface *timer)
+  : output_(*ASSERT_NOT_NULL(output)), timer_(*ASSERT_NOT_NULL(timer)) {
+  Reset();
+}
+
+template<int kCapacity, Endianness LocalEndianness, typename ByteStream>
+void P2PMessageAggregator<kCapacity, LocalEndianness, ByteStream>::Reset() {
+  for (int i = 0; i < P2PPriority::kNumLevels; ++i) {
+    P2PApplicationPacketHeader *header = reinterpret_cast<P2PApplicationPacketHeader *>(bundle_[i]);
+    header->action = kP2PBundleAction;
+    header->stage = 0;
+    header->request_id = 0;
+    bundle_length_[i] = kP2PBundleRecordsOffset;
+    num_bundled_messages_[i] = 0;
+    bundle_requires_ack_[i] = false;
+    bundle_start_time_ns_[i] = 0;
+  }
+}
+
+template<int kCapacity, Endianness LocalEndianness, typename ByteStream>
+bool P2PMessageAggregator<kCapacity, LocalEndianness, ByteStream>::IsTooLongForBundle(int length) {
+  return kP2PBundleRecordsOffset + static_cast<int>(sizeof(P2PBundledMessageLength)) + length > kP2PMaxContentLength;
+}
+
+template<int kCapacity, Endianness LocalEndianness, typename ByteStream>
+bool P2PMessageAggregator<kCapacity, LocalEndianness, ByteStream>::FitsInBundle(P2PPriority priority, int length) const {
+  return bundle_length_[priority] + static_cast<int>(sizeof(P2PBundledMessageLength)) + length <= kP2PMaxContentLength;
+}
+
+template<int kCapacity, Endianness LocalEndianness, typename ByteStream>
+StatusOr<P2PMutablePacketView> P2PMessageAggregator<kCapacity, LocalEndianness, ByteStream>::NewMessage(P2PPriority priority, int length) {
+  ASSERT(length >= static_cast<int>(sizeof(P2PApplicationPacketHeader)) && length <= kP2PMaxContentLength);
+  // One slot to flush the current bundle if the message does not fit, and another one if the
+  // message must be sent in its own packet.
+  int num_slots_needed = 0;
+  if (num_bundled_messages_[priority] > 0 && !FitsInBundle(priority, length)) { ++num_slots_needed; }
+  if (IsTooLongForBundle(length)) { ++num_slots_needed; }
+  if (output_.NumAvailableSlots(priority) < num_slots_needed) {
+    return Status::kUnavailableError;
+  }
+  P2PPacket &message = new_message_[priority];
+  message.header()->priority = priority;
+  message.length() = length;
+  return P2PMutablePacketView(&message);
+}
+
+template<int kCapacity, Endianness LocalEndianness, typename ByteStream>
+bool P2PMessageAggregator<kCapacity, LocalEndianness, ByteStream>::Commit(P2PPriority priority, bool guarantee_delivery) {
+  const P2PPacket &message = new_message_[priority];
+  if (!FitsInBundle(priority, message.length()) && !Flush(priority)) { return false; }
+
+  if (IsTooLongForBundle(message.length())) {
+    StatusOr<P2PMutablePacketView> maybe_packet = output_.NewPacket(priority);
+    if (!maybe_packet.ok()) { return false; }
+    memcpy(maybe_packet->content(), message.content(), message.length());
+    maybe_packet->length() = message.length();
+    return output_.Commit(priority, guarantee_delivery);
+  }
+
+  if (num_bundled_messages_[priority] == 0) {
+    bundle_start_time_ns_[priority] = timer_.GetLocalNanoseconds();
+  }
+  uint8_t *record = &bundle_[priority][bundle_length_[priority]];
+  *reinterpret_cast<P2PBundledMessageLength *>(record) = message.length();
+  memcpy(record + sizeof(P2PBundledMessageLength), message.content(), message.length());
+  bundle_length_[priority] += sizeof(P2PBundledMessageLength) + message.length();
+  ++num_bundled_messages_[priority];
+  bundle_requires_ack_[priority] = bundle_requires_ack_[priority] || guarantee_delivery;
+  return true;
+}
+
+template<int kCapacity, Endianness LocalEndianness, typename ByteStream>
+bool P2PMessageAggregator<kCapacity, LocalEndianness, ByteStream>::Flush(P2PPriority priority) {
+  if (num_bundled_messages_[priority] == 0) { return true; }
+  StatusOr<P2PMutablePacketView> maybe_packet = output_.NewPacket(priority);
+  if (!maybe_packet.ok()) { return false; }
+  if (num_bundled_messages_[priority] == 1) {
+    // Send the message alone, without the bundle header and record length.
+    const int message_offset = kP2PBundleRecordsOffset + sizeof(P2PBundledMessageLength);
+    maybe_packet->length() = bundle_length_[priority] - message_offset;
+    memcpy(maybe_packet->content(), &bundle_[priority][message_offset], maybe_packet->length());
+  } else {
+    maybe_packet->length() = bundle_length_[priority];
+    memcpy(maybe_packet->content(), bundle_[priority], bundle_length_[priority]);
+  }
+  if (!output_.Commit(priority, bundle_requires_ack_[priority])) { return false; }
+  bundle_length_[priority] = kP2PBundleRecordsOffset;
+  num_bundled_messages_[priority] = 0;
+  bundle_requires_ack_[priority] = false;
+  return true;
+}
+
+template<int kCapacity, Endianness LocalEndianness, typename ByteStream>
+bool P2PMessageAggregator<kCapacity, LocalEndianness, ByteStream>::Flush() {
+  bool all_flushed = true;
+  for (int i = 0; i < P2PPriority::kNumLevels; ++i) {
+    all_flushed = Flush(static_cast<P2PPriority>(i)) && all_flushed;
+  }
+  return all_flushed;
+}
+
+template<int kCapacity, Endianness LocalEndianness, typename ByteStream>
+void P2PMessageAggregator<kCapacity, LocalEndianness, ByteStream>::Run() {
+  const uint64_t now_ns = timer_.GetLocalNanoseconds();
+  for (int i = 0; i < P2PPriority::kNumLevels; ++i) {
+    const P2PPriority priority = static_cast<P2PPriority>(i);
+    if (num_bundled_messages_[priority] == 0) { continue; }
+    if (output_.NumCommittedPackets(priority) == 0 ||
+        now_ns - bundle_start_time_ns_[priority] >= kP2PMaxAggregationDelayNs) {
+      Flush(priority);
+    }
+  }
+}
@@ -0,0 +1,60 @@
+#ifndef P2P_MESSAGE_FRAGMENTER_
+#define P2P_MESSAGE_FRAGMENTER_
+
+#include "p2p_application_protocol.h"
+#include "p2p_message_aggregator.h"
+#include "status_or.h"
+
+// Sends an application message longer than a packet as a sequence of fragments (see
+// kP2PFragmentAction). Fragments are queued in the output stream as long as it has space, so
+// they are pipelined within the window of the reliable packets instead of waiting for a round
+// trip each.
+template<int kCapacity, Endianness LocalEndianness, typename ByteStream = P2PByteStreamInterface<LocalEndianness>> class P2PMessageFragmenter {
+public:
+  // Does not take ownership of the aggregator, which must outlive this object.
+  P2PMessageFragmenter(P2PMessageAggregator<kCapacity, LocalEndianness, ByteStream> *aggregator);
+
+  // Starts sending a message with `header` and `payload_length` bytes of `payload`, and
+  // queues as many fragments as possible. The rest are queued by Run().
+  // Does not take ownership of the payload, which must not change until in_progress() is
+  // false. Fragments are always delivered reliably, as the message cannot be reassembled
+  // without all of them.
+  // Returns kExistsError if another message is in progress.
+  Status Send(P2PPriority priority, const P2PApplicationPacketHeader &header, int payload_length, const uint8_t *payload);
+
+  // Queues the pending fragments for which there is space in the output stream.
+  // Must be called from a run loop while in_progress().
+  void Run();
+
+  // Stops sending the fragments of the current message. Queued fragments are still sent.
+  void Cancel() { payload_ = nullptr; }
+
+  // True while there are fragments to queue.
+  bool in_progress() const { return payload_ != nullptr; }
+
+private:
+  P2PMessageAggregator<kCapacity, LocalEndianness, ByteStream> &aggregator_;
+  P2PPriority priority_;
+  P2PApplicationPacketHeader header_;
+  const uint8_t *payload_;
+  int payload_length_;
+  // Position of the next fragment to queue in the payload.
+  int offset_;
+};
+
+// Fragment of an application message received in a message with kP2PFragmentAction.
+typedef struct {
+  P2PAction action;   // Action of the fragmented message.
+  int offset;         // Position of the fragment in the payload of the fragmented message.
+  int total_length;   // Length of the payload of the fragmented message.
+  const uint8_t *data;
+  int length;
+} P2PFragmentView;
+
+// Returns the fragment in `message`, or kMalformedError if the message is not a well-formed
+// fragment.
+template<Endianness LocalEndianness> StatusOr<P2PFragmentView> P2PGetFragment(const P2PApplicationMessageView &message);
+
+#include "p2p_message_fragmenter.hh"
+
+#endif  // P2P_MESSAGE_FRAGMENTER_
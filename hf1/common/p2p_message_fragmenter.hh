@@ -0,0 +1,67 @@
+#include <string.h>
+
+template<int kCapacity, Endianness LocalEndianness, typename ByteStream>
+P2PMessageFragmenter<kCapacity, LocalEndianness, ByteStream>::P2PMessageFragmenter(P2PMessageAggregator<kCapacity, LocalEndianness, ByteStream> *aggregator)
+  : aggregator_(*ASSERT_NOT_NULL(aggregator)), priority_(P2PPriority::kMedium), payload_(nullptr), payload_length_(0), offset_(0) {}
+
+template<int kCapacity, Endianness LocalEndianness, typename ByteStream>
+Status P2PMessageFragmenter<kCapacity, LocalEndianness, ByteStream>::Send(P2PPriority priority, const P2PApplicationPacketHeader &header, int payload_length, const uint8_t *payload) {
+  if (in_progress()) {
+    return Status::kExistsError;
+  }
+  ASSERT(payload_length <= UINT16_MAX);
+  priority_ = priority;
+  header_ = header;
+  payload_ = ASSERT_NOT_NULL(payload);
+  payload_length_ = payload_length;
+  offset_ = 0;
+  Run();
+  return Status::kSuccess;
+}
+
+template<int kCapacity, Endianness LocalEndianness, typename ByteStream>
+void P2PMessageFragmenter<kCapacity, LocalEndianness, ByteStream>::Run() {
+  while (in_progress()) {
+    const int fragment_length = std::min(kP2PMaxFragmentLength, payload_length_ - offset_);
+    const int fragment_offset = sizeof(P2PApplicationPacketHeader) + sizeof(P2PFragmentHeader);
+    StatusOr<P2PMutablePacketView> maybe_message = aggregator_.NewMessage(priority_, fragment_offset + fragment_length);
+    if (!maybe_message.ok()) {
+      return;
+    }
+    P2PApplicationPacketHeader *header = reinterpret_cast<P2PApplicationPacketHeader *>(maybe_message->content());
+    *header = header_;
+    header->action = kP2PFragmentAction;
+    P2PFragmentHeader *fragment_header = reinterpret_cast<P2PFragmentHeader *>(maybe_message->content() + sizeof(P2PApplicationPacketHeader));
+    fragment_header->action = header_.action;
+    fragment_header->offset = LocalToNetwork<LocalEndianness>(static_cast<uint16_t>(offset_));
+    fragment_header->total_length = LocalToNetwork<LocalEndianness>(static_cast<uint16_t>(payload_length_));
+    memcpy(maybe_message->content() + fragment_offset, payload_ + offset_, fragment_length);
+    if (!aggregator_.Commit(priority_, /*guarantee_delivery=*/true)) {
+      // Retry the same fragment in the next call.
+      return;
+    }
+    offset_ += fragment_length;
+    if (offset_ >= payload_length_) {
+      payload_ = nullptr;
+    }
+  }
+}
+
+template<Endianness LocalEndianness>
+StatusOr<P2PFragmentView> P2PGetFragment(const P2PApplicationMessageView &message) {
+  const int fragment_offset = sizeof(P2PApplicationPacketHeader) + sizeof(P2PFragmentHeader);
+  if (message.header()->action != kP2PFragmentAction || message.length() < fragment_offset) {
+    return Status::kMalformedError;
+  }
+  const P2PFragmentHeader *fragment_header = reinterpret_cast<const P2PFragmentHeader *>(message.content() + sizeof(P2PApplicationPacketHeader));
+  P2PFragmentView fragment;
+  fragment.action = static_cast<P2PAction>(fragment_header->action);
+  fragment.offset = NetworkToLocal<LocalEndianness>(fragment_header->offset);
+  fragment.total_length = NetworkToLocal<LocalEndianness>(fragment_header->total_length);
+  fragment.data = message.content() + fragment_offset;
+  fragment.length = message.length() - fragment_offset;
+  if (fragment.length == 0 || fragment.offset + fragment.length > fragment.total_length) {
+    return Status::kMalformedError;
+  }
+  return fragment;
+}
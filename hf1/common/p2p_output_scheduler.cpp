@@ -0,0 +1,115 @@
+#include "p2p_output_scheduler.h"
+
+P2PDeficitRoundRobinScheduler::P2PDeficitRoundRobinScheduler()
+  : current_priority_(0), is_quantum_credited_(false) {
+  for (int priority = 0; priority < P2PPriority::kNumLevels; ++priority) {
+    is_strict_[priority] = priority <= P2PPriority::kHigh;
+    quantum_[priority] = kP2PDefaultSchedulerQuantum;
+    deficit_[priority] = 0;
+    rate_cap_[priority] = 0;
+    tokens_[priority] = 0;
+    refill_timestamp_ns_[priority] = 0;
+  }
+}
+
+void P2PDeficitRoundRobinScheduler::quantum(int priority, int num_bytes) {
+  ASSERT(num_bytes > 0);
+  quantum_[priority] = num_bytes;
+}
+
+void P2PDeficitRoundRobinScheduler::rate_cap(int priority, uint32_t bytes_per_second) {
+  rate_cap_[priority] = bytes_per_second;
+  tokens_[priority] = BucketSize(priority);
+  refill_timestamp_ns_[priority] = 0;
+}
+
+int P2PDeficitRoundRobinScheduler::BucketSize(int priority) const {
+  return std::max(quantum_[priority], kP2PMaxUnencodedPacketLength);
+}
+
+void P2PDeficitRoundRobinScheduler::RefillTokens(int priority, uint64_t timestamp_ns) {
+  if (timestamp_ns <= refill_timestamp_ns_[priority]) {
+    return;
+  }
+  const uint64_t elapsed_ns = timestamp_ns - refill_timestamp_ns_[priority];
+  const uint64_t num_new_tokens = elapsed_ns * rate_cap_[priority] / 1000000000ULL;
+  if (static_cast<int64_t>(num_new_tokens) >= BucketSize(priority) - tokens_[priority]) {
+    // Full bucket: the time until now is not worth any more tokens.
+    tokens_[priority] = BucketSize(priority);
+    refill_timestamp_ns_[priority] = timestamp_ns;
+    return;
+  }
+  // Only advance by the time worth whole tokens, so that the fractions are not lost when
+  // refilling often.
+  tokens_[priority] += num_new_tokens;
+  refill_timestamp_ns_[priority] += num_new_tokens * 1000000000ULL / rate_cap_[priority];
+}
+
+bool P2PDeficitRoundRobinScheduler::IsWithinRateCap(int priority, int packet_length, uint64_t timestamp_ns) {
+  if (rate_cap_[priority] == 0) {
+    return true;
+  }
+  RefillTokens(priority, timestamp_ns);
+  return tokens_[priority] >= std::min(packet_length, BucketSize(priority));
+}
+
+int P2PDeficitRoundRobinScheduler::SelectPriority(const bool *has_packet, const int *packet_lengths, uint64_t timestamp_ns) {
+  bool is_eligible[P2PPriority::kNumLevels];
+  bool any_round_robin_eligible = false;
+  for (int priority = 0; priority < P2PPriority::kNumLevels; ++priority) {
+    is_eligible[priority] = has_packet[priority] && IsWithinRateCap(priority, packet_lengths[priority], timestamp_ns);
+    if (is_eligible[priority] && is_strict_[priority]) {
+      return priority;
+    }
+    any_round_robin_eligible |= is_eligible[priority] && !is_strict_[priority];
+  }
+  if (!any_round_robin_eligible) {
+    return -1;
+  }
+  // Each visit to an eligible level credits its quantum, so this ends within
+  // ceil(max packet length / min quantum) rounds.
+  while (true) {
+    const int priority = current_priority_;
+    if (!is_strict_[priority] && is_eligible[priority]) {
+      if (!is_quantum_credited_) {
+        deficit_[priority] += quantum_[priority];
+        is_quantum_credited_ = true;
+      }
+      if (deficit_[priority] >= packet_lengths[priority]) {
+        return priority;
+      }
+    } else if (!has_packet[priority]) {
+      // Levels without packets do not accumulate credit for later.
+      deficit_[priority] = 0;
+    }
+    current_priority_ = (current_priority_ + 1) % P2PPriority::kNumLevels;
+    is_quantum_credited_ = false;
+  }
+}
+
+bool P2PDeficitRoundRobinScheduler::CanPreempt(int priority, int current_priority) const {
+  return is_strict_[priority] && priority < current_priority;
+}
+
+void P2PDeficitRoundRobinScheduler::OnBytesSent(int priority, int num_bytes, uint64_t timestamp_ns) {
+  if (!is_strict_[priority]) {
+    deficit_[priority] -= num_bytes;
+  }
+  if (rate_cap_[priority] > 0) {
+    RefillTokens(priority, timestamp_ns);
+    tokens_[priority] -= num_bytes;
+  }
+}
+
+uint64_t P2PDeficitRoundRobinScheduler::TimeUntilEligibleNs(int priority, int packet_length, uint64_t timestamp_ns) const {
+  if (rate_cap_[priority] == 0) {
+    return 0;
+  }
+  const int missing_tokens = std::min(packet_length, BucketSize(priority)) - tokens_[priority];
+  if (missing_tokens <= 0) {
+    return 0;
+  }
+  const uint64_t refill_ns = (missing_tokens * 1000000000ULL + rate_cap_[priority] - 1) / rate_cap_[priority];
+  const uint64_t elapsed_ns = timestamp_ns > refill_timestamp_ns_[priority] ? timestamp_ns - refill_timestamp_ns_[priority] : 0;
+  return refill_ns > elapsed_ns ? refill_ns - elapsed_ns : 0;
+}
@@ -0,0 +1,66 @@
+#ifndef P2P_OUTPUT_SCHEDULER_
+#define P2P_OUTPUT_SCHEDULER_
+
+#include "p2p_packet_stream.h"
+
+// Bytes that a level of P2PDeficitRoundRobinScheduler can send per round by default.
+#define kP2PDefaultSchedulerQuantum 256
+
+// Maximum number of bytes of a packet, including header and footer, before encoding.
+#define kP2PMaxUnencodedPacketLength static_cast<int>(sizeof(P2PHeader) + kP2PMaxContentLength + sizeof(P2PFooter))
+
+// Shares the link among priority levels with weighted deficit round-robin, so that a steady
+// flow of higher priority packets cannot starve the lower levels.
+// Strict levels are served before the others, as in P2PStrictPriorityScheduler, and can
+// preempt packets of lower levels. Each of the other levels is credited its quantum of bytes
+// on each round, and sends packets while its credit covers them, so that they share the link
+// in proportion to their quanta. Preemption is not possible among them.
+// Any level can have a rate cap, which holds its packets back with a token bucket.
+class P2PDeficitRoundRobinScheduler : public P2POutputSchedulerInterface {
+public:
+  // By default, kReserved and kHigh are strict, and the others have a quantum of
+  // kP2PDefaultSchedulerQuantum and no rate cap.
+  P2PDeficitRoundRobinScheduler();
+
+  // Sets whether `priority` is served strictly before the others, and can preempt them.
+  void strict(int priority, bool is_strict) { is_strict_[priority] = is_strict; }
+  bool strict(int priority) const { return is_strict_[priority]; }
+
+  // Sets the bytes credited to `priority` on each round. Must be positive.
+  void quantum(int priority, int num_bytes);
+  int quantum(int priority) const { return quantum_[priority]; }
+
+  // Sets the maximum sustained rate of `priority` in bytes per second, or 0 for no limit.
+  // Bursts of up to max(quantum, kP2PMaxUnencodedPacketLength) bytes are allowed.
+  void rate_cap(int priority, uint32_t bytes_per_second);
+  uint32_t rate_cap(int priority) const { return rate_cap_[priority]; }
+
+  virtual int SelectPriority(const bool *has_packet, const int *packet_lengths, uint64_t timestamp_ns);
+  virtual bool CanPreempt(int priority, int current_priority) const;
+  virtual void OnBytesSent(int priority, int num_bytes, uint64_t timestamp_ns);
+  virtual uint64_t TimeUntilEligibleNs(int priority, int packet_length, uint64_t timestamp_ns) const;
+
+private:
+  // Returns true if the rate cap of `priority` allows sending `packet_length` bytes now.
+  bool IsWithinRateCap(int priority, int packet_length, uint64_t timestamp_ns);
+  // Adds the tokens accumulated by `priority` until `timestamp_ns`.
+  void RefillTokens(int priority, uint64_t timestamp_ns);
+  int BucketSize(int priority) const;
+
+  bool is_strict_[P2PPriority::kNumLevels];
+  int quantum_[P2PPriority::kNumLevels];
+  // Bytes that each level can send in the current round.
+  int deficit_[P2PPriority::kNumLevels];
+  // Level visited by the round-robin, and whether its quantum was credited on this visit.
+  int current_priority_;
+  bool is_quantum_credited_;
+
+  uint32_t rate_cap_[P2PPriority::kNumLevels];
+  // Bytes that each capped level can send right away. Negative after sending more than
+  // allowed, as packets are charged the encoded bytes actually written.
+  int tokens_[P2PPriority::kNumLevels];
+  // Time up to which the tokens have been added.
+  uint64_t refill_timestamp_ns_[P2PPriority::kNumLevels];
+};
+
+#endif  // P2P_OUTPUT_SCHEDULER_
@@ -28,12 +28,33 @@
 // this avoids the ambiguity between a content symbol equal to the start token and an actual packet with
 // a length equal to the special token.
 //
+// Framing
+// -------
+// The escaping above is the default framing, which all ends support. It may double the length of
+// the content on the wire (e.g. when floats contain many token bytes), so packets can optionally
+// use Consistent Overhead Byte Stuffing (COBS) instead, which adds one byte per block of up to 254
+// content bytes (a single one for any content up to kP2PMaxContentLength).
+//
+// COBS removes the start token from the content: it splits the content at every byte matching the
+// start token, which is dropped, and sends each block of bytes in between preceded by a block code.
+// As in regular COBS, the block code is the block length plus one, but XOR'ed with the start token
+// so that it cannot match it. A block code for 254 bytes does not imply a dropped start token after
+// the block. The special token has no meaning in COBS content. As the decoded length is known from
+// the header, no trailing block is needed when the content ends with a start token.
+//
+// The is_cobs flag in the header indicates the framing of each packet. A preempted packet restarts
+// with a new block after its continuation header, so both ends only keep the state of the current
+// block. An end sends COBS packets only after the other end announced it can receive them in its
+// handshake request. Handshake packets always use the escaped framing.
+//
 // Data integrity
 // --------------
-// The protocol maximizes packet integrity with length and checksum fields.
+// The protocol maximizes packet integrity with length and checksum fields. Both refer to the
+// decoded content (without the special tokens added for synchronization), so that packets can
+// be encoded while they are transmitted and decoded while they are received, in one pass.
 //
 // As a non-content field, the checksum cannot match either token, and so we must compute it as:
-// checksum  = modulo(sum(content_bytes) + sum(header_bytes) - start_token, M)
+// checksum  = modulo(sum(decoded_content_bytes) + sum(header_bytes) - start_token, M)
 //   where M < min(start_token, special_token)
 // And, so, we pay a price in error detection power; especially, if we have to optimize the modulo
 // operation by choosing an M that is a power of 2. In that situation, however, we have a wider range
@@ -50,15 +71,51 @@
 // Guaranteed delivery
 // -------------------
 // If a packet is marked as reliable (requires_ack=1), the sender will peridically re-send it until
-// an acknowledge (is_ack == 1) from the other end is received. While waiting for an ACK for a
-// packet with priority P, packets with priority P-1 will still go throught the link, but packets
-// whose priority is >= P, will be blocked.
+// an acknowledge (is_ack == 1) from the other end is received. The sender may have a window of
+// several reliable packets per priority in flight; once all of them are sent, it waits for the
+// ACK of the oldest one. If the ACK does not arrive before a retransmission timeout, it goes back
+// to the oldest one and re-sends them in order. The timeout is estimated from the round-trip times
+// of previous packets, and doubles after every retransmission. While waiting for ACKs for packets
+// with priority P, packets with any other priority will still go throught the link, but other
+// packets with priority P will be blocked.
+//
+// Reliable packets have their own sequence numbers, separate from those of best-effort packets:
+// they are numbered contiguously from 0 at the start of the session of every priority. The receiver
+// only accepts the reliable packet following the last one it received in order, and ACKs are
+// cumulative: an ACK acknowledges all reliable packets up to its sequence number. Duplicates and
+// packets after a missing one are discarded, and the last packet received in order is acknowledged
+// again. Handshake packets are acknowledged individually, and no other reliable packet of their
+// priority is sent until they are acknowledged.
+//
+// If the receiver gets the reliable packet it expects with a valid header, but corrupted content,
+// it replies with a negative ACK (NACK): an ACK packet with the sequence number of the corrupted
+// packet, and a single content byte equal to kP2PNegativeACK. It acknowledges all the packets
+// before it, and the sender goes back to the corrupted packet right away, without waiting for
+// the retransmission timeout.
+//
+// To save packets, cumulative ACKs are carried by the data packets going to the other end, as a
+// P2PPiggybackedACK after the content, if the data packet has the same or a higher priority than
+// the packets acknowledged. If no data packet is sent within a short holdoff, the ACK is sent in
+// its own ACK packet. Handshake ACKs and NACKs are always sent in their own packets.
 //
 // ACK packets should have the priority of the original packet minus 1. This is to prevent a
 // deadlock when the two ends send reliable packets of the same priority at the same time.
 // In that case, each end will put one packet in its send queue and will wait for an ACK to remove
 // it from the queue, but that will never happen because the other end will put the ACK in the
 // send queue too, which will be blocked by the other packet waiting to be acknowledged. 
+//
+// Flow control
+// ------------
+// Cumulative ACKs, piggybacked or in their own packets, carry the credit of the receiver
+// (P2PCredit): the number of bytes after the last byte of the acknowledged packet that the
+// receiver can take without overflowing its byte stream's receive buffer, and the number of
+// packets of the acknowledged priority that it can store. The sender keeps sending as long as
+// it has byte credit, and limits its window of reliable packets to the packet credit.
+// Without credit, e.g. when the last one is used up and no ACK has arrived yet, or if the other
+// end does not advertise it, the sender paces its bursts with the ingestion time that its byte
+// stream assumes for the other end.
+// Positive ACK packets with credit have kP2PPositiveACK as their first content byte, followed by
+// the P2PCredit.
 
 #ifndef P2P_PROTOCOL__
 #define P2P_PROTOCOL__
@@ -96,8 +153,23 @@
 #define kSequenceNumberNumBytes 3
 
 typedef uint8_t P2PChecksumType;
+
+// Content framings. The content of a handshake request is a byte with bit (1 << framing) set
+// for every framing that the sender can receive, other than kEscapedFraming, which all ends can
+// receive.
+typedef enum {
+  kEscapedFraming = 0,
+  kCOBSFraming
+} P2PFraming;
 typedef PackedInteger<kSequenceNumberNumBytes, kP2PLowestToken> P2PSequenceNumberType;
 
+// Kinds of ACK packets. ACK packets without content are positive; others have their kind as the
+// first content byte, followed by a P2PCredit in positive ACKs.
+typedef enum {
+  kP2PPositiveACK = 0,
+  kP2PNegativeACK
+} P2PACKKind;
+
 #pragma pack(push, 1)
 
 typedef struct {
@@ -119,30 +191,57 @@ typedef struct {
   // 0 = no acknowledge needed, 1 = the packet must be acknowledged.
   uint8_t requires_ack: 1;
 
-  // 0 = Data packet (data follows), 1 = ACK packet (no data follows).
+  // 0 = Data packet (data follows), 1 = ACK packet (no data follows, except the kind of NACKs).
   uint8_t is_ack: 1;
 
   // 0 = regular packet, 1 = first packet after program restarts (all packets from the other 
   // end received before the init's ACK should be discarded).
   uint8_t is_init: 1;
 
-  // The reserved field must not match the corresponding bits in either token.
-  uint8_t reserved: 2;
+  // 0 = escaped framing, 1 = COBS framing of the content (see Framing above).
+  uint8_t is_cobs: 1;
+
+  // 0 = no ACK, 1 = a P2PPiggybackedACK follows the content (see Guaranteed delivery above).
+  // Only data packets other than handshake requests carry ACKs, so that this byte can never
+  // match either token (which would require is_ack or is_init).
+  uint8_t has_ack: 1;
 
   // The sequence number increments monotonically with each data packet. Each priority
-  // level has its own sequence number. It is used to pair every continuation and ACK with
-  // the original packet.
+  // level has its own sequence numbers for reliable and best-effort packets (see Guaranteed
+  // delivery above). It is used to pair every continuation and ACK with the original packet.
   // No byte in this field can match a token, so the total representable values is
   // kP2PLowestToken^kSequenceNumberNumBytes
   // It is little-endian.
   P2PSequenceNumberType sequence_number;
 
-  // Number of content bytes, including special characters. Cannot match any token.
+  // Number of decoded content bytes, excluding the special tokens added by the encoding. 
+  // Cannot match any token.
   uint8_t length;
 } P2PHeader;
 
+// Credit advertised by the receiver of reliable packets with its ACKs (see Flow control above).
+// Fields are in network order.
+typedef struct {
+  // Number of bytes after the last byte of the acknowledged packet that can be sent, or 0 if
+  // the receiver does not advertise credit.
+  uint16_t num_bytes;
+  // Number of packets with the priority of the acknowledged packets that the receiver can
+  // store.
+  uint8_t num_packets;
+} P2PCredit;
+
+// ACK carried by a data packet. It is appended to the content, and it is included in the length
+// and checksum.
+typedef struct {
+  // Priority of the packets acknowledged.
+  uint8_t priority;
+  // Sequence number of the last packet acknowledged, as in ACK packets.
+  P2PSequenceNumberType sequence_number;
+  P2PCredit credit;
+} P2PPiggybackedACK;
+
 typedef struct {
-  // checksum  = modulo(sum(content_bytes) + sum(header_bytes) - kP2PStartToken, kP2PChecksumModulo)
+  // checksum  = modulo(sum(decoded_content_bytes) + sum(header_bytes) - kP2PStartToken, kP2PChecksumModulo)
   // It can't match any token.
   P2PChecksumType checksum;
 } P2PFooter;
@@ -5,14 +5,78 @@
 #ifndef P2P_PACKET_STREAM_
 #define P2P_PACKET_STREAM_
 
+#include <algorithm>
 #include "p2p_packet_protocol.h"
+#include "p2p_codec.h"
+#include "p2p_link_stats.h"
 #include "p2p_byte_stream_interface.h"
-#include "priority_ring_buffer.h"
+#include "priority_slab.h"
+#include "spsc_ring_buffer.h"
 #include "status_or.h"
 #include "timer_interface.h"
 #include "guid_factory_interface.h"
 #include "logger_interface.h"
 
+// Maximum number of bytes that P2PPacketInputStream::Run() pulls from the byte stream with
+// a single Read(). Reading in blocks amortizes the cost of the platform's read calls (e.g. a
+// system call per Read() on Linux).
+#define kP2PInputStagingBufferLength 64
+
+// Maximum number of encoded bytes that P2PPacketOutputStream::Run() prepares for a single
+// Write(). The actual number is also bounded by the byte stream's atomic send length.
+#define kP2POutputStagingBufferLength 16
+
+// Default maximum number of reliable packets per priority that P2PPacketOutputStream sends
+// before the oldest one is acknowledged. It is bounded by the stream capacity.
+#define kP2PDefaultWindowSize 4
+
+// Bounds of the time that P2PPacketOutputStream waits for the ACK of a reliable packet before
+// sending it again. The timeout is estimated from the round-trip times of previous packets
+// with the same priority, and it is the initial one until there is a first estimate.
+// The timeout doubles after every retransmission, up to the maximum, until a new estimate.
+#define kP2PInitialRetransmissionTimeoutNs 100000000ULL
+#define kP2PMinRetransmissionTimeoutNs 2000000ULL
+#define kP2PMaxRetransmissionTimeoutNs 1000000000ULL
+
+// Maximum time that a cumulative ACK waits for a data packet to carry it, before it is sent in
+// its own ACK packet.
+#define kP2PACKHoldoffNs 1000000ULL
+
+// Number of bytes that a packet may need after its content: a piggybacked ACK in data packets,
+// or the credit in ACK packets.
+#define kP2PPacketTailroomLength static_cast<int>(std::max(sizeof(P2PPiggybackedACK), 1 + sizeof(P2PCredit)))
+
+// Number of bytes that the packet queues reserve for each packet on average. Packets only take
+// the bytes that they use, so queues fit more short packets than long ones. Each priority also
+// has room for one full-size packet of its own, which is the space that a packet takes until
+// it is complete (see PrioritySlab).
+#define kP2PPacketQueueBytesPerPacket 64
+
+// Number of bytes of the queues of the packet streams with `capacity`.
+#define kP2PPacketQueueLength(capacity) static_cast<int>(P2PPriority::kNumLevels * ((capacity) - 1) * kP2PPacketQueueBytesPerPacket)
+
+// Number of bytes of the shared queues of P2PPacketStream that are kept for each priority of
+// the input, and for the ACKs of kHigh packets in the output. A new packet of any priority
+// always has room (see PrioritySlab), but a committed packet keeps that room taken until it is
+// consumed, unless it fits in the shared queues. The reservations keep room there, so that
+// bursts of other packets never leave these priorities with a single packet at a time.
+#define kP2PPacketQueueReservationLength static_cast<int>(sizeof(P2PPacket))
+
+// Number of events that the input half of P2PPacketStream can post to the output half (ACKs
+// received, ACKs to send...), before the output half applies them in its next Run(). It must
+// be a power of two. A received packet posts up to kP2PMaxControlEventsPerPacket events, and
+// it is rejected without room for them, as if it was lost.
+#define kP2PControlMailboxCapacity 32
+#define kP2PMaxControlEventsPerPacket 3
+
+// Returns true if sequence number `a` was assigned after `b`, considering that sequence
+// numbers wrap around.
+inline bool P2PSequenceNumberIsAfter(uint64_t a, uint64_t b) {
+  const uint64_t period = P2PSequenceNumberType::NumValues();
+  const uint64_t distance = (a % period + period - b % period) % period;
+  return distance > 0 && distance < period / 2;
+}
+
 // Represents the priority of a packet.
 // The higher the priority, the lower the latency, as higher priority packets
 // preempt lower priority ones in both the transmitter and receiver.
@@ -39,6 +103,8 @@ private:
 };
 
 // A maximum-length P2P packet with convenience accessors.
+// The content is always stored decoded: the streams encode it while transmitting, and decode
+// it while receiving.
 class P2PPacket {
 public:
   P2PPacket() : commit_time_ns_(-1ULL) {
@@ -51,8 +117,8 @@ public:
   uint8_t length() const { return data_.header.length; }
   uint8_t &length() { return data_.header.length; }
 
-  const uint8_t *content() const { return data_.content_and_footer; }
-  uint8_t *content() { return data_.content_and_footer; }
+  const uint8_t *content() const { return data_.content; }
+  uint8_t *content() { return data_.content; }
 
   const P2PSequenceNumberType &sequence_number() const { 
     return data_.header.sequence_number;
@@ -61,18 +127,16 @@ public:
     return data_.header.sequence_number;
   }
 
-  // Decodes the content in place and updates the length accordingly. 
-  // Returns true if success, or false if error.
-  // An error will occur if the encoded content is malformed.
-  bool PrepareToRead();
-
-  // Encodes the content in place and updates the length and checksum accordingly.
-  // Returns true if success, or false if error.
-  // An error will occur if the encoded content surpasses the maximum content length. 
-  bool PrepareToSend();
+  // ACK carried after the content, if header()->has_ack. Received packets do not count it in
+  // their length.
+  const P2PPiggybackedACK *piggybacked_ack() const {
+    return reinterpret_cast<const P2PPiggybackedACK *>(&data_.content[data_.header.length]);
+  }
 
-  P2PChecksumType checksum() const { return *reinterpret_cast<const P2PChecksumType *>(&data_.content_and_footer[length() + offsetof(P2PFooter, checksum)]); }
-  P2PChecksumType &checksum() { return *reinterpret_cast<P2PChecksumType *>(&data_.content_and_footer[length() + offsetof(P2PFooter, checksum)]); }
+  // Returns the checksum of the header, which is the initial value of the packet checksum
+  // before the content bytes are accumulated. The header must be the original header of the
+  // packet, not that of a continuation.
+  P2PChecksumType HeaderChecksum() const;
 
   uint64_t &commit_time_ns() { return commit_time_ns_; }
   uint64_t commit_time_ns() const { return commit_time_ns_; }
@@ -80,29 +144,47 @@ public:
   bool &counted_in_stats() { return counted_in_stats_; };
   bool counted_in_stats() const { return counted_in_stats_; };
 
-protected:
-  P2PChecksumType CalculateChecksum() const; 
+  // Time at which the last byte of the packet was last sent, and number of times that it has
+  // been fully sent. Used to time retransmissions of reliable packets.
+  uint64_t &send_time_ns() { return send_time_ns_; }
+  uint64_t send_time_ns() const { return send_time_ns_; }
+  uint8_t &num_transmissions() { return num_transmissions_; }
+  uint8_t num_transmissions() const { return num_transmissions_; }
+
+  // Number of bytes that the output stream had sent when the last byte of the packet was last
+  // sent. Used to apply the credit advertised by the other end with the packet's ACK.
+  uint64_t &send_end_byte_count() { return send_end_byte_count_; }
+  uint64_t send_end_byte_count() const { return send_end_byte_count_; }
+
+  // Number of bytes of the object taken by the metadata, the header and the content, plus
+  // room for the ACK or the credit that may follow the content. Queued packets only keep
+  // these bytes (see PrioritySlab).
+  int StorageLength() const {
+    return static_cast<int>(&data_.content[length()] - reinterpret_cast<const uint8_t *>(this)) + kP2PPacketTailroomLength;
+  }
 
 private:
+  // The metadata goes before data_, so that the unused content at the end can be left out.
+  uint64_t commit_time_ns_;
+  uint64_t send_time_ns_;
+  uint64_t send_end_byte_count_;
+  bool counted_in_stats_;
+  uint8_t num_transmissions_;
+
 #pragma pack(push, 1)
   struct {
     P2PHeader header;
-    uint8_t content_and_footer[kP2PMaxContentLength + sizeof(P2PFooter)];
+    uint8_t content[kP2PMaxContentLength];
   } data_;
-  // __attribute__ ((aligned (4)));  // Aligning the memory ensures that we can access it as a byte array.
 #pragma pack(pop)
-
-  // Attention: keep all metadata under data_ to not mess with data_'s alignment. Otherwise,
-  // you may get lost packets. I have not been able to prevent that with compiler attributes so far.
-  uint64_t commit_time_ns_;
-  bool counted_in_stats_;
 };
 
 // A mutable view to a packet's content.
 // Mutating the view is mutating the associated packet.
 class P2PMutablePacketView {
   friend class P2PPacketView;
-  template<int IC, int OC, Endianness LE> friend class P2PPacketStream;
+  template<int C, Endianness LE, typename BS> friend class P2PPacketOutputStream;
+  template<int IC, int OC, Endianness LE, typename BS> friend class P2PPacketStream;
 public:
   // Does not take ownership of the packet, which must outlive this object.
   P2PMutablePacketView(P2PPacket *packet) : packet_(packet) {}
@@ -140,7 +222,7 @@ private:
 
 // An immutable view to a packet.
 class P2PPacketView {
-  template<int IC, int OC, Endianness LE> friend class P2PPacketStream;
+  template<int IC, int OC, Endianness LE, typename BS> friend class P2PPacketStream;
 public:
   // Does not take ownership of the packet, which must outlive this object.
   P2PPacketView(const P2PPacket *packet) : packet_(packet) {}
@@ -215,6 +297,99 @@ public:
   }
 };
 
+class P2PPacketCorruptedCallback : public P2PCallback<void (*)(const P2PPacket &, void *), void *> {
+public:
+  P2PPacketCorruptedCallback() : P2PCallback<void (*)(const P2PPacket &, void *), void *>() {}
+  P2PPacketCorruptedCallback(void (*fn)(const P2PPacket &, void *), void *args) 
+    : P2PCallback<void (*)(const P2PPacket &, void *), void *>(fn, args) {}
+
+  void operator()(const P2PPacket &p) {
+    if (function() != NULL) {
+      function()(p, arg());
+    }
+  }
+};
+
+class P2PPacketReleasedCallback : public P2PCallback<void (*)(const P2PPacket &, void *), void *> {
+public:
+  P2PPacketReleasedCallback() : P2PCallback<void (*)(const P2PPacket &, void *), void *>() {}
+  P2PPacketReleasedCallback(void (*fn)(const P2PPacket &, void *), void *args) 
+    : P2PCallback<void (*)(const P2PPacket &, void *), void *>(fn, args) {}
+
+  void operator()(const P2PPacket &p) {
+    if (function() != NULL) {
+      function()(p, arg());
+    }
+  }
+};
+
+class P2PCreditCallback : public P2PCallback<bool (*)(int, P2PCredit *, void *), void *> {
+public:
+  P2PCreditCallback() : P2PCallback<bool (*)(int, P2PCredit *, void *), void *>() {}
+  P2PCreditCallback(bool (*fn)(int, P2PCredit *, void *), void *args) 
+    : P2PCallback<bool (*)(int, P2PCredit *, void *), void *>(fn, args) {}
+
+  // Returns false if there is no credit to advertise.
+  bool operator()(int priority, P2PCredit *credit) {
+    if (function() == NULL) {
+      return false;
+    }
+    return function()(priority, credit, arg());
+  }
+};
+
+// Called with `is_congested` true when the output queue of `priority` rises to its high
+// watermark, and false when it falls back to its low watermark.
+class P2PQueueWatermarkCallback : public P2PCallback<void (*)(int, bool, void *), void *> {
+public:
+  P2PQueueWatermarkCallback() : P2PCallback<void (*)(int, bool, void *), void *>() {}
+  P2PQueueWatermarkCallback(void (*fn)(int, bool, void *), void *args) 
+    : P2PCallback<void (*)(int, bool, void *), void *>(fn, args) {}
+};
+
+class P2PRunCallback : public P2PCallback<void (*)(void *), void *> {
+public:
+  P2PRunCallback() : P2PCallback<void (*)(void *), void *>() {}
+  P2PRunCallback(void (*fn)(void *), void *args) 
+    : P2PCallback<void (*)(void *), void *>(fn, args) {}
+
+  void operator()() {
+    if (function() != NULL) {
+      function()(arg());
+    }
+  }
+};
+
+// Decides which priority level P2PPacketOutputStream sends a packet of next, and which levels
+// can interrupt the packet being sent.
+class P2POutputSchedulerInterface {
+public:
+  // Returns the priority of the next packet to send, or -1 to send none for now.
+  // `has_packet` tells the priorities with a packet ready to be sent, and `packet_lengths` the
+  // number of bytes of those packets, including header and footer. Both have
+  // P2PPriority::kNumLevels elements.
+  virtual int SelectPriority(const bool *has_packet, const int *packet_lengths, uint64_t timestamp_ns) = 0;
+
+  // Returns true if a packet with `priority` can preempt a packet with `current_priority` that
+  // is being sent.
+  virtual bool CanPreempt(int priority, int current_priority) const = 0;
+
+  // Called when `num_bytes` of a packet with `priority` are written to the byte stream.
+  virtual void OnBytesSent(int, int, uint64_t) {}
+
+  // Returns the time until a packet with `priority` and `packet_length` bytes could be selected,
+  // if it was not selected for other reasons than higher priority packets (e.g. rate limits).
+  virtual uint64_t TimeUntilEligibleNs(int, int, uint64_t) const { return 0; }
+};
+
+// Serves the highest priority level with a packet ready, and lets any higher priority level
+// preempt lower ones. It is the default scheduler of P2PPacketOutputStream.
+class P2PStrictPriorityScheduler : public P2POutputSchedulerInterface {
+public:
+  virtual int SelectPriority(const bool *has_packet, const int *packet_lengths, uint64_t timestamp_ns);
+  virtual bool CanPreempt(int priority, int current_priority) const { return priority < current_priority; }
+};
+
 // Represents a buffered input stream of best-effort packets with priorities. 
 // Higher-priority packets are received and delivered to the caller earlier than lower-priority 
 // ones thanks to a preemption and continuation mechanism.
@@ -222,13 +397,17 @@ public:
 // if the caller cannot consume the packets fast enough.
 // This stream does not send any information to the other end. Any signaling to the other end
 // must be handled by the caller with an output stream.
-template<int kCapacity, Endianness LocalEndianness> class P2PPacketInputStream {
-  template<int IC, int OC, Endianness LE> friend class P2PPacketStream;
+// ByteStream is the type of the byte stream. When it is the platform's final implementation
+// instead of P2PByteStreamInterface, the calls to it are resolved at compile time, and can be
+// inlined, instead of going through the vtable for every few bytes.
+template<int kCapacity, Endianness LocalEndianness, typename ByteStream = P2PByteStreamInterface<LocalEndianness>> class P2PPacketInputStream {
+  template<int IC, int OC, Endianness LE, typename BS> friend class P2PPacketStream;
 public:
   // Does not take ownership of the byte stream or timer, which must outlive this object.
   // Only one packet stream can be associated to each byte stream at a time.
-  P2PPacketInputStream(P2PByteStreamInterface<LocalEndianness> *byte_stream, TimerInterface *timer)
-    : byte_stream_(*byte_stream), timer_(*timer) {
+  P2PPacketInputStream(ByteStream *byte_stream, TimerInterface *timer)
+    : byte_stream_(*byte_stream), timer_(*timer), read_block_length_(kP2PInputStagingBufferLength),
+      num_received_bytes_(0), is_byte_stream_drained_(true) {
       Reset();
     }
 
@@ -236,7 +415,19 @@ public:
   void Reset();
 
   // Returns the number of times that Consume() can be called without OldestPacket() returning NULL.
-  int NumAvailablePackets(P2PPriority priority) const { return packet_buffer_[priority].Size(); }
+  int NumAvailablePackets(P2PPriority priority) const { return packet_buffer_.Size(priority); }
+
+  // Returns the number of packets with `priority` that can be received before the oldest ones
+  // are discarded.
+  int NumAvailableSlots(P2PPriority priority) const { return packet_buffer_.NumAvailableSlots(priority); }
+
+  // Sets the maximum number of bytes that the queued packets with `priority` can take.
+  void queue_quota(P2PPriority priority, int num_bytes) { packet_buffer_.quota(priority, num_bytes); }
+  int queue_quota(P2PPriority priority) const { return packet_buffer_.quota(priority); }
+
+  // Sets the number of bytes of the queues that are kept for packets with `priority`.
+  void queue_reservation(P2PPriority priority, int num_bytes) { packet_buffer_.reservation(priority, num_bytes); }
+  int queue_reservation(P2PPriority priority) const { return packet_buffer_.reservation(priority); }
 
   // Returns a view to the oldest packet in the stream, or kUnavailableError if empty.
   StatusOr<const P2PPacketView> OldestPacket();
@@ -249,6 +440,29 @@ public:
   void packet_filter(const P2PPacketFilter &filter) { packet_filter_ = filter; }
   const P2PPacketFilter &packet_filter() { return packet_filter_; }
 
+  // Sets a callback that's called with every packet whose header was valid, but whose content
+  // was corrupted. Only the header of the packet passed to the callback can be trusted.
+  void packet_corrupted_callback(const P2PPacketCorruptedCallback &callback) { packet_corrupted_callback_ = callback; }
+  P2PPacketCorruptedCallback packet_corrupted_callback() const { return packet_corrupted_callback_; }
+
+  // Sets the maximum number of bytes that Run() reads from the byte stream at once.
+  // It is clamped to [1, kP2PInputStagingBufferLength]. With 1, Run() processes one byte per
+  // call; otherwise, it processes all available bytes up to the block length.
+  void read_block_length(int length) { read_block_length_ = std::max(1, std::min(length, kP2PInputStagingBufferLength)); }
+  int read_block_length() const { return read_block_length_; }
+
+  // Number of bytes read from the byte stream and processed since the stream was created.
+  // Within the packet filter, it includes the last byte of the filtered packet.
+  uint64_t num_received_bytes() const { return num_received_bytes_; }
+
+  // True if the last Run() read all the bytes available in the byte stream.
+  bool is_byte_stream_drained() const { return is_byte_stream_drained_; }
+
+  // Sets a callback that's called at the end of every Run(), after the bytes read have been
+  // processed.
+  void run_callback(const P2PRunCallback &callback) { run_callback_ = callback; }
+  P2PRunCallback run_callback() const { return run_callback_; }
+
   // Runs the stream logic. Must be called from a run loop continuously, or when there is
   // data available in the byte stream. Returns the number of bytes read and processed.
   int Run();
@@ -257,11 +471,15 @@ public:
   class Stats {
     friend class P2PPacketInputStream;
   public:
-    Stats() { 
+    Stats() : total_resyncs_(0) { 
       for (int i = 0; i < P2PPriority::kNumLevels; ++i) { 
         total_packets_[i] = 0;
         total_packet_delay_ns_[i] = 0;
         total_packet_delay_per_byte_ns_[i] = 0;
+        total_dropped_packets_[i] = 0;
+        total_checksum_errors_[i] = 0;
+        total_malformed_continuations_[i] = 0;
+        queue_high_watermark_[i] = 0;
       }
     }
     
@@ -282,24 +500,98 @@ public:
       return total_packets_[priority] > 0 ? total_packet_delay_per_byte_ns_[priority] / total_packets_[priority] : -1;
     }
 
+    // Distribution of the same delays as average_packet_delay_ns().
+    const P2PLatencyHistogram &packet_delay_histogram(P2PPriority priority) const { return packet_delay_histogram_[priority]; }
+
+    // Packets received without space for them in the queue, or evicted from the queue to make
+    // room for a reliable packet.
+    uint64_t total_dropped_packets(P2PPriority priority) const { return total_dropped_packets_[priority]; }
+
+    // Packets received with a wrong checksum or undecodable content.
+    uint64_t total_checksum_errors(P2PPriority priority) const { return total_checksum_errors_[priority]; }
+
+    // Continuations that do not continue the interrupted packet where it was left off.
+    uint64_t total_malformed_continuations(P2PPriority priority) const { return total_malformed_continuations_[priority]; }
+
+    // Times that the reception of a header or footer was broken by an unexpected token or an
+    // invalid header, so that the stream had to synchronize with the next packet.
+    uint64_t total_resyncs() const { return total_resyncs_; }
+
+    // Maximum number of packets that have been waiting in the queue at once.
+    int queue_high_watermark(P2PPriority priority) const { return queue_high_watermark_[priority]; }
+
+    // Packets and bytes received per second over the last window of kP2PStatsRateWindowNs.
+    uint64_t packets_per_second() const { return packet_rate_.rate_per_second(); }
+    uint64_t bytes_per_second() const { return byte_rate_.rate_per_second(); }
+
     private:
       uint64_t total_packets_[P2PPriority::kNumLevels];
       uint64_t total_packet_delay_ns_[P2PPriority::kNumLevels];
       uint64_t total_packet_delay_per_byte_ns_[P2PPriority::kNumLevels];
+      P2PLatencyHistogram packet_delay_histogram_[P2PPriority::kNumLevels];
+      uint64_t total_dropped_packets_[P2PPriority::kNumLevels];
+      uint64_t total_checksum_errors_[P2PPriority::kNumLevels];
+      uint64_t total_malformed_continuations_[P2PPriority::kNumLevels];
+      uint64_t total_resyncs_;
+      int queue_high_watermark_[P2PPriority::kNumLevels];
+      P2PRateMeter packet_rate_;
+      P2PRateMeter byte_rate_;
   };
 
   const Stats &stats() const { return stats_; }
 
 private:
-  PriorityRingBuffer<P2PPacket, kCapacity, P2PPriority> packet_buffer_;
-  P2PByteStreamInterface<LocalEndianness> &byte_stream_;
+  // Advances the reception state machine with the next byte from the link.
+  void ProcessByte(uint8_t byte);
+
+  // Sets up the reception of the content after a full header has been received.
+  void ProcessHeader();
+
+  // Stores a decoded content byte of the incoming packet and accumulates it in the checksum.
+  void AppendContentByte(uint8_t byte);
+
+  // Stores the longest run of content bytes without tokens at the start of `bytes`, up to
+  // the end of the incoming packet's content, and returns its length.
+  int AppendContentRun(const uint8_t *bytes, int length);
+
+  // Stores the bytes at the start of `bytes` that belong to the current COBS block, up to the
+  // first start token, and returns their number. Finishes the block if it is complete.
+  int AppendCOBSBlockBytes(const uint8_t *bytes, int length);
+
+  // Restores the start token that delimited the COBS block just received, if any, and sets up
+  // the reception of the next block or the footer.
+  void FinishCOBSBlock();
+
+  // Restarts the state machine with a start token received in the middle of a packet. 
+  void RestartWithStartToken();
+
+  // Discards the incoming packet, whose content is malformed, so that it cannot be continued.
+  void DiscardCorruptedPacket();
+
+  // Drops the packet being received and waits for the next one, after a header or footer
+  // broken by link errors.
+  void Resync();
+
+  PrioritySlab<P2PPacket, kCapacity, kP2PPacketQueueLength(kCapacity), P2PPriority> packet_buffer_;
+  ByteStream &byte_stream_;
   TimerInterface &timer_;
+  int read_block_length_;
+  uint64_t num_received_bytes_;
+  bool is_byte_stream_drained_;
   unsigned int current_field_read_bytes_;
-  enum State { kWaitingForPacket, kReadingHeader, kReadingContent, kDisambiguatingStartTokenInContent, kReadingFooter } state_;
+  enum State { kWaitingForPacket, kReadingHeader, kReadingContent, kDisambiguatingStartTokenInContent, kReadingEscapedSpecialToken, kReadingCOBSBlockCode, kReadingCOBSBlock, kReadingFooter } state_;
   P2PHeader incoming_header_;
   P2PPacket *incoming_packet_[P2PPriority::kNumLevels];
   P2PPacketFilter packet_filter_;
+  P2PPacketCorruptedCallback packet_corrupted_callback_;
+  P2PRunCallback run_callback_;
+  // Number of decoded content bytes received before a packet was interrupted.
   uint8_t write_offset_before_break_[P2PPriority::kNumLevels];
+  // Checksum accumulated over the header and the content bytes decoded so far.
+  P2PChecksumType checksum_[P2PPriority::kNumLevels];
+  // Length and number of bytes left to receive of the current COBS block.
+  int cobs_block_length_;
+  int cobs_block_pending_bytes_;
   uint64_t current_sequence_number_[P2PPriority::kNumLevels];
   P2PPacket discarded_packet_placeholder_;
 
@@ -311,13 +603,17 @@ private:
 // thanks to a preemption and continuation mechanism.
 // This stream does not receive any information from the other end.
 // Any signaling from the other end must be handled by the caller with an input stream.
-template<int kCapacity, Endianness LocalEndianness> class P2PPacketOutputStream {
-  template<int IC, int OC, Endianness LE> friend class P2PPacketStream;
+// ByteStream is the type of the byte stream, as in P2PPacketInputStream. The link constants
+// of final implementations that define them inline, e.g. GetAtomicSendMaxLength(), are
+// folded into the state machine.
+template<int kCapacity, Endianness LocalEndianness, typename ByteStream = P2PByteStreamInterface<LocalEndianness>> class P2PPacketOutputStream {
+  template<int IC, int OC, Endianness LE, typename BS> friend class P2PPacketStream;
 public:
   // Does not take ownership of the byte stream or timer, which must outlive this object.
   // Only one packet stream can be associated to each byte stream at a time.
-  P2PPacketOutputStream(P2PByteStreamInterface<LocalEndianness> *byte_stream, TimerInterface *timer)
-    : byte_stream_(*byte_stream), timer_(*timer) {
+  P2PPacketOutputStream(ByteStream *byte_stream, TimerInterface *timer)
+    : byte_stream_(*byte_stream), timer_(*timer), window_size_(std::min(kP2PDefaultWindowSize, kCapacity - 1)), framing_(kEscapedFraming),
+      num_sent_bytes_(0), credit_limit_byte_count_(0), scheduler_(&strict_priority_scheduler_) {
       Reset();
     }
 
@@ -329,6 +625,14 @@ public:
     return packet_buffer_.NumAvailableSlots(priority);
   }
 
+  // Sets the maximum number of bytes that the queued packets with `priority` can take.
+  void queue_quota(P2PPriority priority, int num_bytes) { packet_buffer_.quota(priority, num_bytes); }
+  int queue_quota(P2PPriority priority) const { return packet_buffer_.quota(priority); }
+
+  // Sets the number of bytes of the queues that are kept for packets with `priority`.
+  void queue_reservation(P2PPriority priority, int num_bytes) { packet_buffer_.reservation(priority, num_bytes); }
+  int queue_reservation(P2PPriority priority) const { return packet_buffer_.reservation(priority); }
+
   // Returns the number of committed packets waiting to be sent for a given priority.
   int NumCommittedPackets(P2PPriority priority) const {
     return packet_buffer_.Size(priority);
@@ -346,25 +650,83 @@ public:
   // and NewPacket() returns a different view.
   // If `guarantee_delivery` is true, the packet will be retransmitted until the other end 
   // acknowledges its reception. Use it with care because, in the meantime, the transmission of other 
-  // output packets with the same or lower priority will be put on hold. Take this especially into 
-  // account if a long disruption in the other end's reception is expected (e.g. a delay in calling
-  // the communication handling code or a link disconnection). In that case, the lower or equal
-  // priority levels in the output queue could quickly fill up if there are processeses transmitting
-  // periodically.
+  // output packets with the same priority will be put on hold once the window is full. Lower
+  // priority packets are sent while waiting for the ACK, until the retransmission timeout
+  // expires. Take this especially into account if a long disruption in the other end's reception
+  // is expected (e.g. a delay in calling the communication handling code or a link
+  // disconnection). In that case, the priority level in the output queue could quickly fill up if
+  // there are processeses transmitting periodically.
   bool Commit(P2PPriority priority, bool guarantee_delivery, uint64_t seq_number = -1ULL);
 
   P2PPacketCommittedCallback packet_committed_callback() const { return packet_committed_callback_; }
   void packet_committed_callback(const P2PPacketCommittedCallback &callback) { packet_committed_callback_ = callback; }
 
+  // Sets a callback that's called when a packet leaves the stream for good: after it is sent,
+  // or after it is acknowledged if its delivery is guaranteed. It is not called for the packets
+  // discarded by Reset().
+  P2PPacketReleasedCallback packet_released_callback() const { return packet_released_callback_; }
+  void packet_released_callback(const P2PPacketReleasedCallback &callback) { packet_released_callback_ = callback; }
+
   // Not all platforms support lambdas.
   void packet_filter(const P2PPacketFilter &filter) { packet_filter_ = filter; }
   const P2PPacketFilter &packet_filter() { return packet_filter_; }
 
-  // Runs the stream and returns the minimum number of microseconds the caller may wait
+  // Sets a callback that fills the credit advertised with the ACKs of the packets received with
+  // a given priority, when they are sent (see Flow control in p2p_packet_protocol.h).
+  void credit_callback(const P2PCreditCallback &callback) { credit_callback_ = callback; }
+  P2PCreditCallback credit_callback() const { return credit_callback_; }
+
+  // Sets a callback that's called at the start of every Run(), before the next packet to send
+  // is chosen.
+  void run_callback(const P2PRunCallback &callback) { run_callback_ = callback; }
+  P2PRunCallback run_callback() const { return run_callback_; }
+
+  // Sets the number of committed packets of `priority` at which its queue becomes congested,
+  // `high`, and the number at which it stops being congested, `low`. Producers of best-effort
+  // packets can hold them back while the queue is congested, so that it drains and keeps room
+  // for the rest. By default, queues are never congested.
+  void queue_watermarks(P2PPriority priority, int low, int high) { packet_buffer_.occupancy().watermarks(priority, low, high); }
+  bool is_queue_congested(P2PPriority priority) const { return packet_buffer_.occupancy().is_congested(priority); }
+
+  // Sets a callback that's called when the queue of a priority becomes congested or stops
+  // being so. It is called from Commit() or Run(), as they change the number of packets.
+  void queue_watermark_callback(const P2PQueueWatermarkCallback &callback) {
+    queue_watermark_callback_ = callback;
+    packet_buffer_.occupancy().watermark_callback(callback.function(), callback.arg());
+  }
+  P2PQueueWatermarkCallback queue_watermark_callback() const { return queue_watermark_callback_; }
+
+  // Number of bytes that can be sent before running out of the credit advertised by the
+  // other end. Bursts are paced with the byte stream's ingestion time without credit.
+  uint64_t credit_bytes() const {
+    return credit_limit_byte_count_ > num_sent_bytes_ ? credit_limit_byte_count_ - num_sent_bytes_ : 0;
+  }
+
+  // Maximum number of reliable packets per priority in flight, that is, sent and not
+  // acknowledged yet. It is clamped to [1, kCapacity - 1].
+  int window_size() const { return window_size_; }
+  void window_size(int size) { window_size_ = std::max(1, std::min(size, kCapacity - 1)); }
+
+  // Scheduler that decides which priority level sends next. Does not take ownership of the
+  // scheduler, which must outlive this object. NULL restores the default strict priority
+  // scheduler.
+  void scheduler(P2POutputSchedulerInterface *scheduler) { scheduler_ = scheduler != NULL ? scheduler : &strict_priority_scheduler_; }
+
+  // Framing of the packets sent from now on. Packets in progress keep their framing.
+  // The other end must be able to receive it.
+  P2PFraming framing() const { return framing_; }
+  void framing(P2PFraming framing) { framing_ = framing; }
+
+  // Runs the stream and returns the minimum number of nanoseconds the caller may wait
   // until calling Run() again. Multi-threaded platforms can use this value to yield time
   // to other threads.
   uint64_t Run();
 
+  // True if the last Run() found no packet to send. Then, Run() returns the time until the
+  // next retransmission, ACK or packet allowed by the scheduler, or 0 if there is none, and
+  // the caller may wait for a new packet to be committed.
+  bool is_idle() const { return is_idle_; }
+
   // Transmission statistics.
   class Stats {
     friend class P2PPacketOutputStream;
@@ -375,6 +737,12 @@ public:
       for (int i = 0; i < P2PPriority::kNumLevels; ++i) { total_packet_delay_ns_[i] = 0; }
       for (int i = 0; i < P2PPriority::kNumLevels; ++i) { total_packet_delay_per_byte_ns_[i] = 0; }
       for (int i = 0; i < P2PPriority::kNumLevels; ++i) { total_retransmissions_[i] = 0; }
+      for (int i = 0; i < P2PPriority::kNumLevels; ++i) { smoothed_rtt_ns_[i] = -1ULL; }
+      for (int i = 0; i < P2PPriority::kNumLevels; ++i) { rtt_variance_ns_[i] = -1ULL; }
+      for (int i = 0; i < P2PPriority::kNumLevels; ++i) { retransmission_timeout_ns_[i] = kP2PInitialRetransmissionTimeoutNs; }
+      for (int i = 0; i < P2PPriority::kNumLevels; ++i) { total_rejected_packets_[i] = 0; }
+      for (int i = 0; i < P2PPriority::kNumLevels; ++i) { queue_high_watermark_[i] = 0; }
+      burst_ingestion_ns_per_byte_ = 0;
     }
     
     // Total number of sent packets per priority level.
@@ -394,35 +762,222 @@ public:
       return total_packets_[priority] > 0 ? total_packet_delay_per_byte_ns_[priority] / total_packets_[priority] : -1;
     }
 
+    // Total number of retransmissions of reliable packets per priority level.
+    uint64_t total_retransmissions(P2PPriority priority) const { return total_retransmissions_[priority]; }
+
     float average_retransmissions_per_reliable_packet(P2PPriority priority) const {
       return total_retransmissions_[priority] / static_cast<float>(total_reliable_packets_[priority]);
     }
 
+    // Smoothed round-trip time of reliable packets, from the moment they are sent until they are
+    // acknowledged, and its mean deviation. Retransmitted packets are not sampled, as their ACK
+    // may be for any of the transmissions. They are -1 if no packet has been sampled yet.
+    uint64_t smoothed_rtt_ns(P2PPriority priority) const { return smoothed_rtt_ns_[priority]; }
+    uint64_t rtt_variance_ns(P2PPriority priority) const { return rtt_variance_ns_[priority]; }
+
+    // Time to wait for the ACK of the oldest reliable packet in flight before sending it again,
+    // including the backoff after retransmissions.
+    uint64_t retransmission_timeout_ns(P2PPriority priority) const { return retransmission_timeout_ns_[priority]; }
+
+    // Distribution of the same delays as average_packet_delay_ns().
+    const P2PLatencyHistogram &packet_delay_histogram(P2PPriority priority) const { return packet_delay_histogram_[priority]; }
+
+    // Calls to NewPacket() that failed because the queue was full.
+    uint64_t total_rejected_packets(P2PPriority priority) const { return total_rejected_packets_[priority]; }
+
+    // Maximum number of packets that have been waiting in the queue at once, including those
+    // in flight.
+    int queue_high_watermark(P2PPriority priority) const { return queue_high_watermark_[priority]; }
+
+    // Packets and bytes sent per second over the last window of kP2PStatsRateWindowNs,
+    // including retransmissions.
+    uint64_t packets_per_second() const { return packet_rate_.rate_per_second(); }
+    uint64_t bytes_per_second() const { return byte_rate_.rate_per_second(); }
+
+    // Fraction of the byte stream's throughput in use, according to its burst ingestion time
+    // per byte. It is -1 if the byte stream does not tell it.
+    float link_utilization() const {
+      return burst_ingestion_ns_per_byte_ > 0 ? bytes_per_second() * burst_ingestion_ns_per_byte_ / 1e9f : -1;
+    }
+
     private:
       uint64_t total_packets_[P2PPriority::kNumLevels];
       uint64_t total_reliable_packets_[P2PPriority::kNumLevels];
       uint64_t total_packet_delay_ns_[P2PPriority::kNumLevels];
       uint64_t total_packet_delay_per_byte_ns_[P2PPriority::kNumLevels];
       uint64_t total_retransmissions_[P2PPriority::kNumLevels];
+      uint64_t smoothed_rtt_ns_[P2PPriority::kNumLevels];
+      uint64_t rtt_variance_ns_[P2PPriority::kNumLevels];
+      uint64_t retransmission_timeout_ns_[P2PPriority::kNumLevels];
+      P2PLatencyHistogram packet_delay_histogram_[P2PPriority::kNumLevels];
+      uint64_t total_rejected_packets_[P2PPriority::kNumLevels];
+      int queue_high_watermark_[P2PPriority::kNumLevels];
+      P2PRateMeter packet_rate_;
+      P2PRateMeter byte_rate_;
+      int burst_ingestion_ns_per_byte_;
   };
 
   const Stats &stats() const { return stats_; }
 
 private:
-  PriorityRingBuffer<P2PPacket, kCapacity, P2PPriority> packet_buffer_;
-  P2PByteStreamInterface<LocalEndianness> &byte_stream_;
+  PrioritySlab<P2PPacket, kCapacity, kP2PPacketQueueLength(kCapacity), P2PPriority> packet_buffer_;
+  ByteStream &byte_stream_;
   TimerInterface &timer_;
+  // Returns the next packet to send, or NULL if there is none. Goes back to the oldest packet
+  // in flight if a priority level has no more packets it can send and its retransmission
+  // timeout has expired.
+  P2PPacket *NextPacketToSend(uint64_t timestamp_ns);
+
+  // Returns true if the packets with `priority` can be sent at `timestamp_ns`, that is, if there
+  // are packets in the window that have not been sent, or the retransmission timeout expired.
+  bool HasPacketToSend(int priority, uint64_t timestamp_ns) const;
+
+  // Returns true if all the packets with `priority` that can be sent are in flight.
+  bool IsWindowExhausted(int priority) const;
+
+  // Returns the number of bytes of the next packet with `priority` to send, including header
+  // and footer. There must be one.
+  int NextPacketLength(int priority) const;
+
+  // Returns the maximum length of the next burst: the credit, if there is any, or the burst
+  // length that the other end can ingest.
+  int BurstMaxLength() const;
+
+  // Returns the time at which the oldest packet in flight with `priority` is sent again if it is
+  // not acknowledged.
+  uint64_t RetransmissionTimestampNs(int priority) const {
+    return packet_buffer_.OldestValue(priority)->send_time_ns() + stats_.retransmission_timeout_ns_[priority];
+  }
+
+  // Processes an ACK from the other end for the reliable packets with `priority`. Handshake
+  // ACKs acknowledge the handshake request with `sequence_number` only; other ACKs are
+  // cumulative. Acknowledged packets being sent are consumed when they have been sent.
+  void AcknowledgePackets(P2PPriority priority, uint64_t sequence_number, bool is_init);
+
+  // Processes a NACK from the other end for the reliable packet with `priority` and
+  // `sequence_number`, which it received corrupted. As the other end only reports the packet
+  // that it expects next, the packets before it are acknowledged, and the packets from it on are
+  // sent again without waiting for the retransmission timeout.
+  void NegativelyAcknowledgePacket(P2PPriority priority, uint64_t sequence_number);
+
+  // Moves the send index of `priority` back to the pending NACKed packet, unless a packet is in
+  // progress, and clears the pending NACK.
+  void GoBackToNegativelyAcknowledgedPacket(P2PPriority priority);
+
+  // Processes the credit advertised by the other end with the ACK of the reliable packets with
+  // `priority` up to `sequence_number`. It must be called before the ACK is processed, while
+  // the acknowledged packet is still in flight. The credit is ignored if that packet was
+  // retransmitted, as it is unknown which transmission the credit refers to.
+  void ReceiveCredit(P2PPriority priority, uint64_t sequence_number, const P2PCredit &credit);
+
+  // Schedules a cumulative ACK for the reliable packets received with `priority` up to
+  // `sequence_number`. It updates an ACK packet waiting in the queue, if there is one.
+  // Otherwise, the ACK is carried by the next data packet, or sent in its own packet after
+  // kP2PACKHoldoffNs.
+  void ScheduleACK(P2PPriority priority, uint64_t sequence_number);
+
+  // Commits an ACK packet for the packets received with `priority`. Returns false if there is
+  // no space for it.
+  bool CommitACKPacket(P2PPriority priority, uint64_t sequence_number, bool is_init);
+
+  // Commits ACK packets for the scheduled ACKs whose holdoff expired at `timestamp_ns`.
+  void CommitExpiredACKs(uint64_t timestamp_ns);
+
+  // Appends a scheduled ACK to the content of `packet`, if it can carry one, after removing the
+  // one it carried in a previous transmission, if any.
+  void PiggybackACK(P2PPacket *packet);
+
+  // Adds the current credit to `packet`, if it is a positive ACK packet.
+  void AdvertiseCredit(P2PPacket *packet);
+
+  // Discards the ACKs scheduled so far.
+  void ClearScheduledACKs();
+
+  // Returns true if `packet` has been acknowledged by the ACKs received so far.
+  bool IsAcknowledged(const P2PPacket &packet) const;
+
+  // Updates the round-trip time estimate and the retransmission timeout of `priority` with the
+  // time elapsed between a packet was sent and acknowledged.
+  void SampleRoundTripTime(P2PPriority priority, uint64_t rtt_ns);
+
+  // Consumes the packets in flight with `priority` that have been acknowledged, except the
+  // packet being sent, if any.
+  void ConsumeAcknowledgedPackets(P2PPriority priority);
+
+  // Returns true if `packet` is the packet whose bytes are being sent.
+  bool IsBeingSent(const P2PPacket *packet) const {
+    return state_ != kGettingNextPacket && packet == current_packet_;
+  }
+
+  // Forgets which packets are in flight, so that they are all sent again as new packets.
+  void ResetWindows();
+
+  // Fills the staging buffer with the next encoded bytes of the current packet, up to
+  // `max_length`. Appends the footer after the last content byte.
+  void EncodeNextBytes(int max_length);
+  void EncodeNextEscapedContentBytes(int max_length);
+  void EncodeNextCOBSContentBytes(int max_length);
+
   P2PPacket *current_packet_;
   int total_packet_bytes_[P2PPriority::kNumLevels];
   int pending_packet_bytes_;
+  // Number of decoded content bytes of the current packet that have been encoded for sending.
+  int content_offset_;
+  // Checksum accumulated over the header and the content bytes encoded so far.
+  P2PChecksumType checksum_[P2PPriority::kNumLevels];
+  int window_size_;
+  // Number of reliable packets with each priority in flight. They are at the head of their
+  // priority queue.
+  int num_packets_in_flight_[P2PPriority::kNumLevels];
+  // Index in its priority queue of the next packet to send with each priority.
+  int send_index_[P2PPriority::kNumLevels];
+  // The packet at the send index of each priority has been partially sent: it is being sent or
+  // it was preempted. It is always finished before the send index moves.
+  bool is_send_in_progress_[P2PPriority::kNumLevels];
+  // Sequence number of the packet NACKed with each priority while a packet was in progress, or
+  // -1. The stream goes back to it once that packet has been sent.
+  uint64_t pending_nack_sequence_number_[P2PPriority::kNumLevels];
+  // Sequence number of the last cumulative ACK and handshake ACK received for each priority,
+  // or -1.
+  uint64_t last_acked_sequence_number_[P2PPriority::kNumLevels];
+  uint64_t last_acked_init_sequence_number_[P2PPriority::kNumLevels];
+  // Sequence number of the cumulative ACK scheduled for the packets received with each
+  // priority, or -1, and the time at which it is sent in its own packet.
+  uint64_t scheduled_ack_sequence_number_[P2PPriority::kNumLevels];
+  uint64_t scheduled_ack_deadline_ns_[P2PPriority::kNumLevels];
+  P2PFraming framing_;
+  // Length and number of bytes left to encode of the current COBS block, or -1 if a new block
+  // must be started.
+  int cobs_block_length_;
+  int cobs_block_pending_bytes_;
+  // Encoded bytes waiting to be written. They are always fully written before the current
+  // packet can be interrupted, so that escape sequences are never split.
+  uint8_t staging_buffer_[kP2POutputStagingBufferLength];
+  int staging_buffer_length_;
+  int staging_buffer_offset_;
+  bool footer_encoded_;
   int total_burst_bytes_;
   int pending_burst_bytes_;  
   uint64_t after_burst_wait_end_timestamp_ns_;
+  // Number of bytes written to the byte stream so far, and number of bytes that the other end
+  // can take as of its last credit.
+  uint64_t num_sent_bytes_;
+  uint64_t credit_limit_byte_count_;
+  // Number of packets with each priority that the other end can store, as of its last credit.
+  int receiver_window_size_[P2PPriority::kNumLevels];
   uint64_t current_sequence_number_[P2PPriority::kNumLevels];
-  uint64_t last_sent_sequence_number_[P2PPriority::kNumLevels];
+  uint64_t current_reliable_sequence_number_[P2PPriority::kNumLevels];
+  uint64_t last_sent_reliable_sequence_number_[P2PPriority::kNumLevels];
   enum State { kGettingNextPacket, kSendingHeaderBurst, kWaitingForHeaderBurstIngestion, kSendingBurst, kWaitingForBurstIngestion, kWaitingForPartialBurstIngestionBeforeHigherPriorityPacket } state_;  
+  bool is_idle_;
   P2PPacketFilter packet_filter_;
   P2PPacketCommittedCallback packet_committed_callback_;
+  P2PPacketReleasedCallback packet_released_callback_;
+  P2PCreditCallback credit_callback_;
+  P2PRunCallback run_callback_;
+  P2PQueueWatermarkCallback queue_watermark_callback_;
+  P2PStrictPriorityScheduler strict_priority_scheduler_;
+  P2POutputSchedulerInterface *scheduler_;
 
   Stats stats_;
 };
@@ -443,17 +998,34 @@ public:
 // A buffered input/output stream of packets with priorities. 
 // The caller can choose to send packets reliably or as best effort. 
 // Reliable packets are retransmitted until the other end acknowledges them.
-template<int kInputCapacity, int kOutputCapacity, Endianness LocalEndianness> class P2PPacketStream {
+// The stream has an input half, input(), and an output half, output(). The input half only
+// tells the output half about the ACKs that it receives and the ACKs that it must send through
+// a lock-free mailbox, which the output half reads at the start of its Run(), and the output
+// half only reads the credit that the input half publishes.
+// By default, both halves must be run from the same thread, and they share their queues'
+// memory (see kP2PPacketQueueReservationLength). Full-duplex streams do not share it, so that
+// each half can run in its own thread, e.g. to receive while a burst is being sent. Then, the
+// events are applied, and the credit is updated, once per Run() of the respective half.
+template<int kInputCapacity, int kOutputCapacity, Endianness LocalEndianness, typename ByteStream = P2PByteStreamInterface<LocalEndianness>> class P2PPacketStream {
 public:
   // Does not take ownership of the streams, which must outlive this object.
-  P2PPacketStream(P2PByteStreamInterface<LocalEndianness> *byte_stream, TimerInterface *timer, GUIDFactoryInterface &guid_factory);
+  P2PPacketStream(ByteStream *byte_stream, TimerInterface *timer, GUIDFactoryInterface &guid_factory, bool is_full_duplex = false);
+
+  P2PPacketInputStream<kInputCapacity, LocalEndianness, ByteStream> &input() { return input_; }
+  P2PPacketOutputStream<kOutputCapacity, LocalEndianness, ByteStream> &output() { return output_; }
+
+  // True if the input and output halves may run in different threads.
+  bool is_full_duplex() const { return is_full_duplex_; }
 
-  P2PPacketInputStream<kInputCapacity, LocalEndianness> &input() { return input_; }
-  P2PPacketOutputStream<kOutputCapacity, LocalEndianness> &output() { return output_; }
+  // True if the input half posted events that the output half has not applied yet. The
+  // thread of the input half of a full-duplex stream can use it to wake up that of the output.
+  bool has_pending_control_events() const { return !control_mailbox_.IsEmpty(); }
 
   // Sets a callback that's called when the other end sends an init packet. The callback is 
   // used to ensure that all the state previously created in the other end is recreated. 
-  // The function pointed by the callback object must outlive this stream.
+  // The function pointed by the callback object must outlive this stream. It is called from
+  // the input half, unless the stream is full duplex: then, it is called from
+  // NotifyOtherEndStarted().
   void other_end_started_callback(const P2POtherEndStartedCallback &callback) {
     other_end_started_callback_ = callback;
   }
@@ -461,30 +1033,131 @@ public:
     return other_end_started_callback_;
   }
 
+  // Calls the other end started callback if the input half of a full-duplex stream has received
+  // an init packet from a restarted other end since the last call. The input half only takes
+  // note of it, as it may run in a thread of its own, so this must be called from the thread
+  // that owns the state that the callback resets, e.g. with the application's lock held.
+  void NotifyOtherEndStarted() {
+    if (has_other_end_started_.exchange(false, std::memory_order_acquire)) {
+      other_end_started_callback_();
+    }
+  }
+
+  // Framing to send packets with, if the other end can receive it. Otherwise, packets are sent
+  // with the escaped framing. It is kCOBSFraming by default. It belongs to the output half.
+  P2PFraming preferred_framing() const { return preferred_framing_; }
+  void preferred_framing(P2PFraming framing) {
+    preferred_framing_ = framing;
+    UpdateOutputFraming();
+  }
+
+  // Number of times the other end has restarted and handshaked a new session.
+  uint64_t num_handshake_resets() const { return num_handshake_resets_; }
+
 protected:
+  // Event that the input half posts to the output half.
+  typedef struct {
+    enum Type {
+      // ACK or NACK from the other end for the packets with `priority` up to `sequence_number`,
+      // with the `credit` that it advertised, if any.
+      kACKReceived,
+      kNACKReceived,
+      // ACK or NACK to send for the packets received with `priority` up to `sequence_number`.
+      kScheduleACK,
+      kScheduleNACK,
+      // The input half was reset: the ACKs scheduled so far are not valid anymore.
+      kClearScheduledACKs,
+      // The other end can receive the `framings` in the bitmask.
+      kOtherEndFramingsReceived
+    } type;
+    int priority;
+    uint64_t sequence_number;
+    bool is_init;
+    P2PCredit credit;
+    uint8_t framings;
+  } ControlEvent;
+
+  // Methods of the input half.
+
   void ResetInput();
-  void ResetOutputSession(const P2PPacket &handshake_request);
 
-  // Returns true if the acknowledge for the passed `packet` was already committed to the
-  // output stream.
-  bool IsACKCommittedForPacket(const P2PPacket &packet);
+  // Posts `event` to the output half. Returns false if the mailbox is full. The events of
+  // streams that are not full duplex are applied right away.
+  bool PostControlEvent(const ControlEvent &event);
+
+  // Posts an ACK for the reliable packets with `priority` up to `sequence_number`, or for the
+  // handshake request with `sequence_number` if `is_init`. Returns false if there is no room
+  // for it in the mailbox.
+  bool ScheduleACKWithThrottling(P2PPriority priority, uint64_t sequence_number, bool is_init);
 
-  // Returns false if the ACK packet was to be scheduled, but there was not space in the output
-  // buffer. Returns true if no new ACK was required, or if it was scheduled successfully,
-  // otherwise.
-  bool ScheduleACKWithThrottling(const P2PPacket &packet);
+  // Fills the credit to advertise for the packets with `priority` from the state of the input
+  // half. Returns false if there is none.
+  bool ComputeInputCredit(int priority, P2PCredit *credit);
 
   static bool ShouldCommitInputPacket(const P2PPacket &last_rx_packet, void *self_ptr);
+  static void OnCorruptedInputPacket(const P2PPacket &corrupted_rx_packet, void *self_ptr);
+  // Publishes the credit of full-duplex streams for the output half.
+  static void OnInputRun(void *self_ptr);
+
+  // Methods of the output half.
+
+  void ResetOutputSession(const P2PPacket &handshake_request);
+
+  // Applies the events posted by the input half, in order.
+  void ApplyControlEvents();
+  void ApplyControlEvent(const ControlEvent &event);
+
+  // Schedules a cumulative ACK in the output stream, which sends it with data packets when
+  // possible, or commits the ACK packet for the handshake request with `sequence_number` if
+  // `is_init`, unless it is in the output queue already. Returns false if the handshake ACK
+  // packet was to be committed, but there was not space in the output queue.
+  bool ScheduleACK(P2PPriority priority, uint64_t sequence_number, bool is_init);
+
+  // Schedules a NACK for the reliable packet with `priority` and `sequence_number`, unless one is
+  // pending already. NACKs are best effort: if there is no space in the output buffer, the other
+  // end retransmits the packet after its timeout.
+  void ScheduleNACK(P2PPriority priority, uint64_t sequence_number);
+
+  // Sets the framing of the output stream from the preferred framing and the framings that
+  // the other end can receive.
+  void UpdateOutputFraming();
+
   static bool ShouldConsumeOutputPacket(const P2PPacket &last_tx_packet, void *self_ptr);
+  static bool GetInputCredit(int priority, P2PCredit *credit, void *self_ptr);
+  static void OnOutputRun(void *self_ptr);
 
 private:
-  P2PPacketInputStream<kInputCapacity, LocalEndianness> input_;
-  P2PPacketOutputStream<kOutputCapacity, LocalEndianness> output_;
+  P2PPacketInputStream<kInputCapacity, LocalEndianness, ByteStream> input_;
+  P2PPacketOutputStream<kOutputCapacity, LocalEndianness, ByteStream> output_;
+  const bool is_full_duplex_;
+  // Written by the input half and read by the output half.
+  SPSCRingBuffer<ControlEvent, kP2PControlMailboxCapacity> control_mailbox_;
+  // Credit of full-duplex streams as of the last Run() of the input half, for each priority:
+  // the number of bytes in the lower 16 bits, the number of packets in the next 8 bits, and
+  // kValidInputCredit if there is credit.
+  static constexpr uint32_t kValidInputCredit = 1UL << 31;
+  std::atomic<uint32_t> input_credit_[P2PPriority::kNumLevels];
+
+  // State of the input half.
   P2PSequenceNumberType handshake_id_;
   bool handshake_done_;
-  uint64_t last_rx_sequence_number_[P2PPriority::kNumLevels];
+  // Sequence number of the next reliable packet expected from the other end.
+  uint64_t next_rx_sequence_number_[P2PPriority::kNumLevels];
+  // Number of bytes received up to the end of the last reliable packet received in order.
+  uint64_t last_rx_packet_end_byte_count_[P2PPriority::kNumLevels];
   uint64_t last_init_sequence_number_[P2PPriority::kNumLevels];
   P2POtherEndStartedCallback other_end_started_callback_;
+  // The other end restarted, and NotifyOtherEndStarted() has not called the callback yet. Only
+  // used by full-duplex streams.
+  std::atomic<bool> has_other_end_started_;
+  uint64_t num_handshake_resets_;
+
+  // State of the output half.
+  // Handshake request of the other end that started the current output session, or -1.
+  uint64_t output_session_id_;
+  P2PFraming preferred_framing_;
+  // Bitmask of the framings the other end can receive, as in its last handshake request.
+  uint8_t other_end_framings_;
 };
 
 #include "p2p_packet_stream.hh"
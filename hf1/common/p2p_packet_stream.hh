@@ -1,7 +1,8 @@
 #include <algorithm>
+#include <string.h>
 
-template<int kCapacity, Endianness LocalEndianness>
-void P2PPacketInputStream<kCapacity, LocalEndianness>::Reset() {
+template<int kCapacity, Endianness LocalEndianness, typename ByteStream>
+void P2PPacketInputStream<kCapacity, LocalEndianness, ByteStream>::Reset() {
   packet_buffer_.Clear();
   for (int i = 0; i < P2PPriority::kNumLevels; ++i) {
     write_offset_before_break_[i] = 0;
@@ -10,8 +11,8 @@ void P2PPacketInputStream<kCapacity, LocalEndianness>::Reset() {
   state_ = kWaitingForPacket;
 }
 
-template<int kCapacity, Endianness LocalEndianness>
-StatusOr<const P2PPacketView> P2PPacketInputStream<kCapacity, LocalEndianness>::OldestPacket() { 
+template<int kCapacity, Endianness LocalEndianness, typename ByteStream>
+StatusOr<const P2PPacketView> P2PPacketInputStream<kCapacity, LocalEndianness, ByteStream>::OldestPacket() { 
   P2PPacket *packet = packet_buffer_.OldestValue();
   if (packet == NULL) {
     return Status::kUnavailableError;
@@ -21,26 +22,49 @@ StatusOr<const P2PPacketView> P2PPacketInputStream<kCapacity, LocalEndianness>::
     ++stats_.total_packets_[packet->header()->priority];
     stats_.total_packet_delay_ns_[packet->header()->priority] += delay_ns;
     stats_.total_packet_delay_per_byte_ns_[packet->header()->priority] += delay_ns / (sizeof(P2PHeader) + packet->length() + sizeof(P2PFooter));
+    stats_.packet_delay_histogram_[packet->header()->priority].Add(delay_ns);
     // Mute stats update as this function may be called multiple times for a packet.
     packet->counted_in_stats() = true;
   }
   return P2PPacketView(packet);
 }
 
-template<int kCapacity, Endianness LocalEndianness>
-void P2PPacketOutputStream<kCapacity, LocalEndianness>::Reset() {
+template<int kCapacity, Endianness LocalEndianness, typename ByteStream>
+void P2PPacketOutputStream<kCapacity, LocalEndianness, ByteStream>::Reset() {
   packet_buffer_.Clear();
   for (int i = 0; i < P2PPriority::kNumLevels; ++i) {
     current_sequence_number_[i] = 0;
-    last_sent_sequence_number_[i] = -1ULL;
+    current_reliable_sequence_number_[i] = 0;
+    last_sent_reliable_sequence_number_[i] = -1ULL;
     total_packet_bytes_[i] = -1;
   }
+  ResetWindows();
+  ClearScheduledACKs();
+  staging_buffer_length_ = 0;
+  staging_buffer_offset_ = 0;
+  footer_encoded_ = false;
   state_ = kGettingNextPacket;
+  is_idle_ = false;
 }
 
-template<int kCapacity, Endianness LocalEndianness>
-StatusOr<P2PMutablePacketView> P2PPacketOutputStream<kCapacity, LocalEndianness>::NewPacket(P2PPriority priority) {
+template<int kCapacity, Endianness LocalEndianness, typename ByteStream>
+void P2PPacketOutputStream<kCapacity, LocalEndianness, ByteStream>::ResetWindows() {
+  for (int i = 0; i < P2PPriority::kNumLevels; ++i) {
+    num_packets_in_flight_[i] = 0;
+    send_index_[i] = 0;
+    is_send_in_progress_[i] = false;
+    pending_nack_sequence_number_[i] = -1ULL;
+    last_acked_sequence_number_[i] = -1ULL;
+    last_acked_init_sequence_number_[i] = -1ULL;
+    // The other end advertises the packets it can store with its ACKs.
+    receiver_window_size_[i] = kCapacity;
+  }
+}
+
+template<int kCapacity, Endianness LocalEndianness, typename ByteStream>
+StatusOr<P2PMutablePacketView> P2PPacketOutputStream<kCapacity, LocalEndianness, ByteStream>::NewPacket(P2PPriority priority) {
   if (packet_buffer_.IsFull(priority)) {
+    ++stats_.total_rejected_packets_[priority];
     return Status::kUnavailableError;
   }
   P2PPacket &packet = packet_buffer_.NewValue(priority);
@@ -49,294 +73,824 @@ StatusOr<P2PMutablePacketView> P2PPacketOutputStream<kCapacity, LocalEndianness>
   packet.header()->requires_ack = 0;
   packet.header()->is_ack = 0;
   packet.header()->is_init = 0;
-  packet.header()->reserved = 0;
+  packet.header()->is_cobs = 0;
+  packet.header()->has_ack = 0;
   packet.length() = 0;
   return P2PMutablePacketView(&packet);
 }
 
-template<int kCapacity, Endianness LocalEndianness>
-bool P2PPacketOutputStream<kCapacity, LocalEndianness>::Commit(P2PPriority priority, bool guarantee_delivery, uint64_t seq_number) {
+template<int kCapacity, Endianness LocalEndianness, typename ByteStream>
+bool P2PPacketOutputStream<kCapacity, LocalEndianness, ByteStream>::Commit(P2PPriority priority, bool guarantee_delivery, uint64_t seq_number) {
   P2PPacket &packet = packet_buffer_.NewValue(priority);
+  if (packet.length() > kP2PMaxContentLength) { return false; }
+  packet.header()->start_token = kP2PStartToken;
+  packet.header()->has_ack = 0; // ACKs are appended while sending.
   packet.header()->priority = priority;
   packet.header()->requires_ack = guarantee_delivery;
-  if (seq_number == -1ULL) {
-    packet.sequence_number() = current_sequence_number_[priority];
-  } else {
+  if (seq_number != -1ULL) {
     packet.sequence_number() = seq_number;
+  } else if (guarantee_delivery) {
+    // Reliable packets are numbered contiguously, so that the other end detects missing ones.
+    packet.sequence_number() = current_reliable_sequence_number_[priority]++;
+  } else {
+    packet.sequence_number() = current_sequence_number_[priority]++;
   }
-  if (!packet.PrepareToSend()) { return false; }
-  // Fix endianness.
-  packet.checksum() = LocalToNetwork<LocalEndianness>(packet.checksum());
+  // The content is encoded while transmitting. Fix endianness.
   packet.length() = LocalToNetwork<LocalEndianness>(packet.length());
 
   packet.counted_in_stats() = false;
   packet.commit_time_ns() = timer_.GetLocalNanoseconds();
+  packet.num_transmissions() = 0;
   packet_buffer_.Commit(priority);
+  stats_.queue_high_watermark_[priority] = std::max(stats_.queue_high_watermark_[priority], packet_buffer_.Size(priority));
 
-  if (seq_number == -1ULL) {
-    ++current_sequence_number_[priority];
+  // Committing moves the packet.
+  packet_committed_callback_(*packet_buffer_.OldestValue(priority, packet_buffer_.Size(priority) - 1));
+
+  return true;
+}
+
+template<int kCapacity, Endianness LocalEndianness, typename ByteStream> int P2PPacketInputStream<kCapacity, LocalEndianness, ByteStream>::Run() {
+  // Pull all available bytes up to the block length with a single read, and run the state 
+  // machine over them.
+  uint8_t staging_buffer[kP2PInputStagingBufferLength];
+  const int num_bytes_read = byte_stream_.Read(staging_buffer, read_block_length_);
+  is_byte_stream_drained_ = num_bytes_read < read_block_length_;
+  int i = 0;
+  while (i < num_bytes_read) {
+    const uint8_t byte = staging_buffer[i];
+    int num_processed_bytes = 1;
+    if (state_ == kReadingContent && byte != kP2PStartToken && byte != kP2PSpecialToken) {
+      // Bytes other than tokens need no decoding: take them in one go.
+      num_processed_bytes = AppendContentRun(&staging_buffer[i], num_bytes_read - i);
+    } else if (state_ == kReadingCOBSBlock && byte != kP2PStartToken) {
+      num_processed_bytes = AppendCOBSBlockBytes(&staging_buffer[i], num_bytes_read - i);
+    } else {
+      // Count the byte before processing it, as it may be the last one of a packet.
+      ++num_received_bytes_;
+      ProcessByte(byte);
+      num_processed_bytes = 0;
+      ++i;
+    }
+    num_received_bytes_ += num_processed_bytes;
+    i += num_processed_bytes;
   }
+  const uint64_t timestamp_ns = timer_.GetLocalNanoseconds();
+  stats_.byte_rate_.Add(std::max(num_bytes_read, 0), timestamp_ns);
+  stats_.packet_rate_.Update(timestamp_ns);
+  run_callback_();
+  return std::max(num_bytes_read, 0);
+}
 
-  packet_committed_callback_(packet);
+template<int kCapacity, Endianness LocalEndianness, typename ByteStream> 
+void P2PPacketInputStream<kCapacity, LocalEndianness, ByteStream>::RestartWithStartToken() {
+  state_ = kReadingHeader;
+  incoming_header_.start_token = kP2PStartToken;
+  current_field_read_bytes_ = 1;
+}
 
-  return true;
+template<int kCapacity, Endianness LocalEndianness, typename ByteStream> 
+void P2PPacketInputStream<kCapacity, LocalEndianness, ByteStream>::DiscardCorruptedPacket() {
+  ++stats_.total_checksum_errors_[incoming_header_.priority];
+  packet_corrupted_callback_(*incoming_packet_[incoming_header_.priority]);
+  incoming_packet_[incoming_header_.priority] = nullptr;
 }
 
-template<int kCapacity, Endianness LocalEndianness> int P2PPacketInputStream<kCapacity, LocalEndianness>::Run() {
-  int num_bytes_read = 0;
-  switch (state_) {
-    case kWaitingForPacket:
-      {
-        if ((num_bytes_read = byte_stream_.Read(&incoming_header_.start_token, 1)) < 1) {
-          break;
-        }
-        if (incoming_header_.start_token == kP2PStartToken) {
-          state_ = kReadingHeader;
-          current_field_read_bytes_ = 1;
-        }
-        break;
-      }
+template<int kCapacity, Endianness LocalEndianness, typename ByteStream> 
+void P2PPacketInputStream<kCapacity, LocalEndianness, ByteStream>::Resync() {
+  ++stats_.total_resyncs_;
+  state_ = kWaitingForPacket;
+}
 
-    case kReadingHeader:
-      {
-        if (current_field_read_bytes_ >= sizeof(P2PHeader)) {
-          // If it's a new packet, put the received header in a new slot at the given
-          // priority. If it's a continuation of a previous packet, the header is already
-          // there.
-          if (incoming_header_.priority >= P2PPriority::kNumLevels) {
-            // Invalid priority level.
-            state_ = kWaitingForPacket;
+template<int kCapacity, Endianness LocalEndianness, typename ByteStream> 
+void P2PPacketInputStream<kCapacity, LocalEndianness, ByteStream>::ProcessHeader() {
+  // If it's a new packet, put the received header in a new slot at the given
+  // priority. If it's a continuation of a previous packet, the header is already
+  // there.
+  if (incoming_header_.priority >= P2PPriority::kNumLevels ||
+      NetworkToLocal<LocalEndianness>(incoming_header_.length) > kP2PMaxContentLength) {
+    // Invalid priority level or length.
+    Resync();
+    return;
+  }
+
+  if (!incoming_header_.is_continuation) {
+    // New packet.
+
+    if (!packet_buffer_.IsFull(incoming_header_.priority)) {
+      // There is buffer space: get the next empty slot.
+      incoming_packet_[incoming_header_.priority] = &packet_buffer_.NewValue(incoming_header_.priority);
+    } else {
+      // No space available.
+      ++stats_.total_dropped_packets_[incoming_header_.priority];
+      if (!incoming_header_.requires_ack) {
+        // It's a regular packet: finish receiving it without writing it in the 
+        // input queue.
+        incoming_packet_[incoming_header_.priority] = &discarded_packet_placeholder_;
+      } else {
+        // It's a guaranteed-delivery packet: discard one regular packet to make room.
+        for (int i = 0; i < packet_buffer_.Size(incoming_header_.priority); ++i) {
+          if (!packet_buffer_.OldestValue(incoming_header_.priority, i)->header()->requires_ack) {
+            packet_buffer_.Consume(incoming_header_.priority, i);
             break;
           }
+        }
+        if (!packet_buffer_.IsFull(incoming_header_.priority)) {
+          // We were able to discard one regular packet: use the new room for the 
+          // guaranteed-delivery packet.
+          incoming_packet_[incoming_header_.priority] = &packet_buffer_.NewValue(incoming_header_.priority);
+        } else {
+          // There were no regular packets to discard, so it is the received packet that is
+          // dropped, not an evicted one: finish reading the packet, but
+          // store it in bogus location to still react to inconsistencies. The other
+          // end should keep resending it until we have input buffer space to receive it.
+          incoming_packet_[incoming_header_.priority] = &discarded_packet_placeholder_;
+        }
+      }              
+    }
 
-          if (!incoming_header_.is_continuation) {
-            // New packet.
+    P2PPacket &packet = *incoming_packet_[incoming_header_.priority];
+    for (unsigned int i = 0; i < sizeof(P2PHeader); ++i) {
+      reinterpret_cast<uint8_t *>(packet.header())[i] = reinterpret_cast<uint8_t *>(&incoming_header_)[i];
+    }
+    // Fix endianness of header fields, so they can be used locally in next states.
+    packet.length() = NetworkToLocal<LocalEndianness>(packet.length());
+    write_offset_before_break_[incoming_header_.priority] = 0;
+    checksum_[incoming_header_.priority] = packet.HeaderChecksum();
+    current_field_read_bytes_ = 0;
+  } else {
+    // Continuing a packet previously interrupted by a higher-priority packet.
 
-            if (!packet_buffer_.IsFull(incoming_header_.priority)) {
-              // There is buffer space: get the next empty slot.
-              incoming_packet_[incoming_header_.priority] = &packet_buffer_.NewValue(incoming_header_.priority);
-            } else {
-              // No space available.
-              if (!incoming_header_.requires_ack) {
-                // It's a regular packet: finish receiving it without writing it in the 
-                // input queue.
-                incoming_packet_[incoming_header_.priority] = &discarded_packet_placeholder_;
-              } else {
-                // It's a guaranteed-delivery packet: discard one regular packet to make room.
-                for (int i = 0; i < packet_buffer_.Size(incoming_header_.priority); ++i) {
-                  if (!packet_buffer_.OldestValue(incoming_header_.priority, i)->header()->requires_ack) {
-                    packet_buffer_.Consume(incoming_header_.priority, i);
-                    break;
-                  }
-                }
-                if (!packet_buffer_.IsFull(incoming_header_.priority)) {
-                  // We were able to discard one regular packet: use the new room for the 
-                  // guaranteed-delivery packet.
-                  incoming_packet_[incoming_header_.priority] = &packet_buffer_.NewValue(incoming_header_.priority);
-                } else {
-                  // There were no regular packets to discard: finish reading the packet, but
-                  // store it in bogus location to still react to inconsistencies. The other
-                  // end should keep resending it until we have input buffer space to receive it.
-                  incoming_packet_[incoming_header_.priority] = &discarded_packet_placeholder_;
-                }
-              }              
-            }
+    if (incoming_packet_[incoming_header_.priority] == nullptr) {
+      // This packet was not being tracked. Ignore as it could just be noise resembling a packet.
+      ++stats_.total_malformed_continuations_[incoming_header_.priority];
+      state_ = kWaitingForPacket;
+      return;
+    }
 
-            P2PPacket &packet = *incoming_packet_[incoming_header_.priority];
-            for (unsigned int i = 0; i < sizeof(P2PHeader); ++i) {
-              reinterpret_cast<uint8_t *>(&packet)[i] = reinterpret_cast<uint8_t *>(&incoming_header_)[i];
-            }
-            // Fix endianness of header fields, so they can be used locally in next states.
-            packet.length() = NetworkToLocal<LocalEndianness>(packet.length());
-            write_offset_before_break_[incoming_header_.priority] = 0;
-            current_field_read_bytes_ = 0;
-          } else {
-            // Continuing a packet previously interrupted by a higher-priority packet.
+    P2PPacket &packet = *incoming_packet_[incoming_header_.priority];
+    // The length field for a packet continuation is the remaining length.
+    int remaining_length = NetworkToLocal<LocalEndianness>(incoming_header_.length);
+    if (incoming_header_.sequence_number != packet.sequence_number() || 
+        incoming_header_.is_cobs != packet.header()->is_cobs ||
+        remaining_length != packet.length() - write_offset_before_break_[incoming_header_.priority]) {
+      // This continuation does not belong to the packet we have in store, or the
+      // continuation offset is not where we left off (could be a continuation from a
+      // different retransmission). There must have been a link interruption: reset the
+      // state machine.
+      ++stats_.total_malformed_continuations_[incoming_header_.priority];
+      state_ = kWaitingForPacket;
+      return;
+    }
+    // Keep receiving content where we left off.
+    current_field_read_bytes_ = packet.length() - remaining_length;
+  }
 
-            if (incoming_packet_[incoming_header_.priority] == nullptr) {
-              // This packet was not being tracked. Ignore as it could just be noise resembling a packet.
-              state_ = kWaitingForPacket;
-              break;
-            }
+  if (current_field_read_bytes_ >= incoming_packet_[incoming_header_.priority]->length()) {
+    // No content left to receive.
+    state_ = kReadingFooter;
+    current_field_read_bytes_ = 0;
+    return;
+  }
+  // COBS content always starts with a new block, even in continuations.
+  state_ = incoming_packet_[incoming_header_.priority]->header()->is_cobs ? kReadingCOBSBlockCode : kReadingContent;
+}
 
-            P2PPacket &packet = *incoming_packet_[incoming_header_.priority];
-            // The length field for a packet continuation is the remaining length.
-            int remaining_length = NetworkToLocal<LocalEndianness>(incoming_header_.length);
-            if (incoming_header_.sequence_number != packet.sequence_number() || 
-                remaining_length != packet.length() - write_offset_before_break_[incoming_header_.priority]) {
-              // This continuation does not belong to the packet we have in store, or the
-              // continuation offset is not where we left off (could be a continuation from a
-              // different retransmission). There must have been a link interruption: reset the
-              // state machine.
-              state_ = kWaitingForPacket;
-              break;
-            }
-            // Keep receiving content where we left off.
-            current_field_read_bytes_ = packet.length() - remaining_length;
-          }
-          state_ = kReadingContent;
-          break;
-        }
-        uint8_t *current_byte = &reinterpret_cast<uint8_t *>(&incoming_header_)[current_field_read_bytes_];
-        num_bytes_read = byte_stream_.Read(current_byte, 1);
-        if (num_bytes_read < 1) {
-          break;
-        }
-        current_field_read_bytes_ += num_bytes_read;
-        if (*current_byte == kP2PStartToken) {
+template<int kCapacity, Endianness LocalEndianness, typename ByteStream> 
+void P2PPacketInputStream<kCapacity, LocalEndianness, ByteStream>::ProcessByte(uint8_t byte) {
+  switch (state_) {
+    case kWaitingForPacket:
+      if (byte == kP2PStartToken) {
+        RestartWithStartToken();
+      }
+      break;
+
+    case kReadingHeader:
+      {
+        if (byte == kP2PStartToken) {
           // Must be a new packet after a link interruption because priority takeover is
           // not legal mid-header.
-          state_ = kReadingHeader;
-          incoming_header_.start_token = kP2PStartToken;
-          current_field_read_bytes_ = 1;
+          ++stats_.total_resyncs_;
+          RestartWithStartToken();
           break;
         }
-        if (*current_byte == kP2PSpecialToken) {
+        if (byte == kP2PSpecialToken) {
           // Malformed packet.
-          state_ = kWaitingForPacket;
+          Resync();
+          break;
+        }
+        reinterpret_cast<uint8_t *>(&incoming_header_)[current_field_read_bytes_++] = byte;
+        if (current_field_read_bytes_ >= sizeof(P2PHeader)) {
+          ProcessHeader();
         }
         break;
       }
 
     case kReadingContent:
       {
-        ASSERT(incoming_packet_[incoming_header_.priority] != nullptr);
-        P2PPacket &packet = *incoming_packet_[incoming_header_.priority];
-        if (current_field_read_bytes_ >= packet.length()) {
-          state_ = kReadingFooter;
-          current_field_read_bytes_ = 0;
+        // Content bytes matching a token are followed by a special token. Decode them once
+        // the special token is received.
+        if (byte == kP2PStartToken) {
+          // It could be a start token, if the next byte is not a special token.
+          state_ = kDisambiguatingStartTokenInContent;
           break;
         }
-        uint8_t *next_content_byte = &packet.content()[current_field_read_bytes_];
-        num_bytes_read = byte_stream_.Read(next_content_byte, 1);
-        if (num_bytes_read < 1) {
+        if (byte == kP2PSpecialToken) {
+          state_ = kReadingEscapedSpecialToken;
           break;
         }
-        current_field_read_bytes_ += num_bytes_read;
-        if (*next_content_byte == kP2PStartToken) {
-          if (current_field_read_bytes_ < packet.length()) {
-            // It could be a start token, if the next byte is not a special token.
-            state_ = kDisambiguatingStartTokenInContent;
-          } else {
-            // If there can't be a special token next because this is the last content byte,
-            // it could either be a malformed packet or a new packet start. Assume the other
-            // end will form correct packets. The start token may then be due to a new packet
-            // after a link interruption, or a packet with higher priority.
-            write_offset_before_break_[incoming_header_.priority] = current_field_read_bytes_ - 1;
-            state_ = kReadingHeader;
-            incoming_header_.start_token = kP2PStartToken;
-            current_field_read_bytes_ = 1;
-          }
-        }
+        AppendContentByte(byte);
         break;
       }
 
     case kDisambiguatingStartTokenInContent:
       {
-        ASSERT(incoming_packet_[incoming_header_.priority] != nullptr);
-        P2PPacket &packet = *incoming_packet_[incoming_header_.priority];
-        // Read next byte and check if it's a special token.
-        // No need to check if we reached the content length here, as a content byte matching the start token should always be followed by a special token.
-        uint8_t *next_content_byte = &packet.content()[current_field_read_bytes_];
-        num_bytes_read = byte_stream_.Read(next_content_byte, 1);
-        if (num_bytes_read < 1) {
+        if (byte == kP2PSpecialToken) {
+          // Not a start token, but a content byte.
+          AppendContentByte(kP2PStartToken);
           break;
         }
-        current_field_read_bytes_ += num_bytes_read;
-        if (*next_content_byte == kP2PSpecialToken) {
-          // Not a start token, but a content byte.
-          state_ = kReadingContent;
-        } else {
-          if (*next_content_byte == kP2PStartToken) {
-            // Either a malformed packet, or a new packet after link reestablished, or a
-            // higher priority packet.
-            // Assume well designed transmitter and try the latter.
-            write_offset_before_break_[incoming_header_.priority] = current_field_read_bytes_ - 1;
-            state_ = kReadingHeader;
-            incoming_header_.start_token = kP2PStartToken;
-            current_field_read_bytes_ = 1;
-          } else {
-            // Must be a start token. Restart the state to re-synchronize with minimal latency.
-            write_offset_before_break_[incoming_header_.priority] = current_field_read_bytes_ - 2;
-            state_ = kReadingHeader;
-            incoming_header_.start_token = kP2PStartToken;
-            reinterpret_cast<uint8_t *>(&incoming_header_)[1] = *next_content_byte;
-            current_field_read_bytes_ = 2;
-          }
+        // A new packet after the link was reestablished, or a higher priority packet. In 
+        // the latter case, the current packet will be continued where we left off.
+        write_offset_before_break_[incoming_header_.priority] = current_field_read_bytes_;
+        RestartWithStartToken();
+        if (byte != kP2PStartToken) {
+          // The previous byte was the start token: this is the first header byte. Otherwise,
+          // this is the start token of a new packet after a link interruption.
+          reinterpret_cast<uint8_t *>(&incoming_header_)[current_field_read_bytes_++] = byte;
         }
+        break;
       }
-      break;
 
-    case kReadingFooter:
+    case kReadingEscapedSpecialToken:
       {
-        ASSERT(incoming_packet_[incoming_header_.priority] != nullptr);
-        P2PPacket &packet = *incoming_packet_[incoming_header_.priority];
-        if (current_field_read_bytes_ >= sizeof(P2PFooter)) {
+        if (byte == kP2PSpecialToken) {
+          AppendContentByte(kP2PSpecialToken);
+          break;
+        }
+        DiscardCorruptedPacket();
+        if (byte == kP2PStartToken) {
+          RestartWithStartToken();
+        } else {
           state_ = kWaitingForPacket;
+        }
+        break;
+      }
+
+    case kReadingCOBSBlockCode:
+    case kReadingCOBSBlock:
+      {
+        if (byte == kP2PStartToken) {
+          // COBS content never contains start tokens: this is a new packet after the link was
+          // reestablished, or a higher priority packet. In the latter case, the current packet
+          // will be continued where we left off.
+          write_offset_before_break_[incoming_header_.priority] = current_field_read_bytes_;
+          RestartWithStartToken();
           break;
         }
-        uint8_t *current_byte = packet.content() + packet.length() + current_field_read_bytes_;
-        num_bytes_read = byte_stream_.Read(current_byte, 1);
-        if (num_bytes_read < 1) {
+        if (state_ == kReadingCOBSBlock) {
+          AppendCOBSBlockBytes(&byte, 1);
+          break;
+        }
+        cobs_block_length_ = P2PCOBSBlockLength(byte);
+        if (cobs_block_length_ > incoming_packet_[incoming_header_.priority]->length() - static_cast<int>(current_field_read_bytes_)) {
+          DiscardCorruptedPacket();
+          state_ = kWaitingForPacket;
           break;
         }
-        current_field_read_bytes_ += num_bytes_read;
+        cobs_block_pending_bytes_ = cobs_block_length_;
+        if (cobs_block_pending_bytes_ > 0) {
+          state_ = kReadingCOBSBlock;
+        } else {
+          FinishCOBSBlock();
+        }
+        break;
+      }
 
-        if (*current_byte == kP2PStartToken) {
+    case kReadingFooter:
+      {
+        ASSERT(incoming_packet_[incoming_header_.priority] != nullptr);
+        P2PPacket &packet = *incoming_packet_[incoming_header_.priority];
+        if (byte == kP2PStartToken) {
           // New packet after interrupts, as no priority takeover is allowed mid-footer.
           write_offset_before_break_[incoming_header_.priority] = packet.length();
-          state_ = kReadingHeader;
-          incoming_header_.start_token = kP2PStartToken;
-          current_field_read_bytes_ = 1;
+          ++stats_.total_resyncs_;
+          RestartWithStartToken();
           break;
         }
-        if (*current_byte == kP2PSpecialToken) {
+        if (byte == kP2PSpecialToken) {
           // Malformed packet.
-          state_ = kWaitingForPacket;
+          Resync();
+          break;
         }
-
-        if (current_field_read_bytes_ >= sizeof(P2PFooter)) {
-          // Adapt endianness of footer fields.
-          packet.checksum() = NetworkToLocal<LocalEndianness>(packet.checksum());
-          if (packet.PrepareToRead()) {
-            if (packet_filter_(packet)) {
-              packet.counted_in_stats() = false;
-              packet.commit_time_ns() = timer_.GetLocalNanoseconds();
-              packet_buffer_.Commit(incoming_header_.priority);
+        
+        // Adapt endianness of footer fields.
+        const P2PChecksumType checksum = NetworkToLocal<LocalEndianness>(static_cast<P2PChecksumType>(byte));
+        if (checksum == checksum_[incoming_header_.priority] % kP2PChecksumModulo) {
+          if (packet.header()->has_ack) {
+            // Leave the piggybacked ACK after the content.
+            if (packet.length() < sizeof(P2PPiggybackedACK)) {
+              state_ = kWaitingForPacket;
+              break;
             }
+            packet.length() -= sizeof(P2PPiggybackedACK);
           }
-          state_ = kWaitingForPacket;
+          if (&packet == &discarded_packet_placeholder_) {
+            // There was no space to store the packet. Still let the filter process best-effort
+            // packets (e.g. ACKs), but not reliable ones, so that they are not acknowledged
+            // and the other end retransmits them.
+            if (!packet.header()->requires_ack) {
+              packet_filter_(packet);
+            }
+          } else if (packet_filter_(packet)) {
+            packet.counted_in_stats() = false;
+            packet.commit_time_ns() = timer_.GetLocalNanoseconds();
+            packet_buffer_.Commit(incoming_header_.priority);
+            stats_.queue_high_watermark_[incoming_header_.priority] = std::max(stats_.queue_high_watermark_[incoming_header_.priority], packet_buffer_.Size(incoming_header_.priority));
+          }
+          stats_.packet_rate_.Add(1, timer_.GetLocalNanoseconds());
+        } else {
+          ++stats_.total_checksum_errors_[incoming_header_.priority];
+          packet_corrupted_callback_(packet);
         }
+        state_ = kWaitingForPacket;
+        break;
       }
+  }
+}
+
+template<int kCapacity, Endianness LocalEndianness, typename ByteStream> 
+void P2PPacketInputStream<kCapacity, LocalEndianness, ByteStream>::AppendContentByte(uint8_t byte) {
+  ASSERT(incoming_packet_[incoming_header_.priority] != nullptr);
+  P2PPacket &packet = *incoming_packet_[incoming_header_.priority];
+  packet.content()[current_field_read_bytes_++] = byte;
+  checksum_[incoming_header_.priority] += byte;
+  if (current_field_read_bytes_ >= packet.length()) {
+    state_ = kReadingFooter;
+    current_field_read_bytes_ = 0;
+  } else {
+    state_ = kReadingContent;
+  }
+}
+
+template<int kCapacity, Endianness LocalEndianness, typename ByteStream> 
+int P2PPacketInputStream<kCapacity, LocalEndianness, ByteStream>::AppendContentRun(const uint8_t *bytes, int length) {
+  ASSERT(incoming_packet_[incoming_header_.priority] != nullptr);
+  P2PPacket &packet = *incoming_packet_[incoming_header_.priority];
+  const int run_length = P2PFindToken(bytes, std::min(length, packet.length() - static_cast<int>(current_field_read_bytes_)));
+  memcpy(&packet.content()[current_field_read_bytes_], bytes, run_length);
+  checksum_[incoming_header_.priority] += P2PSumBytes(bytes, run_length);
+  current_field_read_bytes_ += run_length;
+  if (current_field_read_bytes_ >= packet.length()) {
+    state_ = kReadingFooter;
+    current_field_read_bytes_ = 0;
+  }
+  return run_length;
+}
+
+template<int kCapacity, Endianness LocalEndianness, typename ByteStream> 
+int P2PPacketInputStream<kCapacity, LocalEndianness, ByteStream>::AppendCOBSBlockBytes(const uint8_t *bytes, int length) {
+  ASSERT(incoming_packet_[incoming_header_.priority] != nullptr);
+  P2PPacket &packet = *incoming_packet_[incoming_header_.priority];
+  const int run_length = P2PFindStartToken(bytes, std::min(length, cobs_block_pending_bytes_));
+  memcpy(&packet.content()[current_field_read_bytes_], bytes, run_length);
+  checksum_[incoming_header_.priority] += P2PSumBytes(bytes, run_length);
+  current_field_read_bytes_ += run_length;
+  cobs_block_pending_bytes_ -= run_length;
+  if (cobs_block_pending_bytes_ <= 0) {
+    FinishCOBSBlock();
+  }
+  return run_length;
+}
+
+template<int kCapacity, Endianness LocalEndianness, typename ByteStream> 
+void P2PPacketInputStream<kCapacity, LocalEndianness, ByteStream>::FinishCOBSBlock() {
+  P2PPacket &packet = *incoming_packet_[incoming_header_.priority];
+  if (cobs_block_length_ < kP2PCOBSMaxBlockLength && current_field_read_bytes_ < packet.length()) {
+    // The block was delimited by a start token in the content.
+    packet.content()[current_field_read_bytes_++] = kP2PStartToken;
+    checksum_[incoming_header_.priority] += kP2PStartToken;
+  }
+  if (current_field_read_bytes_ >= packet.length()) {
+    state_ = kReadingFooter;
+    current_field_read_bytes_ = 0;
+  } else {
+    state_ = kReadingCOBSBlockCode;
+  }
+}
+
+template<int kCapacity, Endianness LocalEndianness, typename ByteStream> 
+bool P2PPacketOutputStream<kCapacity, LocalEndianness, ByteStream>::IsWindowExhausted(int priority) const {
+  // A packet in progress is finished first, as it was in the window when it started.
+  if (is_send_in_progress_[priority]) { return false; }
+  // The other end resets its input with every handshake request it receives, so nothing
+  // else must be in flight with an unacknowledged handshake request.
+  const int window_size = packet_buffer_.OldestValue(priority)->header()->is_init ? 1 : std::min(window_size_, receiver_window_size_[priority]);
+  return send_index_[priority] >= packet_buffer_.Size(priority) || send_index_[priority] >= window_size;
+}
+
+template<int kCapacity, Endianness LocalEndianness, typename ByteStream> 
+int P2PPacketOutputStream<kCapacity, LocalEndianness, ByteStream>::BurstMaxLength() const {
+  const uint64_t credit = credit_bytes();
+  if (credit > 0) {
+    return static_cast<int>(std::min<uint64_t>(credit, UINT16_MAX));
+  }
+  return byte_stream_.GetBurstMaxLength();
+}
+
+template<int kCapacity, Endianness LocalEndianness, typename ByteStream> 
+bool P2PPacketOutputStream<kCapacity, LocalEndianness, ByteStream>::HasPacketToSend(int priority, uint64_t timestamp_ns) const {
+  if (packet_buffer_.Size(priority) == 0) { return false; }
+  return !IsWindowExhausted(priority) || timestamp_ns >= RetransmissionTimestampNs(priority);
+}
+
+template<int kCapacity, Endianness LocalEndianness, typename ByteStream> 
+int P2PPacketOutputStream<kCapacity, LocalEndianness, ByteStream>::NextPacketLength(int priority) const {
+  // After the retransmission timeout, the oldest packet in flight is sent again.
+  const int index = IsWindowExhausted(priority) ? 0 : send_index_[priority];
+  const P2PPacket *packet = packet_buffer_.OldestValue(priority, index);
+  return sizeof(P2PHeader) + NetworkToLocal<LocalEndianness>(packet->length()) + sizeof(P2PFooter);
+}
+
+template<int kCapacity, Endianness LocalEndianness, typename ByteStream> 
+P2PPacket *P2PPacketOutputStream<kCapacity, LocalEndianness, ByteStream>::NextPacketToSend(uint64_t timestamp_ns) {
+  bool has_packet[P2PPriority::kNumLevels] = {};
+  int packet_lengths[P2PPriority::kNumLevels] = {};
+  // Only the priorities with packets are checked.
+  for (uint32_t levels = packet_buffer_.occupancy().levels(); levels != 0; levels &= levels - 1) {
+    const int priority = __builtin_ctz(levels);
+    // Waiting for ACKs: let other priorities use the link meanwhile.
+    has_packet[priority] = HasPacketToSend(priority, timestamp_ns);
+    packet_lengths[priority] = has_packet[priority] ? NextPacketLength(priority) : 0;
+  }
+  const int priority = scheduler_->SelectPriority(has_packet, packet_lengths, timestamp_ns);
+  if (priority < 0) {
+    return NULL;
+  }
+  ASSERT(priority < P2PPriority::kNumLevels && has_packet[priority]);
+  if (IsWindowExhausted(priority)) {
+    // The oldest packet in flight was not acknowledged in time: retransmit the ones in flight,
+    // and back off in case the other end is just slow to acknowledge them.
+    send_index_[priority] = 0;
+    stats_.retransmission_timeout_ns_[priority] = std::min<uint64_t>(2 * stats_.retransmission_timeout_ns_[priority], kP2PMaxRetransmissionTimeoutNs);
+  }
+  return packet_buffer_.OldestValue(priority, send_index_[priority]);
+}
+
+template<int kCapacity, Endianness LocalEndianness, typename ByteStream> 
+void P2PPacketOutputStream<kCapacity, LocalEndianness, ByteStream>::AcknowledgePackets(P2PPriority priority, uint64_t sequence_number, bool is_init) {
+  if (is_init) {
+    if (sequence_number == last_acked_init_sequence_number_[priority]) { return; }
+    last_acked_init_sequence_number_[priority] = sequence_number;
+  } else {
+    if (last_acked_sequence_number_[priority] != -1ULL &&
+        !P2PSequenceNumberIsAfter(sequence_number, last_acked_sequence_number_[priority])) {
+      // Duplicate ACK.
+      return;
+    }
+    last_acked_sequence_number_[priority] = sequence_number;
+  }
+
+  // Sample the round-trip time with the newest packet acknowledged, unless it was retransmitted.
+  const P2PPacket *newest_acknowledged_packet = NULL;
+  for (int i = 0; i < num_packets_in_flight_[priority]; ++i) {
+    const P2PPacket *packet = packet_buffer_.OldestValue(priority, i);
+    if (!IsAcknowledged(*packet)) { break; }
+    newest_acknowledged_packet = packet;
+  }
+  if (newest_acknowledged_packet != NULL && newest_acknowledged_packet->num_transmissions() == 1) {
+    SampleRoundTripTime(priority, timer_.GetLocalNanoseconds() - newest_acknowledged_packet->send_time_ns());
+  }
+
+  ConsumeAcknowledgedPackets(priority);
+}
+
+template<int kCapacity, Endianness LocalEndianness, typename ByteStream> 
+void P2PPacketOutputStream<kCapacity, LocalEndianness, ByteStream>::NegativelyAcknowledgePacket(P2PPriority priority, uint64_t sequence_number) {
+  const uint64_t period = P2PSequenceNumberType::NumValues();
+  AcknowledgePackets(priority, (sequence_number + period - 1) % period, /*is_init=*/false);
+  // The packet in progress, if any, still needs the send index: go back after it is sent.
+  pending_nack_sequence_number_[priority] = sequence_number;
+  GoBackToNegativelyAcknowledgedPacket(priority);
+}
+
+template<int kCapacity, Endianness LocalEndianness, typename ByteStream> 
+void P2PPacketOutputStream<kCapacity, LocalEndianness, ByteStream>::GoBackToNegativelyAcknowledgedPacket(P2PPriority priority) {
+  const uint64_t sequence_number = pending_nack_sequence_number_[priority];
+  if (sequence_number == -1ULL || is_send_in_progress_[priority]) { return; }
+  pending_nack_sequence_number_[priority] = -1ULL;
+  for (int i = 0; i < num_packets_in_flight_[priority]; ++i) {
+    const P2PPacket *packet = packet_buffer_.OldestValue(priority, i);
+    if (!packet->header()->is_init && packet->sequence_number() == sequence_number) {
+      // Go back to it, unless it is about to be sent again anyway. The link works, so there
+      // is no backoff.
+      send_index_[priority] = std::min(send_index_[priority], i);
       break;
+    }
+  }
+}
+
+template<int kCapacity, Endianness LocalEndianness, typename ByteStream> 
+void P2PPacketOutputStream<kCapacity, LocalEndianness, ByteStream>::ReceiveCredit(P2PPriority priority, uint64_t sequence_number, const P2PCredit &credit) {
+  const int num_bytes = NetworkToLocal<LocalEndianness>(credit.num_bytes);
+  if (num_bytes == 0) { return; }
+  for (int i = 0; i < num_packets_in_flight_[priority]; ++i) {
+    const P2PPacket *packet = packet_buffer_.OldestValue(priority, i);
+    if (packet->header()->is_init || packet->sequence_number() != sequence_number) { continue; }
+    if (packet->num_transmissions() != 1 || IsBeingSent(packet)) { return; }
+    credit_limit_byte_count_ = std::max(credit_limit_byte_count_, packet->send_end_byte_count() + num_bytes);
+    // Always let one packet through, so that the other end can advertise new credit.
+    receiver_window_size_[priority] = std::max<int>(1, credit.num_packets);
+    return;
+  }
+}
+
+template<int kCapacity, Endianness LocalEndianness, typename ByteStream> 
+void P2PPacketOutputStream<kCapacity, LocalEndianness, ByteStream>::ScheduleACK(P2PPriority priority, uint64_t sequence_number) {
+  // ACKs always have a priority one level higher to avoid deadlocks.
+  const P2PPriority ack_priority = priority - 1;
+  for (int i = 0; i < packet_buffer_.Size(ack_priority); ++i) {
+    P2PPacket *maybe_ack_packet = packet_buffer_.OldestValue(ack_priority, i);
+    if (maybe_ack_packet->header()->is_ack && !maybe_ack_packet->header()->is_init &&
+        maybe_ack_packet->length() == 0 && !IsBeingSent(maybe_ack_packet)) {
+      // ACKs are cumulative: the waiting ACK packet can acknowledge the new packets too.
+      if (P2PSequenceNumberIsAfter(sequence_number, maybe_ack_packet->sequence_number())) {
+        maybe_ack_packet->sequence_number() = sequence_number;
+      }
+      return;
+    }
+  }
+  uint64_t &scheduled_sequence_number = scheduled_ack_sequence_number_[priority];
+  if (scheduled_sequence_number == -1ULL) {
+    scheduled_sequence_number = sequence_number;
+    scheduled_ack_deadline_ns_[priority] = timer_.GetLocalNanoseconds() + kP2PACKHoldoffNs;
+  } else if (P2PSequenceNumberIsAfter(sequence_number, scheduled_sequence_number)) {
+    scheduled_sequence_number = sequence_number;
   }
-  return num_bytes_read;
 }
 
-template<int kCapacity, Endianness LocalEndianness> uint64_t P2PPacketOutputStream<kCapacity, LocalEndianness>::Run() {
+template<int kCapacity, Endianness LocalEndianness, typename ByteStream> 
+bool P2PPacketOutputStream<kCapacity, LocalEndianness, ByteStream>::CommitACKPacket(P2PPriority priority, uint64_t sequence_number, bool is_init) {
+  const P2PPriority ack_priority = priority - 1;
+  StatusOr<P2PMutablePacketView> ack_packet_view = NewPacket(ack_priority);
+  if (!ack_packet_view.ok()) { return false; }
+  P2PPacket *ack = ack_packet_view->packet();
+  ack->header()->is_ack = 1;
+  ack->header()->is_init = is_init;
+  Commit(ack_priority, /*guaranteed_delivery=*/false, /*seq_number=*/sequence_number);
+  return true;
+}
+
+template<int kCapacity, Endianness LocalEndianness, typename ByteStream> 
+void P2PPacketOutputStream<kCapacity, LocalEndianness, ByteStream>::CommitExpiredACKs(uint64_t timestamp_ns) {
+  // There are no ACKs for the highest priority level, as ACKs need a higher one.
+  for (int priority = P2PPriority::kReserved + 1; priority < P2PPriority::kNumLevels; ++priority) {
+    if (scheduled_ack_sequence_number_[priority] == -1ULL || timestamp_ns < scheduled_ack_deadline_ns_[priority]) {
+      continue;
+    }
+    if (CommitACKPacket(priority, scheduled_ack_sequence_number_[priority], /*is_init=*/false)) {
+      scheduled_ack_sequence_number_[priority] = -1ULL;
+    }
+  }
+}
+
+template<int kCapacity, Endianness LocalEndianness, typename ByteStream> 
+void P2PPacketOutputStream<kCapacity, LocalEndianness, ByteStream>::PiggybackACK(P2PPacket *packet) {
+  P2PHeader &header = *packet->header();
+  if (header.is_ack || header.is_init) { return; }
+  uint8_t length = NetworkToLocal<LocalEndianness>(packet->length());
+  if (header.has_ack) {
+    // The ACK from a previous transmission may be outdated.
+    length -= sizeof(P2PPiggybackedACK);
+    header.has_ack = 0;
+  }
+  if (length + sizeof(P2PPiggybackedACK) <= kP2PMaxContentLength) {
+    // Only carry ACKs of packets with the same or a lower priority, which would not be sent
+    // earlier in their own packet.
+    for (int priority = header.priority; priority < P2PPriority::kNumLevels; ++priority) {
+      if (priority == P2PPriority::kReserved || scheduled_ack_sequence_number_[priority] == -1ULL) { continue; }
+      P2PPiggybackedACK ack;
+      ack.priority = priority;
+      ack.sequence_number = scheduled_ack_sequence_number_[priority];
+      if (!credit_callback_(priority, &ack.credit)) {
+        ack.credit.num_bytes = 0;
+        ack.credit.num_packets = 0;
+      }
+      memcpy(&packet->content()[length], &ack, sizeof(ack));
+      length += sizeof(ack);
+      header.has_ack = 1;
+      scheduled_ack_sequence_number_[priority] = -1ULL;
+      break;
+    }
+  }
+  packet->length() = LocalToNetwork<LocalEndianness>(length);
+}
+
+template<int kCapacity, Endianness LocalEndianness, typename ByteStream> 
+void P2PPacketOutputStream<kCapacity, LocalEndianness, ByteStream>::AdvertiseCredit(P2PPacket *packet) {
+  P2PHeader &header = *packet->header();
+  if (!header.is_ack || header.is_init || header.priority + 1 >= P2PPriority::kNumLevels) { return; }
+  const uint8_t length = NetworkToLocal<LocalEndianness>(packet->length());
+  if (length > 0 && packet->content()[0] != kP2PPositiveACK) { return; }
+  // ACK packets have a priority one level higher than the packets they acknowledge.
+  P2PCredit credit;
+  if (!credit_callback_(header.priority + 1, &credit)) { return; }
+  packet->content()[0] = kP2PPositiveACK;
+  memcpy(&packet->content()[1], &credit, sizeof(credit));
+  packet->length() = LocalToNetwork<LocalEndianness>(static_cast<uint8_t>(1 + sizeof(credit)));
+}
+
+template<int kCapacity, Endianness LocalEndianness, typename ByteStream> 
+void P2PPacketOutputStream<kCapacity, LocalEndianness, ByteStream>::ClearScheduledACKs() {
+  for (int i = 0; i < P2PPriority::kNumLevels; ++i) {
+    scheduled_ack_sequence_number_[i] = -1ULL;
+  }
+}
+
+template<int kCapacity, Endianness LocalEndianness, typename ByteStream> 
+bool P2PPacketOutputStream<kCapacity, LocalEndianness, ByteStream>::IsAcknowledged(const P2PPacket &packet) const {
+  const int priority = packet.header()->priority;
+  if (packet.header()->is_init) {
+    return packet.sequence_number() == last_acked_init_sequence_number_[priority];
+  }
+  return last_acked_sequence_number_[priority] != -1ULL &&
+    !P2PSequenceNumberIsAfter(packet.sequence_number(), last_acked_sequence_number_[priority]);
+}
+
+template<int kCapacity, Endianness LocalEndianness, typename ByteStream> 
+void P2PPacketOutputStream<kCapacity, LocalEndianness, ByteStream>::SampleRoundTripTime(P2PPriority priority, uint64_t rtt_ns) {
+  // Jacobson/Karels estimator, as in TCP (RFC 6298).
+  uint64_t &srtt = stats_.smoothed_rtt_ns_[priority];
+  uint64_t &rttvar = stats_.rtt_variance_ns_[priority];
+  if (srtt == -1ULL) {
+    srtt = rtt_ns;
+    rttvar = rtt_ns / 2;
+  } else {
+    const uint64_t deviation = srtt > rtt_ns ? srtt - rtt_ns : rtt_ns - srtt;
+    rttvar = (3 * rttvar + deviation) / 4;
+    srtt = (7 * srtt + rtt_ns) / 8;
+  }
+  // A new estimate also ends the backoff.
+  stats_.retransmission_timeout_ns_[priority] = std::max<uint64_t>(kP2PMinRetransmissionTimeoutNs, std::min<uint64_t>(srtt + 4 * rttvar, kP2PMaxRetransmissionTimeoutNs));
+}
+
+template<int kCapacity, Endianness LocalEndianness, typename ByteStream> 
+void P2PPacketOutputStream<kCapacity, LocalEndianness, ByteStream>::ConsumeAcknowledgedPackets(P2PPriority priority) {
+  while (num_packets_in_flight_[priority] > 0) {
+    const P2PPacket *packet = packet_buffer_.OldestValue(priority);
+    if (!IsAcknowledged(*packet) || IsBeingSent(packet)) {
+      // Not acknowledged, or it will be consumed once sent.
+      break;
+    }
+    if (send_index_[priority] == 0) {
+      // A preempted packet that was acknowledged meanwhile: the other end drops its partial
+      // content once the next packet starts.
+      is_send_in_progress_[priority] = false;
+    }
+    packet_released_callback_(*packet);
+    packet_buffer_.Consume(priority);
+    --num_packets_in_flight_[priority];
+    send_index_[priority] = std::max(send_index_[priority] - 1, 0);
+  }
+  GoBackToNegativelyAcknowledgedPacket(priority);
+}
+
+template<int kCapacity, Endianness LocalEndianness, typename ByteStream> 
+void P2PPacketOutputStream<kCapacity, LocalEndianness, ByteStream>::EncodeNextBytes(int max_length) {
+  const P2PPriority priority = current_packet_->header()->priority;
+  const int length = total_packet_bytes_[priority] - sizeof(P2PHeader) - sizeof(P2PFooter);
+  staging_buffer_length_ = 0;
+  staging_buffer_offset_ = 0;
+  if (current_packet_->header()->is_cobs) {
+    EncodeNextCOBSContentBytes(max_length);
+  } else {
+    EncodeNextEscapedContentBytes(max_length);
+  }
+  if (content_offset_ >= length && staging_buffer_length_ + static_cast<int>(sizeof(P2PFooter)) <= max_length) {
+    // The footer is the checksum.
+    staging_buffer_[staging_buffer_length_++] = LocalToNetwork<LocalEndianness>(static_cast<P2PChecksumType>(checksum_[priority] % kP2PChecksumModulo));
+    footer_encoded_ = true;
+  }
+}
+
+template<int kCapacity, Endianness LocalEndianness, typename ByteStream> 
+void P2PPacketOutputStream<kCapacity, LocalEndianness, ByteStream>::EncodeNextEscapedContentBytes(int max_length) {
+  const P2PPriority priority = current_packet_->header()->priority;
+  const int length = total_packet_bytes_[priority] - sizeof(P2PHeader) - sizeof(P2PFooter);
+  while (content_offset_ < length && staging_buffer_length_ < max_length) {
+    const uint8_t *content = &current_packet_->content()[content_offset_];
+    if (content[0] == kP2PStartToken || content[0] == kP2PSpecialToken) {
+      // Content bytes matching a token are followed by a special token.
+      if (staging_buffer_length_ + 2 > max_length) { break; }
+      staging_buffer_[staging_buffer_length_++] = content[0];
+      staging_buffer_[staging_buffer_length_++] = kP2PSpecialToken;
+      checksum_[priority] += content[0];
+      ++content_offset_;
+      continue;
+    }
+    // Bytes other than tokens are sent as they are: copy them in one go.
+    const int run_length = P2PFindToken(content, std::min(length - content_offset_, max_length - staging_buffer_length_));
+    memcpy(&staging_buffer_[staging_buffer_length_], content, run_length);
+    checksum_[priority] += P2PSumBytes(content, run_length);
+    staging_buffer_length_ += run_length;
+    content_offset_ += run_length;
+  }
+}
+
+template<int kCapacity, Endianness LocalEndianness, typename ByteStream> 
+void P2PPacketOutputStream<kCapacity, LocalEndianness, ByteStream>::EncodeNextCOBSContentBytes(int max_length) {
+  const P2PPriority priority = current_packet_->header()->priority;
+  const int length = total_packet_bytes_[priority] - sizeof(P2PHeader) - sizeof(P2PFooter);
+  while (content_offset_ < length && staging_buffer_length_ < max_length) {
+    const uint8_t *content = &current_packet_->content()[content_offset_];
+    if (cobs_block_pending_bytes_ < 0) {
+      // New block up to the next start token.
+      cobs_block_length_ = P2PFindStartToken(content, std::min(length - content_offset_, kP2PCOBSMaxBlockLength));
+      cobs_block_pending_bytes_ = cobs_block_length_;
+      staging_buffer_[staging_buffer_length_++] = P2PCOBSBlockCode(cobs_block_length_);
+    } else {
+      const int run_length = std::min(cobs_block_pending_bytes_, max_length - staging_buffer_length_);
+      memcpy(&staging_buffer_[staging_buffer_length_], content, run_length);
+      checksum_[priority] += P2PSumBytes(content, run_length);
+      staging_buffer_length_ += run_length;
+      content_offset_ += run_length;
+      cobs_block_pending_bytes_ -= run_length;
+    }
+    if (cobs_block_pending_bytes_ == 0) {
+      if (cobs_block_length_ < kP2PCOBSMaxBlockLength && content_offset_ < length) {
+        // Drop the start token delimiting the block. The other end restores it as soon as it
+        // receives the last byte of the block.
+        checksum_[priority] += kP2PStartToken;
+        ++content_offset_;
+      }
+      cobs_block_pending_bytes_ = -1;
+    }
+  }
+}
+
+template<int kCapacity, Endianness LocalEndianness, typename ByteStream> uint64_t P2PPacketOutputStream<kCapacity, LocalEndianness, ByteStream>::Run() {
+  run_callback_();
   uint64_t time_until_next_event = 0;
+  is_idle_ = false;
   switch (state_) {
     case kGettingNextPacket:
       {
-        current_packet_ = packet_buffer_.OldestValue();
+        for (uint32_t levels = packet_buffer_.occupancy().levels(); levels != 0; levels &= levels - 1) {
+          ConsumeAcknowledgedPackets(__builtin_ctz(levels));
+        }
+        const uint64_t timestamp_ns = timer_.GetLocalNanoseconds();
+        // Close the rate windows while idle as well.
+        stats_.packet_rate_.Update(timestamp_ns);
+        stats_.byte_rate_.Update(timestamp_ns);
+        stats_.burst_ingestion_ns_per_byte_ = byte_stream_.GetBurstIngestionNanosecondsPerByte();
+        CommitExpiredACKs(timestamp_ns);
+        current_packet_ = NextPacketToSend(timestamp_ns);
         if (current_packet_ == NULL) {
-          // No more packets to send: keep waiting for one.
+          is_idle_ = true;
+          // No more packets to send: keep waiting for one, for the next retransmission, or for
+          // the next ACK holdoff to expire.
+          for (int priority = 0; priority < P2PPriority::kNumLevels; ++priority) {
+            uint64_t wait_ns = -1ULL;
+            if (HasPacketToSend(priority, timestamp_ns)) {
+              // Held back by the scheduler.
+              wait_ns = scheduler_->TimeUntilEligibleNs(priority, NextPacketLength(priority), timestamp_ns);
+            } else if (packet_buffer_.Size(priority) > 0) {
+              wait_ns = RetransmissionTimestampNs(priority) - timestamp_ns;
+            }
+            if (scheduled_ack_sequence_number_[priority] != -1ULL) {
+              wait_ns = std::min(wait_ns, scheduled_ack_deadline_ns_[priority] - timestamp_ns);
+            }
+            if (wait_ns != -1ULL && (time_until_next_event == 0 || wait_ns < time_until_next_event)) {
+              time_until_next_event = wait_ns;
+            }
+          }
           break;
         }
 
         // Start sending the new packet.
         P2PPriority priority = current_packet_->header()->priority;
+        is_send_in_progress_[priority] = true;
         if (!current_packet_->header()->is_continuation) {
+          PiggybackACK(current_packet_);
+          AdvertiseCredit(current_packet_);
+          // Handshake packets must be received by any other end.
+          current_packet_->header()->is_cobs = framing_ == kCOBSFraming && !current_packet_->header()->is_init;
           // Full packet length.
           total_packet_bytes_[priority] = sizeof(P2PHeader) + NetworkToLocal<LocalEndianness>(current_packet_->length()) + sizeof(P2PFooter);
+          checksum_[priority] = current_packet_->HeaderChecksum();
         } else {
           // Continuation without a previous original packet is invalid.
           ASSERT(total_packet_bytes_[priority] >= 0);
         }
+        // The length field of a continuation is the remaining content length.
+        content_offset_ = total_packet_bytes_[priority] - sizeof(P2PHeader) - sizeof(P2PFooter) - NetworkToLocal<LocalEndianness>(current_packet_->length());
+        footer_encoded_ = false;
+        // COBS content always starts with a new block, even in continuations.
+        cobs_block_pending_bytes_ = -1;
         pending_packet_bytes_ = sizeof(P2PHeader);
 
         state_ = kSendingHeaderBurst;
-        total_burst_bytes_ = std::min(pending_packet_bytes_, byte_stream_.GetBurstMaxLength());
+        total_burst_bytes_ = std::min(pending_packet_bytes_, BurstMaxLength());
         pending_burst_bytes_ = total_burst_bytes_;
         break;
       }
@@ -347,74 +901,94 @@ template<int kCapacity, Endianness LocalEndianness> uint64_t P2PPacketOutputStre
         pending_burst_bytes_);
       pending_packet_bytes_ -= written_bytes;
       pending_burst_bytes_ -= written_bytes;
+      num_sent_bytes_ += written_bytes;
+      scheduler_->OnBytesSent(current_packet_->header()->priority, written_bytes, timer_.GetLocalNanoseconds());
+      stats_.byte_rate_.Add(written_bytes, timer_.GetLocalNanoseconds());
 
-      const uint64_t timestamp_ns = timer_.GetLocalNanoseconds();
-      if (pending_packet_bytes_ <= 0) { 
-        after_burst_wait_end_timestamp_ns_ = timestamp_ns + total_burst_bytes_ * byte_stream_.GetBurstIngestionNanosecondsPerByte();
-        state_ = kWaitingForHeaderBurstIngestion;
-        break;
-      }
-
-      if (pending_burst_bytes_ <= 0) {
-        // Burst fully sent: calculate when to start the next burst.
-        after_burst_wait_end_timestamp_ns_ = timestamp_ns + total_burst_bytes_ * byte_stream_.GetBurstIngestionNanosecondsPerByte();
+      if (pending_packet_bytes_ <= 0 || pending_burst_bytes_ <= 0) {
+        // Header or burst fully sent: calculate when to start the next burst.
+        after_burst_wait_end_timestamp_ns_ = timer_.GetLocalNanoseconds() + total_burst_bytes_ * byte_stream_.GetBurstIngestionNanosecondsPerByte();
         state_ = kWaitingForHeaderBurstIngestion;
-        break;
       }
-
       break;
     }
 
     case kWaitingForHeaderBurstIngestion:
       {
         const uint64_t timestamp_ns = timer_.GetLocalNanoseconds();
-        if (timestamp_ns < after_burst_wait_end_timestamp_ns_) {
-          // Ingestion time not expired: keep waiting.
+        if (timestamp_ns < after_burst_wait_end_timestamp_ns_ && credit_bytes() == 0) {
+          // Ingestion time not expired, and the other end did not advertise room for more
+          // bytes: keep waiting.
           time_until_next_event = after_burst_wait_end_timestamp_ns_ - timestamp_ns;
           break;
         }
 
         if (pending_packet_bytes_ <= 0) { 
-          // Header was fully sent just now: adjust the pending bytes: adjust the pending bytes.
-          if (current_packet_->header()->is_continuation) {
-            pending_packet_bytes_ = NetworkToLocal<LocalEndianness>(current_packet_->length()) + sizeof(P2PFooter);
-          } else {
-            pending_packet_bytes_ = total_packet_bytes_[current_packet_->header()->priority] - sizeof(P2PHeader);
-          }
-
+          // Header was fully sent just now: send the content and footer, which are encoded
+          // on the fly.
           state_ = kSendingBurst;
-          total_burst_bytes_ = std::min(pending_packet_bytes_, byte_stream_.GetBurstMaxLength());
+          staging_buffer_length_ = 0;
+          staging_buffer_offset_ = 0;
+          total_burst_bytes_ = BurstMaxLength();
           pending_burst_bytes_ = total_burst_bytes_;
           break;
         }
 
         state_ = kSendingHeaderBurst;
-        total_burst_bytes_ = std::min(pending_packet_bytes_, byte_stream_.GetBurstMaxLength());
+        total_burst_bytes_ = std::min(pending_packet_bytes_, BurstMaxLength());
         pending_burst_bytes_ = total_burst_bytes_;
+        break;
       }
 
     case kSendingBurst:
       {
         P2PPriority priority = current_packet_->header()->priority;
-        const int written_bytes = byte_stream_.Write(
-          &reinterpret_cast<const uint8_t *>(current_packet_->header())[total_packet_bytes_[priority] - pending_packet_bytes_],
-          std::min(byte_stream_.GetAtomicSendMaxLength(), pending_burst_bytes_));
-        pending_packet_bytes_ -= written_bytes;
+        if (staging_buffer_offset_ >= staging_buffer_length_) {
+          // Encode the next bytes to send. Allow exceeding the atomic send length for escape
+          // sequences, but never the burst length.
+          const int max_length = std::min(pending_burst_bytes_, std::min(kP2POutputStagingBufferLength, std::max(2, byte_stream_.GetAtomicSendMaxLength())));
+          EncodeNextBytes(max_length);
+        }
+        const uint64_t timestamp_ns = timer_.GetLocalNanoseconds();
+        if (staging_buffer_length_ == 0) {
+          // The next escape sequence does not fit in the burst: finish the burst early.
+          after_burst_wait_end_timestamp_ns_ = timestamp_ns + (total_burst_bytes_ - pending_burst_bytes_) * byte_stream_.GetBurstIngestionNanosecondsPerByte();
+          state_ = kWaitingForBurstIngestion;
+          break;
+        }
+
+        const int written_bytes = byte_stream_.Write(&staging_buffer_[staging_buffer_offset_], staging_buffer_length_ - staging_buffer_offset_);
+        staging_buffer_offset_ += written_bytes;
         pending_burst_bytes_ -= written_bytes;
+        num_sent_bytes_ += written_bytes;
+        scheduler_->OnBytesSent(priority, written_bytes, timestamp_ns);
+        stats_.byte_rate_.Add(written_bytes, timestamp_ns);
+        if (staging_buffer_offset_ < staging_buffer_length_) {
+          // The byte stream could not take all the bytes: keep writing them in the next run.
+          break;
+        }
 
-        const uint64_t timestamp_ns = timer_.GetLocalNanoseconds();
-        if (pending_packet_bytes_ <= 0) {
+        if (footer_encoded_) {
+          // Packet fully sent.
+          current_packet_->send_time_ns() = timestamp_ns;
+          current_packet_->send_end_byte_count() = num_sent_bytes_;
+          stats_.packet_rate_.Add(1, timestamp_ns);
+          if (current_packet_->num_transmissions() < 0xff) { ++current_packet_->num_transmissions(); }
           if (!current_packet_->header()->is_init) {
             // is_init is filtered to avoid confusing all following packets with retransmissions,
             // as is_init packets have a random sequence number.
-            if (last_sent_sequence_number_[priority] == -1ULL || 
-              current_packet_->sequence_number() > last_sent_sequence_number_[priority]) {
-              last_sent_sequence_number_[priority] = current_packet_->sequence_number();
+            const bool requires_ack = current_packet_->header()->requires_ack;
+            if (!requires_ack || last_sent_reliable_sequence_number_[priority] == -1ULL || 
+                P2PSequenceNumberIsAfter(current_packet_->sequence_number(), last_sent_reliable_sequence_number_[priority])) {
+              if (requires_ack) {
+                last_sent_reliable_sequence_number_[priority] = current_packet_->sequence_number();
+              }
               // Not a retransmission: update latency stats.
               const uint64_t packet_delay = timestamp_ns - current_packet_->commit_time_ns();
               ++stats_.total_packets_[priority];
               stats_.total_packet_delay_ns_[priority] += packet_delay;
               stats_.total_packet_delay_per_byte_ns_[priority] += packet_delay / total_packet_bytes_[priority];
+              stats_.packet_delay_histogram_[priority].Add(packet_delay);
               if (current_packet_->header()->requires_ack) {
                 ++stats_.total_reliable_packets_[priority];
               }
@@ -424,11 +998,19 @@ template<int kCapacity, Endianness LocalEndianness> uint64_t P2PPacketOutputStre
             }
           }
 
+          // The filter may reset the windows, so read the send index after it.
+          is_send_in_progress_[priority] = false;
           if (packet_filter_(*current_packet_)) {
-            packet_buffer_.Consume(current_packet_->header()->priority);
+            packet_released_callback_(*current_packet_);
+            packet_buffer_.Consume(priority, send_index_[priority]);
+          } else {
+            // Keep the packet in flight until it is acknowledged.
+            num_packets_in_flight_[priority] = std::max(num_packets_in_flight_[priority], send_index_[priority] + 1);
+            ++send_index_[priority];
           }
+          GoBackToNegativelyAcknowledgedPacket(priority);
 
-          after_burst_wait_end_timestamp_ns_ = timestamp_ns + total_burst_bytes_ * byte_stream_.GetBurstIngestionNanosecondsPerByte();
+          after_burst_wait_end_timestamp_ns_ = timestamp_ns + (total_burst_bytes_ - pending_burst_bytes_) * byte_stream_.GetBurstIngestionNanosecondsPerByte();
           state_ = kWaitingForBurstIngestion;
           break;
         }
@@ -440,14 +1022,19 @@ template<int kCapacity, Endianness LocalEndianness> uint64_t P2PPacketOutputStre
           break;
         }
 
-        // Header has been sent already: we can break the transfer for a higher priority
-        // packet now.
-        const P2PPacket *maybe_higher_priority_packet = packet_buffer_.OldestValue();
-        if (maybe_higher_priority_packet != NULL && maybe_higher_priority_packet != current_packet_) {
+        // Header has been sent already and there are no escape sequences in progress: we can
+        // break the transfer for a higher priority packet now, if the scheduler allows it.
+        // Only the priorities with packets are checked.
+        bool higher_priority_packet_waiting = false;
+        for (uint32_t levels = packet_buffer_.occupancy().levels(); levels != 0 && !higher_priority_packet_waiting; levels &= levels - 1) {
+          const int other_priority = __builtin_ctz(levels);
+          higher_priority_packet_waiting = scheduler_->CanPreempt(other_priority, priority) && HasPacketToSend(other_priority, timestamp_ns);
+        }
+        if (higher_priority_packet_waiting) {
           // There is a higher priority packet waiting: mark the current one as needing
           // continuation.
           current_packet_->header()->is_continuation = 1;
-          current_packet_->length() = LocalToNetwork<LocalEndianness>(pending_packet_bytes_ - sizeof(P2PFooter));
+          current_packet_->length() = LocalToNetwork<LocalEndianness>(static_cast<uint8_t>(total_packet_bytes_[priority] - sizeof(P2PHeader) - sizeof(P2PFooter) - content_offset_));
           after_burst_wait_end_timestamp_ns_ = timestamp_ns + (total_burst_bytes_ - pending_burst_bytes_) * byte_stream_.GetBurstIngestionNanosecondsPerByte();
           state_ = kWaitingForPartialBurstIngestionBeforeHigherPriorityPacket;
         }
@@ -458,21 +1045,22 @@ template<int kCapacity, Endianness LocalEndianness> uint64_t P2PPacketOutputStre
     case kWaitingForBurstIngestion:
       {
         const uint64_t timestamp_ns = timer_.GetLocalNanoseconds();
-        if (timestamp_ns < after_burst_wait_end_timestamp_ns_) {
-          // Ingestion time not expired: keep waiting.
+        if (timestamp_ns < after_burst_wait_end_timestamp_ns_ && credit_bytes() == 0) {
+          // Ingestion time not expired, and the other end did not advertise room for more
+          // bytes: keep waiting.
           time_until_next_event = after_burst_wait_end_timestamp_ns_ - timestamp_ns;
           break;
         }
 
         // Burst should have been ingested by the other end.
-        if (pending_packet_bytes_ <= 0) {
+        if (footer_encoded_ && staging_buffer_offset_ >= staging_buffer_length_) {
           // No more bursts: next packet.
           state_ = kGettingNextPacket;
           break;
         }
 
         state_ = kSendingBurst;
-        total_burst_bytes_ = std::min(pending_packet_bytes_, byte_stream_.GetBurstMaxLength());
+        total_burst_bytes_ = BurstMaxLength();
         pending_burst_bytes_ = total_burst_bytes_;
 
         break;
@@ -481,8 +1069,9 @@ template<int kCapacity, Endianness LocalEndianness> uint64_t P2PPacketOutputStre
     case kWaitingForPartialBurstIngestionBeforeHigherPriorityPacket:
       {
         const uint64_t timestamp_ns = timer_.GetLocalNanoseconds();
-        if (timestamp_ns < after_burst_wait_end_timestamp_ns_) {
-          // Ingestion time not expired: keep waiting.
+        if (timestamp_ns < after_burst_wait_end_timestamp_ns_ && credit_bytes() == 0) {
+          // Ingestion time not expired, and the other end did not advertise room for more
+          // bytes: keep waiting.
           time_until_next_event = after_burst_wait_end_timestamp_ns_ - timestamp_ns;
           break;
         }
@@ -494,111 +1083,243 @@ template<int kCapacity, Endianness LocalEndianness> uint64_t P2PPacketOutputStre
   return time_until_next_event;
 }
 
-template<int kCapacity, Endianness LocalEndianness> 
-int P2PPacketOutputStream<kCapacity, LocalEndianness>::NumCommittedPackets() const {
+template<int kCapacity, Endianness LocalEndianness, typename ByteStream> 
+int P2PPacketOutputStream<kCapacity, LocalEndianness, ByteStream>::NumCommittedPackets() const {
   int num_packets = 0;
-  for (int priority = 0; priority < P2PPriority::kNumLevels; ++priority) {
-    num_packets += packet_buffer_.Size(priority);
+  for (uint32_t levels = packet_buffer_.occupancy().levels(); levels != 0; levels &= levels - 1) {
+    num_packets += packet_buffer_.Size(__builtin_ctz(levels));
   }
   return num_packets;
 }
 
-template<int kInputCapacity, int kOutputCapacity, Endianness LocalEndianness>
-P2PPacketStream<kInputCapacity, kOutputCapacity, LocalEndianness>::P2PPacketStream(P2PByteStreamInterface<LocalEndianness> *byte_stream, TimerInterface *timer, GUIDFactoryInterface &guid_factory)
-    : input_(byte_stream, timer), output_(byte_stream, timer), 
-      handshake_id_(guid_factory.CreateGUID<kSequenceNumberNumBytes, kP2PLowestToken>()), handshake_done_(false) {
+template<int kInputCapacity, int kOutputCapacity, Endianness LocalEndianness, typename ByteStream>
+P2PPacketStream<kInputCapacity, kOutputCapacity, LocalEndianness, ByteStream>::P2PPacketStream(ByteStream *byte_stream, TimerInterface *timer, GUIDFactoryInterface &guid_factory, bool is_full_duplex)
+    : input_(byte_stream, timer), output_(byte_stream, timer), is_full_duplex_(is_full_duplex),
+      handshake_id_(guid_factory.CreateGUID<kSequenceNumberNumBytes, kP2PLowestToken>()), handshake_done_(false),
+      has_other_end_started_(false), num_handshake_resets_(0), output_session_id_(-1ULL), preferred_framing_(kCOBSFraming), other_end_framings_(0) {
   for (int i = 0; i < P2PPriority::kNumLevels; ++i) {
     last_init_sequence_number_[i] = -1ULL;
+    input_credit_[i].store(0, std::memory_order_relaxed);
   }
+
+  if (!is_full_duplex_) {
+    // Both directions draw from the queues of either, so that a burst in one priority or
+    // direction is not dropped while the others have room. The queues of full-duplex streams
+    // are used from different threads, so each direction keeps its own.
+    input_.packet_buffer_.Share(&output_.packet_buffer_);
+  }
+  // Received packets, and the ACKs and handshake replies, always find room for the packet
+  // being built. The reservations keep room for them once committed.
+  for (int i = 0; i < P2PPriority::kNumLevels; ++i) {
+    input_.queue_reservation(i, kP2PPacketQueueReservationLength);
+  }
+  output_.queue_reservation(P2PPriority::kReserved, kP2PPacketQueueReservationLength);
   
   ResetInput();
 
   input_.packet_filter(P2PPacketFilter(&ShouldCommitInputPacket, this));
+  input_.packet_corrupted_callback(P2PPacketCorruptedCallback(&OnCorruptedInputPacket, this));
+  input_.run_callback(P2PRunCallback(&OnInputRun, this));
+  output_.credit_callback(P2PCreditCallback(&GetInputCredit, this));
   output_.packet_filter(P2PPacketFilter(&ShouldConsumeOutputPacket, this));
+  output_.run_callback(P2PRunCallback(&OnOutputRun, this));
 
   // Schedule handshake packet. The handshake reply is a regular ACK with is_init.
   P2PPriority init_priority = P2PPriority::kHigh;
   StatusOr<P2PMutablePacketView> init_packet_view = output_.NewPacket(init_priority);
   ASSERT(init_packet_view.ok());
   init_packet_view->packet()->header()->is_init = 1;
+  // Announce the framings this end can receive.
+  init_packet_view->content()[0] = 1 << kCOBSFraming;
+  init_packet_view->length() = 1;
   output_.Commit(init_priority, /*guaranteed_delivery=*/true, /*seq_number=*/handshake_id_);
 }
 
-template<int kInputCapacity, int kOutputCapacity, Endianness LocalEndianness>
-void P2PPacketStream<kInputCapacity, kOutputCapacity, LocalEndianness>::ResetInput() {
+template<int kInputCapacity, int kOutputCapacity, Endianness LocalEndianness, typename ByteStream>
+void P2PPacketStream<kInputCapacity, kOutputCapacity, LocalEndianness, ByteStream>::ResetInput() {
   input_.Reset();
   for (int i = 0; i < P2PPriority::kNumLevels; ++i) {
-    last_rx_sequence_number_[i] = -1ULL;
+    next_rx_sequence_number_[i] = 0;
+    last_rx_packet_end_byte_count_[i] = input_.num_received_bytes();
+    input_credit_[i].store(0, std::memory_order_relaxed);
   }
+  // ACKs for the packets received so far are not valid anymore. The packets that post events
+  // check that there is room for them first.
+  ControlEvent event;
+  event.type = ControlEvent::kClearScheduledACKs;
+  ASSERT(PostControlEvent(event));
 }
 
-template<int kInputCapacity, int kOutputCapacity, Endianness LocalEndianness>
-void P2PPacketStream<kInputCapacity, kOutputCapacity, LocalEndianness>::ResetOutputSession(const P2PPacket &handshake_request) {
+template<int kInputCapacity, int kOutputCapacity, Endianness LocalEndianness, typename ByteStream>
+void P2PPacketStream<kInputCapacity, kOutputCapacity, LocalEndianness, ByteStream>::ResetOutputSession(const P2PPacket &handshake_request) {
   // Purge ACKs in output buffer (except for those of the ongoing handshake).
   for (int p = 0; p < P2PPriority::kNumLevels; ++p) {
-    // Cache packets to copy because Size() could change within the loop.
-    const int num_packets_to_maybe_copy = output_.packet_buffer_.Size(p);
-    for (int i = 0; i < num_packets_to_maybe_copy; ++i) {
-      const P2PPacket packet_copy = *output_.packet_buffer_.OldestValue(p);
-      output_.packet_buffer_.Consume(p);
-      if (!packet_copy.header()->is_ack ||
-          packet_copy.sequence_number() == handshake_request.sequence_number()) {
-        output_.packet_buffer_.NewValue(p) = packet_copy;
-        output_.packet_buffer_.Commit(p);
+    int i = 0;
+    while (i < output_.packet_buffer_.Size(p)) {
+      const P2PPacket *packet = output_.packet_buffer_.OldestValue(p, i);
+      if (packet->header()->is_ack &&
+          packet->sequence_number() != handshake_request.sequence_number()) {
+        output_.packet_buffer_.Consume(p, i);
+      } else {
+        ++i;
       }
     }
   }
 
   // Reset continuation packets to the original packets.
   for (int p = 0; p < P2PPriority::kNumLevels; ++p) {
-    P2PPacket *packet = output_.packet_buffer_.OldestValue(p);
-    if (packet != NULL && packet->header()->is_continuation) {
-      packet->header()->is_continuation = 0;
-      ASSERT(output_.total_packet_bytes_[p] != -1);
-      packet->length() = LocalToNetwork<LocalEndianness>(output_.total_packet_bytes_[p] - sizeof(P2PHeader) - sizeof(P2PFooter));
+    for (int i = 0; i < output_.packet_buffer_.Size(p); ++i) {
+      P2PPacket *packet = output_.packet_buffer_.OldestValue(p, i);
+      if (packet->header()->is_continuation) {
+        packet->header()->is_continuation = 0;
+        ASSERT(output_.total_packet_bytes_[p] != -1);
+        packet->length() = LocalToNetwork<LocalEndianness>(output_.total_packet_bytes_[p] - sizeof(P2PHeader) - sizeof(P2PFooter));
+      }
+    }
+  }
+
+  // Packets were moved in the queues: send them all again.
+  output_.ResetWindows();
+
+  if (handshake_request.sequence_number() != output_session_id_) {
+    // The other end expects reliable packets numbered from 0 again. Duplicates of the
+    // handshake request must not restart the numbering, as the other end may have received
+    // packets with the new numbers already.
+    output_session_id_ = handshake_request.sequence_number();
+    for (int p = 0; p < P2PPriority::kNumLevels; ++p) {
+      uint64_t sequence_number = 0;
+      for (int i = 0; i < output_.packet_buffer_.Size(p); ++i) {
+        P2PPacket *packet = output_.packet_buffer_.OldestValue(p, i);
+        if (packet->header()->requires_ack && !packet->header()->is_init) {
+          packet->sequence_number() = sequence_number++;
+        }
+      }
+      output_.current_reliable_sequence_number_[p] = sequence_number;
+      output_.last_sent_reliable_sequence_number_[p] = -1ULL;
     }
   }
 }
 
-template<int kInputCapacity, int kOutputCapacity, Endianness LocalEndianness>
-bool P2PPacketStream<kInputCapacity, kOutputCapacity, LocalEndianness>::IsACKCommittedForPacket(const P2PPacket &packet) {
+template<int kInputCapacity, int kOutputCapacity, Endianness LocalEndianness, typename ByteStream>
+void P2PPacketStream<kInputCapacity, kOutputCapacity, LocalEndianness, ByteStream>::UpdateOutputFraming() {
+  if (other_end_framings_ & (1 << preferred_framing_)) {
+    output_.framing(preferred_framing_);
+  } else {
+    output_.framing(kEscapedFraming);
+  }
+}
+
+template<int kInputCapacity, int kOutputCapacity, Endianness LocalEndianness, typename ByteStream>
+bool P2PPacketStream<kInputCapacity, kOutputCapacity, LocalEndianness, ByteStream>::PostControlEvent(const ControlEvent &event) {
+  ControlEvent *new_event = control_mailbox_.NewValue();
+  if (new_event == NULL) { return false; }
+  *new_event = event;
+  control_mailbox_.Commit();
+  if (!is_full_duplex_) {
+    ApplyControlEvents();
+  }
+  return true;
+}
+
+template<int kInputCapacity, int kOutputCapacity, Endianness LocalEndianness, typename ByteStream>
+bool P2PPacketStream<kInputCapacity, kOutputCapacity, LocalEndianness, ByteStream>::ScheduleACKWithThrottling(P2PPriority priority, uint64_t sequence_number, bool is_init) {
+  ControlEvent event;
+  event.type = ControlEvent::kScheduleACK;
+  event.priority = priority;
+  event.sequence_number = sequence_number;
+  event.is_init = is_init;
+  return PostControlEvent(event);
+}
+
+template<int kInputCapacity, int kOutputCapacity, Endianness LocalEndianness, typename ByteStream>
+void P2PPacketStream<kInputCapacity, kOutputCapacity, LocalEndianness, ByteStream>::ApplyControlEvents() {
+  const ControlEvent *event;
+  while ((event = control_mailbox_.OldestValue()) != NULL) {
+    ApplyControlEvent(*event);
+    control_mailbox_.Consume();
+  }
+}
+
+template<int kInputCapacity, int kOutputCapacity, Endianness LocalEndianness, typename ByteStream>
+void P2PPacketStream<kInputCapacity, kOutputCapacity, LocalEndianness, ByteStream>::ApplyControlEvent(const ControlEvent &event) {
+  switch (event.type) {
+    case ControlEvent::kACKReceived:
+      // The credit refers to the acknowledged packet, which must still be in flight.
+      output_.ReceiveCredit(event.priority, event.sequence_number, event.credit);
+      output_.AcknowledgePackets(event.priority, event.sequence_number, event.is_init);
+      break;
+    case ControlEvent::kNACKReceived:
+      output_.NegativelyAcknowledgePacket(event.priority, event.sequence_number);
+      break;
+    case ControlEvent::kScheduleACK:
+      {
+        const bool ack_ok = ScheduleACK(event.priority, event.sequence_number, event.is_init);
+        // Only handshake ACKs may fail, and the session was reset, so there should always be
+        // space in the output queue at the ACK's priority, if the handshake is at the highest
+        // priority.
+        ASSERT(ack_ok);
+      }
+      break;
+    case ControlEvent::kScheduleNACK:
+      ScheduleNACK(event.priority, event.sequence_number);
+      break;
+    case ControlEvent::kClearScheduledACKs:
+      output_.ClearScheduledACKs();
+      break;
+    case ControlEvent::kOtherEndFramingsReceived:
+      other_end_framings_ = event.framings;
+      UpdateOutputFraming();
+      break;
+  }
+}
+
+template<int kInputCapacity, int kOutputCapacity, Endianness LocalEndianness, typename ByteStream>
+bool P2PPacketStream<kInputCapacity, kOutputCapacity, LocalEndianness, ByteStream>::ScheduleACK(P2PPriority priority, uint64_t sequence_number, bool is_init) {
+  if (!is_init) {
+    output_.ScheduleACK(priority, sequence_number);
+    return true;
+  }
   // ACKs always have a priority one level higher to avoid deadlocks.
-  const P2PPriority ack_priority = packet.header()->priority - 1;
-  bool ack_found = false;
+  const P2PPriority ack_priority = priority - 1;
   for (int i = 0; i < output_.packet_buffer_.Size(ack_priority); ++i) {
     const P2PPacket *maybe_ack_packet = output_.packet_buffer_.OldestValue(ack_priority, i);
     ASSERT(maybe_ack_packet != NULL);
-    if (maybe_ack_packet->sequence_number() == packet.sequence_number()) {
-      ack_found = true;
-      break;
+    if (maybe_ack_packet->header()->is_ack && maybe_ack_packet->header()->is_init &&
+        maybe_ack_packet->sequence_number() == sequence_number) {
+      return true;
     }
-  }      
-  return ack_found;
+  }
+  return output_.CommitACKPacket(priority, sequence_number, /*is_init=*/true);
 }
 
-template<int kInputCapacity, int kOutputCapacity, Endianness LocalEndianness>
-bool P2PPacketStream<kInputCapacity, kOutputCapacity, LocalEndianness>::ScheduleACKWithThrottling(const P2PPacket &packet) {
-  if (IsACKCommittedForPacket(packet)) {
-    return true;
-  }
-  // ACKs always have a priority one level higher to avoid deadlocks.
-  const P2PPriority ack_priority = packet.header()->priority - 1;
-  StatusOr<P2PMutablePacketView> ack_packet_view = output_.NewPacket(ack_priority);
-  if (!ack_packet_view.ok()) {
-    // Only commit the packet if there is space for the ACK in the output stream.
-    // Let the other end keep retransmitting until there's space for the ACK.
-    return false;
+template<int kInputCapacity, int kOutputCapacity, Endianness LocalEndianness, typename ByteStream>
+void P2PPacketStream<kInputCapacity, kOutputCapacity, LocalEndianness, ByteStream>::ScheduleNACK(P2PPriority priority, uint64_t sequence_number) {
+  // NACKs have the priority of ACKs.
+  const P2PPriority ack_priority = priority - 1;
+  for (int i = 0; i < output_.packet_buffer_.Size(ack_priority); ++i) {
+    const P2PPacket *maybe_nack_packet = output_.packet_buffer_.OldestValue(ack_priority, i);
+    if (maybe_nack_packet->header()->is_ack && maybe_nack_packet->length() > 0 &&
+        maybe_nack_packet->content()[0] == kP2PNegativeACK &&
+        maybe_nack_packet->sequence_number() == sequence_number && !output_.IsBeingSent(maybe_nack_packet)) {
+      return;
+    }
   }
-  P2PPacket *ack = ack_packet_view->packet();
-  ack->header()->is_ack = 1;
-  ack->header()->is_init = packet.header()->is_init;
-  output_.Commit(ack_priority, /*guaranteed_delivery=*/false, /*seq_number=*/packet.sequence_number());
-  return true;
+  StatusOr<P2PMutablePacketView> nack_packet_view = output_.NewPacket(ack_priority);
+  if (!nack_packet_view.ok()) { return; }
+  nack_packet_view->packet()->header()->is_ack = 1;
+  nack_packet_view->content()[0] = kP2PNegativeACK;
+  nack_packet_view->length() = 1;
+  output_.Commit(ack_priority, /*guaranteed_delivery=*/false, /*seq_number=*/sequence_number);
 }
+
 #include <sstream>
-template<int kInputCapacity, int kOutputCapacity, Endianness LocalEndianness>
-bool P2PPacketStream<kInputCapacity, kOutputCapacity, LocalEndianness>::ShouldCommitInputPacket(const P2PPacket &last_rx_packet, void *self_ptr) {
-  P2PPacketStream<kInputCapacity, kOutputCapacity, LocalEndianness> &self = *reinterpret_cast<P2PPacketStream<kInputCapacity, kOutputCapacity, LocalEndianness> *>(self_ptr);
+template<int kInputCapacity, int kOutputCapacity, Endianness LocalEndianness, typename ByteStream>
+bool P2PPacketStream<kInputCapacity, kOutputCapacity, LocalEndianness, ByteStream>::ShouldCommitInputPacket(const P2PPacket &last_rx_packet, void *self_ptr) {
+  P2PPacketStream<kInputCapacity, kOutputCapacity, LocalEndianness, ByteStream> &self = *reinterpret_cast<P2PPacketStream<kInputCapacity, kOutputCapacity, LocalEndianness, ByteStream> *>(self_ptr);
+  if (self.control_mailbox_.NumAvailableSlots() < kP2PMaxControlEventsPerPacket) {
+    // The output half is behind: let the other end retransmit until it catches up.
+    return false;
+  }
   if (!self.handshake_done_) {
     if (!last_rx_packet.header()->is_init) { 
       // Reject all packets until handshake. This ensures that any old ACKs or continuation in
@@ -613,6 +1334,20 @@ bool P2PPacketStream<kInputCapacity, kOutputCapacity, LocalEndianness>::ShouldCo
     }
   }
 
+  if (last_rx_packet.header()->has_ack) {
+    // A data packet carrying an ACK: discard the retransmitting packets that it acknowledges.
+    const P2PPiggybackedACK &ack = *last_rx_packet.piggybacked_ack();
+    if (ack.priority > P2PPriority::kReserved && ack.priority < P2PPriority::kNumLevels) {
+      ControlEvent event;
+      event.type = ControlEvent::kACKReceived;
+      event.priority = ack.priority;
+      event.sequence_number = ack.sequence_number;
+      event.is_init = false;
+      event.credit = ack.credit;
+      self.PostControlEvent(event);
+    }
+  }
+
   if (last_rx_packet.header()->is_init && !last_rx_packet.header()->is_ack) {
     // Handshake request: any state tied to the other end's state before reset is invalid:
     // a) Packets from the other end, received or in progress.
@@ -627,32 +1362,49 @@ bool P2PPacketStream<kInputCapacity, kOutputCapacity, LocalEndianness>::ShouldCo
     // because its bytes are limited to the lowest possible token value (start, special) 
     // of the protocol.
     if (last_rx_packet.sequence_number() != self.last_init_sequence_number_[priority]) {      
-      self.other_end_started_callback_();
+      ++self.num_handshake_resets_;
+      if (self.is_full_duplex_) {
+        // The callback may touch state of the output half or of the application, which other
+        // threads may be using.
+        self.has_other_end_started_.store(true, std::memory_order_release);
+      } else {
+        self.other_end_started_callback_();
+      }
     }
     self.last_init_sequence_number_[priority] = last_rx_packet.sequence_number();
 
-    // The session was reset, so there should always be space in the output queue at the 
-    // ACK's priority, if the handshake is at the highest priority.
-    const bool ack_ok = self.ScheduleACKWithThrottling(last_rx_packet);
-    ASSERT(ack_ok);
+    // Other ends that predate framing negotiation send no content, and only receive the
+    // escaped framing.
+    ControlEvent event;
+    event.type = ControlEvent::kOtherEndFramingsReceived;
+    event.framings = last_rx_packet.length() > 0 ? last_rx_packet.content()[0] : 0;
+    self.PostControlEvent(event);
+
+    self.ScheduleACKWithThrottling(priority, last_rx_packet.sequence_number(), /*is_init=*/true);
 
     return false;
   }
 
   if (last_rx_packet.header()->is_ack) {
-    // We got an ACK: discard the retrainsmitting packet that originated it.
+    // We got an ACK: discard the retransmitting packets that it acknowledges.
 
     // ACKs always have a priority one level higher to avoid deadlocks. Turn priority down one
-    // notch to get that of the retransmitting packet.
-    P2PPriority data_packet_priority = last_rx_packet.header()->priority + 1;
-
-    const P2PPacket *retransmitting_packet = self.output_.packet_buffer_.OldestValue(data_packet_priority);      
-    // Check the retransmitting packet exists, as it could have been consumed already by a
-    // previous ACK.      
-    if (retransmitting_packet != NULL && retransmitting_packet->header()->requires_ack &&
-        last_rx_packet.sequence_number() == retransmitting_packet->sequence_number()) {
-      self.output_.packet_buffer_.Consume(data_packet_priority);
+    // notch to get that of the retransmitting packets.
+    ControlEvent event;
+    event.priority = last_rx_packet.header()->priority + 1;
+    event.sequence_number = last_rx_packet.sequence_number();
+    event.is_init = last_rx_packet.header()->is_init;
+    if (last_rx_packet.length() > 0 && last_rx_packet.content()[0] == kP2PNegativeACK) {
+      event.type = ControlEvent::kNACKReceived;
+    } else {
+      event.type = ControlEvent::kACKReceived;
+      // Without credit, the ACK has none to apply.
+      memset(&event.credit, 0, sizeof(event.credit));
+      if (last_rx_packet.length() >= 1 + sizeof(P2PCredit) && !last_rx_packet.header()->is_init) {
+        memcpy(&event.credit, &last_rx_packet.content()[1], sizeof(event.credit));
+      }
     }
+    self.PostControlEvent(event);
 
     // Do not expose an ACK in the API.
     return false;
@@ -661,29 +1413,59 @@ bool P2PPacketStream<kInputCapacity, kOutputCapacity, LocalEndianness>::ShouldCo
   // It's a data packet: reply with ACK if there is no ACK in the output buffer already,
   // to avoid flooding the buffer and blocking the sender for this priority and lower.
   if (last_rx_packet.header()->requires_ack) {
-
-    if (!self.ScheduleACKWithThrottling(last_rx_packet)) {
-      // No space for the ACK packet: let the other end retransmit until we can guarantee the
-      // ACK is sent.
+    const P2PPriority priority = last_rx_packet.header()->priority;
+    const uint64_t expected_sequence_number = self.next_rx_sequence_number_[priority];
+    if (last_rx_packet.sequence_number() != expected_sequence_number % P2PSequenceNumberType::NumValues()) {
+      // This packet had been received already, or a previous one is missing: filter it, and
+      // acknowledge the last packet received in order again, so that the other end can move
+      // its window forward.
+      if (expected_sequence_number > 0) {
+        self.ScheduleACKWithThrottling(priority, expected_sequence_number - 1, /*is_init=*/false);
+      }
       return false;
     }
 
-    const P2PPriority priority = last_rx_packet.header()->priority;
-    if (self.last_rx_sequence_number_[priority] != -1ULL &&
-        last_rx_packet.sequence_number() <= self.last_rx_sequence_number_[priority]) {
-      // This packet had been received already: filter it.
+    // The published credit refers to the end of the last packet: withdraw it before the output
+    // half sees the new ACK, until the end of this Run() publishes it again.
+    self.input_credit_[priority].store(0, std::memory_order_relaxed);
+    if (!self.ScheduleACKWithThrottling(priority, last_rx_packet.sequence_number(), /*is_init=*/false)) {
+      // No space for the ACK: let the other end retransmit until we can guarantee the ACK is
+      // sent.
       return false;
     }
-    self.last_rx_sequence_number_[priority] = last_rx_packet.sequence_number();
+    self.next_rx_sequence_number_[priority] = expected_sequence_number + 1;
+    self.last_rx_packet_end_byte_count_[priority] = self.input_.num_received_bytes();
   }
   
   // Expose the packet in the API.
   return true;
 }
 
-template<int kInputCapacity, int kOutputCapacity, Endianness LocalEndianness>
-bool P2PPacketStream<kInputCapacity, kOutputCapacity, LocalEndianness>::ShouldConsumeOutputPacket(const P2PPacket &last_tx_packet, void *self_ptr) {
-  P2PPacketStream<kInputCapacity, kOutputCapacity, LocalEndianness> &self = *reinterpret_cast<P2PPacketStream<kInputCapacity, kOutputCapacity, LocalEndianness> *>(self_ptr);
+template<int kInputCapacity, int kOutputCapacity, Endianness LocalEndianness, typename ByteStream>
+void P2PPacketStream<kInputCapacity, kOutputCapacity, LocalEndianness, ByteStream>::OnCorruptedInputPacket(const P2PPacket &corrupted_rx_packet, void *self_ptr) {
+  P2PPacketStream<kInputCapacity, kOutputCapacity, LocalEndianness, ByteStream> &self = *reinterpret_cast<P2PPacketStream<kInputCapacity, kOutputCapacity, LocalEndianness, ByteStream> *>(self_ptr);
+  const P2PHeader &header = *corrupted_rx_packet.header();
+  if (!self.handshake_done_ || header.priority == P2PPriority::kReserved || !header.requires_ack ||
+      header.is_ack || header.is_init) {
+    return;
+  }
+  // Only report the packet expected next: the other end retransmits it and the ones after it,
+  // and other packets would be discarded anyway.
+  const P2PPriority priority = header.priority;
+  const uint64_t expected_sequence_number = self.next_rx_sequence_number_[priority];
+  if (corrupted_rx_packet.sequence_number() == expected_sequence_number % P2PSequenceNumberType::NumValues()) {
+    // Best effort, like the NACK packet itself.
+    ControlEvent event;
+    event.type = ControlEvent::kScheduleNACK;
+    event.priority = priority;
+    event.sequence_number = corrupted_rx_packet.sequence_number();
+    self.PostControlEvent(event);
+  }
+}
+
+template<int kInputCapacity, int kOutputCapacity, Endianness LocalEndianness, typename ByteStream>
+bool P2PPacketStream<kInputCapacity, kOutputCapacity, LocalEndianness, ByteStream>::ShouldConsumeOutputPacket(const P2PPacket &last_tx_packet, void *self_ptr) {
+  P2PPacketStream<kInputCapacity, kOutputCapacity, LocalEndianness, ByteStream> &self = *reinterpret_cast<P2PPacketStream<kInputCapacity, kOutputCapacity, LocalEndianness, ByteStream> *>(self_ptr);
   if (last_tx_packet.header()->is_init && last_tx_packet.header()->is_ack) {
     // The handshake ACK was just sent. We may now reset the output session without
     // having to update the packet-scope state variables.
@@ -692,3 +1474,57 @@ bool P2PPacketStream<kInputCapacity, kOutputCapacity, LocalEndianness>::ShouldCo
   // Packets requiring an ACK are left in the queue for retransmission.
   return !last_tx_packet.header()->requires_ack;
 }
+
+template<int kInputCapacity, int kOutputCapacity, Endianness LocalEndianness, typename ByteStream>
+bool P2PPacketStream<kInputCapacity, kOutputCapacity, LocalEndianness, ByteStream>::ComputeInputCredit(int priority, P2PCredit *credit) {
+  const int receive_buffer_length = input_.byte_stream_.GetReceiveBufferLength();
+  if (receive_buffer_length <= 0) {
+    return false;
+  }
+  // The bytes read after the acknowledged packet are out of the receive buffer. If the last
+  // read did not drain the byte stream, there may be more bytes waiting in the buffer, so
+  // there is no room guaranteed beyond those read.
+  uint64_t num_bytes = input_.num_received_bytes() - last_rx_packet_end_byte_count_[priority];
+  if (input_.is_byte_stream_drained()) {
+    num_bytes += receive_buffer_length;
+  }
+  credit->num_bytes = LocalToNetwork<LocalEndianness>(static_cast<uint16_t>(std::min<uint64_t>(num_bytes, UINT16_MAX)));
+  credit->num_packets = std::min(input_.NumAvailableSlots(priority), 0xff);
+  return true;
+}
+
+template<int kInputCapacity, int kOutputCapacity, Endianness LocalEndianness, typename ByteStream>
+void P2PPacketStream<kInputCapacity, kOutputCapacity, LocalEndianness, ByteStream>::OnInputRun(void *self_ptr) {
+  P2PPacketStream<kInputCapacity, kOutputCapacity, LocalEndianness, ByteStream> &self = *reinterpret_cast<P2PPacketStream<kInputCapacity, kOutputCapacity, LocalEndianness, ByteStream> *>(self_ptr);
+  if (!self.is_full_duplex_) { return; }
+  for (int i = 0; i < P2PPriority::kNumLevels; ++i) {
+    P2PCredit credit;
+    uint32_t packed_credit = 0;
+    if (self.ComputeInputCredit(i, &credit)) {
+      packed_credit = kValidInputCredit | NetworkToLocal<LocalEndianness>(credit.num_bytes) | (static_cast<uint32_t>(credit.num_packets) << 16);
+    }
+    self.input_credit_[i].store(packed_credit, std::memory_order_relaxed);
+  }
+}
+
+template<int kInputCapacity, int kOutputCapacity, Endianness LocalEndianness, typename ByteStream>
+bool P2PPacketStream<kInputCapacity, kOutputCapacity, LocalEndianness, ByteStream>::GetInputCredit(int priority, P2PCredit *credit, void *self_ptr) {
+  P2PPacketStream<kInputCapacity, kOutputCapacity, LocalEndianness, ByteStream> &self = *reinterpret_cast<P2PPacketStream<kInputCapacity, kOutputCapacity, LocalEndianness, ByteStream> *>(self_ptr);
+  if (!self.is_full_duplex_) {
+    return self.ComputeInputCredit(priority, credit);
+  }
+  // The input half may be running: take the credit as of its last Run().
+  const uint32_t packed_credit = self.input_credit_[priority].load(std::memory_order_relaxed);
+  if ((packed_credit & kValidInputCredit) == 0) {
+    return false;
+  }
+  credit->num_bytes = LocalToNetwork<LocalEndianness>(static_cast<uint16_t>(packed_credit & 0xffff));
+  credit->num_packets = (packed_credit >> 16) & 0xff;
+  return true;
+}
+
+template<int kInputCapacity, int kOutputCapacity, Endianness LocalEndianness, typename ByteStream>
+void P2PPacketStream<kInputCapacity, kOutputCapacity, LocalEndianness, ByteStream>::OnOutputRun(void *self_ptr) {
+  P2PPacketStream<kInputCapacity, kOutputCapacity, LocalEndianness, ByteStream> &self = *reinterpret_cast<P2PPacketStream<kInputCapacity, kOutputCapacity, LocalEndianness, ByteStream> *>(self_ptr);
+  self.ApplyControlEvents();
+}
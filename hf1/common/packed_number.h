@@ -8,6 +8,14 @@ template<int kNumBytes, int kMaxValuePerByte> struct PackedInteger {
   uint8_t bytes[kNumBytes];
 #pragma pack(pop)
 
+  // Returns the number of different values the integer can represent. Assigned values
+  // wrap around after it.
+  static constexpr uint64_t NumValues() {
+    uint64_t n = 1;
+    for (int i = 0; i < kNumBytes; ++i) { n *= kMaxValuePerByte; }
+    return n;
+  }
+
   PackedInteger(uint64_t n) { *this = n; }
   PackedInteger() : PackedInteger(0) {}
 
@@ -0,0 +1,85 @@
+#ifndef PRIORITY_OCCUPANCY_
+#define PRIORITY_OCCUPANCY_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <limits.h>
+
+// Tracks the sizes of the levels of a priority queue, for PriorityRingBuffer and PrioritySlab.
+// The levels with values are kept in a bitmap, so that the highest priority with values is
+// found with a count of trailing zeros instead of a scan of all the levels.
+// Each level also has a high and a low watermark. When its size rises to the high watermark,
+// the level is congested until its size falls back to the low watermark, and the watermark
+// callback is called on both transitions. Producers can use it for backpressure, e.g. to stop
+// queuing best-effort values of a congested level while the queue drains.
+template<typename PriorityType> class PriorityOccupancy {
+public:
+  static_assert(PriorityType::kNumLevels <= 32, "The levels must fit in the bitmap.");
+
+  // Called with `is_congested` true when the size of `priority` rises to its high watermark,
+  // and false when it falls back to its low watermark.
+  typedef void (*WatermarkCallback)(int priority, bool is_congested, void *arg);
+
+  PriorityOccupancy() : levels_(0), congested_levels_(0), watermark_callback_(NULL), watermark_callback_arg_(NULL) {
+    for (int i = 0; i < PriorityType::kNumLevels; ++i) {
+      low_watermarks_[i] = 0;
+      high_watermarks_[i] = INT_MAX;
+    }
+  }
+
+  // Bitmap of the levels with values: bit i is set if level i has values.
+  uint32_t levels() const { return levels_; }
+
+  // Returns the highest priority (lowest level) with values, or -1 if all levels are empty.
+  int HighestLevel() const { return levels_ == 0 ? -1 : __builtin_ctz(levels_); }
+
+  // Sets the watermarks of `priority`. `low` must be lower than `high`. By default, levels
+  // are never congested.
+  void watermarks(PriorityType priority, int low, int high) {
+    low_watermarks_[priority] = low;
+    high_watermarks_[priority] = high;
+  }
+  int low_watermark(PriorityType priority) const { return low_watermarks_[priority]; }
+  int high_watermark(PriorityType priority) const { return high_watermarks_[priority]; }
+
+  // Does not take ownership of `arg`, which must outlive this object or be replaced.
+  void watermark_callback(WatermarkCallback callback, void *arg) {
+    watermark_callback_ = callback;
+    watermark_callback_arg_ = arg;
+  }
+
+  // True from the time the size of `priority` rises to its high watermark until it falls back
+  // to its low watermark.
+  bool is_congested(PriorityType priority) const { return (congested_levels_ & (1U << priority)) != 0; }
+
+  // Must be called by the queue with the new size of `priority` whenever it changes.
+  void Update(int priority, int size) {
+    const uint32_t bit = 1U << priority;
+    levels_ = size > 0 ? levels_ | bit : levels_ & ~bit;
+    if ((congested_levels_ & bit) == 0) {
+      if (size >= high_watermarks_[priority]) {
+        congested_levels_ |= bit;
+        NotifyWatermark(priority, true);
+      }
+    } else if (size <= low_watermarks_[priority]) {
+      congested_levels_ &= ~bit;
+      NotifyWatermark(priority, false);
+    }
+  }
+
+private:
+  void NotifyWatermark(int priority, bool is_congested) {
+    if (watermark_callback_ != NULL) {
+      watermark_callback_(priority, is_congested, watermark_callback_arg_);
+    }
+  }
+
+  uint32_t levels_;
+  uint32_t congested_levels_;
+  int low_watermarks_[PriorityType::kNumLevels];
+  int high_watermarks_[PriorityType::kNumLevels];
+  WatermarkCallback watermark_callback_;
+  void *watermark_callback_arg_;
+};
+
+#endif  // PRIORITY_OCCUPANCY_
@@ -1,9 +1,13 @@
 #ifndef PRIORITY_RING_BUFFER_
 #define PRIORITY_RING_BUFFER_
 
+#include "priority_occupancy.h"
 #include "ring_buffer.h"
 
-template<typename ValueType, int kCapacity, typename PriorityType> class PriorityRingBuffer {
+// One ring buffer per priority level. QueueType is RingBuffer, or FIFORingBuffer if values are
+// only consumed in order.
+// The levels with values are tracked in occupancy(), which also holds their watermarks.
+template<typename ValueType, int kCapacity, typename PriorityType, template<typename, int> class QueueType = RingBuffer> class PriorityRingBuffer {
 public:
   bool IsFull(PriorityType priority) const {
     return buffer_[priority].IsFull();
@@ -14,23 +18,13 @@ public:
   }
 
   ValueType *OldestValue() {
-    for (int i = 0; i < PriorityType::kNumLevels; ++i) {
-      ValueType *value = buffer_[i].OldestValue();
-      if (value != NULL) {
-        return value;
-      }
-    }
-    return NULL;
+    const int priority = occupancy_.HighestLevel();
+    return priority >= 0 ? buffer_[priority].OldestValue() : NULL;
   }
 
   const ValueType *OldestValue() const {
-    for (int i = 0; i < PriorityType::kNumLevels; ++i) {
-      const ValueType *value = buffer_[i].OldestValue();
-      if (value != NULL) {
-        return value;
-      }
-    }
-    return NULL;
+    const int priority = occupancy_.HighestLevel();
+    return priority >= 0 ? buffer_[priority].OldestValue() : NULL;
   }
 
   const ValueType *OldestValue(PriorityType priority, int i = 0) const {
@@ -40,8 +34,15 @@ public:
     return buffer_[priority].OldestValue(i);
   }
 
-  bool Consume(PriorityType priority, int i = 0) {
-    return buffer_[priority].Consume(i);
+  bool Consume(PriorityType priority) {
+    if (!buffer_[priority].Consume()) { return false; }
+    occupancy_.Update(priority, buffer_[priority].Size());
+    return true;
+  }
+  bool Consume(PriorityType priority, int i) {
+    if (!buffer_[priority].Consume(i)) { return false; }
+    occupancy_.Update(priority, buffer_[priority].Size());
+    return true;
   }
 
   ValueType &NewValue(PriorityType priority) {
@@ -50,6 +51,7 @@ public:
   
   void Commit(PriorityType priority) {
     buffer_[static_cast<int>(priority)].Commit();
+    occupancy_.Update(priority, buffer_[priority].Size());
   }
 
   int Size(PriorityType priority) const {
@@ -60,18 +62,24 @@ public:
     return kCapacity;
   }
 
-  void Clear(PriorityType priority) const {
+  void Clear(PriorityType priority) {
     buffer_[priority].Clear();
+    occupancy_.Update(priority, 0);
   }
 
   void Clear() {
     for (int i = 0; i < PriorityType::kNumLevels; ++i) {
       buffer_[i].Clear();
+      occupancy_.Update(i, 0);
     }
   }
 
+  PriorityOccupancy<PriorityType> &occupancy() { return occupancy_; }
+  const PriorityOccupancy<PriorityType> &occupancy() const { return occupancy_; }
+
 private:
-  RingBuffer<ValueType, kCapacity> buffer_[PriorityType::kNumLevels];
+  QueueType<ValueType, kCapacity> buffer_[PriorityType::kNumLevels];
+  PriorityOccupancy<PriorityType> occupancy_;
 };
 
-#endif  // PRIORITY_RING_BUFFER_
\ No newline at end of file
+#endif  // PRIORITY_RING_BUFFER_
@@ -0,0 +1,310 @@
+#ifndef PRIORITY_SLAB_
+#define PRIORITY_SLAB_
+
+#include <stdint.h>
+#include <limits.h>
+#include <string.h>
+#include <algorithm>
+#include "logger_interface.h"
+#include "priority_occupancy.h"
+#include "ring_buffer.h"
+
+// Slabs that can share their arenas (see Share()).
+// The values of each slab are allocated in any of the arenas of the slabs sharing with it, so
+// a burst in one slab can take the room that the others do not use. Quotas cap the bytes of
+// a priority, and reservations keep bytes of the arenas free for a priority that others cannot
+// take. Reservations only count bytes, not contiguous room. A new value never needs them, as
+// each priority builds it in a block of its own (see PrioritySlab): they keep room for the
+// committed values of the priority, so that its block is released for the next value.
+template<typename PriorityType> class PrioritySlabInterface {
+public:
+  PrioritySlabInterface(uint8_t *arena, int arena_length) : arena_(arena), arena_length_(arena_length), next_shared_slab_(this) {
+    for (int i = 0; i < PriorityType::kNumLevels; ++i) {
+      quotas_[i] = INT_MAX;
+      reservations_[i] = 0;
+    }
+  }
+
+  // Sets the maximum number of bytes that values with `priority` can take.
+  void quota(PriorityType priority, int num_bytes) { quotas_[priority] = num_bytes; }
+  int quota(PriorityType priority) const { return quotas_[priority]; }
+
+  // Sets the number of bytes of the shared arenas that are kept for committed values with
+  // `priority`: other priorities and slabs cannot take them while values with `priority` take
+  // less.
+  void reservation(PriorityType priority, int num_bytes) { reservations_[priority] = num_bytes; }
+  int reservation(PriorityType priority) const { return reservations_[priority]; }
+
+  // Makes this slab and `other`, along with the slabs already sharing with either of them,
+  // allocate their values in all their arenas.
+  void Share(PrioritySlabInterface *other) {
+    const PrioritySlabInterface *slab = this;
+    do {
+      if (slab == other) { return; }  // Already sharing.
+      slab = slab->next_shared_slab_;
+    } while (slab != this);
+    PrioritySlabInterface *next = next_shared_slab_;
+    next_shared_slab_ = other->next_shared_slab_;
+    other->next_shared_slab_ = next;
+  }
+
+  // Returns the number of bytes taken by the values with `priority`, including the new one.
+  int NumUsedBytes(PriorityType priority) const {
+    int num_bytes = 0;
+    for (int i = 0; AllocationAt(priority, i) != NULL; ++i) {
+      num_bytes += AllocationAt(priority, i)->length;
+    }
+    return num_bytes;
+  }
+
+  // Returns the number of bytes taken by the values, including the new ones.
+  int NumUsedBytes() const {
+    int num_bytes = 0;
+    for (int p = 0; p < PriorityType::kNumLevels; ++p) {
+      num_bytes += NumUsedBytes(p);
+    }
+    return num_bytes;
+  }
+
+protected:
+  // Bytes of an arena taken by a value. A length of 0 means no allocation.
+  typedef struct {
+    uint8_t *begin;
+    int length;
+  } Allocation;
+
+  // Returns the i-th allocation of the values with `priority`, or NULL if there are no more.
+  virtual const Allocation *AllocationAt(int priority, int i) const = 0;
+
+  // Returns true if the values with `priority` can take `length` more bytes within its quota.
+  bool IsWithinQuota(PriorityType priority, int length) const {
+    return NumUsedBytes(priority) + length <= quotas_[priority];
+  }
+
+  // Returns true if a value with `priority` can take `length` bytes of the shared arenas
+  // without taking bytes reserved for other priorities or slabs.
+  bool IsWithinReservations(PriorityType priority, int length) const {
+    int num_free_bytes = 0;
+    int num_reserved_bytes = 0;
+    const PrioritySlabInterface *slab = this;
+    do {
+      for (int p = 0; p < PriorityType::kNumLevels; ++p) {
+        const int num_arena_bytes = slab->NumArenaBytes(p);
+        num_free_bytes -= num_arena_bytes;
+        if (slab == this && p == priority) { continue; }
+        num_reserved_bytes += std::max(0, slab->reservations_[p] - num_arena_bytes);
+      }
+      num_free_bytes += slab->arena_length_;
+      slab = slab->next_shared_slab_;
+    } while (slab != this);
+    return num_free_bytes - length >= num_reserved_bytes;
+  }
+
+  // Returns the first address in the shared arenas with `length` free bytes, or NULL if there
+  // is none.
+  uint8_t *FindFreeBytes(int length) const {
+    const PrioritySlabInterface *slab = this;
+    do {
+      uint8_t *begin = slab->arena_;
+      uint8_t *const end = slab->arena_ + slab->arena_length_;
+      while (begin + length <= end) {
+        // Addresses and lengths are aligned, so the end of an allocation is a valid address.
+        uint8_t *overlapping_end = OverlappingAllocationEnd(begin, length);
+        if (overlapping_end == NULL) {
+          return begin;
+        }
+        begin = overlapping_end;
+      }
+      slab = slab->next_shared_slab_;
+    } while (slab != this);
+    return NULL;
+  }
+
+private:
+  // Returns the number of bytes of the shared arenas taken by the values with `priority`,
+  // leaving out the values that are outside the arenas.
+  int NumArenaBytes(int priority) const {
+    int num_bytes = 0;
+    for (int i = 0; AllocationAt(priority, i) != NULL; ++i) {
+      const Allocation &allocation = *AllocationAt(priority, i);
+      if (IsInArenas(allocation.begin)) { num_bytes += allocation.length; }
+    }
+    return num_bytes;
+  }
+
+  bool IsInArenas(const uint8_t *address) const {
+    const PrioritySlabInterface *slab = this;
+    do {
+      if (address >= slab->arena_ && address < slab->arena_ + slab->arena_length_) { return true; }
+      slab = slab->next_shared_slab_;
+    } while (slab != this);
+    return false;
+  }
+
+  // Returns the end of an allocation in any of the shared slabs that overlaps `length` bytes
+  // from `begin`, or NULL if there is none.
+  uint8_t *OverlappingAllocationEnd(const uint8_t *begin, int length) const {
+    const PrioritySlabInterface *slab = this;
+    do {
+      for (int p = 0; p < PriorityType::kNumLevels; ++p) {
+        for (int i = 0; slab->AllocationAt(p, i) != NULL; ++i) {
+          const Allocation &allocation = *slab->AllocationAt(p, i);
+          if (allocation.begin < begin + length && begin < allocation.begin + allocation.length) {
+            return allocation.begin + allocation.length;
+          }
+        }
+      }
+      slab = slab->next_shared_slab_;
+    } while (slab != this);
+    return NULL;
+  }
+
+  uint8_t *const arena_;
+  const int arena_length_;
+  // The slabs sharing arenas are linked in a ring.
+  PrioritySlabInterface *next_shared_slab_;
+  int quotas_[PriorityType::kNumLevels];
+  int reservations_[PriorityType::kNumLevels];
+};
+
+// Queues of values with priorities, like PriorityRingBuffer, whose values share an arena of
+// kNumBytes and only take the bytes that they use, as returned by ValueType::StorageLength().
+// The bytes of a value past its storage length are not kept once the value is committed, so
+// they must not be accessed afterwards.
+// A new value takes the full size of ValueType until it is committed, as its length is not
+// known before. Each priority builds its new value in a full-size block of its own, outside
+// the arenas, and Commit() moves it to the first free bytes of the arenas where it fits. So
+// holes in the arenas smaller than a full-size value never keep new values out. If the value
+// does not fit in the arenas, it is committed in place, and the priority is full until it is
+// consumed. Pointers to a new value are invalid after Commit(), but committed values never
+// move, so pointers to them are valid until they are consumed.
+// Each priority stores at most kCapacity - 1 values, as long as they fit in the arenas.
+// The priorities with values are tracked in occupancy(), which also holds their watermarks.
+// The watermarks count values, not bytes.
+template<typename ValueType, int kCapacity, int kNumBytes, typename PriorityType> class PrioritySlab : public PrioritySlabInterface<PriorityType> {
+public:
+  static_assert(kNumBytes >= static_cast<int>(sizeof(ValueType)), "The arena must fit a full-size value.");
+
+  PrioritySlab() : PrioritySlabInterface<PriorityType>(bytes_, kNumBytes) { Clear(); }
+
+  // Returns true if there is no slot for a new value with `priority`, a full-size value would
+  // exceed its quota, or its block holds a committed value.
+  bool IsFull(PriorityType priority) const {
+    if (allocations_[priority].IsFull()) { return true; }
+    if (new_allocations_[priority].length > 0) { return false; }
+    return is_block_taken_[priority] || !this->IsWithinQuota(priority, kMaxLength);
+  }
+
+  int NumAvailableSlots(PriorityType priority) const {
+    return IsFull(priority) ? 0 : allocations_[priority].NumAvailableSlots();
+  }
+
+  ValueType *OldestValue() {
+    const int priority = occupancy_.HighestLevel();
+    return priority >= 0 ? OldestValue(priority) : NULL;
+  }
+
+  const ValueType *OldestValue() const {
+    const int priority = occupancy_.HighestLevel();
+    return priority >= 0 ? OldestValue(priority) : NULL;
+  }
+
+  ValueType *OldestValue(PriorityType priority, int i = 0) {
+    const Allocation *allocation = allocations_[priority].OldestValue(i);
+    return allocation != NULL ? ValueAt(allocation->begin) : NULL;
+  }
+  const ValueType *OldestValue(PriorityType priority, int i = 0) const {
+    const Allocation *allocation = allocations_[priority].OldestValue(i);
+    return allocation != NULL ? ValueAt(allocation->begin) : NULL;
+  }
+
+  bool Consume(PriorityType priority, int i = 0) {
+    const Allocation *allocation = allocations_[priority].OldestValue(i);
+    if (allocation == NULL) { return false; }
+    if (allocation->begin == blocks_[priority]) { is_block_taken_[priority] = false; }
+    allocations_[priority].Consume(i);
+    occupancy_.Update(priority, allocations_[priority].Size());
+    return true;
+  }
+
+  // Returns the new value with `priority`, which is default-constructed the first time after
+  // the last Commit() with `priority`. The slab must not be full.
+  ValueType &NewValue(PriorityType priority) {
+    Allocation &allocation = new_allocations_[priority];
+    if (allocation.length == 0) {
+      ASSERT(!is_block_taken_[priority]);
+      allocation.begin = blocks_[priority];
+      allocation.length = kMaxLength;
+      *ValueAt(allocation.begin) = ValueType();
+    }
+    return *ValueAt(allocation.begin);
+  }
+
+  // Appends the new value with `priority` to its queue, and releases the bytes past its
+  // storage length. The value is moved to the arenas if it fits.
+  void Commit(PriorityType priority) {
+    Allocation &allocation = new_allocations_[priority];
+    ASSERT(allocation.length > 0 && !allocations_[priority].IsFull());
+    const int length = AlignedLength(ValueAt(allocation.begin)->StorageLength());
+    ASSERT(length <= kMaxLength);
+    // The new value takes no bytes of the arenas.
+    allocation.length = 0;
+    uint8_t *begin = this->IsWithinReservations(priority, length) ? this->FindFreeBytes(length) : NULL;
+    if (begin != NULL) {
+      memcpy(begin, allocation.begin, length);
+    } else {
+      begin = allocation.begin;
+      is_block_taken_[priority] = true;
+    }
+    allocations_[priority].Write(Allocation{ begin, length });
+    occupancy_.Update(priority, allocations_[priority].Size());
+  }
+
+  int Size(PriorityType priority) const {
+    return allocations_[priority].Size();
+  }
+
+  int Capacity(PriorityType) const {
+    return kCapacity;
+  }
+
+  void Clear() {
+    for (int i = 0; i < PriorityType::kNumLevels; ++i) {
+      allocations_[i].Clear();
+      new_allocations_[i].length = 0;
+      is_block_taken_[i] = false;
+      occupancy_.Update(i, 0);
+    }
+  }
+
+  PriorityOccupancy<PriorityType> &occupancy() { return occupancy_; }
+  const PriorityOccupancy<PriorityType> &occupancy() const { return occupancy_; }
+
+protected:
+  typedef typename PrioritySlabInterface<PriorityType>::Allocation Allocation;
+
+  const Allocation *AllocationAt(int priority, int i) const override {
+    if (i < allocations_[priority].Size()) { return allocations_[priority].OldestValue(i); }
+    if (i == allocations_[priority].Size() && new_allocations_[priority].length > 0) { return &new_allocations_[priority]; }
+    return NULL;
+  }
+
+private:
+  static constexpr int AlignedLength(int length) {
+    return (length + alignof(ValueType) - 1) / alignof(ValueType) * alignof(ValueType);
+  }
+  static constexpr int kMaxLength = AlignedLength(sizeof(ValueType));
+
+  ValueType *ValueAt(uint8_t *begin) { return reinterpret_cast<ValueType *>(begin); }
+  const ValueType *ValueAt(const uint8_t *begin) const { return reinterpret_cast<const ValueType *>(begin); }
+
+  RingBuffer<Allocation, kCapacity> allocations_[PriorityType::kNumLevels];
+  Allocation new_allocations_[PriorityType::kNumLevels];
+  // The block of a priority is taken by a committed value that did not fit in the arenas.
+  bool is_block_taken_[PriorityType::kNumLevels];
+  PriorityOccupancy<PriorityType> occupancy_;
+  alignas(ValueType) uint8_t blocks_[PriorityType::kNumLevels][kMaxLength];
+  alignas(ValueType) uint8_t bytes_[kNumBytes];
+};
+
+#endif  // PRIORITY_SLAB_
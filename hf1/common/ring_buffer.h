@@ -5,10 +5,23 @@
 #include "utils.h"
 #include "logger_interface.h"
 
+// Returns `index` modulo kCapacity, for `index` in [-kCapacity, 2 * kCapacity), which are all
+// the indices that the ring buffers compute. Power-of-two capacities take a mask, and the
+// others a comparison, instead of a division.
+template<int kCapacity> inline int RingBufferWrapIndex(int index) {
+  if constexpr ((kCapacity & (kCapacity - 1)) == 0) {
+    return index & (kCapacity - 1);
+  } else {
+    return index < 0 ? index + kCapacity : (index >= kCapacity ? index - kCapacity : index);
+  }
+}
+
 // A zero-copy ring buffer.
 // Values are read and written in place.
 // The newest value is always reserved for writing, so the maximum number of values the
 // buffer can store is kCapacity - 1.
+// Values are reached through an array of indices, so that any of them can be consumed. Users
+// that only consume the oldest value should use FIFORingBuffer instead.
 template<typename ValueType, int kCapacity> class RingBuffer {
   public:
     static_assert(kCapacity > 1);
@@ -53,11 +66,11 @@ template<typename ValueType, int kCapacity> class RingBuffer {
     // This function does not block. 
     ValueType *OldestValue(int i = 0) {
       if (Size() <= i) { return NULL; }
-      return &values_[indices_[(read_index_ + i) % kCapacity]];
+      return &values_[indices_[RingBufferWrapIndex<kCapacity>(read_index_ + i)]];
     }
     const ValueType *OldestValue(int i = 0) const {
       if (Size() <= i) { return NULL; }
-      return &values_[indices_[(read_index_ + i) % kCapacity]];
+      return &values_[indices_[RingBufferWrapIndex<kCapacity>(read_index_ + i)]];
     }
     
     // Discards the i-th oldest value in the buffer. Returns true if success, or false if
@@ -66,8 +79,8 @@ template<typename ValueType, int kCapacity> class RingBuffer {
     bool Consume(int i = 0) {
       if (Size() <= i) { return false; }
       // Move indices one position to the right up to i.
-      for (int k = 0, j = (read_index_ + i) % kCapacity; k < i; ++k, j = IndexMod(j - 1, kCapacity)) {
-        indices_[j] = indices_[IndexMod(j - 1, kCapacity)];
+      for (int k = 0, j = RingBufferWrapIndex<kCapacity>(read_index_ + i); k < i; ++k, j = RingBufferWrapIndex<kCapacity>(j - 1)) {
+        indices_[j] = indices_[RingBufferWrapIndex<kCapacity>(j - 1)];
       }
       IncReadIndex();
       --size_;
@@ -108,11 +121,11 @@ template<typename ValueType, int kCapacity> class RingBuffer {
 
   protected:
     inline void IncReadIndex() {
-      read_index_ = (read_index_ + 1) % kCapacity;
+      read_index_ = RingBufferWrapIndex<kCapacity>(read_index_ + 1);
     }
 
     inline void IncWriteIndex() {
-      write_index_ = (write_index_ + 1) % kCapacity;
+      write_index_ = RingBufferWrapIndex<kCapacity>(write_index_ + 1);
     }
 
   private:
@@ -123,4 +136,97 @@ template<typename ValueType, int kCapacity> class RingBuffer {
     volatile int size_;
 };
 
+// A zero-copy ring buffer whose values can only be consumed in order, which saves the
+// indirection of RingBuffer. Otherwise, it behaves like RingBuffer: the newest value is
+// always reserved for writing, and a full buffer overwrites its oldest value.
+template<typename ValueType, int kCapacity> class FIFORingBuffer {
+  public:
+    static_assert(kCapacity > 1);
+
+    FIFORingBuffer() { Clear(); }
+
+    inline int Capacity() const {
+      return kCapacity;
+    }
+
+    // Returns the number of values that can be read from the buffer, up to kCapacity - 1.
+    inline int Size() const {
+      return size_;
+    }
+
+    bool IsFull() const {
+      return size_ >= kCapacity - 1;
+    }
+
+    int NumAvailableSlots() const {
+      return Capacity() - 1 - Size();
+    }
+
+    // Empties the buffer.
+    // Invalidates pointers obtained with OldestValue() and NewValue().
+    void Clear() {
+      read_index_ = 0;
+      write_index_ = 0;
+      size_ = 0;
+    }
+
+    // Returns a pointer to the i-th oldest value in the buffer, or NULL if there are not enough
+    // elements in the buffer. The same caveats as in RingBuffer apply.
+    ValueType *OldestValue(int i = 0) {
+      if (Size() <= i) { return NULL; }
+      return &values_[RingBufferWrapIndex<kCapacity>(read_index_ + i)];
+    }
+    const ValueType *OldestValue(int i = 0) const {
+      if (Size() <= i) { return NULL; }
+      return &values_[RingBufferWrapIndex<kCapacity>(read_index_ + i)];
+    }
+
+    // Discards the oldest value in the buffer. Returns true if success, or false if the buffer
+    // is empty.
+    // Invalidates the pointer obtained with OldestValue().
+    bool Consume() {
+      if (Size() == 0) { return false; }
+      read_index_ = RingBufferWrapIndex<kCapacity>(read_index_ + 1);
+      --size_;
+      return true;
+    }
+
+    // Returns a writable reference to a new value in the buffer, which is not visible until
+    // Commit() is called. When the buffer is full, it is the oldest value in the buffer.
+    ValueType &NewValue() {
+      return values_[write_index_];
+    }
+
+    // Makes the the newest value visible to readers.
+    void Commit() {
+      write_index_ = RingBufferWrapIndex<kCapacity>(write_index_ + 1);
+      if (size_ < kCapacity - 1) {
+        ++size_;
+      }
+      if (write_index_ == read_index_) {
+        // Claim oldest unread slot for writing
+        read_index_ = RingBufferWrapIndex<kCapacity>(read_index_ + 1);
+      }
+    }
+
+    // Writes a new value in the buffer.
+    void Write(const ValueType &value) {
+      NewValue() = value;
+      Commit();
+    }
+
+    const ValueType Read() {
+      ASSERT(OldestValue() != nullptr);
+      const ValueType value = *OldestValue();
+      Consume();
+      return value;
+    }
+
+  private:
+    ValueType values_[kCapacity];
+    int read_index_;
+    int write_index_;
+    volatile int size_;
+};
+
 #endif  // RING_BUFFER__
\ No newline at end of file
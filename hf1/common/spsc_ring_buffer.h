@@ -0,0 +1,144 @@
+#ifndef SPSC_RING_BUFFER_
+#define SPSC_RING_BUFFER_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <algorithm>
+#include <atomic>
+
+// A zero-copy ring buffer for one producer thread and one consumer thread, which never locks.
+// The producer fills the value returned by NewValue() in place and publishes it with Commit().
+// The consumer reads the value returned by OldestValue() in place and releases it with
+// Consume(). Unlike RingBuffer, a full buffer rejects new values instead of overwriting the
+// oldest one, and all kCapacity slots store values.
+// The indices are 32-bit, so that they are lock-free on 32-bit microcontrollers too. The
+// producer may also be an ISR and the consumer the main loop of a single-core microcontroller,
+// so that the latter does not need to mask the IRQ to read.
+// Values can be written and read in bulk, with WriteN() and ReadN(), or in place through the
+// contiguous spans returned by NewValues() and OldestValues(), which publish or release all
+// the values at once.
+template<typename ValueType, int kCapacity> class SPSCRingBuffer {
+public:
+  static_assert(kCapacity > 1 && (kCapacity & (kCapacity - 1)) == 0, "The capacity must be a power of two.");
+
+  // Contiguous values in the buffer.
+  typedef struct {
+    ValueType *values;
+    int length;
+  } Span;
+
+  SPSCRingBuffer() : write_index_(0), read_index_(0) {}
+
+  int Capacity() const { return kCapacity; }
+
+  // Returns the number of committed values that have not been consumed. It may be outdated
+  // as soon as it returns, if the other thread writes or reads.
+  int Size() const {
+    return static_cast<int>(write_index_.load(std::memory_order_acquire) - read_index_.load(std::memory_order_acquire));
+  }
+
+  bool IsEmpty() const { return Size() == 0; }
+
+  int NumAvailableSlots() const { return kCapacity - Size(); }
+
+  // Returns a pointer to the new value, or NULL if the buffer is full. The value is not
+  // visible to the consumer until Commit() is called.
+  // Must only be called from the producer thread.
+  ValueType *NewValue() {
+    const uint32_t write_index = write_index_.load(std::memory_order_relaxed);
+    if (write_index - read_index_.load(std::memory_order_acquire) >= kCapacity) { return NULL; }
+    return &values_[write_index & (kCapacity - 1)];
+  }
+
+  // Returns the longest span of new values that are contiguous in memory, which is empty if the
+  // buffer is full. It may be shorter than NumAvailableSlots() if the free slots wrap around.
+  // Must only be called from the producer thread.
+  Span NewValues() {
+    const uint32_t write_index = write_index_.load(std::memory_order_relaxed);
+    const int num_free_slots = kCapacity - static_cast<int>(write_index - read_index_.load(std::memory_order_acquire));
+    const int offset = write_index & (kCapacity - 1);
+    return Span{ &values_[offset], std::min(num_free_slots, kCapacity - offset) };
+  }
+
+  // Makes the `num_values` values after the last committed one visible to the consumer, i.e.
+  // the value returned by NewValue() or the first ones of the span returned by NewValues().
+  // Must only be called from the producer thread.
+  void Commit(int num_values = 1) {
+    write_index_.store(write_index_.load(std::memory_order_relaxed) + num_values, std::memory_order_release);
+  }
+
+  // Copies up to `num_values` values to the buffer and makes them visible to the consumer at
+  // once. Returns the number of values copied, which is less than `num_values` if the buffer
+  // becomes full.
+  // Must only be called from the producer thread.
+  int WriteN(const ValueType *values, int num_values) {
+    const uint32_t write_index = write_index_.load(std::memory_order_relaxed);
+    const int num_free_slots = kCapacity - static_cast<int>(write_index - read_index_.load(std::memory_order_acquire));
+    const int length = std::min(num_values, num_free_slots);
+    // The values may wrap around the end of the array.
+    const int offset = write_index & (kCapacity - 1);
+    const int head_length = std::min(length, kCapacity - offset);
+    std::copy(values, values + head_length, &values_[offset]);
+    std::copy(values + head_length, values + length, &values_[0]);
+    write_index_.store(write_index + length, std::memory_order_release);
+    return length;
+  }
+
+  // Returns a pointer to the oldest committed value, or NULL if there is none.
+  // Must only be called from the consumer thread.
+  ValueType *OldestValue() {
+    const uint32_t read_index = read_index_.load(std::memory_order_relaxed);
+    if (write_index_.load(std::memory_order_acquire) == read_index) { return NULL; }
+    return &values_[read_index & (kCapacity - 1)];
+  }
+
+  // Returns the longest span of committed values that are contiguous in memory, oldest first,
+  // which is empty if there are none. It may be shorter than Size() if the values wrap around.
+  // Must only be called from the consumer thread.
+  Span OldestValues() {
+    const uint32_t read_index = read_index_.load(std::memory_order_relaxed);
+    const int size = static_cast<int>(write_index_.load(std::memory_order_acquire) - read_index);
+    const int offset = read_index & (kCapacity - 1);
+    return Span{ &values_[offset], std::min(size, kCapacity - offset) };
+  }
+
+  // Releases the oldest value. Returns false if there is no committed value to consume.
+  // Invalidates the pointer obtained with OldestValue().
+  // Must only be called from the consumer thread.
+  bool Consume() {
+    if (OldestValue() == NULL) { return false; }
+    read_index_.store(read_index_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Releases the `num_values` oldest values, e.g. the first ones of the span returned by
+  // OldestValues(). There must be at least `num_values` committed values.
+  // Must only be called from the consumer thread.
+  void Consume(int num_values) {
+    read_index_.store(read_index_.load(std::memory_order_relaxed) + num_values, std::memory_order_release);
+  }
+
+  // Copies up to `num_values` of the oldest values to `values`, and releases them at once.
+  // Returns the number of values copied, which is less than `num_values` if the buffer becomes
+  // empty.
+  // Must only be called from the consumer thread.
+  int ReadN(ValueType *values, int num_values) {
+    const uint32_t read_index = read_index_.load(std::memory_order_relaxed);
+    const int size = static_cast<int>(write_index_.load(std::memory_order_acquire) - read_index);
+    const int length = std::min(num_values, size);
+    const int offset = read_index & (kCapacity - 1);
+    const int head_length = std::min(length, kCapacity - offset);
+    std::copy(&values_[offset], &values_[offset + head_length], values);
+    std::copy(&values_[0], &values_[length - head_length], values + head_length);
+    read_index_.store(read_index + length, std::memory_order_release);
+    return length;
+  }
+
+private:
+  ValueType values_[kCapacity];
+  // Free-running indices: their difference is the size, also when they wrap around.
+  std::atomic<uint32_t> write_index_;
+  std::atomic<uint32_t> read_index_;
+};
+
+#endif  // SPSC_RING_BUFFER_
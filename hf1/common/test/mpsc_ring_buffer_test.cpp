@@ -0,0 +1,90 @@
+#include <gtest/gtest.h>
+#include <thread>
+#include <vector>
+#include "mpsc_ring_buffer.h"
+
+TEST(MPSCRingBufferTest, OldestValueReturnsNullIfEmpty) {
+  MPSCRingBuffer<int, /*kCapacity=*/4> buffer;
+
+  EXPECT_EQ(buffer.OldestValue(), nullptr);
+  EXPECT_FALSE(buffer.Consume());
+}
+
+TEST(MPSCRingBufferTest, ValueIsNotVisibleUntilCommitted) {
+  MPSCRingBuffer<int, /*kCapacity=*/4> buffer;
+  int *value = buffer.NewValue();
+  ASSERT_NE(value, nullptr);
+  *value = 7;
+  EXPECT_EQ(buffer.OldestValue(), nullptr);
+
+  buffer.Commit(value);
+  ASSERT_NE(buffer.OldestValue(), nullptr);
+  EXPECT_EQ(*buffer.OldestValue(), 7);
+}
+
+TEST(MPSCRingBufferTest, UncommittedValueHoldsBackLaterOnes) {
+  MPSCRingBuffer<int, /*kCapacity=*/4> buffer;
+  int *first = buffer.NewValue();
+  int *second = buffer.NewValue();
+  *second = 2;
+  buffer.Commit(second);
+  EXPECT_EQ(buffer.OldestValue(), nullptr);
+
+  *first = 1;
+  buffer.Commit(first);
+  ASSERT_NE(buffer.OldestValue(), nullptr);
+  EXPECT_EQ(*buffer.OldestValue(), 1);
+  buffer.Consume();
+  EXPECT_EQ(*buffer.OldestValue(), 2);
+}
+
+TEST(MPSCRingBufferTest, NewValueReturnsNullWhenFull) {
+  MPSCRingBuffer<int, /*kCapacity=*/4> buffer;
+  for (int i = 0; i < 4; ++i) {
+    int *value = buffer.NewValue();
+    ASSERT_NE(value, nullptr);
+    *value = i;
+    buffer.Commit(value);
+  }
+  EXPECT_EQ(buffer.NewValue(), nullptr);
+
+  buffer.Consume();
+  int *value = buffer.NewValue();
+  ASSERT_NE(value, nullptr);
+  *value = 4;
+  buffer.Commit(value);
+  for (int i = 1; i <= 4; ++i) {
+    ASSERT_NE(buffer.OldestValue(), nullptr);
+    EXPECT_EQ(*buffer.OldestValue(), i);
+    buffer.Consume();
+  }
+}
+
+TEST(MPSCRingBufferTest, ValuesOfConcurrentProducersAreAllReceivedInOrder) {
+  const int kNumProducers = 8;
+  const int kNumValuesPerProducer = 10000;
+  MPSCRingBuffer<std::pair<int, int>, /*kCapacity=*/16> buffer;
+  std::vector<std::thread> producers;
+  for (int p = 0; p < kNumProducers; ++p) {
+    producers.emplace_back([&buffer, p]() {
+      for (int i = 0; i < kNumValuesPerProducer; ++i) {
+        std::pair<int, int> *value;
+        while ((value = buffer.NewValue()) == nullptr) { std::this_thread::yield(); }
+        *value = std::make_pair(p, i);
+        buffer.Commit(value);
+      }
+    });
+  }
+
+  std::vector<int> next_value(kNumProducers, 0);
+  for (int n = 0; n < kNumProducers * kNumValuesPerProducer; ++n) {
+    const std::pair<int, int> *value;
+    while ((value = buffer.OldestValue()) == nullptr) { std::this_thread::yield(); }
+    // The values of each producer arrive in the order in which it committed them.
+    ASSERT_EQ(value->second, next_value[value->first]);
+    ++next_value[value->first];
+    buffer.Consume();
+  }
+  for (std::thread &producer : producers) { producer.join(); }
+  EXPECT_EQ(buffer.OldestValue(), nullptr);
+}
@@ -0,0 +1,215 @@
+#include <gtest/gtest.h>
+#include <deque>
+#include <vector>
+#include "p2p_bonded_packet_stream.h"
+#include "p2p_link_emulator.h"
+
+namespace {
+
+// Byte stream that writes to and reads from in-memory queues. Written bytes are lost while it
+// is disconnected.
+class MemoryByteStream : public P2PByteStreamInterface<kLittleEndian> {
+public:
+  MemoryByteStream(std::deque<uint8_t> *rx, std::deque<uint8_t> *tx)
+    : P2PByteStreamInterface<kLittleEndian>(Handler{ .object = nullptr }), rx_(*rx), tx_(*tx), connected_(true) {}
+
+  virtual int Write(const void *buffer, int length) {
+    const uint8_t *bytes = static_cast<const uint8_t *>(buffer);
+    if (connected_) {
+      tx_.insert(tx_.end(), bytes, bytes + length);
+    }
+    return length;
+  }
+
+  virtual int Read(void *buffer, int length) {
+    const int num_bytes = std::min(length, static_cast<int>(rx_.size()));
+    std::copy(rx_.begin(), rx_.begin() + num_bytes, static_cast<uint8_t *>(buffer));
+    rx_.erase(rx_.begin(), rx_.begin() + num_bytes);
+    return num_bytes;
+  }
+
+  virtual int GetBurstMaxLength() { return 1024; }
+  virtual int GetBurstIngestionNanosecondsPerByte() { return 0; }
+  virtual int GetAtomicSendMaxLength() { return 4; }
+  virtual int GetReceiveBufferLength() { return 0; }
+
+  void connected(bool connected) { connected_ = connected; }
+
+private:
+  std::deque<uint8_t> &rx_;
+  std::deque<uint8_t> &tx_;
+  bool connected_;
+};
+
+class FakeTimer : public TimerInterface {
+public:
+  FakeTimer() : ns_(0) {}
+  virtual uint64_t GetLocalNanoseconds() const { return ns_; }
+  uint64_t &ns() { return ns_; }
+
+private:
+  uint64_t ns_;
+};
+
+class FakeGUIDFactory : public GUIDFactoryInterface {
+public:
+  FakeGUIDFactory(uint8_t seed) : seed_(seed) {}
+  virtual void CreateGUID(int len, uint8_t *buffer, uint8_t max_byte_value) {
+    for (int i = 0; i < len; ++i) { buffer[i] = (seed_ + i) % max_byte_value; }
+  }
+
+private:
+  uint8_t seed_;
+};
+
+using TestLinkStream = P2PPacketStream<16, 16, kLittleEndian>;
+using TestBondedStream = P2PBondedPacketStream<2, 16, 16, kLittleEndian>;
+
+// Two ends bonded over two in-memory links.
+class P2PBondedPacketStreamTest : public ::testing::Test {
+protected:
+  P2PBondedPacketStreamTest()
+    : byte_streams_a_{ { &b_to_a_[0], &a_to_b_[0] }, { &b_to_a_[1], &a_to_b_[1] } },
+      byte_streams_b_{ { &a_to_b_[0], &b_to_a_[0] }, { &a_to_b_[1], &b_to_a_[1] } },
+      guid_factory_a_(1), guid_factory_b_(7),
+      links_a_{ { &byte_streams_a_[0], &timer_, guid_factory_a_ }, { &byte_streams_a_[1], &timer_, guid_factory_a_ } },
+      links_b_{ { &byte_streams_b_[0], &timer_, guid_factory_b_ }, { &byte_streams_b_[1], &timer_, guid_factory_b_ } },
+      link_pointers_a_{ &links_a_[0], &links_a_[1] }, link_pointers_b_{ &links_b_[0], &links_b_[1] },
+      a_(link_pointers_a_, &timer_), b_(link_pointers_b_, &timer_) {}
+
+  // Queues packets with consecutive first bytes in `a_` as long as there is space, up to
+  // `num_packets` in total.
+  void SendPackets(int num_packets) {
+    while (num_sent_packets_ < num_packets && a_.NumAvailableSlots(P2PPriority::kMedium) > 0) {
+      StatusOr<P2PMutablePacketView> view = a_.NewPacket(P2PPriority::kMedium);
+      ASSERT_TRUE(view.ok());
+      memset(view->content(), num_sent_packets_, 50);
+      view->length() = 50;
+      ASSERT_TRUE(a_.Commit(P2PPriority::kMedium, /*guarantee_delivery=*/true));
+      ++num_sent_packets_;
+    }
+  }
+
+  // Runs both ends for `num_iterations` steps of 100 us, sending up to `num_packets` in total.
+  void RunLink(int num_iterations, int num_packets) {
+    for (int i = 0; i < num_iterations; ++i) {
+      SendPackets(num_packets);
+      a_.Run();
+      b_.Run();
+      while (b_.NumAvailablePackets(P2PPriority::kMedium) > 0) {
+        StatusOr<const P2PPacketView> packet = b_.OldestPacket();
+        ASSERT_TRUE(packet.ok());
+        EXPECT_EQ(packet->length(), 50);
+        received_.push_back(packet->content()[0]);
+        b_.Consume(P2PPriority::kMedium);
+      }
+      timer_.ns() += 100000;
+    }
+  }
+
+  std::vector<uint8_t> ExpectedPackets(int num_packets) {
+    std::vector<uint8_t> expected;
+    for (int i = 0; i < num_packets; ++i) { expected.push_back(i); }
+    return expected;
+  }
+
+  std::deque<uint8_t> a_to_b_[2];
+  std::deque<uint8_t> b_to_a_[2];
+  MemoryByteStream byte_streams_a_[2];
+  MemoryByteStream byte_streams_b_[2];
+  FakeTimer timer_;
+  FakeGUIDFactory guid_factory_a_;
+  FakeGUIDFactory guid_factory_b_;
+  TestLinkStream links_a_[2];
+  TestLinkStream links_b_[2];
+  TestLinkStream *link_pointers_a_[2];
+  TestLinkStream *link_pointers_b_[2];
+  TestBondedStream a_;
+  TestBondedStream b_;
+  int num_sent_packets_ = 0;
+  std::vector<uint8_t> received_;
+};
+
+TEST_F(P2PBondedPacketStreamTest, PacketsAreStripedAcrossLinksAndDeliveredInOrder) {
+  RunLink(2000, 100);
+  EXPECT_EQ(received_, ExpectedPackets(100));
+  EXPECT_GT(a_.stats().total_link_packets(0), 20);
+  EXPECT_GT(a_.stats().total_link_packets(1), 20);
+  EXPECT_EQ(a_.stats().total_stalls(), 0);
+  EXPECT_EQ(b_.stats().total_duplicate_packets(), 0);
+  EXPECT_EQ(b_.stats().total_skipped_packets(), 0);
+  EXPECT_EQ(a_.NumCommittedPackets(P2PPriority::kMedium), 0);
+}
+
+TEST_F(P2PBondedPacketStreamTest, PacketsFailOverFromStalledLink) {
+  RunLink(1000, 10);
+  ASSERT_EQ(received_, ExpectedPackets(10));
+
+  byte_streams_a_[1].connected(false);
+  RunLink(2000, 60);
+  EXPECT_TRUE(a_.is_stalled(1));
+  EXPECT_GE(a_.stats().total_stalls(), 1);
+  EXPECT_GT(a_.stats().total_resent_packets(), 0);
+  EXPECT_EQ(received_, ExpectedPackets(60));
+
+  // The link recovers and retransmits the packets it held, which are discarded.
+  byte_streams_a_[1].connected(true);
+  RunLink(20000, 100);
+  EXPECT_FALSE(a_.is_stalled(1));
+  EXPECT_GT(b_.stats().total_duplicate_packets(), 0);
+  EXPECT_EQ(b_.stats().total_skipped_packets(), 0);
+  EXPECT_EQ(received_, ExpectedPackets(100));
+}
+
+// Returns the virtual time that it takes to send `num_packets` reliable packets from a bonded
+// stream to another over `kNumLinks` emulated UARTs.
+template<int kNumLinks> uint64_t TimeToSendOverEmulatedLinks(int num_packets) {
+  std::vector<P2PLinkEmulator *> emulators;
+  std::vector<P2PPacketStream<16, 16, kLittleEndian> *> links_a, links_b;
+  FakeGUIDFactory guid_factory_a(1);
+  FakeGUIDFactory guid_factory_b(7);
+  for (int i = 0; i < kNumLinks; ++i) {
+    emulators.push_back(new P2PLinkEmulator(P2PLinkEmulator::UARTConfig(), P2PLinkEmulator::UARTConfig()));
+    links_a.push_back(new P2PPacketStream<16, 16, kLittleEndian>(&emulators[i]->end_a(), &emulators[i]->timer(), guid_factory_a));
+    links_b.push_back(new P2PPacketStream<16, 16, kLittleEndian>(&emulators[i]->end_b(), &emulators[i]->timer(), guid_factory_b));
+  }
+  P2PBondedPacketStream<kNumLinks, 16, 16, kLittleEndian> a(links_a.data(), &emulators[0]->timer());
+  P2PBondedPacketStream<kNumLinks, 16, 16, kLittleEndian> b(links_b.data(), &emulators[0]->timer());
+  int num_sent_packets = 0;
+  int num_received_packets = 0;
+  while (num_received_packets < num_packets) {
+    if (num_sent_packets < num_packets) {
+      StatusOr<P2PMutablePacketView> view = a.NewPacket(P2PPriority::kMedium);
+      if (view.ok()) {
+        memset(view->content(), num_sent_packets, 100);
+        view->length() = 100;
+        a.Commit(P2PPriority::kMedium, /*guarantee_delivery=*/true);
+        ++num_sent_packets;
+      }
+    }
+    a.Run();
+    b.Run();
+    while (b.NumAvailablePackets(P2PPriority::kMedium) > 0) {
+      EXPECT_EQ(b.OldestPacket()->content()[0], static_cast<uint8_t>(num_received_packets));
+      b.Consume(P2PPriority::kMedium);
+      ++num_received_packets;
+    }
+    // All the emulators advance in lockstep.
+    for (P2PLinkEmulator *emulator : emulators) { emulator->Advance(10000); }
+  }
+  const uint64_t elapsed_ns = emulators[0]->timer().GetLocalNanoseconds();
+  for (int i = 0; i < kNumLinks; ++i) {
+    delete links_a[i];
+    delete links_b[i];
+    delete emulators[i];
+  }
+  return elapsed_ns;
+}
+
+TEST(P2PBondedPacketStreamBandwidthTest, BandwidthScalesWithNumberOfLinks) {
+  const uint64_t one_link_ns = TimeToSendOverEmulatedLinks<1>(200);
+  const uint64_t two_links_ns = TimeToSendOverEmulatedLinks<2>(200);
+  EXPECT_LT(two_links_ns, one_link_ns * 0.65);
+}
+
+}  // namespace
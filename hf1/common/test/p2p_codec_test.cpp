@@ -0,0 +1,78 @@
+#include <gtest/gtest.h>
+#include <vector>
+#include "p2p_codec.h"
+
+namespace {
+
+// Lengths around the vector widths, so that both the vectorized and the tail loops run.
+const int kLengths[] = { 0, 1, 15, 16, 17, 31, 32, 33, 63, 64, 65, kP2PMaxContentLength };
+
+std::vector<uint8_t> NonTokenBytes(int length) {
+  std::vector<uint8_t> bytes(length);
+  for (int i = 0; i < length; ++i) { bytes[i] = i % kP2PStartToken; }
+  return bytes;
+}
+
+TEST(P2PCodecTest, FindTokenReturnsLengthIfThereAreNoTokens) {
+  for (int length : kLengths) {
+    std::vector<uint8_t> bytes = NonTokenBytes(length);
+    EXPECT_EQ(P2PFindToken(bytes.data(), length), length);
+    EXPECT_EQ(P2PFindTokenScalar(bytes.data(), length), length);
+  }
+}
+
+TEST(P2PCodecTest, FindTokenReturnsFirstTokenAtAnyPosition) {
+  for (int length : kLengths) {
+    for (int position = 0; position < length; ++position) {
+      for (uint8_t token : { kP2PStartToken, kP2PSpecialToken }) {
+        std::vector<uint8_t> bytes = NonTokenBytes(length);
+        bytes[position] = token;
+        if (position + 1 < length) { bytes[position + 1] = kP2PStartToken; }
+        ASSERT_EQ(P2PFindToken(bytes.data(), length), position) << "length " << length;
+        ASSERT_EQ(P2PFindTokenScalar(bytes.data(), length), position) << "length " << length;
+      }
+    }
+  }
+}
+
+TEST(P2PCodecTest, FindStartTokenIgnoresSpecialTokens) {
+  for (int length : kLengths) {
+    for (int position = 0; position < length; ++position) {
+      std::vector<uint8_t> bytes(length, kP2PSpecialToken);
+      bytes[position] = kP2PStartToken;
+      ASSERT_EQ(P2PFindStartToken(bytes.data(), length), position) << "length " << length;
+      ASSERT_EQ(P2PFindStartTokenScalar(bytes.data(), length), position) << "length " << length;
+    }
+    std::vector<uint8_t> bytes(length, kP2PSpecialToken);
+    EXPECT_EQ(P2PFindStartToken(bytes.data(), length), length);
+  }
+}
+
+TEST(P2PCodecTest, COBSBlockCodeIsNeverStartToken) {
+  for (int block_length = 0; block_length <= kP2PCOBSMaxBlockLength; ++block_length) {
+    ASSERT_NE(P2PCOBSBlockCode(block_length), kP2PStartToken);
+    ASSERT_EQ(P2PCOBSBlockLength(P2PCOBSBlockCode(block_length)), block_length);
+  }
+}
+
+TEST(P2PCodecTest, FindTokenDoesNotReadBeyondLength) {
+  std::vector<uint8_t> bytes = NonTokenBytes(64);
+  bytes[40] = kP2PStartToken;
+  // Unaligned start and a token right past the end.
+  EXPECT_EQ(P2PFindToken(&bytes[3], 37), 37);
+}
+
+TEST(P2PCodecTest, SumBytesMatchesScalarSum) {
+  std::vector<uint8_t> bytes(kP2PMaxContentLength + 3);
+  for (unsigned int i = 0; i < bytes.size(); ++i) { bytes[i] = 0xff - i * 7; }
+  for (int length : kLengths) {
+    for (int offset = 0; offset < 3; ++offset) {
+      P2PChecksumType expected_sum = 0;
+      for (int i = 0; i < length; ++i) { expected_sum += bytes[offset + i]; }
+      EXPECT_EQ(P2PSumBytes(&bytes[offset], length), expected_sum) << "length " << length;
+      EXPECT_EQ(P2PSumBytesScalar(&bytes[offset], length), expected_sum) << "length " << length;
+    }
+  }
+}
+
+}  // namespace
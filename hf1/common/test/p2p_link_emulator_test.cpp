@@ -0,0 +1,101 @@
+#include <gtest/gtest.h>
+#include <vector>
+#include "p2p_link_emulator.h"
+#include "p2p_packet_stream.h"
+
+namespace {
+
+class FakeGUIDFactory : public GUIDFactoryInterface {
+public:
+  FakeGUIDFactory(uint8_t seed) : seed_(seed) {}
+  virtual void CreateGUID(int len, uint8_t *buffer, uint8_t max_byte_value) {
+    for (int i = 0; i < len; ++i) { buffer[i] = (seed_ + i) % max_byte_value; }
+  }
+
+private:
+  uint8_t seed_;
+};
+
+TEST(P2PLinkEmulatorTest, BytesArriveAfterSerializationAndPropagation) {
+  P2PLinkEmulatorConfig config = P2PLinkEmulator::UARTConfig();
+  config.propagation_delay_ns = 5000;
+  P2PLinkEmulator link(config, config);
+  const uint8_t bytes[] = { 1, 2, 3 };
+  ASSERT_EQ(link.end_a().Write(bytes, sizeof(bytes)), 3);
+
+  uint8_t received[3];
+  // The first byte takes 10 us on the wire at 100 KB/s, and 5 us more to propagate.
+  link.Advance(14999);
+  EXPECT_EQ(link.end_b().Read(received, sizeof(received)), 0);
+  link.Advance(1);
+  EXPECT_EQ(link.end_b().Read(received, sizeof(received)), 1);
+  link.Advance(20000);
+  EXPECT_EQ(link.end_b().Read(&received[1], 2), 2);
+  EXPECT_EQ(std::vector<uint8_t>(received, received + 3), std::vector<uint8_t>({ 1, 2, 3 }));
+  EXPECT_EQ(link.end_a().Read(received, sizeof(received)), 0);
+}
+
+TEST(P2PLinkEmulatorTest, FifoAndReceiveBufferLimitBytesInTransit) {
+  P2PLinkEmulatorConfig config = P2PLinkEmulator::UARTConfig();
+  config.tx_fifo_length = 4;
+  config.rx_buffer_length = 2;
+  P2PLinkEmulator link(config, config);
+  const uint8_t bytes[] = { 1, 2, 3, 4, 5, 6 };
+  EXPECT_EQ(link.end_a().Write(bytes, sizeof(bytes)), 4);
+  link.Advance(1000000);
+  uint8_t received[4];
+  EXPECT_EQ(link.end_b().Read(received, sizeof(received)), 2);
+  EXPECT_EQ(link.a_to_b_stats().num_overrun_bytes, 2);
+}
+
+// Sends reliable packets from a 16/16 stream to a 4/2 stream over a link with errors, and
+// returns the link counters.
+P2PLinkEmulatorStats SendOverLossyLink(uint32_t seed, std::vector<uint8_t> *received) {
+  P2PLinkEmulatorConfig config = P2PLinkEmulator::UARTConfig();
+  config.bit_error_rate = 1e-4;
+  config.byte_drop_rate = 1e-4;
+  P2PLinkEmulator link(config, config, seed);
+  FakeGUIDFactory guid_factory_a(1);
+  FakeGUIDFactory guid_factory_b(7);
+  P2PPacketStream<16, 16, kLittleEndian> a(&link.end_a(), &link.timer(), guid_factory_a);
+  P2PPacketStream<4, 2, kLittleEndian> b(&link.end_b(), &link.timer(), guid_factory_b);
+  int num_sent_packets = 0;
+  for (int i = 0; i < 100000 && received->size() < 50; ++i) {
+    if (num_sent_packets < 50) {
+      StatusOr<P2PMutablePacketView> view = a.output().NewPacket(P2PPriority::kMedium);
+      if (view.ok()) {
+        memset(view->content(), num_sent_packets, 100);
+        view->length() = 100;
+        a.output().Commit(P2PPriority::kMedium, /*guarantee_delivery=*/true);
+        ++num_sent_packets;
+      }
+    }
+    a.output().Run();
+    b.output().Run();
+    a.input().Run();
+    b.input().Run();
+    while (b.input().NumAvailablePackets(P2PPriority::kMedium) > 0) {
+      received->push_back(b.input().OldestPacket()->content()[0]);
+      b.input().Consume(P2PPriority::kMedium);
+    }
+    link.Advance(10000);
+  }
+  return link.a_to_b_stats();
+}
+
+TEST(P2PLinkEmulatorTest, ReliablePacketsCrossLossyLinkReproducibly) {
+  std::vector<uint8_t> received;
+  const P2PLinkEmulatorStats stats = SendOverLossyLink(/*seed=*/3, &received);
+  std::vector<uint8_t> expected;
+  for (int i = 0; i < 50; ++i) { expected.push_back(i); }
+  EXPECT_EQ(received, expected);
+  EXPECT_GT(stats.num_corrupted_bytes + stats.num_dropped_bytes, 0);
+
+  std::vector<uint8_t> received_again;
+  const P2PLinkEmulatorStats stats_again = SendOverLossyLink(/*seed=*/3, &received_again);
+  EXPECT_EQ(stats_again.num_sent_bytes, stats.num_sent_bytes);
+  EXPECT_EQ(stats_again.num_corrupted_bytes, stats.num_corrupted_bytes);
+  EXPECT_EQ(stats_again.num_dropped_bytes, stats.num_dropped_bytes);
+}
+
+}  // namespace
@@ -0,0 +1,40 @@
+#include <gtest/gtest.h>
+#include "p2p_link_stats.h"
+
+namespace {
+
+TEST(P2PLatencyHistogramTest, BucketsCoverLatenciesContiguously) {
+  for (int i = 0; i < kP2PLatencyHistogramNumBuckets - 1; ++i) {
+    const uint64_t end_ns = P2PLatencyHistogram::BucketEndNs(i);
+    EXPECT_EQ(P2PLatencyHistogram::BucketIndex(end_ns - 1), i);
+    EXPECT_EQ(P2PLatencyHistogram::BucketIndex(end_ns), i + 1);
+  }
+  EXPECT_EQ(P2PLatencyHistogram::BucketIndex(-1ULL), kP2PLatencyHistogramNumBuckets - 1);
+}
+
+TEST(P2PLatencyHistogramTest, QuantilesAreUpperBoundsWithinBucketError) {
+  P2PLatencyHistogram histogram;
+  EXPECT_EQ(histogram.Quantile(0.5f), 0);
+  // 1 to 1000 us.
+  for (int i = 1; i <= 1000; ++i) { histogram.Add(i * 1000ULL); }
+  EXPECT_EQ(histogram.count(), 1000);
+  EXPECT_EQ(histogram.max_ns(), 1000000);
+  EXPECT_GE(histogram.Quantile(0.5f), 500000);
+  EXPECT_LE(histogram.Quantile(0.5f), 500000 * 5 / 4);
+  EXPECT_GE(histogram.Quantile(0.99f), 990000);
+  EXPECT_LE(histogram.Quantile(0.99f), 1000000);
+  EXPECT_EQ(histogram.Quantile(1.0f), 1000000);
+}
+
+TEST(P2PRateMeterTest, RateIsMeasuredOverLastWindow) {
+  P2PRateMeter meter;
+  for (uint64_t t = 0; t < kP2PStatsRateWindowNs; t += kP2PStatsRateWindowNs / 100) { meter.Add(5, t); }
+  EXPECT_EQ(meter.rate_per_second(), 0);
+  meter.Update(kP2PStatsRateWindowNs);
+  EXPECT_EQ(meter.rate_per_second(), 500);
+  // Nothing added during the next window.
+  meter.Update(2 * kP2PStatsRateWindowNs);
+  EXPECT_EQ(meter.rate_per_second(), 0);
+}
+
+}  // namespace
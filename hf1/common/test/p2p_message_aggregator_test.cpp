@@ -0,0 +1,164 @@
+#include <gtest/gtest.h>
+#include <deque>
+#include <string.h>
+#include <vector>
+#include "p2p_message_aggregator.h"
+
+namespace {
+
+// Byte stream that writes to and reads from the same in-memory queue.
+class LoopbackByteStream : public P2PByteStreamInterface<kLittleEndian> {
+public:
+  LoopbackByteStream() : P2PByteStreamInterface<kLittleEndian>(Handler{ .object = nullptr }) {}
+
+  virtual int Write(const void *buffer, int length) {
+    const uint8_t *bytes = static_cast<const uint8_t *>(buffer);
+    bytes_.insert(bytes_.end(), bytes, bytes + length);
+    return length;
+  }
+
+  virtual int Read(void *buffer, int length) {
+    const int num_bytes = std::min(length, static_cast<int>(bytes_.size()));
+    std::copy(bytes_.begin(), bytes_.begin() + num_bytes, static_cast<uint8_t *>(buffer));
+    bytes_.erase(bytes_.begin(), bytes_.begin() + num_bytes);
+    return num_bytes;
+  }
+
+  virtual int GetBurstMaxLength() { return 1024; }
+  virtual int GetBurstIngestionNanosecondsPerByte() { return 0; }
+  virtual int GetAtomicSendMaxLength() { return 4; }
+  virtual int GetReceiveBufferLength() { return 0; }
+
+private:
+  std::deque<uint8_t> bytes_;
+};
+
+class FakeTimer : public TimerInterface {
+public:
+  FakeTimer() : ns_(0) {}
+  virtual uint64_t GetLocalNanoseconds() const { return ns_; }
+  uint64_t &ns() { return ns_; }
+
+private:
+  uint64_t ns_;
+};
+
+using TestInputStream = P2PPacketInputStream<4, kLittleEndian>;
+using TestOutputStream = P2PPacketOutputStream<4, kLittleEndian>;
+using TestAggregator = P2PMessageAggregator<4, kLittleEndian>;
+
+class P2PMessageAggregatorTest : public ::testing::Test {
+protected:
+  P2PMessageAggregatorTest()
+    : input_(&byte_stream_, &timer_), output_(&byte_stream_, &timer_), aggregator_(&output_, &timer_) {}
+
+  // Adds a message of `action` with a payload of `payload_length` bytes set to `request_id`.
+  void AddMessage(P2PAction action, P2PActionRequestID request_id, int payload_length) {
+    const int length = sizeof(P2PApplicationPacketHeader) + payload_length;
+    StatusOr<P2PMutablePacketView> view = aggregator_.NewMessage(P2PPriority::kMedium, length);
+    ASSERT_TRUE(view.ok());
+    P2PApplicationPacketHeader *header = reinterpret_cast<P2PApplicationPacketHeader *>(view->content());
+    header->action = action;
+    header->stage = kRequest;
+    header->request_id = request_id;
+    memset(view->content() + sizeof(P2PApplicationPacketHeader), request_id, payload_length);
+    ASSERT_TRUE(aggregator_.Commit(P2PPriority::kMedium, /*guarantee_delivery=*/false));
+  }
+
+  // Sends all committed packets over the loopback and returns the number of packets received.
+  int Transfer() {
+    while (output_.NumCommittedPackets() > 0) { output_.Run(); }
+    while (input_.Run() > 0) {}
+    return input_.NumAvailablePackets(P2PPriority::kMedium);
+  }
+
+  // Returns the request IDs of all messages in the oldest received packet, and consumes it.
+  std::vector<int> ReceiveMessages() {
+    std::vector<int> request_ids;
+    StatusOr<const P2PPacketView> packet = input_.OldestPacket();
+    EXPECT_TRUE(packet.ok());
+    int offset = 0;
+    do {
+      StatusOr<P2PApplicationMessageView> message = P2PGetApplicationMessage(*packet, offset);
+      EXPECT_TRUE(message.ok());
+      if (!message.ok()) { break; }
+      request_ids.push_back(message->header()->request_id);
+      offset = message->next_offset();
+    } while (offset != 0);
+    input_.Consume(P2PPriority::kMedium);
+    return request_ids;
+  }
+
+  LoopbackByteStream byte_stream_;
+  FakeTimer timer_;
+  TestInputStream input_;
+  TestOutputStream output_;
+  TestAggregator aggregator_;
+};
+
+TEST_F(P2PMessageAggregatorTest, MessageIsSentAloneWhenOutputIsIdle) {
+  AddMessage(kPing, 1, 4);
+  aggregator_.Run();
+  EXPECT_EQ(aggregator_.NumBundledMessages(P2PPriority::kMedium), 0);
+  ASSERT_EQ(Transfer(), 1);
+  StatusOr<const P2PPacketView> packet = input_.OldestPacket();
+  ASSERT_TRUE(packet.ok());
+  // Without aggregation, the message is a regular application packet.
+  EXPECT_EQ(packet->length(), sizeof(P2PApplicationPacketHeader) + 4);
+  EXPECT_EQ(ReceiveMessages(), std::vector<int>({ 1 }));
+}
+
+TEST_F(P2PMessageAggregatorTest, MessagesAreBundledWhileOutputIsBusy) {
+  // A packet waiting in the output stream holds the messages back.
+  StatusOr<P2PMutablePacketView> busy = output_.NewPacket(P2PPriority::kMedium);
+  ASSERT_TRUE(busy.ok());
+  busy->length() = 1;
+  ASSERT_TRUE(output_.Commit(P2PPriority::kMedium, /*guarantee_delivery=*/false));
+
+  AddMessage(kPing, 1, 4);
+  AddMessage(kSetHeadPose, 2, 8);
+  AddMessage(kPing, 3, 0);
+  aggregator_.Run();
+  EXPECT_EQ(aggregator_.NumBundledMessages(P2PPriority::kMedium), 3);
+  EXPECT_EQ(output_.NumCommittedPackets(P2PPriority::kMedium), 1);
+
+  timer_.ns() += kP2PMaxAggregationDelayNs;
+  aggregator_.Run();
+  EXPECT_EQ(aggregator_.NumBundledMessages(P2PPriority::kMedium), 0);
+  ASSERT_EQ(Transfer(), 2);
+  input_.Consume(P2PPriority::kMedium);
+  EXPECT_EQ(ReceiveMessages(), std::vector<int>({ 1, 2, 3 }));
+}
+
+TEST_F(P2PMessageAggregatorTest, FullBundleIsFlushedAndLongMessagesAreSentAloneInOrder) {
+  AddMessage(kPing, 1, 100);
+  AddMessage(kPing, 2, 100);
+  // The first message was flushed to make room for the second one.
+  EXPECT_EQ(output_.NumCommittedPackets(P2PPriority::kMedium), 1);
+  // A message that does not fit in any bundle goes after the bundled ones.
+  AddMessage(kPing, 3, kP2PMaxContentLength - sizeof(P2PApplicationPacketHeader));
+  EXPECT_EQ(output_.NumCommittedPackets(P2PPriority::kMedium), 3);
+  // The output stream has no room for another packet.
+  EXPECT_FALSE(aggregator_.NewMessage(P2PPriority::kMedium, kP2PMaxContentLength).ok());
+
+  ASSERT_EQ(Transfer(), 3);
+  EXPECT_EQ(ReceiveMessages(), std::vector<int>({ 1 }));
+  EXPECT_EQ(ReceiveMessages(), std::vector<int>({ 2 }));
+  EXPECT_EQ(ReceiveMessages(), std::vector<int>({ 3 }));
+}
+
+TEST_F(P2PMessageAggregatorTest, MalformedBundleIsRejected) {
+  P2PPacket packet;
+  packet.header()->priority = P2PPriority::kMedium;
+  P2PApplicationPacketHeader *header = reinterpret_cast<P2PApplicationPacketHeader *>(packet.content());
+  header->action = kP2PBundleAction;
+  // The record claims more bytes than the packet has.
+  packet.content()[sizeof(P2PApplicationPacketHeader)] = 10;
+  packet.length() = sizeof(P2PApplicationPacketHeader) + sizeof(P2PBundledMessageLength) + 5;
+  EXPECT_FALSE(P2PGetApplicationMessage(P2PPacketView(&packet)).ok());
+  // The record is too short for an application message.
+  packet.content()[sizeof(P2PApplicationPacketHeader)] = 1;
+  EXPECT_FALSE(P2PGetApplicationMessage(P2PPacketView(&packet)).ok());
+}
+
+}  // namespace
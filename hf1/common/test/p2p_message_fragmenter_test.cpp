@@ -0,0 +1,197 @@
+#include <gtest/gtest.h>
+#include <deque>
+#include <vector>
+#include <string.h>
+#include "p2p_message_fragmenter.h"
+
+namespace {
+
+// Byte stream that writes to and reads from in-memory queues.
+class MemoryByteStream : public P2PByteStreamInterface<kLittleEndian> {
+public:
+  MemoryByteStream(std::deque<uint8_t> *rx, std::deque<uint8_t> *tx)
+    : P2PByteStreamInterface<kLittleEndian>(Handler{ .object = nullptr }), rx_(*rx), tx_(*tx) {}
+
+  virtual int Write(const void *buffer, int length) {
+    const uint8_t *bytes = static_cast<const uint8_t *>(buffer);
+    tx_.insert(tx_.end(), bytes, bytes + length);
+    return length;
+  }
+
+  virtual int Read(void *buffer, int length) {
+    const int num_bytes = std::min(length, static_cast<int>(rx_.size()));
+    std::copy(rx_.begin(), rx_.begin() + num_bytes, static_cast<uint8_t *>(buffer));
+    rx_.erase(rx_.begin(), rx_.begin() + num_bytes);
+    return num_bytes;
+  }
+
+  virtual int GetBurstMaxLength() { return 1024; }
+  virtual int GetBurstIngestionNanosecondsPerByte() { return 0; }
+  virtual int GetAtomicSendMaxLength() { return 4; }
+  virtual int GetReceiveBufferLength() { return 0; }
+
+private:
+  std::deque<uint8_t> &rx_;
+  std::deque<uint8_t> &tx_;
+};
+
+class FakeTimer : public TimerInterface {
+public:
+  FakeTimer() : ns_(0) {}
+  virtual uint64_t GetLocalNanoseconds() const { return ns_; }
+  uint64_t &ns() { return ns_; }
+
+private:
+  uint64_t ns_;
+};
+
+class FakeGUIDFactory : public GUIDFactoryInterface {
+public:
+  FakeGUIDFactory(uint8_t seed) : seed_(seed) {}
+  virtual void CreateGUID(int len, uint8_t *buffer, uint8_t max_byte_value) {
+    for (int i = 0; i < len; ++i) { buffer[i] = (seed_ + i) % max_byte_value; }
+  }
+
+private:
+  uint8_t seed_;
+};
+
+using TestPacketStream = P2PPacketStream<8, 8, kLittleEndian>;
+using TestAggregator = P2PMessageAggregator<8, kLittleEndian>;
+using TestFragmenter = P2PMessageFragmenter<8, kLittleEndian>;
+
+class P2PMessageFragmenterTest : public ::testing::Test {
+protected:
+  P2PMessageFragmenterTest()
+    : byte_stream_a_(&b_to_a_, &a_to_b_), byte_stream_b_(&a_to_b_, &b_to_a_),
+      guid_factory_a_(1), guid_factory_b_(7),
+      a_(&byte_stream_a_, &timer_, guid_factory_a_), b_(&byte_stream_b_, &timer_, guid_factory_b_),
+      aggregator_(&a_.output(), &timer_), fragmenter_(&aggregator_) {
+    RunLink(1000);
+  }
+
+  // Runs both ends of the link for `num_iterations` steps of 100 us. The sender queues
+  // pending fragments and the receiver collects the fragments in each step.
+  void RunLink(int num_iterations) {
+    for (int i = 0; i < num_iterations; ++i) {
+      fragmenter_.Run();
+      aggregator_.Run();
+      a_.output().Run();
+      b_.output().Run();
+      a_.input().Run();
+      b_.input().Run();
+      ReceiveFragments();
+      timer_.ns() += 100000;
+    }
+  }
+
+  // Copies the payload of the received fragments into `reassembled_`.
+  void ReceiveFragments() {
+    // Drop the packets that take precedence over the fragments, which only fill the link.
+    while (b_.input().Consume(P2PPriority::kHigh)) {}
+    while (b_.input().NumAvailablePackets(P2PPriority::kMedium) > 0) {
+      StatusOr<const P2PPacketView> packet = b_.input().OldestPacket();
+      StatusOr<P2PApplicationMessageView> message = P2PGetApplicationMessage(*packet);
+      ASSERT_TRUE(message.ok());
+      if (message->header()->action != kP2PFragmentAction) {
+        ++num_other_messages_;
+        b_.input().Consume(P2PPriority::kMedium);
+        continue;
+      }
+      StatusOr<P2PFragmentView> fragment = P2PGetFragment<kLittleEndian>(*message);
+      ASSERT_TRUE(fragment.ok());
+      EXPECT_EQ(fragment->action, kCreateBaseTrajectory);
+      EXPECT_EQ(message->header()->request_id, 5);
+      EXPECT_EQ(fragment->offset, static_cast<int>(reassembled_.size()));
+      reassembled_.insert(reassembled_.end(), fragment->data, fragment->data + fragment->length);
+      total_length_ = fragment->total_length;
+      ++num_fragments_;
+      b_.input().Consume(P2PPriority::kMedium);
+    }
+  }
+
+  std::deque<uint8_t> a_to_b_;
+  std::deque<uint8_t> b_to_a_;
+  MemoryByteStream byte_stream_a_;
+  MemoryByteStream byte_stream_b_;
+  FakeTimer timer_;
+  FakeGUIDFactory guid_factory_a_;
+  FakeGUIDFactory guid_factory_b_;
+  TestPacketStream a_;
+  TestPacketStream b_;
+  TestAggregator aggregator_;
+  TestFragmenter fragmenter_;
+  std::vector<uint8_t> reassembled_;
+  int total_length_ = 0;
+  int num_fragments_ = 0;
+  int num_other_messages_ = 0;
+};
+
+TEST_F(P2PMessageFragmenterTest, LongMessageIsReassembledFromPipelinedFragments) {
+  std::vector<uint8_t> payload(2000);
+  for (size_t i = 0; i < payload.size(); ++i) { payload[i] = i * 7; }
+  const P2PApplicationPacketHeader header = { .action = kCreateBaseTrajectory, .stage = kRequest, .request_id = 5 };
+  ASSERT_EQ(fragmenter_.Send(P2PPriority::kMedium, header, payload.size(), payload.data()), Status::kSuccess);
+  // Several fragments are in flight at once, up to the space in the output stream.
+  EXPECT_GT(a_.output().NumCommittedPackets(P2PPriority::kMedium), 1);
+  EXPECT_TRUE(fragmenter_.in_progress());
+  EXPECT_EQ(fragmenter_.Send(P2PPriority::kMedium, header, payload.size(), payload.data()), Status::kExistsError);
+
+  RunLink(1000);
+  EXPECT_FALSE(fragmenter_.in_progress());
+  EXPECT_EQ(num_fragments_, (2000 + kP2PMaxFragmentLength - 1) / kP2PMaxFragmentLength);
+  EXPECT_EQ(total_length_, 2000);
+  EXPECT_EQ(reassembled_, payload);
+}
+
+TEST_F(P2PMessageFragmenterTest, FragmentIsRetriedWhenItCannotBeCommitted) {
+  // Take the space that the queues share with packets of other priorities, down to fewer
+  // bytes than the short message below needs.
+  const P2PPriority kOtherPriorities[] = { P2PPriority::kHigh, P2PPriority::kLow };
+  const int kOtherLengths[] = { kP2PMaxContentLength, kP2PMaxContentLength - 32 };
+  for (int i = 0; i < 2; ++i) {
+    while (a_.output().NumAvailableSlots(kOtherPriorities[i]) > 0) {
+      StatusOr<P2PMutablePacketView> packet = a_.output().NewPacket(kOtherPriorities[i]);
+      ASSERT_TRUE(packet.ok());
+      packet->length() = kOtherLengths[i];
+      ASSERT_TRUE(a_.output().Commit(kOtherPriorities[i], /*guarantee_delivery=*/false));
+    }
+  }
+  // The first fragment must flush this message, which then takes the block of kMedium where
+  // the fragment would be built.
+  StatusOr<P2PMutablePacketView> message = aggregator_.NewMessage(P2PPriority::kMedium, sizeof(P2PApplicationPacketHeader));
+  ASSERT_TRUE(message.ok());
+  *reinterpret_cast<P2PApplicationPacketHeader *>(message->content()) = { .action = kGetLinkStats, .stage = kRequest, .request_id = 4 };
+  ASSERT_TRUE(aggregator_.Commit(P2PPriority::kMedium, /*guarantee_delivery=*/true));
+
+  std::vector<uint8_t> payload(500);
+  for (size_t i = 0; i < payload.size(); ++i) { payload[i] = i * 3; }
+  const P2PApplicationPacketHeader header = { .action = kCreateBaseTrajectory, .stage = kRequest, .request_id = 5 };
+  ASSERT_EQ(fragmenter_.Send(P2PPriority::kMedium, header, payload.size(), payload.data()), Status::kSuccess);
+  // Only the flushed message was committed.
+  EXPECT_EQ(a_.output().NumCommittedPackets(P2PPriority::kMedium), 1);
+  EXPECT_TRUE(fragmenter_.in_progress());
+
+  RunLink(1000);
+  EXPECT_FALSE(fragmenter_.in_progress());
+  EXPECT_EQ(num_other_messages_, 1);
+  EXPECT_EQ(total_length_, 500);
+  EXPECT_EQ(reassembled_, payload);
+}
+
+TEST_F(P2PMessageFragmenterTest, FragmentPastTotalLengthIsMalformed) {
+  uint8_t content[sizeof(P2PApplicationPacketHeader) + sizeof(P2PFragmentHeader) + 4] = {};
+  P2PApplicationPacketHeader *header = reinterpret_cast<P2PApplicationPacketHeader *>(content);
+  header->action = kP2PFragmentAction;
+  P2PFragmentHeader *fragment_header = reinterpret_cast<P2PFragmentHeader *>(content + sizeof(P2PApplicationPacketHeader));
+  fragment_header->action = kCreateBaseTrajectory;
+  fragment_header->offset = 10;
+  fragment_header->total_length = 12;
+  const P2PApplicationMessageView message(P2PPriority::kMedium, content, sizeof(content), 0);
+  EXPECT_FALSE(P2PGetFragment<kLittleEndian>(message).ok());
+  fragment_header->total_length = 14;
+  ASSERT_TRUE(P2PGetFragment<kLittleEndian>(message).ok());
+  EXPECT_EQ(P2PGetFragment<kLittleEndian>(message)->length, 4);
+}
+
+}  // namespace
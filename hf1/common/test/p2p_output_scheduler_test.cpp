@@ -0,0 +1,67 @@
+#include <gtest/gtest.h>
+#include "p2p_output_scheduler.h"
+
+namespace {
+
+// Selects `num_packets` packets of `packet_length` bytes while all levels have packets, and
+// returns the number of bytes sent by each level.
+std::vector<int> SendSaturated(P2POutputSchedulerInterface *scheduler, int num_packets, int packet_length, uint64_t time_step_ns = 0) {
+  bool has_packet[P2PPriority::kNumLevels];
+  int packet_lengths[P2PPriority::kNumLevels];
+  for (int priority = 0; priority < P2PPriority::kNumLevels; ++priority) {
+    has_packet[priority] = priority != P2PPriority::kReserved;
+    packet_lengths[priority] = packet_length;
+  }
+  std::vector<int> sent_bytes(P2PPriority::kNumLevels, 0);
+  uint64_t timestamp_ns = 0;
+  for (int i = 0; i < num_packets; ++i, timestamp_ns += time_step_ns) {
+    const int priority = scheduler->SelectPriority(has_packet, packet_lengths, timestamp_ns);
+    if (priority < 0) { continue; }
+    scheduler->OnBytesSent(priority, packet_length, timestamp_ns);
+    sent_bytes[priority] += packet_length;
+  }
+  return sent_bytes;
+}
+
+TEST(P2POutputSchedulerTest, StrictPriorityStarvesLowerLevels) {
+  P2PStrictPriorityScheduler scheduler;
+  const std::vector<int> sent_bytes = SendSaturated(&scheduler, 100, 50);
+  EXPECT_EQ(sent_bytes[P2PPriority::kHigh], 5000);
+  EXPECT_EQ(sent_bytes[P2PPriority::kMedium], 0);
+  EXPECT_TRUE(scheduler.CanPreempt(P2PPriority::kMedium, P2PPriority::kLow));
+}
+
+TEST(P2POutputSchedulerTest, DeficitRoundRobinSharesLinkInProportionToQuanta) {
+  P2PDeficitRoundRobinScheduler scheduler;
+  scheduler.strict(P2PPriority::kHigh, false);
+  scheduler.quantum(P2PPriority::kHigh, 400);
+  scheduler.quantum(P2PPriority::kMedium, 200);
+  scheduler.quantum(P2PPriority::kLow, 100);
+  const std::vector<int> sent_bytes = SendSaturated(&scheduler, 700, 50);
+  EXPECT_NEAR(sent_bytes[P2PPriority::kHigh], 20000, 400);
+  EXPECT_NEAR(sent_bytes[P2PPriority::kMedium], 10000, 400);
+  EXPECT_NEAR(sent_bytes[P2PPriority::kLow], 5000, 400);
+  EXPECT_FALSE(scheduler.CanPreempt(P2PPriority::kMedium, P2PPriority::kLow));
+}
+
+TEST(P2POutputSchedulerTest, StrictLevelIsServedFirstAndPreempts) {
+  P2PDeficitRoundRobinScheduler scheduler;
+  const std::vector<int> sent_bytes = SendSaturated(&scheduler, 100, 50);
+  EXPECT_EQ(sent_bytes[P2PPriority::kHigh], 5000);
+  EXPECT_TRUE(scheduler.CanPreempt(P2PPriority::kHigh, P2PPriority::kMedium));
+  EXPECT_FALSE(scheduler.CanPreempt(P2PPriority::kMedium, P2PPriority::kHigh));
+}
+
+TEST(P2POutputSchedulerTest, RateCapLimitsLevelAndLetsOthersUseTheLink) {
+  P2PDeficitRoundRobinScheduler scheduler;
+  scheduler.rate_cap(P2PPriority::kHigh, 10000);
+  // 1000 selections in 1 second: kHigh can only send its initial burst plus 10000 bytes.
+  const std::vector<int> sent_bytes = SendSaturated(&scheduler, 1000, 50, /*time_step_ns=*/1000000);
+  EXPECT_LE(sent_bytes[P2PPriority::kHigh], 10000 + kP2PMaxUnencodedPacketLength + 50);
+  EXPECT_GE(sent_bytes[P2PPriority::kHigh], 10000 - 50);
+  EXPECT_GT(sent_bytes[P2PPriority::kMedium], 0);
+  EXPECT_GT(sent_bytes[P2PPriority::kLow], 0);
+  EXPECT_EQ(scheduler.TimeUntilEligibleNs(P2PPriority::kMedium, 50, 0), 0);
+}
+
+}  // namespace
@@ -0,0 +1,970 @@
+#include <gtest/gtest.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <string.h>
+#include "p2p_output_scheduler.h"
+#include "p2p_packet_stream.h"
+
+namespace {
+
+// Byte stream that writes to and reads from in-memory queues.
+class MemoryByteStream : public P2PByteStreamInterface<kLittleEndian> {
+public:
+  MemoryByteStream(std::deque<uint8_t> *rx, std::deque<uint8_t> *tx)
+    : P2PByteStreamInterface<kLittleEndian>(Handler{ .object = nullptr }), rx_(*rx), tx_(*tx), num_reads_(0),
+      burst_max_length_(1024), burst_ingestion_ns_per_byte_(0), receive_buffer_length_(0) {}
+
+  virtual int Write(const void *buffer, int length) {
+    const uint8_t *bytes = static_cast<const uint8_t *>(buffer);
+    tx_.insert(tx_.end(), bytes, bytes + length);
+    return length;
+  }
+
+  virtual int Read(void *buffer, int length) {
+    ++num_reads_;
+    const int num_bytes = std::min(length, static_cast<int>(rx_.size()));
+    std::copy(rx_.begin(), rx_.begin() + num_bytes, static_cast<uint8_t *>(buffer));
+    rx_.erase(rx_.begin(), rx_.begin() + num_bytes);
+    return num_bytes;
+  }
+
+  virtual int GetBurstMaxLength() { return burst_max_length_; }
+  virtual int GetBurstIngestionNanosecondsPerByte() { return burst_ingestion_ns_per_byte_; }
+  virtual int GetAtomicSendMaxLength() { return 4; }
+  virtual int GetReceiveBufferLength() { return receive_buffer_length_; }
+
+  int num_reads() const { return num_reads_; }
+  void burst_max_length(int length) { burst_max_length_ = length; }
+  void burst_ingestion_ns_per_byte(int ns) { burst_ingestion_ns_per_byte_ = ns; }
+  void receive_buffer_length(int length) { receive_buffer_length_ = length; }
+
+private:
+  std::deque<uint8_t> &rx_;
+  std::deque<uint8_t> &tx_;
+  int num_reads_;
+  int burst_max_length_;
+  int burst_ingestion_ns_per_byte_;
+  int receive_buffer_length_;
+};
+
+// Memory byte stream whose ends can be used from different threads.
+class LockedMemoryByteStream : public MemoryByteStream {
+public:
+  LockedMemoryByteStream(std::deque<uint8_t> *rx, std::deque<uint8_t> *tx, std::mutex *mutex)
+    : MemoryByteStream(rx, tx), mutex_(*mutex) {}
+
+  virtual int Write(const void *buffer, int length) {
+    std::lock_guard<std::mutex> guard(mutex_);
+    return MemoryByteStream::Write(buffer, length);
+  }
+
+  virtual int Read(void *buffer, int length) {
+    std::lock_guard<std::mutex> guard(mutex_);
+    return MemoryByteStream::Read(buffer, length);
+  }
+
+private:
+  std::mutex &mutex_;
+};
+
+class SteadyTimer : public TimerInterface {
+public:
+  virtual uint64_t GetLocalNanoseconds() const {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+};
+
+class FakeTimer : public TimerInterface {
+public:
+  FakeTimer() : ns_(0) {}
+  virtual uint64_t GetLocalNanoseconds() const { return ns_; }
+  uint64_t &ns() { return ns_; }
+
+private:
+  uint64_t ns_;
+};
+
+class FakeGUIDFactory : public GUIDFactoryInterface {
+public:
+  FakeGUIDFactory(uint8_t seed) : seed_(seed) {}
+  virtual void CreateGUID(int len, uint8_t *buffer, uint8_t max_byte_value) {
+    for (int i = 0; i < len; ++i) { buffer[i] = (seed_ + i) % max_byte_value; }
+  }
+
+private:
+  uint8_t seed_;
+};
+
+using TestInputStream = P2PPacketInputStream<4, kLittleEndian>;
+using TestOutputStream = P2PPacketOutputStream<4, kLittleEndian>;
+using TestPacketStream = P2PPacketStream<4, 4, kLittleEndian>;
+
+class P2PPacketStreamTest : public ::testing::Test {
+protected:
+  P2PPacketStreamTest()
+    : byte_stream_a_(&b_to_a_, &a_to_b_), byte_stream_b_(&a_to_b_, &b_to_a_) {}
+
+  // Sends a packet with `length` bytes of `content` from the output stream to the wire.
+  void SendPacket(TestOutputStream *output, P2PPriority priority, const uint8_t *content, int length) {
+    StatusOr<P2PMutablePacketView> view = output->NewPacket(priority);
+    ASSERT_TRUE(view.ok());
+    memcpy(view->content(), content, length);
+    view->length() = length;
+    ASSERT_TRUE(output->Commit(priority, /*guarantee_delivery=*/false));
+    while (output->NumCommittedPackets() > 0) { output->Run(); }
+  }
+
+  // Commits a reliable packet whose content is `value`.
+  void CommitReliablePacket(TestPacketStream *stream, P2PPriority priority, uint8_t value) {
+    StatusOr<P2PMutablePacketView> view = stream->output().NewPacket(priority);
+    ASSERT_TRUE(view.ok());
+    view->content()[0] = value;
+    view->length() = 1;
+    ASSERT_TRUE(stream->output().Commit(priority, /*guarantee_delivery=*/true));
+  }
+
+  // Consumes all packets available in `stream` with `priority`, and returns their values.
+  std::vector<uint8_t> ReceivePackets(TestPacketStream *stream, P2PPriority priority) {
+    std::vector<uint8_t> values;
+    while (stream->input().NumAvailablePackets(priority) > 0) {
+      StatusOr<const P2PPacketView> packet = stream->input().OldestPacket();
+      values.push_back(packet->content()[0]);
+      stream->input().Consume(priority);
+    }
+    return values;
+  }
+
+  // Runs both ends of the link for `max_iterations` steps of `time_step_ns`. By default, it is
+  // long enough for the bytes in transit to arrive and for lost packets to be retransmitted.
+  void RunLink(TestPacketStream *a, TestPacketStream *b, int max_iterations = 10000, uint64_t time_step_ns = 100000) {
+    for (int i = 0; i < max_iterations; ++i) {
+      a->output().Run();
+      b->output().Run();
+      a->input().Run();
+      b->input().Run();
+      timer_.ns() += time_step_ns;
+    }
+  }
+
+  std::deque<uint8_t> a_to_b_;
+  std::deque<uint8_t> b_to_a_;
+  MemoryByteStream byte_stream_a_;
+  MemoryByteStream byte_stream_b_;
+  FakeTimer timer_;
+};
+
+TEST_F(P2PPacketStreamTest, InputStreamReceivesPacketWithBlockReads) {
+  TestOutputStream output(&byte_stream_a_, &timer_);
+  TestInputStream input(&byte_stream_b_, &timer_);
+  const uint8_t content[] = { 1, 2, kP2PStartToken, 3, kP2PSpecialToken, 4 };
+  SendPacket(&output, P2PPriority::kMedium, content, sizeof(content));
+
+  while (input.Run() > 0) {}
+
+  StatusOr<const P2PPacketView> packet = input.OldestPacket();
+  ASSERT_TRUE(packet.ok());
+  ASSERT_EQ(packet->length(), sizeof(content));
+  EXPECT_EQ(memcmp(packet->content(), content, sizeof(content)), 0);
+}
+
+TEST_F(P2PPacketStreamTest, InputStreamReceivesPacketWithByteReads) {
+  TestOutputStream output(&byte_stream_a_, &timer_);
+  TestInputStream input(&byte_stream_b_, &timer_);
+  input.read_block_length(1);
+  const uint8_t content[] = { 1, 2, kP2PStartToken, 3, kP2PSpecialToken, 4 };
+  SendPacket(&output, P2PPriority::kMedium, content, sizeof(content));
+
+  while (input.Run() > 0) {}
+
+  StatusOr<const P2PPacketView> packet = input.OldestPacket();
+  ASSERT_TRUE(packet.ok());
+  ASSERT_EQ(packet->length(), sizeof(content));
+  EXPECT_EQ(memcmp(packet->content(), content, sizeof(content)), 0);
+}
+
+TEST_F(P2PPacketStreamTest, RunProcessesAllAvailableBytesWithOneRead) {
+  TestOutputStream output(&byte_stream_a_, &timer_);
+  TestInputStream input(&byte_stream_b_, &timer_);
+  const uint8_t content[] = { 1, 2, 3 };
+  SendPacket(&output, P2PPriority::kMedium, content, sizeof(content));
+  SendPacket(&output, P2PPriority::kMedium, content, sizeof(content));
+  const int num_wire_bytes = a_to_b_.size();
+  ASSERT_LE(num_wire_bytes, kP2PInputStagingBufferLength);
+
+  EXPECT_EQ(input.Run(), num_wire_bytes);
+  EXPECT_EQ(byte_stream_b_.num_reads(), 1);
+  EXPECT_EQ(input.NumAvailablePackets(P2PPriority::kMedium), 2);
+}
+
+TEST_F(P2PPacketStreamTest, ReadBlockLengthIsClamped) {
+  TestInputStream input(&byte_stream_b_, &timer_);
+
+  input.read_block_length(0);
+  EXPECT_EQ(input.read_block_length(), 1);
+  input.read_block_length(kP2PInputStagingBufferLength + 1);
+  EXPECT_EQ(input.read_block_length(), kP2PInputStagingBufferLength);
+}
+
+TEST_F(P2PPacketStreamTest, OutputStreamIsIdleOnlyWithoutPacketsToSend) {
+  TestOutputStream output(&byte_stream_a_, &timer_);
+  EXPECT_EQ(output.Run(), 0ULL);
+  EXPECT_TRUE(output.is_idle());
+
+  StatusOr<P2PMutablePacketView> view = output.NewPacket(P2PPriority::kMedium);
+  ASSERT_TRUE(view.ok());
+  view->length() = 1;
+  ASSERT_TRUE(output.Commit(P2PPriority::kMedium, /*guarantee_delivery=*/false));
+  output.Run();
+  EXPECT_FALSE(output.is_idle());
+
+  // Wait for the other end to ingest the last burst.
+  for (int i = 0; i < 100 && !output.is_idle(); ++i) { timer_.ns() += output.Run(); }
+  EXPECT_EQ(output.NumCommittedPackets(), 0);
+  EXPECT_TRUE(output.is_idle());
+}
+
+TEST_F(P2PPacketStreamTest, QueueIsCongestedBetweenWatermarks) {
+  TestOutputStream output(&byte_stream_a_, &timer_);
+  std::vector<bool> transitions;
+  output.queue_watermarks(P2PPriority::kLow, /*low=*/0, /*high=*/2);
+  output.queue_watermark_callback(P2PQueueWatermarkCallback([](int priority, bool is_congested, void *arg) {
+    EXPECT_EQ(priority, P2PPriority::kLow);
+    static_cast<std::vector<bool> *>(arg)->push_back(is_congested);
+  }, &transitions));
+  for (int i = 0; i < 2; ++i) {
+    StatusOr<P2PMutablePacketView> view = output.NewPacket(P2PPriority::kLow);
+    ASSERT_TRUE(view.ok());
+    view->length() = 1;
+    ASSERT_TRUE(output.Commit(P2PPriority::kLow, /*guarantee_delivery=*/false));
+  }
+  EXPECT_TRUE(output.is_queue_congested(P2PPriority::kLow));
+  EXPECT_FALSE(output.is_queue_congested(P2PPriority::kMedium));
+
+  while (output.NumCommittedPackets() > 0) { output.Run(); }
+  EXPECT_FALSE(output.is_queue_congested(P2PPriority::kLow));
+  EXPECT_EQ(transitions, std::vector<bool>({ true, false }));
+}
+
+TEST_F(P2PPacketStreamTest, ACKPriorityHasRoomWhenOtherQueuesAreFull) {
+  FakeGUIDFactory guid_factory(1);
+  TestPacketStream stream(&byte_stream_a_, &timer_, guid_factory);
+  // Fill the shared queues with full-size packets, and the blocks of their priorities.
+  for (const P2PPriority priority : { P2PPriority::kHigh, P2PPriority::kMedium, P2PPriority::kLow }) {
+    for (StatusOr<P2PMutablePacketView> view = stream.output().NewPacket(priority); view.ok(); view = stream.output().NewPacket(priority)) {
+      view->length() = kP2PMaxContentLength;
+      ASSERT_TRUE(stream.output().Commit(priority, /*guarantee_delivery=*/false));
+    }
+  }
+
+  // ACKs fit in the bytes reserved for them, which keeps room for the next one.
+  for (int i = 0; i < 2; ++i) {
+    StatusOr<P2PMutablePacketView> view = stream.output().NewPacket(P2PPriority::kReserved);
+    ASSERT_TRUE(view.ok()) << i;
+    view->length() = 0;
+    ASSERT_TRUE(stream.output().Commit(P2PPriority::kReserved, /*guarantee_delivery=*/false));
+  }
+  EXPECT_TRUE(stream.output().NewPacket(P2PPriority::kReserved).ok());
+}
+
+TEST_F(P2PPacketStreamTest, MaxLengthPacketOfTokensIsDelivered) {
+  TestOutputStream output(&byte_stream_a_, &timer_);
+  TestInputStream input(&byte_stream_b_, &timer_);
+  uint8_t content[kP2PMaxContentLength];
+  for (unsigned int i = 0; i < sizeof(content); ++i) { content[i] = i % 2 ? kP2PStartToken : kP2PSpecialToken; }
+  SendPacket(&output, P2PPriority::kMedium, content, sizeof(content));
+
+  while (input.Run() > 0) {}
+
+  StatusOr<const P2PPacketView> packet = input.OldestPacket();
+  ASSERT_TRUE(packet.ok());
+  ASSERT_EQ(packet->length(), sizeof(content));
+  EXPECT_EQ(memcmp(packet->content(), content, sizeof(content)), 0);
+}
+
+TEST_F(P2PPacketStreamTest, CommitRejectsContentLongerThanMaximum) {
+  TestOutputStream output(&byte_stream_a_, &timer_);
+  StatusOr<P2PMutablePacketView> view = output.NewPacket(P2PPriority::kMedium);
+  ASSERT_TRUE(view.ok());
+  view->length() = kP2PMaxContentLength + 1;
+
+  EXPECT_FALSE(output.Commit(P2PPriority::kMedium, /*guarantee_delivery=*/false));
+}
+
+TEST_F(P2PPacketStreamTest, PreemptedPacketIsContinuedAfterHigherPriorityPacket) {
+  TestOutputStream output(&byte_stream_a_, &timer_);
+  TestInputStream input(&byte_stream_b_, &timer_);
+  uint8_t low_content[100];
+  for (unsigned int i = 0; i < sizeof(low_content); ++i) { low_content[i] = i % 3 ? i : kP2PStartToken; }
+  const uint8_t high_content[] = { kP2PSpecialToken, 1, kP2PStartToken };
+
+  StatusOr<P2PMutablePacketView> low_view = output.NewPacket(P2PPriority::kLow);
+  ASSERT_TRUE(low_view.ok());
+  memcpy(low_view->content(), low_content, sizeof(low_content));
+  low_view->length() = sizeof(low_content);
+  ASSERT_TRUE(output.Commit(P2PPriority::kLow, /*guarantee_delivery=*/false));
+  while (a_to_b_.size() < sizeof(P2PHeader) + 20) { output.Run(); }
+
+  StatusOr<P2PMutablePacketView> high_view = output.NewPacket(P2PPriority::kHigh);
+  ASSERT_TRUE(high_view.ok());
+  memcpy(high_view->content(), high_content, sizeof(high_content));
+  high_view->length() = sizeof(high_content);
+  ASSERT_TRUE(output.Commit(P2PPriority::kHigh, /*guarantee_delivery=*/false));
+  while (output.NumCommittedPackets() > 0) { output.Run(); }
+  while (input.Run() > 0) {}
+
+  StatusOr<const P2PPacketView> high_packet = input.OldestPacket();
+  ASSERT_TRUE(high_packet.ok());
+  ASSERT_EQ(high_packet->priority(), P2PPriority::kHigh);
+  ASSERT_EQ(high_packet->length(), sizeof(high_content));
+  EXPECT_EQ(memcmp(high_packet->content(), high_content, sizeof(high_content)), 0);
+  input.Consume(P2PPriority::kHigh);
+  StatusOr<const P2PPacketView> low_packet = input.OldestPacket();
+  ASSERT_TRUE(low_packet.ok());
+  ASSERT_EQ(low_packet->priority(), P2PPriority::kLow);
+  ASSERT_EQ(low_packet->length(), sizeof(low_content));
+  EXPECT_EQ(memcmp(low_packet->content(), low_content, sizeof(low_content)), 0);
+}
+
+// Keeps the kMedium queue of `output` full while sending for `num_iterations` steps, and
+// returns the number of kLow packets received, out of the 3 committed at the start.
+int NumLowPriorityPacketsSentUnderLoad(TestOutputStream *output, TestInputStream *input, int num_iterations) {
+  for (int i = 0; i < 3; ++i) {
+    StatusOr<P2PMutablePacketView> view = output->NewPacket(P2PPriority::kLow);
+    view->length() = 50;
+    output->Commit(P2PPriority::kLow, /*guarantee_delivery=*/false);
+  }
+  int num_low_packets = 0;
+  for (int i = 0; i < num_iterations; ++i) {
+    for (StatusOr<P2PMutablePacketView> view = output->NewPacket(P2PPriority::kMedium); view.ok(); view = output->NewPacket(P2PPriority::kMedium)) {
+      view->length() = 50;
+      output->Commit(P2PPriority::kMedium, /*guarantee_delivery=*/false);
+    }
+    output->Run();
+    input->Run();
+    while (input->OldestPacket().ok()) {
+      const int priority = input->OldestPacket()->priority();
+      num_low_packets += priority == P2PPriority::kLow;
+      input->Consume(priority);
+    }
+  }
+  return num_low_packets;
+}
+
+TEST_F(P2PPacketStreamTest, DeficitRoundRobinSchedulerDoesNotStarveLowerPriorities) {
+  TestOutputStream strict_output(&byte_stream_a_, &timer_);
+  TestInputStream strict_input(&byte_stream_b_, &timer_);
+  EXPECT_EQ(NumLowPriorityPacketsSentUnderLoad(&strict_output, &strict_input, 1000), 0);
+
+  TestOutputStream output(&byte_stream_a_, &timer_);
+  TestInputStream input(&byte_stream_b_, &timer_);
+  P2PDeficitRoundRobinScheduler scheduler;
+  output.scheduler(&scheduler);
+  EXPECT_EQ(NumLowPriorityPacketsSentUnderLoad(&output, &input, 1000), 3);
+}
+
+TEST_F(P2PPacketStreamTest, CorruptedPacketIsDiscarded) {
+  TestOutputStream output(&byte_stream_a_, &timer_);
+  TestInputStream input(&byte_stream_b_, &timer_);
+  const uint8_t content[] = { 1, 2, 3, 4 };
+  SendPacket(&output, P2PPriority::kMedium, content, sizeof(content));
+  a_to_b_[sizeof(P2PHeader) + 1] ^= 0x10;
+
+  while (input.Run() > 0) {}
+
+  EXPECT_FALSE(input.OldestPacket().ok());
+  EXPECT_EQ(input.stats().total_checksum_errors(P2PPriority::kMedium), 1);
+}
+
+TEST_F(P2PPacketStreamTest, StatsTrackDroppedPacketsAndQueueHighWatermark) {
+  TestOutputStream output(&byte_stream_a_, &timer_);
+  TestInputStream input(&byte_stream_b_, &timer_);
+  const uint8_t content[] = { 1, 2, 3, 4 };
+  for (int i = 0; i < 5; ++i) { SendPacket(&output, P2PPriority::kMedium, content, sizeof(content)); }
+  while (input.Run() > 0) {}
+
+  EXPECT_EQ(input.stats().queue_high_watermark(P2PPriority::kMedium), 3);
+  EXPECT_EQ(input.stats().total_dropped_packets(P2PPriority::kMedium), 2);
+  EXPECT_EQ(input.stats().total_resyncs(), 0);
+  EXPECT_EQ(output.stats().queue_high_watermark(P2PPriority::kMedium), 1);
+  while (input.OldestPacket().ok()) { input.Consume(P2PPriority::kMedium); }
+  EXPECT_EQ(input.stats().packet_delay_histogram(P2PPriority::kMedium).count(), 3);
+}
+
+TEST_F(P2PPacketStreamTest, COBSPacketsAreDelivered) {
+  TestOutputStream output(&byte_stream_a_, &timer_);
+  TestInputStream input(&byte_stream_b_, &timer_);
+  output.framing(kCOBSFraming);
+  const std::vector<std::vector<uint8_t>> contents = {
+    {},
+    { kP2PStartToken },
+    { kP2PStartToken, 1, kP2PSpecialToken },
+    { 1, 2, kP2PStartToken, kP2PStartToken, 3, kP2PStartToken },
+    std::vector<uint8_t>(kP2PMaxContentLength, kP2PStartToken),
+    std::vector<uint8_t>(kP2PMaxContentLength, kP2PSpecialToken),
+  };
+
+  for (const std::vector<uint8_t> &content : contents) {
+    SendPacket(&output, P2PPriority::kMedium, content.data(), content.size());
+    // At most one byte of overhead for any content length.
+    EXPECT_LE(a_to_b_.size(), sizeof(P2PHeader) + content.size() + 1 + sizeof(P2PFooter));
+    while (input.Run() > 0) {}
+
+    StatusOr<const P2PPacketView> packet = input.OldestPacket();
+    ASSERT_TRUE(packet.ok());
+    ASSERT_EQ(packet->length(), content.size());
+    EXPECT_EQ(memcmp(packet->content(), content.data(), content.size()), 0);
+    input.Consume(P2PPriority::kMedium);
+  }
+}
+
+TEST_F(P2PPacketStreamTest, PreemptedCOBSPacketIsContinuedAfterHigherPriorityPacket) {
+  TestOutputStream output(&byte_stream_a_, &timer_);
+  TestInputStream input(&byte_stream_b_, &timer_);
+  output.framing(kCOBSFraming);
+  uint8_t low_content[100];
+  for (unsigned int i = 0; i < sizeof(low_content); ++i) { low_content[i] = i % 7 ? i : kP2PStartToken; }
+  const uint8_t high_content[] = { kP2PStartToken, 1, kP2PStartToken };
+
+  StatusOr<P2PMutablePacketView> low_view = output.NewPacket(P2PPriority::kLow);
+  ASSERT_TRUE(low_view.ok());
+  memcpy(low_view->content(), low_content, sizeof(low_content));
+  low_view->length() = sizeof(low_content);
+  ASSERT_TRUE(output.Commit(P2PPriority::kLow, /*guarantee_delivery=*/false));
+  while (a_to_b_.size() < sizeof(P2PHeader) + 10) { output.Run(); }
+
+  StatusOr<P2PMutablePacketView> high_view = output.NewPacket(P2PPriority::kHigh);
+  ASSERT_TRUE(high_view.ok());
+  memcpy(high_view->content(), high_content, sizeof(high_content));
+  high_view->length() = sizeof(high_content);
+  ASSERT_TRUE(output.Commit(P2PPriority::kHigh, /*guarantee_delivery=*/false));
+  while (output.NumCommittedPackets() > 0) { output.Run(); }
+  while (input.Run() > 0) {}
+
+  StatusOr<const P2PPacketView> high_packet = input.OldestPacket();
+  ASSERT_TRUE(high_packet.ok());
+  ASSERT_EQ(high_packet->priority(), P2PPriority::kHigh);
+  ASSERT_EQ(high_packet->length(), sizeof(high_content));
+  EXPECT_EQ(memcmp(high_packet->content(), high_content, sizeof(high_content)), 0);
+  input.Consume(P2PPriority::kHigh);
+  StatusOr<const P2PPacketView> low_packet = input.OldestPacket();
+  ASSERT_TRUE(low_packet.ok());
+  ASSERT_EQ(low_packet->priority(), P2PPriority::kLow);
+  ASSERT_EQ(low_packet->length(), sizeof(low_content));
+  EXPECT_EQ(memcmp(low_packet->content(), low_content, sizeof(low_content)), 0);
+}
+
+TEST_F(P2PPacketStreamTest, CorruptedCOBSPacketIsDiscarded) {
+  TestOutputStream output(&byte_stream_a_, &timer_);
+  TestInputStream input(&byte_stream_b_, &timer_);
+  output.framing(kCOBSFraming);
+  const uint8_t content[] = { 1, kP2PStartToken, 3, 4 };
+  SendPacket(&output, P2PPriority::kMedium, content, sizeof(content));
+  // Change the first block code.
+  a_to_b_[sizeof(P2PHeader)] ^= 0x01;
+
+  while (input.Run() > 0) {}
+
+  EXPECT_FALSE(input.OldestPacket().ok());
+}
+
+TEST_F(P2PPacketStreamTest, COBSFramingIsNegotiatedAtHandshake) {
+  FakeGUIDFactory guid_factory_a(1);
+  FakeGUIDFactory guid_factory_b(7);
+  TestPacketStream a(&byte_stream_a_, &timer_, guid_factory_a);
+  TestPacketStream b(&byte_stream_b_, &timer_, guid_factory_b);
+  b.preferred_framing(kEscapedFraming);
+  EXPECT_EQ(a.output().framing(), kEscapedFraming);
+  RunLink(&a, &b);
+
+  EXPECT_EQ(a.output().framing(), kCOBSFraming);
+  EXPECT_EQ(b.output().framing(), kEscapedFraming);
+  for (TestPacketStream *sender : { &a, &b }) {
+    TestPacketStream *receiver = sender == &a ? &b : &a;
+    StatusOr<P2PMutablePacketView> view = sender->output().NewPacket(P2PPriority::kMedium);
+    ASSERT_TRUE(view.ok());
+    view->content()[0] = kP2PStartToken;
+    view->content()[1] = 52;
+    view->length() = 2;
+    ASSERT_TRUE(sender->output().Commit(P2PPriority::kMedium, /*guarantee_delivery=*/true));
+    RunLink(&a, &b);
+
+    StatusOr<const P2PPacketView> packet = receiver->input().OldestPacket();
+    ASSERT_TRUE(packet.ok());
+    ASSERT_EQ(packet->length(), 2);
+    EXPECT_EQ(packet->content()[0], kP2PStartToken);
+    EXPECT_EQ(packet->content()[1], 52);
+  }
+}
+
+TEST_F(P2PPacketStreamTest, ReliablePacketIsDeliveredAfterHandshake) {
+  FakeGUIDFactory guid_factory_a(1);
+  FakeGUIDFactory guid_factory_b(7);
+  TestPacketStream a(&byte_stream_a_, &timer_, guid_factory_a);
+  TestPacketStream b(&byte_stream_b_, &timer_, guid_factory_b);
+  RunLink(&a, &b);
+
+  StatusOr<P2PMutablePacketView> view = a.output().NewPacket(P2PPriority::kMedium);
+  ASSERT_TRUE(view.ok());
+  view->content()[0] = 52;
+  view->length() = 1;
+  ASSERT_TRUE(a.output().Commit(P2PPriority::kMedium, /*guarantee_delivery=*/true));
+  RunLink(&a, &b);
+
+  StatusOr<const P2PPacketView> packet = b.input().OldestPacket();
+  ASSERT_TRUE(packet.ok());
+  ASSERT_EQ(packet->length(), 1);
+  EXPECT_EQ(packet->content()[0], 52);
+  EXPECT_EQ(a.output().NumCommittedPackets(), 0);
+}
+
+TEST_F(P2PPacketStreamTest, ReliablePacketsInWindowAreSentWithoutWaitingForACKs) {
+  FakeGUIDFactory guid_factory_a(1);
+  FakeGUIDFactory guid_factory_b(7);
+  TestPacketStream a(&byte_stream_a_, &timer_, guid_factory_a);
+  TestPacketStream b(&byte_stream_b_, &timer_, guid_factory_b);
+  RunLink(&a, &b);
+  ASSERT_EQ(a.output().window_size(), 3);
+
+  for (int i = 0; i < 3; ++i) { CommitReliablePacket(&a, P2PPriority::kMedium, i); }
+  // No ACKs come back while the window is sent, and the retransmission timeout does not expire.
+  for (int i = 0; i < 1000; ++i) { a.output().Run(); }
+  while (b.input().Run() > 0) {}
+
+  EXPECT_EQ(ReceivePackets(&b, P2PPriority::kMedium), std::vector<uint8_t>({ 0, 1, 2 }));
+  RunLink(&a, &b);
+  EXPECT_EQ(a.output().NumCommittedPackets(), 0);
+  EXPECT_TRUE(ReceivePackets(&b, P2PPriority::kMedium).empty());
+}
+
+TEST_F(P2PPacketStreamTest, StopAndWaitWithWindowOfOnePacket) {
+  FakeGUIDFactory guid_factory_a(1);
+  FakeGUIDFactory guid_factory_b(7);
+  TestPacketStream a(&byte_stream_a_, &timer_, guid_factory_a);
+  TestPacketStream b(&byte_stream_b_, &timer_, guid_factory_b);
+  RunLink(&a, &b);
+  a.output().window_size(0);
+  ASSERT_EQ(a.output().window_size(), 1);
+
+  for (int i = 0; i < 3; ++i) { CommitReliablePacket(&a, P2PPriority::kMedium, i); }
+  for (int i = 0; i < 1000; ++i) { a.output().Run(); }
+  while (b.input().Run() > 0) {}
+
+  EXPECT_EQ(ReceivePackets(&b, P2PPriority::kMedium), std::vector<uint8_t>({ 0 }));
+}
+
+TEST_F(P2PPacketStreamTest, PacketsAfterLostReliablePacketAreDeliveredInOrder) {
+  FakeGUIDFactory guid_factory_a(1);
+  FakeGUIDFactory guid_factory_b(7);
+  TestPacketStream a(&byte_stream_a_, &timer_, guid_factory_a);
+  TestPacketStream b(&byte_stream_b_, &timer_, guid_factory_b);
+  RunLink(&a, &b);
+
+  for (int i = 0; i < 3; ++i) { CommitReliablePacket(&a, P2PPriority::kMedium, i); }
+  while (a_to_b_.size() < 3 * (sizeof(P2PHeader) + 1 + sizeof(P2PFooter))) { a.output().Run(); }
+  // Corrupt the content of the first packet.
+  a_to_b_[sizeof(P2PHeader)] ^= 0x01;
+  while (b.input().Run() > 0) {}
+  EXPECT_TRUE(ReceivePackets(&b, P2PPriority::kMedium).empty());
+
+  RunLink(&a, &b);
+  EXPECT_EQ(ReceivePackets(&b, P2PPriority::kMedium), std::vector<uint8_t>({ 0, 1, 2 }));
+  EXPECT_EQ(a.output().NumCommittedPackets(), 0);
+}
+
+TEST_F(P2PPacketStreamTest, UnacknowledgedPacketIsRetransmittedAfterTimeoutWithBackoff) {
+  FakeGUIDFactory guid_factory_a(1);
+  FakeGUIDFactory guid_factory_b(7);
+  TestPacketStream a(&byte_stream_a_, &timer_, guid_factory_a);
+  TestPacketStream b(&byte_stream_b_, &timer_, guid_factory_b);
+  RunLink(&a, &b);
+
+  CommitReliablePacket(&a, P2PPriority::kMedium, 52);
+  const uint64_t timeout_ns = a.output().stats().retransmission_timeout_ns(P2PPriority::kMedium);
+  EXPECT_EQ(timeout_ns, kP2PInitialRetransmissionTimeoutNs);
+  // The packet is lost, and sent only once until the timeout expires.
+  for (int i = 0; i < 1000; ++i) { a.output().Run(); }
+  const size_t packet_length = a_to_b_.size();
+  ASSERT_GT(packet_length, 0);
+  a_to_b_.clear();
+  timer_.ns() += timeout_ns - 1;
+  EXPECT_GT(a.output().Run(), 0);
+  for (int i = 0; i < 1000; ++i) { a.output().Run(); }
+  EXPECT_TRUE(a_to_b_.empty());
+
+  timer_.ns() += 1;
+  for (int i = 0; i < 1000; ++i) { a.output().Run(); }
+  EXPECT_EQ(a_to_b_.size(), packet_length);
+  EXPECT_EQ(a.output().stats().retransmission_timeout_ns(P2PPriority::kMedium), 2 * timeout_ns);
+
+  RunLink(&a, &b);
+  EXPECT_EQ(ReceivePackets(&b, P2PPriority::kMedium), std::vector<uint8_t>({ 52 }));
+  EXPECT_EQ(a.output().NumCommittedPackets(), 0);
+}
+
+TEST_F(P2PPacketStreamTest, LowerPriorityPacketsAreSentWhileWaitingForACK) {
+  FakeGUIDFactory guid_factory_a(1);
+  FakeGUIDFactory guid_factory_b(7);
+  TestPacketStream a(&byte_stream_a_, &timer_, guid_factory_a);
+  TestPacketStream b(&byte_stream_b_, &timer_, guid_factory_b);
+  RunLink(&a, &b);
+  a.output().window_size(1);
+
+  CommitReliablePacket(&a, P2PPriority::kMedium, 1);
+  CommitReliablePacket(&a, P2PPriority::kMedium, 2);
+  StatusOr<P2PMutablePacketView> view = a.output().NewPacket(P2PPriority::kLow);
+  ASSERT_TRUE(view.ok());
+  view->content()[0] = 3;
+  view->length() = 1;
+  ASSERT_TRUE(a.output().Commit(P2PPriority::kLow, /*guarantee_delivery=*/false));
+  for (int i = 0; i < 1000; ++i) { a.output().Run(); }
+  while (b.input().Run() > 0) {}
+
+  EXPECT_EQ(ReceivePackets(&b, P2PPriority::kMedium), std::vector<uint8_t>({ 1 }));
+  EXPECT_EQ(ReceivePackets(&b, P2PPriority::kLow), std::vector<uint8_t>({ 3 }));
+}
+
+TEST_F(P2PPacketStreamTest, RetransmissionTimeoutIsEstimatedFromRoundTripTimes) {
+  FakeGUIDFactory guid_factory_a(1);
+  FakeGUIDFactory guid_factory_b(7);
+  TestPacketStream a(&byte_stream_a_, &timer_, guid_factory_a);
+  TestPacketStream b(&byte_stream_b_, &timer_, guid_factory_b);
+  RunLink(&a, &b);
+  EXPECT_EQ(a.output().stats().smoothed_rtt_ns(P2PPriority::kMedium), -1ULL);
+
+  for (int i = 0; i < 3; ++i) {
+    CommitReliablePacket(&a, P2PPriority::kMedium, i);
+    RunLink(&a, &b);
+  }
+  EXPECT_EQ(ReceivePackets(&b, P2PPriority::kMedium), std::vector<uint8_t>({ 0, 1, 2 }));
+  const P2PPacketOutputStream<4, kLittleEndian>::Stats &stats = a.output().stats();
+  const uint64_t srtt_ns = stats.smoothed_rtt_ns(P2PPriority::kMedium);
+  const uint64_t rttvar_ns = stats.rtt_variance_ns(P2PPriority::kMedium);
+  ASSERT_NE(srtt_ns, -1ULL);
+  ASSERT_NE(rttvar_ns, -1ULL);
+  // b has no data to send, so the round trip is dominated by the ACK holdoff.
+  EXPECT_GE(srtt_ns, kP2PACKHoldoffNs);
+  EXPECT_LT(srtt_ns, kP2PACKHoldoffNs + 1000000);
+  EXPECT_EQ(stats.retransmission_timeout_ns(P2PPriority::kMedium), std::max<uint64_t>(kP2PMinRetransmissionTimeoutNs, srtt_ns + 4 * rttvar_ns));
+  EXPECT_EQ(stats.average_retransmissions_per_reliable_packet(P2PPriority::kMedium), 0);
+}
+
+TEST_F(P2PPacketStreamTest, CorruptedReliablePacketIsRetransmittedAfterNACKWithoutTimeout) {
+  FakeGUIDFactory guid_factory_a(1);
+  FakeGUIDFactory guid_factory_b(7);
+  TestPacketStream a(&byte_stream_a_, &timer_, guid_factory_a);
+  TestPacketStream b(&byte_stream_b_, &timer_, guid_factory_b);
+  RunLink(&a, &b);
+
+  for (int i = 0; i < 3; ++i) { CommitReliablePacket(&a, P2PPriority::kMedium, i); }
+  while (a_to_b_.size() < 3 * (sizeof(P2PHeader) + 1 + sizeof(P2PFooter))) { a.output().Run(); }
+  // Corrupt the footer of the second packet, so that its header is still valid.
+  const size_t packet_length = a_to_b_.size() / 3;
+  a_to_b_[2 * packet_length - 1] ^= 0x01;
+
+  // The time does not advance, so the retransmission timeout never expires.
+  RunLink(&a, &b, /*max_iterations=*/1000, /*time_step_ns=*/0);
+  EXPECT_EQ(ReceivePackets(&b, P2PPriority::kMedium), std::vector<uint8_t>({ 0, 1, 2 }));
+  // The ACK is sent after its holdoff.
+  RunLink(&a, &b);
+  EXPECT_EQ(a.output().NumCommittedPackets(), 0);
+  EXPECT_GT(a.output().stats().average_retransmissions_per_reliable_packet(P2PPriority::kMedium), 0);
+}
+
+TEST_F(P2PPacketStreamTest, NACKReceivedWhilePacketIsBeingSentIsAppliedAfterIt) {
+  for (const bool guarantee_delivery : { false, true }) {
+    SCOPED_TRACE(guarantee_delivery);
+    a_to_b_.clear();
+    b_to_a_.clear();
+    FakeGUIDFactory guid_factory_a(1);
+    FakeGUIDFactory guid_factory_b(7);
+    TestPacketStream a(&byte_stream_a_, &timer_, guid_factory_a);
+    TestPacketStream b(&byte_stream_b_, &timer_, guid_factory_b);
+    RunLink(&a, &b);
+
+    for (int i = 0; i < 2; ++i) { CommitReliablePacket(&a, P2PPriority::kMedium, i); }
+    StatusOr<P2PMutablePacketView> view = a.output().NewPacket(P2PPriority::kMedium);
+    ASSERT_TRUE(view.ok());
+    memset(view->content(), 2, 100);
+    view->length() = 100;
+    ASSERT_TRUE(a.output().Commit(P2PPriority::kMedium, guarantee_delivery));
+    // Send the first two packets and the beginning of the long one.
+    const size_t packet_length = sizeof(P2PHeader) + 1 + sizeof(P2PFooter);
+    while (a_to_b_.size() < 2 * packet_length + sizeof(P2PHeader) + 8) { a.output().Run(); }
+    // Corrupt the footer of the second packet, so that its header is still valid.
+    a_to_b_[2 * packet_length - 1] ^= 0x01;
+
+    // The NACK arrives in the middle of the long packet. The time does not advance, so the
+    // retransmission timeout never expires.
+    while (b.input().Run() > 0) {}
+    for (int i = 0; i < 1000; ++i) { b.output().Run(); }
+    while (a.input().Run() > 0) {}
+    RunLink(&a, &b, /*max_iterations=*/1000, /*time_step_ns=*/0);
+    std::vector<uint8_t> values = ReceivePackets(&b, P2PPriority::kMedium);
+    std::sort(values.begin(), values.end());
+    // A best-effort packet is delivered before the retransmission.
+    EXPECT_EQ(values, std::vector<uint8_t>({ 0, 1, 2 }));
+    RunLink(&a, &b);
+    EXPECT_EQ(a.output().NumCommittedPackets(), 0);
+  }
+}
+
+TEST_F(P2PPacketStreamTest, CorruptedBestEffortPacketIsNotNACKed) {
+  FakeGUIDFactory guid_factory_a(1);
+  FakeGUIDFactory guid_factory_b(7);
+  TestPacketStream a(&byte_stream_a_, &timer_, guid_factory_a);
+  TestPacketStream b(&byte_stream_b_, &timer_, guid_factory_b);
+  RunLink(&a, &b);
+  ASSERT_TRUE(b_to_a_.empty());
+
+  StatusOr<P2PMutablePacketView> view = a.output().NewPacket(P2PPriority::kMedium);
+  ASSERT_TRUE(view.ok());
+  view->content()[0] = 52;
+  view->length() = 1;
+  ASSERT_TRUE(a.output().Commit(P2PPriority::kMedium, /*guarantee_delivery=*/false));
+  while (a.output().NumCommittedPackets() > 0) { a.output().Run(); }
+  a_to_b_.back() ^= 0x01;
+  while (b.input().Run() > 0) {}
+  for (int i = 0; i < 1000; ++i) { b.output().Run(); }
+
+  EXPECT_TRUE(ReceivePackets(&b, P2PPriority::kMedium).empty());
+  EXPECT_TRUE(b_to_a_.empty());
+}
+
+TEST_F(P2PPacketStreamTest, ACKIsPiggybackedOnReverseDataPacket) {
+  FakeGUIDFactory guid_factory_a(1);
+  FakeGUIDFactory guid_factory_b(7);
+  TestPacketStream a(&byte_stream_a_, &timer_, guid_factory_a);
+  TestPacketStream b(&byte_stream_b_, &timer_, guid_factory_b);
+  RunLink(&a, &b);
+
+  CommitReliablePacket(&a, P2PPriority::kMedium, 1);
+  for (int i = 0; i < 1000; ++i) { a.output().Run(); }
+  while (b.input().Run() > 0) {}
+  EXPECT_EQ(ReceivePackets(&b, P2PPriority::kMedium), std::vector<uint8_t>({ 1 }));
+
+  // The time does not advance, so the ACK holdoff never expires: only the data packet carries
+  // the ACK.
+  CommitReliablePacket(&b, P2PPriority::kMedium, 2);
+  for (int i = 0; i < 1000; ++i) { b.output().Run(); }
+  EXPECT_EQ(b.output().NumCommittedPackets(), 1);
+  while (a.input().Run() > 0) {}
+  EXPECT_EQ(a.output().NumCommittedPackets(), 0);
+  StatusOr<const P2PPacketView> packet = a.input().OldestPacket();
+  ASSERT_TRUE(packet.ok());
+  ASSERT_EQ(packet->length(), 1);
+  EXPECT_EQ(packet->content()[0], 2);
+}
+
+TEST_F(P2PPacketStreamTest, ACKIsSentInOwnPacketAfterHoldoff) {
+  FakeGUIDFactory guid_factory_a(1);
+  FakeGUIDFactory guid_factory_b(7);
+  TestPacketStream a(&byte_stream_a_, &timer_, guid_factory_a);
+  TestPacketStream b(&byte_stream_b_, &timer_, guid_factory_b);
+  RunLink(&a, &b);
+
+  CommitReliablePacket(&a, P2PPriority::kMedium, 1);
+  for (int i = 0; i < 1000; ++i) { a.output().Run(); }
+  while (b.input().Run() > 0) {}
+  // The ACK takes no space in the output queue while it waits for a data packet.
+  EXPECT_EQ(b.output().NumCommittedPackets(), 0);
+  EXPECT_EQ(b.output().Run(), kP2PACKHoldoffNs);
+  EXPECT_TRUE(b_to_a_.empty());
+
+  timer_.ns() += kP2PACKHoldoffNs;
+  for (int i = 0; i < 1000; ++i) { b.output().Run(); }
+  EXPECT_EQ(b_to_a_.size(), sizeof(P2PHeader) + sizeof(P2PFooter));
+  while (a.input().Run() > 0) {}
+  EXPECT_EQ(a.output().NumCommittedPackets(), 0);
+}
+
+// Sends `num_packets` reliable packets from `a` to `b` with the burst pacing of a slow
+// receiver, and returns the time it takes until `b` receives them all.
+uint64_t SendPacedReliablePackets(TestPacketStream *a, TestPacketStream *b, FakeTimer *timer, int num_packets) {
+  const uint64_t start_ns = timer->ns();
+  int num_sent_packets = 0;
+  int num_received_packets = 0;
+  while (num_received_packets < num_packets) {
+    if (num_sent_packets < num_packets && a->output().NumAvailableSlots(P2PPriority::kMedium) > 0) {
+      StatusOr<P2PMutablePacketView> view = a->output().NewPacket(P2PPriority::kMedium);
+      memset(view->content(), num_sent_packets, 32);
+      view->length() = 32;
+      a->output().Commit(P2PPriority::kMedium, /*guarantee_delivery=*/true);
+      ++num_sent_packets;
+    }
+    a->output().Run();
+    b->output().Run();
+    a->input().Run();
+    b->input().Run();
+    while (b->input().NumAvailablePackets(P2PPriority::kMedium) > 0) {
+      b->input().Consume(P2PPriority::kMedium);
+      ++num_received_packets;
+    }
+    timer->ns() += 10000;
+  }
+  return timer->ns() - start_ns;
+}
+
+TEST_F(P2PPacketStreamTest, CreditAdvertisedWithACKsLiftsBurstPacing) {
+  // The sender assumes that the receiver ingests 8-byte bursts at 100 us per byte.
+  byte_stream_a_.burst_max_length(8);
+  byte_stream_a_.burst_ingestion_ns_per_byte(100000);
+  FakeGUIDFactory guid_factory_a(1);
+  FakeGUIDFactory guid_factory_b(7);
+  TestPacketStream a(&byte_stream_a_, &timer_, guid_factory_a);
+  TestPacketStream b(&byte_stream_b_, &timer_, guid_factory_b);
+  RunLink(&a, &b);
+  const uint64_t paced_ns = SendPacedReliablePackets(&a, &b, &timer_, 20);
+  EXPECT_EQ(a.output().credit_bytes(), 0);
+
+  // The receiver advertises its receive buffer, so the sender only waits for ACKs.
+  byte_stream_b_.receive_buffer_length(256);
+  const uint64_t credited_ns = SendPacedReliablePackets(&a, &b, &timer_, 20);
+  EXPECT_LT(credited_ns, paced_ns / 4);
+  EXPECT_TRUE(a_to_b_.empty());
+}
+
+TEST_F(P2PPacketStreamTest, SenderDoesNotExceedAdvertisedCredit) {
+  byte_stream_a_.burst_max_length(8);
+  byte_stream_a_.burst_ingestion_ns_per_byte(100000);
+  byte_stream_b_.receive_buffer_length(64);
+  FakeGUIDFactory guid_factory_a(1);
+  FakeGUIDFactory guid_factory_b(7);
+  TestPacketStream a(&byte_stream_a_, &timer_, guid_factory_a);
+  TestPacketStream b(&byte_stream_b_, &timer_, guid_factory_b);
+  RunLink(&a, &b);
+  SendPacedReliablePackets(&a, &b, &timer_, 5);
+  RunLink(&a, &b, 100);
+  ASSERT_EQ(a.output().NumCommittedPackets(), 0);
+  ASSERT_GT(a.output().credit_bytes(), 0);
+
+  // The receiver stops reading: the sender fills the advertised buffer, and then falls back to
+  // the ingestion pacing, which lets one more burst through.
+  for (int i = 0; i < 3; ++i) {
+    StatusOr<P2PMutablePacketView> view = a.output().NewPacket(P2PPriority::kMedium);
+    ASSERT_TRUE(view.ok());
+    memset(view->content(), i, 32);
+    view->length() = 32;
+    ASSERT_TRUE(a.output().Commit(P2PPriority::kMedium, /*guarantee_delivery=*/true));
+  }
+  for (int i = 0; i < 100; ++i) { a.output().Run(); }
+  EXPECT_LE(a_to_b_.size(), 64 + byte_stream_a_.GetBurstMaxLength());
+  EXPECT_EQ(a.output().credit_bytes(), 0);
+}
+
+TEST_F(P2PPacketStreamTest, FullDuplexStreamAppliesReceivedACKsInOutputRun) {
+  FakeGUIDFactory guid_factory_a(1);
+  FakeGUIDFactory guid_factory_b(7);
+  TestPacketStream a(&byte_stream_a_, &timer_, guid_factory_a, /*is_full_duplex=*/true);
+  TestPacketStream b(&byte_stream_b_, &timer_, guid_factory_b, /*is_full_duplex=*/true);
+  RunLink(&a, &b);
+
+  CommitReliablePacket(&a, P2PPriority::kMedium, 1);
+  for (int i = 0; i < 1000; ++i) { a.output().Run(); }
+  while (b.input().Run() > 0) {}
+  // The ACK to send waits in the mailbox until the output half runs.
+  EXPECT_TRUE(b.has_pending_control_events());
+  b.output().Run();
+  EXPECT_FALSE(b.has_pending_control_events());
+  timer_.ns() += kP2PACKHoldoffNs;
+  for (int i = 0; i < 1000; ++i) { b.output().Run(); }
+
+  while (a.input().Run() > 0) {}
+  EXPECT_EQ(a.output().NumCommittedPackets(), 1);
+  a.output().Run();
+  EXPECT_EQ(a.output().NumCommittedPackets(), 0);
+  EXPECT_EQ(ReceivePackets(&b, P2PPriority::kMedium), std::vector<uint8_t>({1}));
+}
+
+TEST_F(P2PPacketStreamTest, FullDuplexStreamCallsOtherEndStartedCallbackWhenNotified) {
+  FakeGUIDFactory guid_factory_a(1);
+  FakeGUIDFactory guid_factory_b(7);
+  TestPacketStream a(&byte_stream_a_, &timer_, guid_factory_a, /*is_full_duplex=*/true);
+  TestPacketStream b(&byte_stream_b_, &timer_, guid_factory_b, /*is_full_duplex=*/true);
+  int num_other_end_starts = 0;
+  b.other_end_started_callback(P2POtherEndStartedCallback([](void *count) { ++*static_cast<int *>(count); }, &num_other_end_starts));
+
+  // The input half only takes note of the handshake request.
+  RunLink(&a, &b);
+  EXPECT_EQ(b.num_handshake_resets(), 1);
+  EXPECT_EQ(num_other_end_starts, 0);
+  b.NotifyOtherEndStarted();
+  EXPECT_EQ(num_other_end_starts, 1);
+  b.NotifyOtherEndStarted();
+  EXPECT_EQ(num_other_end_starts, 1);
+
+  // The other end restarts.
+  FakeGUIDFactory guid_factory_restarted_a(3);
+  TestPacketStream restarted_a(&byte_stream_a_, &timer_, guid_factory_restarted_a, /*is_full_duplex=*/true);
+  RunLink(&restarted_a, &b);
+  EXPECT_EQ(b.num_handshake_resets(), 2);
+  EXPECT_EQ(num_other_end_starts, 1);
+  b.NotifyOtherEndStarted();
+  EXPECT_EQ(num_other_end_starts, 2);
+}
+
+TEST(P2PFullDuplexPacketStreamTest, HalvesRunInSeparateThreads) {
+  const int kNumPackets = 500;
+  std::deque<uint8_t> a_to_b;
+  std::deque<uint8_t> b_to_a;
+  std::mutex link_mutex;
+  LockedMemoryByteStream byte_stream_a(&b_to_a, &a_to_b, &link_mutex);
+  LockedMemoryByteStream byte_stream_b(&a_to_b, &b_to_a, &link_mutex);
+  byte_stream_a.receive_buffer_length(256);
+  byte_stream_b.receive_buffer_length(256);
+  SteadyTimer timer;
+  FakeGUIDFactory guid_factory_a(1);
+  FakeGUIDFactory guid_factory_b(7);
+  TestPacketStream a(&byte_stream_a, &timer, guid_factory_a, /*is_full_duplex=*/true);
+  TestPacketStream b(&byte_stream_b, &timer, guid_factory_b, /*is_full_duplex=*/true);
+
+  // Both ends send reliable packets numbered from 0 to the other end, which checks that they
+  // arrive in order.
+  std::atomic<bool> failed(false);
+  std::atomic<int> num_done_halves(0);
+  const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(20);
+  auto run_input = [&](TestPacketStream *stream) {
+    int num_received_packets = 0;
+    while (num_done_halves < 4 && std::chrono::steady_clock::now() < deadline) {
+      stream->input().Run();
+      while (stream->input().NumAvailablePackets(P2PPriority::kMedium) > 0) {
+        StatusOr<const P2PPacketView> packet = stream->input().OldestPacket();
+        uint16_t value;
+        memcpy(&value, packet->content(), sizeof(value));
+        failed = failed || value != num_received_packets;
+        stream->input().Consume(P2PPriority::kMedium);
+        if (++num_received_packets == kNumPackets) { ++num_done_halves; }
+      }
+      std::this_thread::yield();
+    }
+  };
+  auto run_output = [&](TestPacketStream *stream) {
+    int num_sent_packets = 0;
+    while (num_done_halves < 4 && std::chrono::steady_clock::now() < deadline) {
+      if (num_sent_packets < kNumPackets && stream->output().NumAvailableSlots(P2PPriority::kMedium) > 0) {
+        StatusOr<P2PMutablePacketView> view = stream->output().NewPacket(P2PPriority::kMedium);
+        const uint16_t value = num_sent_packets;
+        memcpy(view->content(), &value, sizeof(value));
+        view->length() = 32;
+        stream->output().Commit(P2PPriority::kMedium, /*guarantee_delivery=*/true);
+        if (++num_sent_packets == kNumPackets) { ++num_done_halves; }
+      }
+      stream->output().Run();
+      std::this_thread::yield();
+    }
+  };
+  std::thread threads[] = {
+    std::thread(run_input, &a), std::thread(run_output, &a),
+    std::thread(run_input, &b), std::thread(run_output, &b)
+  };
+  for (std::thread &thread : threads) { thread.join(); }
+
+  EXPECT_FALSE(failed);
+  EXPECT_EQ(num_done_halves, 4);
+}
+
+}  // namespace
@@ -0,0 +1,241 @@
+#include <gtest/gtest.h>
+#include <utility>
+#include <vector>
+#include "p2p_packet_stream.h"
+#include "priority_slab.h"
+
+// A value whose storage length is the number of bytes of the header plus its length.
+class Value {
+public:
+  Value() : length_(0) {}
+  int &length() { return length_; }
+  uint8_t *content() { return content_; }
+  int StorageLength() const { return static_cast<int>(sizeof(length_)) + length_; }
+
+private:
+  int length_;
+  uint8_t content_[60];
+};
+
+class Priority {
+public:
+  enum Level { kHigh = 0, kLow, kNumLevels };
+  Priority(int level) : level_(level) {}
+  operator int() const { return level_; }
+
+private:
+  int level_;
+};
+
+TEST(PrioritySlabTest, CommittedValueIsReadBack) {
+  PrioritySlab<Value, /*kCapacity=*/4, /*kNumBytes=*/256, Priority> slab;
+  Value &value = slab.NewValue(Priority::kLow);
+  value.length() = 3;
+  memcpy(value.content(), "abc", 3);
+  slab.Commit(Priority::kLow);
+
+  ASSERT_EQ(slab.Size(Priority::kLow), 1);
+  EXPECT_EQ(slab.OldestValue(), slab.OldestValue(Priority::kLow));
+  EXPECT_EQ(slab.OldestValue(Priority::kLow)->length(), 3);
+  EXPECT_EQ(memcmp(slab.OldestValue(Priority::kLow)->content(), "abc", 3), 0);
+}
+
+TEST(PrioritySlabTest, OldestValueReturnsHighestPriorityFirst) {
+  PrioritySlab<Value, /*kCapacity=*/4, /*kNumBytes=*/256, Priority> slab;
+  slab.NewValue(Priority::kLow).length() = 1;
+  slab.Commit(Priority::kLow);
+  slab.NewValue(Priority::kHigh).length() = 2;
+  slab.Commit(Priority::kHigh);
+
+  EXPECT_EQ(slab.OldestValue()->length(), 2);
+  slab.Consume(Priority::kHigh);
+  EXPECT_EQ(slab.OldestValue()->length(), 1);
+}
+
+TEST(PrioritySlabTest, ShortValuesOnlyTakeTheirStorageLength) {
+  // The arena fits one full-size value plus a few bytes.
+  PrioritySlab<Value, /*kCapacity=*/16, /*kNumBytes=*/sizeof(Value) + 32, Priority> slab;
+  for (int i = 0; i < 8; ++i) {
+    ASSERT_FALSE(slab.IsFull(Priority::kHigh));
+    slab.NewValue(Priority::kHigh).length() = 0;
+    slab.Commit(Priority::kHigh);
+  }
+  EXPECT_EQ(slab.Size(Priority::kHigh), 8);
+  EXPECT_EQ(slab.NumUsedBytes(), 8 * static_cast<int>(sizeof(int)));
+}
+
+TEST(PrioritySlabTest, ValueThatDoesNotFitInTheArenaIsKeptInItsBlock) {
+  PrioritySlab<Value, /*kCapacity=*/16, /*kNumBytes=*/sizeof(Value) + 8, Priority> slab;
+  slab.NewValue(Priority::kHigh).length() = 4;
+  slab.Commit(Priority::kHigh);
+  slab.NewValue(Priority::kHigh).length() = 4;
+  slab.Commit(Priority::kHigh);
+  slab.NewValue(Priority::kHigh).length() = sizeof(Value) - sizeof(int);
+  slab.Commit(Priority::kHigh);
+
+  // Only the priority whose block holds the value is full.
+  ASSERT_EQ(slab.Size(Priority::kHigh), 3);
+  EXPECT_EQ(slab.OldestValue(Priority::kHigh, 2)->length(), static_cast<int>(sizeof(Value) - sizeof(int)));
+  EXPECT_TRUE(slab.IsFull(Priority::kHigh));
+  EXPECT_EQ(slab.NumAvailableSlots(Priority::kHigh), 0);
+  EXPECT_FALSE(slab.IsFull(Priority::kLow));
+
+  slab.Consume(Priority::kHigh, 1);
+  EXPECT_TRUE(slab.IsFull(Priority::kHigh));
+  slab.Consume(Priority::kHigh, 1);
+  EXPECT_FALSE(slab.IsFull(Priority::kHigh));
+}
+
+TEST(PrioritySlabTest, InterleavedShortAndLongPacketsDoNotFragmentTheArena) {
+  // The output queue of a full-duplex Linux stream, which is not shared.
+  PrioritySlab<P2PPacket, /*kCapacity=*/16, /*kNumBytes=*/kP2PPacketQueueLength(16), P2PPriority> slab;
+  slab.reservation(P2PPriority::kReserved, kP2PPacketQueueReservationLength);
+  // Long packets are consumed, and the short packets between them wait.
+  for (int i = 0; i < 2 * 15; ++i) {
+    ASSERT_FALSE(slab.IsFull(P2PPriority::kHigh)) << i;
+    slab.NewValue(P2PPriority::kHigh).length() = 150;
+    slab.Commit(P2PPriority::kHigh);
+    const P2PPriority priority = i % 2 == 0 ? P2PPriority::kMedium : P2PPriority::kLow;
+    ASSERT_FALSE(slab.IsFull(priority)) << i;
+    slab.NewValue(priority).length() = 4;
+    slab.Commit(priority);
+    slab.Consume(P2PPriority::kHigh);
+  }
+
+  EXPECT_FALSE(slab.IsFull(P2PPriority::kReserved));
+  EXPECT_FALSE(slab.IsFull(P2PPriority::kHigh));
+  for (int i = 0; i < 4; ++i) {
+    slab.NewValue(P2PPriority::kHigh).length() = kP2PMaxContentLength;
+    slab.Commit(P2PPriority::kHigh);
+  }
+  // The queued packets only take their bytes: the long packets are in the arena too.
+  EXPECT_EQ(slab.Size(P2PPriority::kHigh), 4);
+  EXPECT_FALSE(slab.IsFull(P2PPriority::kHigh));
+}
+
+TEST(PrioritySlabTest, IsFullWhenAllSlotsAreTaken) {
+  PrioritySlab<Value, /*kCapacity=*/3, /*kNumBytes=*/1024, Priority> slab;
+  slab.NewValue(Priority::kHigh);
+  slab.Commit(Priority::kHigh);
+  slab.NewValue(Priority::kHigh);
+  slab.Commit(Priority::kHigh);
+
+  EXPECT_TRUE(slab.IsFull(Priority::kHigh));
+  EXPECT_FALSE(slab.IsFull(Priority::kLow));
+}
+
+TEST(PrioritySlabTest, ConsumingValueInTheMiddleKeepsOthersInPlace) {
+  PrioritySlab<Value, /*kCapacity=*/4, /*kNumBytes=*/256, Priority> slab;
+  for (int i = 1; i <= 3; ++i) {
+    slab.NewValue(Priority::kLow).length() = i;
+    slab.Commit(Priority::kLow);
+  }
+  Value *last = slab.OldestValue(Priority::kLow, 2);
+
+  ASSERT_TRUE(slab.Consume(Priority::kLow, 1));
+  ASSERT_EQ(slab.Size(Priority::kLow), 2);
+  EXPECT_EQ(slab.OldestValue(Priority::kLow, 0)->length(), 1);
+  EXPECT_EQ(slab.OldestValue(Priority::kLow, 1), last);
+}
+
+TEST(PrioritySlabTest, NewValueIsKeptUntilCommit) {
+  PrioritySlab<Value, /*kCapacity=*/4, /*kNumBytes=*/256, Priority> slab;
+  Value &value = slab.NewValue(Priority::kHigh);
+  value.length() = 5;
+
+  EXPECT_EQ(&slab.NewValue(Priority::kHigh), &value);
+  EXPECT_EQ(slab.NewValue(Priority::kHigh).length(), 5);
+  EXPECT_EQ(slab.Size(Priority::kHigh), 0);
+}
+
+TEST(PrioritySlabTest, SharingSlabsAllocateInEachOthersArena) {
+  PrioritySlab<Value, /*kCapacity=*/8, /*kNumBytes=*/sizeof(Value), Priority> a;
+  PrioritySlab<Value, /*kCapacity=*/8, /*kNumBytes=*/sizeof(Value), Priority> b;
+  a.Share(&b);
+  // The first value fills the arena of `a`, and the second one that of `b`.
+  for (int i = 0; i < 2; ++i) {
+    a.NewValue(Priority::kHigh).length() = sizeof(Value) - sizeof(int);
+    a.Commit(Priority::kHigh);
+    ASSERT_FALSE(a.IsFull(Priority::kHigh));
+  }
+  a.NewValue(Priority::kHigh).length() = sizeof(Value) - sizeof(int);
+  a.Commit(Priority::kHigh);
+  EXPECT_EQ(a.Size(Priority::kHigh), 3);
+  EXPECT_TRUE(a.IsFull(Priority::kHigh));
+
+  // A value of `b` takes the bytes that `a` releases.
+  a.Consume(Priority::kHigh);
+  b.NewValue(Priority::kLow).length() = sizeof(Value) - sizeof(int);
+  b.Commit(Priority::kLow);
+  EXPECT_FALSE(b.IsFull(Priority::kLow));
+  EXPECT_TRUE(a.IsFull(Priority::kHigh));
+}
+
+TEST(PrioritySlabTest, QuotaLimitsBytesOfPriority) {
+  PrioritySlab<Value, /*kCapacity=*/8, /*kNumBytes=*/1024, Priority> slab;
+  slab.quota(Priority::kLow, sizeof(Value) + 8);
+  slab.NewValue(Priority::kLow).length() = 4;
+  slab.Commit(Priority::kLow);
+
+  EXPECT_FALSE(slab.IsFull(Priority::kLow));
+  slab.NewValue(Priority::kLow).length() = 4;
+  slab.Commit(Priority::kLow);
+  EXPECT_TRUE(slab.IsFull(Priority::kLow));
+  EXPECT_FALSE(slab.IsFull(Priority::kHigh));
+}
+
+TEST(PrioritySlabTest, ReservationKeepsRoomForPriority) {
+  PrioritySlab<Value, /*kCapacity=*/8, /*kNumBytes=*/sizeof(Value) + 8, Priority> a;
+  PrioritySlab<Value, /*kCapacity=*/8, /*kNumBytes=*/sizeof(Value), Priority> b;
+  a.Share(&b);
+  b.reservation(Priority::kHigh, sizeof(Value) + 8);
+  a.NewValue(Priority::kLow).length() = 4;
+  a.Commit(Priority::kLow);
+
+  // Both arenas have room for another full-size value, but only one is left unreserved.
+  a.NewValue(Priority::kLow).length() = sizeof(Value) - sizeof(int);
+  a.Commit(Priority::kLow);
+  EXPECT_TRUE(a.IsFull(Priority::kLow));
+  b.NewValue(Priority::kHigh).length() = sizeof(Value) - sizeof(int);
+  b.Commit(Priority::kHigh);
+  EXPECT_FALSE(b.IsFull(Priority::kHigh));
+}
+
+TEST(PrioritySlabTest, OldestValueSkipsEmptiedPriorities) {
+  PrioritySlab<Value, /*kCapacity=*/4, /*kNumBytes=*/256, Priority> slab;
+  slab.NewValue(Priority::kHigh).length() = 1;
+  slab.Commit(Priority::kHigh);
+  slab.NewValue(Priority::kLow).length() = 2;
+  slab.Commit(Priority::kLow);
+  EXPECT_EQ(slab.occupancy().levels(), 3U);
+
+  slab.Consume(Priority::kHigh);
+  EXPECT_EQ(slab.occupancy().HighestLevel(), Priority::kLow);
+  ASSERT_NE(slab.OldestValue(), nullptr);
+  EXPECT_EQ(slab.OldestValue()->length(), 2);
+  slab.Clear();
+  EXPECT_EQ(slab.OldestValue(), nullptr);
+}
+
+TEST(PrioritySlabTest, WatermarksHaveHysteresis) {
+  PrioritySlab<Value, /*kCapacity=*/8, /*kNumBytes=*/1024, Priority> slab;
+  std::vector<std::pair<int, bool>> transitions;
+  slab.occupancy().watermarks(Priority::kLow, /*low=*/1, /*high=*/3);
+  slab.occupancy().watermark_callback([](int priority, bool is_congested, void *arg) {
+    static_cast<std::vector<std::pair<int, bool>> *>(arg)->emplace_back(priority, is_congested);
+  }, &transitions);
+  for (int i = 0; i < 3; ++i) {
+    slab.NewValue(Priority::kLow).length() = 1;
+    slab.Commit(Priority::kLow);
+  }
+  EXPECT_TRUE(slab.occupancy().is_congested(Priority::kLow));
+  EXPECT_FALSE(slab.occupancy().is_congested(Priority::kHigh));
+
+  // Still congested until the size falls back to the low watermark.
+  slab.Consume(Priority::kLow);
+  EXPECT_TRUE(slab.occupancy().is_congested(Priority::kLow));
+  slab.Consume(Priority::kLow);
+  EXPECT_FALSE(slab.occupancy().is_congested(Priority::kLow));
+  const std::vector<std::pair<int, bool>> expected = { { Priority::kLow, true }, { Priority::kLow, false } };
+  EXPECT_EQ(transitions, expected);
+}
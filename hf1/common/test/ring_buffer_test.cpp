@@ -229,3 +229,68 @@ TEST(RingBuffer, IsFullReturnsTrueAfterRollover) {
 
   EXPECT_TRUE(buffer.IsFull());
 }
+
+TEST(RingBuffer, ConsumeWithIndexKeepsOrderAcrossWrapAroundWithoutPowerOfTwoCapacity) {
+  RingBuffer<int, /*kCapacity=*/5> buffer;
+  for (int i = 0; i < 7; ++i) { buffer.Write(50 + i); }
+  ASSERT_EQ(buffer.Size(), 4);
+  buffer.Consume(2);
+  buffer.Write(57);
+  ASSERT_EQ(buffer.Size(), 4);
+
+  EXPECT_EQ(*buffer.OldestValue(0), 53);
+  EXPECT_EQ(*buffer.OldestValue(1), 54);
+  EXPECT_EQ(*buffer.OldestValue(2), 56);
+  EXPECT_EQ(*buffer.OldestValue(3), 57);
+}
+
+TEST(FIFORingBufferTest, ConsumeReturnsFalseIfEmpty) {
+  FIFORingBuffer<int, /*kCapacity=*/4> buffer;
+
+  EXPECT_EQ(buffer.OldestValue(), nullptr);
+  EXPECT_FALSE(buffer.Consume());
+}
+
+TEST(FIFORingBufferTest, ReadOnEmptyBufferDies) {
+  FIFORingBuffer<int, /*kCapacity=*/4> buffer;
+
+  EXPECT_DEATH(buffer.Read(), "");
+}
+
+TEST(FIFORingBufferTest, ValuesAreReadInWriteOrder) {
+  FIFORingBuffer<int, /*kCapacity=*/4> buffer;
+  buffer.Write(52);
+  buffer.Write(53);
+  ASSERT_EQ(buffer.Size(), 2);
+  ASSERT_NE(buffer.OldestValue(1), nullptr);
+  EXPECT_EQ(*buffer.OldestValue(1), 53);
+
+  EXPECT_EQ(buffer.Read(), 52);
+  EXPECT_EQ(buffer.Read(), 53);
+  EXPECT_EQ(buffer.Size(), 0);
+}
+
+TEST(FIFORingBufferTest, WriteOverwritesOldestValueWhenFull) {
+  FIFORingBuffer<int, /*kCapacity=*/3> buffer;
+  buffer.Write(52);
+  buffer.Write(53);
+  ASSERT_TRUE(buffer.IsFull());
+  buffer.Write(54);
+
+  EXPECT_EQ(buffer.Size(), 2);
+  EXPECT_EQ(buffer.Read(), 53);
+  EXPECT_EQ(buffer.Read(), 54);
+}
+
+TEST(FIFORingBufferTest, KeepsOrderAcrossWrapAround) {
+  FIFORingBuffer<int, /*kCapacity=*/5> buffer;
+  int next_value = 0;
+  for (int i = 0; i < 23; ++i) {
+    buffer.Write(i);
+    if (buffer.IsFull()) { ASSERT_EQ(buffer.Read(), next_value++); }
+  }
+  ASSERT_EQ(buffer.Size(), 3);
+  while (next_value < 23) {
+    EXPECT_EQ(buffer.Read(), next_value++);
+  }
+}
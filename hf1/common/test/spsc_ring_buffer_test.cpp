@@ -0,0 +1,154 @@
+#include <gtest/gtest.h>
+#include <thread>
+#include "spsc_ring_buffer.h"
+
+TEST(SPSCRingBufferTest, OldestValueReturnsNullIfEmpty) {
+  SPSCRingBuffer<int, /*kCapacity=*/4> buffer;
+
+  EXPECT_TRUE(buffer.IsEmpty());
+  EXPECT_EQ(buffer.OldestValue(), nullptr);
+  EXPECT_FALSE(buffer.Consume());
+}
+
+TEST(SPSCRingBufferTest, ValueIsNotVisibleUntilCommitted) {
+  SPSCRingBuffer<int, /*kCapacity=*/4> buffer;
+  int *value = buffer.NewValue();
+  ASSERT_NE(value, nullptr);
+  *value = 7;
+  EXPECT_EQ(buffer.OldestValue(), nullptr);
+
+  buffer.Commit();
+  EXPECT_EQ(buffer.Size(), 1);
+  ASSERT_NE(buffer.OldestValue(), nullptr);
+  EXPECT_EQ(*buffer.OldestValue(), 7);
+}
+
+TEST(SPSCRingBufferTest, StoresCapacityValuesAndRejectsMore) {
+  SPSCRingBuffer<int, /*kCapacity=*/4> buffer;
+  for (int i = 0; i < 4; ++i) {
+    int *value = buffer.NewValue();
+    ASSERT_NE(value, nullptr);
+    *value = i;
+    buffer.Commit();
+  }
+  EXPECT_EQ(buffer.NumAvailableSlots(), 0);
+  EXPECT_EQ(buffer.NewValue(), nullptr);
+
+  // Wrap around.
+  buffer.Consume();
+  int *value = buffer.NewValue();
+  ASSERT_NE(value, nullptr);
+  *value = 4;
+  buffer.Commit();
+  for (int i = 1; i <= 4; ++i) {
+    ASSERT_NE(buffer.OldestValue(), nullptr);
+    EXPECT_EQ(*buffer.OldestValue(), i);
+    buffer.Consume();
+  }
+  EXPECT_TRUE(buffer.IsEmpty());
+}
+
+TEST(SPSCRingBufferTest, ValuesOfProducerThreadAreAllReceivedInOrder) {
+  const int kNumValues = 100000;
+  SPSCRingBuffer<int, /*kCapacity=*/16> buffer;
+  std::thread producer([&buffer]() {
+    for (int i = 0; i < kNumValues; ++i) {
+      int *value;
+      while ((value = buffer.NewValue()) == nullptr) { std::this_thread::yield(); }
+      *value = i;
+      buffer.Commit();
+    }
+  });
+
+  for (int i = 0; i < kNumValues; ++i) {
+    const int *value;
+    while ((value = buffer.OldestValue()) == nullptr) { std::this_thread::yield(); }
+    ASSERT_EQ(*value, i);
+    buffer.Consume();
+  }
+  producer.join();
+  EXPECT_TRUE(buffer.IsEmpty());
+}
+
+TEST(SPSCRingBufferTest, WriteNAndReadNWrapAround) {
+  SPSCRingBuffer<int, /*kCapacity=*/8> buffer;
+  const int values[] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9 };
+  ASSERT_EQ(buffer.WriteN(values, 6), 6);
+  int read_values[10];
+  ASSERT_EQ(buffer.ReadN(read_values, 5), 5);
+
+  // Only 7 slots are free: the last value does not fit.
+  EXPECT_EQ(buffer.WriteN(&values[2], 8), 7);
+  EXPECT_EQ(buffer.Size(), 8);
+  EXPECT_EQ(buffer.ReadN(read_values, 10), 8);
+  EXPECT_EQ(read_values[0], 5);
+  for (int i = 1; i < 8; ++i) {
+    EXPECT_EQ(read_values[i], i + 1);
+  }
+  EXPECT_TRUE(buffer.IsEmpty());
+  EXPECT_EQ(buffer.ReadN(read_values, 10), 0);
+}
+
+TEST(SPSCRingBufferTest, SpansStopAtTheEndOfTheArray) {
+  SPSCRingBuffer<int, /*kCapacity=*/4> buffer;
+  SPSCRingBuffer<int, /*kCapacity=*/4>::Span span = buffer.NewValues();
+  ASSERT_EQ(span.length, 4);
+  span.values[0] = 52;
+  span.values[1] = 53;
+  span.values[2] = 54;
+  EXPECT_TRUE(buffer.IsEmpty());
+  buffer.Commit(3);
+
+  span = buffer.OldestValues();
+  ASSERT_EQ(span.length, 3);
+  EXPECT_EQ(span.values[0], 52);
+  EXPECT_EQ(span.values[2], 54);
+  buffer.Consume(2);
+
+  // The free slots wrap around: the span only covers the last one.
+  span = buffer.NewValues();
+  ASSERT_EQ(span.length, 1);
+  span.values[0] = 55;
+  buffer.Commit(1);
+  EXPECT_EQ(buffer.NewValues().length, 2);
+
+  span = buffer.OldestValues();
+  ASSERT_EQ(span.length, 2);
+  EXPECT_EQ(span.values[0], 54);
+  EXPECT_EQ(span.values[1], 55);
+}
+
+TEST(SPSCRingBufferTest, BulkValuesOfProducerThreadAreAllReceivedInOrder) {
+  const int kNumValues = 100000;
+  SPSCRingBuffer<int, /*kCapacity=*/16> buffer;
+  std::thread producer([&buffer]() {
+    int values[5];
+    for (int i = 0; i < kNumValues;) {
+      const int length = std::min(5, kNumValues - i);
+      for (int k = 0; k < length; ++k) { values[k] = i + k; }
+      int num_written_values = 0;
+      while ((num_written_values += buffer.WriteN(&values[num_written_values], length - num_written_values)) < length) {
+        std::this_thread::yield();
+      }
+      i += length;
+    }
+  });
+
+  int next_value = 0;
+  while (next_value < kNumValues) {
+    // Alternate spans and copies.
+    if (next_value % 2 == 0) {
+      const SPSCRingBuffer<int, /*kCapacity=*/16>::Span span = buffer.OldestValues();
+      for (int i = 0; i < span.length; ++i) { ASSERT_EQ(span.values[i], next_value++); }
+      buffer.Consume(span.length);
+      if (span.length == 0) { std::this_thread::yield(); }
+    } else {
+      int values[7];
+      const int length = buffer.ReadN(values, 7);
+      for (int i = 0; i < length; ++i) { ASSERT_EQ(values[i], next_value++); }
+      if (length == 0) { std::this_thread::yield(); }
+    }
+  }
+  producer.join();
+  EXPECT_TRUE(buffer.IsEmpty());
+}
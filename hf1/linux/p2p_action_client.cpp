@@ -6,52 +6,102 @@
 #include <iostream>
 
 Status P2PActionClientHandlerBase::Request(int payload_length, const void *payload, std::optional<P2PPriority> priority, std::optional<bool> guarantee_delivery) {
-  // Protect with a mutex as this will be called from a different thread than Run().
-  std::lock_guard<std::mutex> guard(p2p_mutex_);
+  ASSERT(client_ != nullptr);
+  if (!allows_concurrent_requests_) {
+    // Claim the action atomically, as other threads may request it at the same time.
+    State expected_state = kIdle;
+    if (!state_.compare_exchange_strong(expected_state, kWaitingForResponse)) {
+      return Status::kExistsError;
+    }
+  }
 
-  if (!allows_concurrent_requests_ && state_ != kIdle) {
-    return Status::kExistsError;
+  const P2PPriority request_priority = priority.has_value() ? *priority : priority_;
+  if (sizeof(P2PApplicationPacketHeader) + payload_length > kP2PMaxContentLength) {
+    // Protect with a mutex as this will be called from a different thread than Run().
+    std::lock_guard<std::mutex> guard(p2p_mutex_);
+    if (fragmenter_->in_progress()) {
+      if (!allows_concurrent_requests_) { state_ = kIdle; }
+      return Status::kUnavailableError;
+    }
+    const uint8_t *payload_bytes = reinterpret_cast<const uint8_t *>(payload);
+    fragmented_payload_.assign(payload_bytes, payload_bytes + payload_length);
+    P2PApplicationPacketHeader header;
+    header.action = action_;
+    header.stage = P2PActionStage::kRequest;
+    header.request_id = ++current_request_id_;
+    fragmenter_->Send(request_priority, header, fragmented_payload_.size(), fragmented_payload_.data());
+    return Status::kSuccess;
   }
 
-  auto maybe_new_packet = p2p_stream_.output().NewPacket(priority.has_value() ? *priority : priority_);
-  if (!maybe_new_packet.ok()) {
+  P2PActionSubmission *submission = client_->submissions_[request_priority].NewValue();
+  if (submission == nullptr) {
+    if (!allows_concurrent_requests_) { state_ = kIdle; }
     return Status::kUnavailableError;
   }
-  maybe_new_packet->length() = sizeof(P2PApplicationPacketHeader) + payload_length;
-  P2PApplicationPacketHeader *header = reinterpret_cast<P2PApplicationPacketHeader *>(maybe_new_packet->content());
-  header->action = action_;
-  header->stage = P2PActionStage::kRequest;
-  header->request_id = ++current_request_id_;
-  memcpy(maybe_new_packet->content() + sizeof(P2PApplicationPacketHeader), payload, payload_length);
-  p2p_stream_.output().Commit(maybe_new_packet->priority(), guarantee_delivery.has_value() ? *guarantee_delivery : guarantee_delivery_);
-
-  state_ = allows_concurrent_requests_ ? kIdle : kWaitingForResponse;
+  submission->stage = P2PActionStage::kRequest;
+  submission->request_id = ++current_request_id_;
+  submission->guarantee_delivery = guarantee_delivery.has_value() ? *guarantee_delivery : guarantee_delivery_;
+  submission->payload_length = payload_length;
+  memcpy(submission->payload, payload, payload_length);
+  CommitSubmission(request_priority, submission);
   return Status::kSuccess;
 }
 
 Status P2PActionClientHandlerBase::Cancel(std::optional<P2PPriority> priority, std::optional<bool> guarantee_delivery) {
-  // Protect with a mutex as this will be called from a different thread than Run().
-  std::lock_guard<std::mutex> guard(p2p_mutex_);
-
+  ASSERT(client_ != nullptr);
   if (!allows_concurrent_requests_ && state_ != kWaitingForResponse) {
     return Status::kDoesNotExistError;
   }
 
-  auto maybe_new_packet = p2p_stream_.output().NewPacket(priority.has_value() ? *priority : priority_);
-  if (!maybe_new_packet.ok()) {
+  const P2PPriority cancel_priority = priority.has_value() ? *priority : priority_;
+  P2PActionSubmission *submission = client_->submissions_[cancel_priority].NewValue();
+  if (submission == nullptr) {
     return Status::kUnavailableError;
   }
-  maybe_new_packet->length() = sizeof(P2PApplicationPacketHeader);
-  P2PApplicationPacketHeader *header = reinterpret_cast<P2PApplicationPacketHeader *>(maybe_new_packet->content());
-  header->action = action_;
-  header->stage = P2PActionStage::kCancel;
-  header->request_id = current_request_id_;
-  p2p_stream_.output().Commit(maybe_new_packet->priority(), guarantee_delivery.has_value() ? *guarantee_delivery : guarantee_delivery_);
+  submission->stage = P2PActionStage::kCancel;
+  submission->request_id = current_request_id_;
+  submission->guarantee_delivery = guarantee_delivery.has_value() ? *guarantee_delivery : guarantee_delivery_;
+  submission->payload_length = 0;
+  CommitSubmission(cancel_priority, submission);
 
   state_ = kIdle;
   return Status::kSuccess;
 }
 
+void P2PActionClientHandlerBase::CommitSubmission(P2PPriority priority, P2PActionSubmission *submission) {
+  submission->handler = this;
+  ++num_pending_submissions_;
+  client_->submissions_[priority].Commit(submission);
+  if (client_->submission_callback_) {
+    client_->submission_callback_();
+  }
+}
+
+bool P2PActionClientHandlerBase::Send(P2PPriority priority, const P2PActionSubmission &submission) {
+  // The caller is responsible for locking p2p_mutex_ before calling this function.
+  ASSERT(aggregator_ != nullptr);
+  auto maybe_new_packet = aggregator_->NewMessage(priority, sizeof(P2PApplicationPacketHeader) + submission.payload_length);
+  if (!maybe_new_packet.ok()) {
+    return false;
+  }
+  P2PApplicationPacketHeader *header = reinterpret_cast<P2PApplicationPacketHeader *>(maybe_new_packet->content());
+  header->action = action_;
+  header->stage = submission.stage;
+  header->request_id = submission.request_id;
+  memcpy(maybe_new_packet->content() + sizeof(P2PApplicationPacketHeader), submission.payload, submission.payload_length);
+  if (submission.stage == P2PActionStage::kCancel) {
+    // The rest of a fragmented request would be of no use.
+    fragmenter_->Cancel();
+  }
+  if (!aggregator_->Commit(priority, submission.guarantee_delivery)) {
+    return false;
+  }
+
+  --num_pending_submissions_;
+  OnSubmitted(static_cast<P2PActionStage>(submission.stage), submission.request_id);
+  return true;
+}
+
 bool P2PActionClientHandlerBase::in_progress() const { 
   // No need to lock p2p_mutex_ because state_ is atomic.
   return !allows_concurrent_requests_ && state_ != kIdle;
@@ -71,36 +121,89 @@ void P2PActionClientHandlerBase::OnProgress(int payload_length, const void *payl
 
 void P2PActionClientHandlerBase::OnOtherEndStarted() {
   state_ = kIdle;
+  // The other end cannot complete a fragmented request started before it restarted.
+  if (fragmenter_.has_value()) {
+    fragmenter_->Cancel();
+  }
+}
+
+void P2PActionClientHandlerBase::OnSubmitted(P2PActionStage, P2PActionRequestID) {}
+
+void P2PActionClientHandlerBase::SetClient(P2PActionClient *client, P2PMessageAggregatorLinux *aggregator) {
+  client_ = client;
+  aggregator_ = aggregator;
+  fragmenter_.emplace(aggregator);
 }
 
 P2PActionClient::P2PActionClient(P2PPacketStreamLinux *p2p_stream, const TimerInterface *system_timer)
-  : p2p_stream_(*ASSERT_NOT_NULL(p2p_stream)), system_timer_(*ASSERT_NOT_NULL(system_timer)) {
+  : p2p_stream_(*ASSERT_NOT_NULL(p2p_stream)), system_timer_(*ASSERT_NOT_NULL(system_timer)), aggregator_(&p2p_stream->output(), system_timer) {
   p2p_stream_.other_end_started_callback(P2POtherEndStartedCallback(&P2PActionClient::OnOtherEndStarted, this));
   for (int i = 0; i < sizeof(handlers_) / sizeof(handlers_[0]); ++i) {
     handlers_[i] = nullptr;
   }
+  for (int i = 0; i < P2PPriority::kNumLevels; ++i) {
+    message_offset_[i] = 0;
+  }
 }
 
 void P2PActionClient::Register(P2PActionClientHandlerBase *handler) {
   ASSERT(handler->action() < sizeof(handlers_) / sizeof(handlers_[0]));
   ASSERT(handlers_[handler->action()] == NULL);
   handlers_[handler->action()] = handler;
+  handler->SetClient(this, &aggregator_);
 }
 
 void P2PActionClient::Run() {
   // The caller is responsible for locking p2p_mutex_ before calling this function.
-  // Process new packets.
+  // Process new messages.
+  RunMessage();
+  RunSubmissions();
+  for (size_t i = 0; i < sizeof(handlers_) / sizeof(handlers_[0]); ++i) {
+    if (handlers_[i] != nullptr) {
+      handlers_[i]->fragmenter_->Run();
+    }
+  }
+  aggregator_.Run();
+}
+
+void P2PActionClient::RunSubmissions() {
+  for (int priority = 0; priority < P2PPriority::kNumLevels; ++priority) {
+    const P2PActionSubmission *submission;
+    while ((submission = submissions_[priority].OldestValue()) != nullptr &&
+           submission->handler->Send(priority, *submission)) {
+      submissions_[priority].Consume();
+    }
+  }
+}
+
+void P2PActionClient::ConsumeMessage(const P2PApplicationMessageView &message) {
+  message_offset_[message.priority()] = message.next_offset();
+  if (message.next_offset() == 0) {
+    p2p_stream_.input().Consume(static_cast<P2PPriority>(message.priority()));
+  }
+}
+
+void P2PActionClient::RunMessage() {
   const auto &maybe_packet = p2p_stream_.input().OldestPacket();
   if (!maybe_packet.ok()) {
     return;
   }  
 
-  const auto *header = reinterpret_cast<const P2PApplicationPacketHeader *>(maybe_packet->content());  
+  const int priority = maybe_packet->priority();
+  const auto maybe_message = P2PGetApplicationMessage(*maybe_packet, message_offset_[priority]);
+  if (!maybe_message.ok()) {
+    LOG_ERROR("Malformed application packet.");
+    message_offset_[priority] = 0;
+    p2p_stream_.input().Consume(static_cast<P2PPriority>(priority));
+    return;
+  }
+
+  const auto *header = maybe_message->header();
   if (header->action >= P2PAction::kCount) {
     std::ostringstream oss;
     oss << "Unknown action " << header->action << ".";
     LOG_ERROR(oss.str().c_str());
-    p2p_stream_.input().Consume(maybe_packet->priority());
+    ConsumeMessage(*maybe_message);
     return;
   }
 
@@ -109,23 +212,23 @@ void P2PActionClient::Run() {
     std::ostringstream oss;
     oss << "No handler installed for action " << header->action << ".";
     LOG_WARNING(oss.str().c_str());    
-    p2p_stream_.input().Consume(maybe_packet->priority());
+    ConsumeMessage(*maybe_message);
     return;
   }
 
   if (header->request_id != handler->current_request_id()) {
     // This is a response from a previous action that was cancelled.
-    p2p_stream_.input().Consume(maybe_packet->priority());
+    ConsumeMessage(*maybe_message);
     return;
   }
 
-  const uint8_t *payload = maybe_packet->content() + sizeof(P2PApplicationPacketHeader);
+  const uint8_t *payload = maybe_message->content() + sizeof(P2PApplicationPacketHeader);
   switch(header->stage) {
     case P2PActionStage::kReply:
-      handler->OnReply(maybe_packet->length() - sizeof(P2PApplicationPacketHeader), payload);
+      handler->OnReply(maybe_message->length() - sizeof(P2PApplicationPacketHeader), payload);
       break;
     case P2PActionStage::kProgress:
-      handler->OnProgress(maybe_packet->length() - sizeof(P2PApplicationPacketHeader), payload);
+      handler->OnProgress(maybe_message->length() - sizeof(P2PApplicationPacketHeader), payload);
       break;
     default: {
       std::ostringstream oss;
@@ -134,12 +237,16 @@ void P2PActionClient::Run() {
       break;
     }
   }
-  p2p_stream_.input().Consume(maybe_packet->priority());
+  ConsumeMessage(*maybe_message);
 }
 
 void P2PActionClient::OnOtherEndStarted(void *p_self) {
   ASSERT_NOT_NULL(p_self);
   P2PActionClient &self = *reinterpret_cast<P2PActionClient *>(p_self);
+  // The input stream was reset, so no packet is partially processed.
+  for (int i = 0; i < P2PPriority::kNumLevels; ++i) {
+    self.message_offset_[i] = 0;
+  }
   for (int i = 0; i < sizeof(handlers_) / sizeof(handlers_[0]); ++i) {
     if (self.handlers_[i] != nullptr) {
       self.handlers_[i]->OnOtherEndStarted();
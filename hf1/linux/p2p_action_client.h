@@ -5,9 +5,30 @@
 #include "p2p_packet_stream_linux.h"
 #include "timer_interface.h"
 #include "logger_interface.h"
+#include "mpsc_ring_buffer.h"
 #include <mutex>
 #include <optional>
 #include <atomic>
+#include <functional>
+#include <vector>
+
+// Maximum number of requests and cancellations of each priority that can wait for the link
+// thread to send them. Must be a power of two.
+#define kP2PActionSubmissionQueueCapacity 16
+
+class P2PActionClient;
+class P2PActionClientHandlerBase;
+
+// Request or cancellation that an application thread submitted, waiting for the link thread
+// to pass it to the output stream.
+typedef struct {
+  P2PActionClientHandlerBase *handler;
+  P2PActionStage stage;
+  P2PActionRequestID request_id;
+  bool guarantee_delivery;
+  int payload_length;
+  uint8_t payload[kP2PMaxContentLength - sizeof(P2PApplicationPacketHeader)];
+} P2PActionSubmission;
 
 class P2PActionClientHandlerBase {
 public:  
@@ -19,17 +40,26 @@ public:
       priority_(default_priority),
       guarantee_delivery_(default_guarantee_delivery),
       p2p_stream_(*ASSERT_NOT_NULL(p2p_stream)), 
+      client_(nullptr),
+      aggregator_(nullptr),
       current_request_id_(0),
       p2p_mutex_(*ASSERT_NOT_NULL(p2p_mutex)),
       allows_concurrent_requests_(allows_concurrent_requests), 
-      state_(kIdle) {}
+      state_(kIdle),
+      num_pending_submissions_(0) {}
 
   // Sends an action request message with the given `payload`.
   // If `priority` and `guarantee_delivery` are passed, they override the default
   // configuration passed in the constructor.
   // If successful, it resturn Status::kSuccess.
   // If the action is already in progress, it returns Status::kExistsError.
-  // If no P2P packet slots are available to send the message, it returns Status::kUnavailableError.
+  // If the submission queue of the priority is full, it returns Status::kUnavailableError.
+  // The message is queued without locking the p2p_mutex, and the client's Run() passes it to
+  // the output stream as soon as there is room (see OnSubmitted()). It may share a packet with
+  // other messages of the same priority.
+  // If the message does not fit in a packet, it is sent in fragments with guaranteed delivery
+  // by the client's Run(). In the meantime, other requests that do not fit in a packet return
+  // Status::kUnavailableError. Only these requests lock the p2p_mutex.
   Status Request(int payload_length, const void *payload, std::optional<P2PPriority> priority = std::nullopt, std::optional<bool> guarantee_delivery = std::nullopt);
 
   // Sends an action cancellation message.
@@ -37,34 +67,58 @@ public:
   // configuration passed in the constructor.
   // If successful, it resturn Status::kSuccess.
   // If the action was not in progress, it returns Status::kDoesNotExistsError.
-  // If no P2P packet slots are available to send the message, it returns Status::kUnavailableError.
+  // If the submission queue of the priority is full, it returns Status::kUnavailableError.
+  // Like requests, cancellations are queued without locking the p2p_mutex.
   Status Cancel(std::optional<P2PPriority> priority = std::nullopt, std::optional<bool> guarantee_delivery = std::nullopt);
 
   P2PAction action() const { return action_; }
   // True if the action is being executed; false, otherwise.
   bool in_progress() const;
 
+  // Number of requests and cancellations submitted and not passed to the output stream yet.
+  // Can be called from any thread.
+  int num_pending_submissions() const { return num_pending_submissions_; }
+
   // Overrides must call the parent.
   virtual void OnReply(int payload_length, const void *payload);
   virtual void OnProgress(int payload_length, const void *payload);
   virtual void OnOtherEndStarted();
+  // Called from the client's Run() when a request or cancellation submitted before has been
+  // passed to the output stream.
+  virtual void OnSubmitted(P2PActionStage stage, P2PActionRequestID request_id);
 
 protected:
-  // Must be called with p2p_mutex_ locked.
   P2PActionRequestID current_request_id() const { return current_request_id_; }
 
 private:
+  // Must be called with p2p_mutex_ locked.
+  void SetClient(P2PActionClient *client, P2PMessageAggregatorLinux *aggregator);
+  // Makes a submission obtained from the client's queue of `priority` visible to its Run().
+  void CommitSubmission(P2PPriority priority, P2PActionSubmission *submission);
+  // Passes a submitted message to the output stream. Returns false if there is no room for
+  // it yet. Must be called with p2p_mutex_ locked.
+  bool Send(P2PPriority priority, const P2PActionSubmission &submission);
+
   P2PAction action_;
   P2PPriority priority_;
   bool guarantee_delivery_;
   P2PPacketStreamLinux &p2p_stream_;
-  P2PActionRequestID current_request_id_;
+  // Set by the client when the handler is registered.
+  P2PActionClient *client_;
+  P2PMessageAggregatorLinux *aggregator_;
+  // Sends the requests that do not fit in a packet. Set with the aggregator.
+  std::optional<P2PMessageFragmenterLinux> fragmenter_;
+  // Copy of the request being fragmented.
+  std::vector<uint8_t> fragmented_payload_;
+  // Atomic, as requests are submitted without locking.
+  std::atomic<P2PActionRequestID> current_request_id_;
   std::mutex &p2p_mutex_;
   const bool allows_concurrent_requests_;
 
   using State = enum { kIdle, kWaitingForResponse };
   // Since the state is atomic, we can read it without locking.
   std::atomic<State> state_;
+  std::atomic<int> num_pending_submissions_;
 };
 
 template<typename TRequest, typename TReply = P2PVoid, typename TProgress = P2PVoid> class P2PActionClientHandler : public P2PActionClientHandlerBase {
@@ -84,7 +138,7 @@ public:
     reply_callback_ = reply_callback;
     progress_callback_ = progress_callback;
     other_end_started_callback_ = other_end_started_callback;
-    return P2PActionClientHandlerBase::Request(sizeof(TRequest), &request, priority, guarantee_delivery);
+    return P2PActionClientHandlerBase::Request(P2PGetRequestLength<kP2PLocalEndianness>(request), &request, priority, guarantee_delivery);
   }
 
 protected:
@@ -112,6 +166,9 @@ private:
 
 class P2PActionClient {
 public:
+  // The handlers submit their messages to the client's queues.
+  friend class P2PActionClientHandlerBase;
+
   // Does not take ownership of the pointees, which must outlive this object.
   P2PActionClient(P2PPacketStreamLinux *p2p_stream, const TimerInterface *system_timer);
 
@@ -122,20 +179,39 @@ public:
     return handlers_[action];
   }
 
-  // Dispatches reply and progress packets to handler callbacks.
+  // Dispatches reply and progress messages to handler callbacks, and sends the pending
+  // messages of the handlers when due.
   // Should be called with the p2p_mutex passed to the P2PActionClientHandlers locked.
   void Run();
 
+  // Sets a callback that is called from the submitting thread after a handler queues a
+  // message, e.g. to wake up the link thread with P2PLinkReactor::Wake().
+  void submission_callback(const std::function<void()> &callback) { submission_callback_ = callback; }
+
   P2PPacketStreamLinux &p2p_stream() { return p2p_stream_; }
 
 private:
   // Called when the other end is restarted.
   // Notifies all action handlers.
   static void OnOtherEndStarted(void *p_self);
+  // Dispatches the next input message, if any.
+  void RunMessage();
+  // Passes the submitted messages to the output stream, in order within each priority, until
+  // there is no room for the next one.
+  void RunSubmissions();
+  // Moves on to the next message in the packet of `message`, and consumes the packet after
+  // its last message.
+  void ConsumeMessage(const P2PApplicationMessageView &message);
 
   P2PPacketStreamLinux &p2p_stream_;
   const TimerInterface &system_timer_;
+  P2PMessageAggregatorLinux aggregator_;
   P2PActionClientHandlerBase *handlers_[P2PAction::kCount];
+  // Messages submitted by the handlers of all actions, written by any thread and read by Run().
+  MPSCRingBuffer<P2PActionSubmission, kP2PActionSubmissionQueueCapacity> submissions_[P2PPriority::kNumLevels];
+  std::function<void()> submission_callback_;
+  // Offset of the next message to process in the oldest input packet of each priority.
+  int message_offset_[P2PPriority::kNumLevels];
 };
 
 #endif  // P2P_ACTION_CLIENT_INCLUDED_
\ No newline at end of file
@@ -3,6 +3,9 @@
 
 int P2PByteStreamLinux::Write(const void *buffer, int length) {
   int result = write(handler().fd, buffer, length);
+  if (result < length) {
+    ++num_blocked_writes_;
+  }
   return result != -1 ? result : 0;
 }
 
@@ -10,16 +13,3 @@ int P2PByteStreamLinux::Read(void *buffer, int length) {
   int result = read(handler().fd, buffer, length);
   return result != -1 ? result : 0;
 }
-
-int P2PByteStreamLinux::GetBurstMaxLength() {
-  return 42;
-}
-
-int P2PByteStreamLinux::GetBurstIngestionNanosecondsPerByte() {
-	return 250000;
-}
-
-int P2PByteStreamLinux::GetAtomicSendMaxLength() {
-  return 4;
-}
-
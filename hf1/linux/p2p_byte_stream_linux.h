@@ -1,14 +1,34 @@
+#ifndef P2P_BYTE_STREAM_LINUX_INCLUDED__
+#define P2P_BYTE_STREAM_LINUX_INCLUDED__
+
 #include "p2p_byte_stream_interface.h"
 
-class P2PByteStreamLinux : public P2PByteStreamInterface<kLittleEndian> {
+// Size of the receive buffer of the kernel's TTY layer (N_TTY_BUF_SIZE).
+#define kP2PTTYReceiveBufferLength 4096
+
+// Final, so that the packet streams that take it as their ByteStream type call it directly.
+class P2PByteStreamLinux final : public P2PByteStreamInterface<kLittleEndian> {
 public:
   // Does not take ownership of the stream, which must outlive this object.
   P2PByteStreamLinux(int fd) 
-    : P2PByteStreamInterface<kLittleEndian>(Handler{ .fd = fd}) {}
+    : P2PByteStreamInterface<kLittleEndian>(Handler{ .fd = fd}), num_blocked_writes_(0) {}
 
   virtual int Write(const void *buffer, int length);
   virtual int Read(void *buffer, int length);
-  virtual int GetBurstMaxLength();
-  virtual int GetBurstIngestionNanosecondsPerByte();
-  virtual int GetAtomicSendMaxLength();
+  // The link constants are defined here, so that they are folded into the packet streams.
+  virtual int GetBurstMaxLength() { return 42; }
+  virtual int GetBurstIngestionNanosecondsPerByte() { return 250000; }
+  virtual int GetAtomicSendMaxLength() { return 4; }
+  virtual int GetReceiveBufferLength() { return kP2PTTYReceiveBufferLength; }
+
+  int fd() const { return handler().fd; }
+
+  // Number of writes that could not send all their bytes because the output buffer of the
+  // file descriptor was full. The caller may wait until it is writable before writing again.
+  uint64_t num_blocked_writes() const { return num_blocked_writes_; }
+
+private:
+  uint64_t num_blocked_writes_;
 };
+
+#endif  // P2P_BYTE_STREAM_LINUX_INCLUDED__
@@ -0,0 +1,233 @@
+#include "p2p_link_reactor.h"
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#include <errno.h>
+#include <algorithm>
+#include <thread>
+#include "logger_interface.h"
+
+P2PLinkReactor::P2PLinkReactor(P2PByteStreamLinux *byte_stream, P2PPacketStreamLinux *p2p_stream, std::mutex *p2p_mutex)
+  : byte_stream_(*ASSERT_NOT_NULL(byte_stream)),
+    p2p_stream_(*ASSERT_NOT_NULL(p2p_stream)),
+    p2p_mutex_(*ASSERT_NOT_NULL(p2p_mutex)),
+    input_epoll_fd_(-1),
+    input_event_fd_(-1),
+    can_read_(true),
+    can_write_(true),
+    is_running_streams_(false),
+    stop_requested_(false),
+    num_wake_ups_(0) {
+  epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+  ASSERTM(epoll_fd_ >= 0, "Error creating epoll instance");
+  timer_fd_ = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  ASSERTM(timer_fd_ >= 0, "Error creating timerfd");
+  event_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  ASSERTM(event_fd_ >= 0, "Error creating eventfd");
+
+  struct epoll_event event;
+  if (p2p_stream_.is_full_duplex()) {
+    // An fd can be watched by several epoll instances: each thread waits for its own events.
+    input_epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+    ASSERTM(input_epoll_fd_ >= 0, "Error creating epoll instance");
+    input_event_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    ASSERTM(input_event_fd_ >= 0, "Error creating eventfd");
+    event.events = EPOLLIN | EPOLLET;
+    event.data.fd = byte_stream_.fd();
+    ASSERTM(epoll_ctl(input_epoll_fd_, EPOLL_CTL_ADD, byte_stream_.fd(), &event) >= 0, "Error watching the byte stream");
+    event.events = EPOLLIN;
+    event.data.fd = input_event_fd_;
+    ASSERTM(epoll_ctl(input_epoll_fd_, EPOLL_CTL_ADD, input_event_fd_, &event) >= 0, "Error watching the eventfd");
+    event.events = EPOLLOUT | EPOLLET;
+  } else {
+    event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+  }
+  event.data.fd = byte_stream_.fd();
+  ASSERTM(epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, byte_stream_.fd(), &event) >= 0, "Error watching the byte stream");
+  event.events = EPOLLIN;
+  event.data.fd = timer_fd_;
+  ASSERTM(epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, timer_fd_, &event) >= 0, "Error watching the timerfd");
+  event.events = EPOLLIN;
+  event.data.fd = event_fd_;
+  ASSERTM(epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, event_fd_, &event) >= 0, "Error watching the eventfd");
+
+  p2p_stream_.output().packet_committed_callback(P2PPacketCommittedCallback(&P2PLinkReactor::OnPacketCommitted, this));
+}
+
+P2PLinkReactor::~P2PLinkReactor() {
+  p2p_stream_.output().packet_committed_callback(P2PPacketCommittedCallback());
+  if (input_epoll_fd_ >= 0) {
+    close(input_event_fd_);
+    close(input_epoll_fd_);
+  }
+  close(event_fd_);
+  close(timer_fd_);
+  close(epoll_fd_);
+}
+
+void P2PLinkReactor::Run(const RunCallback &callback) {
+  if (p2p_stream_.is_full_duplex()) {
+    std::thread output_thread(&P2PLinkReactor::RunOutputThread, this);
+    while (!stop_requested_) {
+      RunInput();
+      {
+        std::lock_guard<std::mutex> guard(p2p_mutex_);
+        // The input stream only takes note of restarts of the other end, as it runs unlocked.
+        p2p_stream_.NotifyOtherEndStarted();
+        callback();
+      }
+      // Send the ACKs of the packets received, and apply the ACKs received.
+      if (p2p_stream_.has_pending_control_events()) {
+        WakeOutput();
+      }
+      WaitForEvents(input_epoll_fd_);
+    }
+    output_thread.join();
+    stop_requested_ = false;
+    return;
+  }
+
+  // Run once before waiting, as there may be bytes or packets from before the reactor existed.
+  {
+    std::lock_guard<std::mutex> guard(p2p_mutex_);
+    RunStreams(callback);
+  }
+  while (!stop_requested_) {
+    WaitForEvents(epoll_fd_);
+    std::lock_guard<std::mutex> guard(p2p_mutex_);
+    RunStreams(callback);
+  }
+  stop_requested_ = false;
+}
+
+void P2PLinkReactor::Stop() {
+  stop_requested_ = true;
+  Wake();
+}
+
+void P2PLinkReactor::Wake() {
+  if (input_event_fd_ >= 0) {
+    SignalEventFd(input_event_fd_);
+  }
+  WakeOutput();
+}
+
+void P2PLinkReactor::WakeOutput() {
+  SignalEventFd(event_fd_);
+}
+
+void P2PLinkReactor::WaitForEvents(int epoll_fd) {
+  struct epoll_event events[kP2PLinkReactorMaxEvents];
+  const int num_events = epoll_wait(epoll_fd, events, kP2PLinkReactorMaxEvents, -1);
+  if (num_events < 0) {
+    ASSERTM(errno == EINTR, "Error waiting for link events");
+    return;
+  }
+  ++num_wake_ups_;
+  const bool is_input_epoll = epoll_fd == input_epoll_fd_;
+  for (int i = 0; i < num_events; ++i) {
+    if (events[i].data.fd == byte_stream_.fd()) {
+      // Errors and hang-ups are reported by the reads and writes of the streams, and to both
+      // epoll instances of full-duplex streams.
+      if (is_input_epoll || input_epoll_fd_ < 0) {
+        can_read_ |= (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) != 0;
+      }
+      if (!is_input_epoll) {
+        can_write_ |= (events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) != 0;
+      }
+    } else {
+      // The timerfd or an eventfd.
+      ClearCounterFd(events[i].data.fd);
+    }
+  }
+}
+
+void P2PLinkReactor::RunStreams(const RunCallback &callback) {
+  is_running_streams_ = true;
+  RunInput();
+  callback();
+  RunOutput();
+  is_running_streams_ = false;
+}
+
+void P2PLinkReactor::RunInput() {
+  if (can_read_) {
+    // The fd is edge-triggered: read until it is drained, or no new edge will come.
+    do {
+      p2p_stream_.input().Run();
+    } while (!p2p_stream_.input().is_byte_stream_drained());
+    can_read_ = false;
+  }
+}
+
+void P2PLinkReactor::RunOutput() {
+  P2PPacketOutputStream<kP2POutputCapacity, kP2PLocalEndianness, P2PByteStreamLinux> &output = p2p_stream_.output();
+  uint64_t timeout_ns = 0;
+  if (can_write_) {
+    while (true) {
+      const uint64_t num_blocked_writes = byte_stream_.num_blocked_writes();
+      timeout_ns = output.Run();
+      if (byte_stream_.num_blocked_writes() != num_blocked_writes) {
+        // The output buffer is full: wait until the fd signals room.
+        can_write_ = false;
+        break;
+      }
+      if (timeout_ns > 0 || output.is_idle()) { break; }
+    }
+  } else if (p2p_stream_.has_pending_control_events()) {
+    // Apply the ACKs received, which do not need room to write.
+    output.Run();
+  }
+  if (output.NumCommittedPackets() > 0) {
+    // Bundles may wait for the packets in the output stream: do not sleep past their delay.
+    timeout_ns = timeout_ns > 0 ? std::min<uint64_t>(timeout_ns, kP2PLinkReactorMaxBusyWaitNs) : kP2PLinkReactorMaxBusyWaitNs;
+  }
+  ArmTimer(timeout_ns);
+}
+
+void P2PLinkReactor::RunOutputThread() {
+  while (!stop_requested_) {
+    {
+      std::lock_guard<std::mutex> guard(p2p_mutex_);
+      // Packets committed meanwhile are sent now: they need not wake this thread.
+      is_running_streams_ = true;
+      RunOutput();
+      is_running_streams_ = false;
+    }
+    WaitForEvents(epoll_fd_);
+  }
+}
+
+void P2PLinkReactor::ArmTimer(uint64_t timeout_ns) {
+  struct itimerspec timer_spec = {};
+  // A zero it_value disarms the timer.
+  timer_spec.it_value.tv_sec = timeout_ns / 1000000000ULL;
+  timer_spec.it_value.tv_nsec = timeout_ns % 1000000000ULL;
+  ASSERT(timerfd_settime(timer_fd_, 0, &timer_spec, NULL) >= 0);
+}
+
+void P2PLinkReactor::SignalEventFd(int fd) {
+  const uint64_t increment = 1;
+  if (write(fd, &increment, sizeof(increment)) != sizeof(increment)) {
+    // The counter is saturated only if nobody read it: the thread waiting for it wakes up anyway.
+    ASSERTM(errno == EAGAIN, "Error signaling the eventfd");
+  }
+}
+
+void P2PLinkReactor::ClearCounterFd(int fd) {
+  uint64_t counter;
+  if (read(fd, &counter, sizeof(counter)) != sizeof(counter)) {
+    // Nothing to clear, e.g. the timer was re-armed since the epoll instance reported it.
+    ASSERTM(errno == EAGAIN, "Error reading the counter of the eventfd or timerfd");
+  }
+}
+
+void P2PLinkReactor::OnPacketCommitted(const P2PPacket &, void *self_ptr) {
+  P2PLinkReactor &self = *reinterpret_cast<P2PLinkReactor *>(self_ptr);
+  // Packets committed while running the output stream are sent before the reactor waits again.
+  // Otherwise, the committer holds p2p_mutex, so the reactor is not running the output stream.
+  if (!self.is_running_streams_) {
+    self.WakeOutput();
+  }
+}
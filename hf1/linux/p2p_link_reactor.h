@@ -0,0 +1,102 @@
+#ifndef P2P_LINK_REACTOR_INCLUDED_
+#define P2P_LINK_REACTOR_INCLUDED_
+
+#include "p2p_packet_stream_linux.h"
+#include "p2p_byte_stream_linux.h"
+#include "p2p_message_aggregator.h"
+#include <atomic>
+#include <functional>
+#include <mutex>
+
+// Maximum number of events handled per wake-up of the reactor.
+#define kP2PLinkReactorMaxEvents 4
+
+// Maximum time that the reactor sleeps while there are packets in the output stream, so that
+// the application messages waiting in a bundle for them are sent on time.
+#define kP2PLinkReactorMaxBusyWaitNs kP2PMaxAggregationDelayNs
+
+// Runs a P2P link from the events of its byte stream, instead of spinning on the streams'
+// Run() functions.
+// The file descriptor of the byte stream is watched with edge-triggered epoll, so the input
+// stream only runs when bytes arrive, and the output stream only writes when there is room.
+// A timerfd wakes the reactor when the output stream has something to do later, as returned
+// by P2PPacketOutputStream::Run(), and an eventfd wakes it when other threads commit packets.
+// If the packet stream is full duplex, the output stream runs in a thread of its own, so that
+// sending never delays receiving, and the other way around.
+class P2PLinkReactor {
+public:
+  using RunCallback = std::function<void()>;
+
+  // Does not take ownership of the pointees, which must outlive this object.
+  // Takes over the packet committed callback of the output stream, to wake up on new packets.
+  P2PLinkReactor(P2PByteStreamLinux *byte_stream, P2PPacketStreamLinux *p2p_stream, std::mutex *p2p_mutex);
+  virtual ~P2PLinkReactor();
+
+  // Runs the link until Stop() is called. After every wake-up, it runs the streams and
+  // `callback` with p2p_mutex locked. The callback should run the application logic, e.g.
+  // P2PActionClient::Run().
+  // With a full-duplex packet stream, the calling thread only runs the input stream, without
+  // locking p2p_mutex, and the other end started callback of the packet stream and `callback`,
+  // with p2p_mutex locked. The output stream runs in a new
+  // thread with p2p_mutex locked, so p2p_mutex still guards the output stream.
+  void Run(const RunCallback &callback);
+
+  // Makes Run() return after the current wake-up. Can be called from any thread.
+  void Stop();
+
+  // Wakes up Run() to run the callback and to send the packets committed by other threads.
+  // Can be called from any thread.
+  void Wake();
+
+  // Number of times that Run() woke up, in either thread.
+  uint64_t num_wake_ups() const { return num_wake_ups_; }
+
+private:
+  // Waits for the events of `epoll_fd` and takes note of them.
+  void WaitForEvents(int epoll_fd);
+  // Runs the input stream, the callback and the output stream of a packet stream that is not
+  // full duplex. Must be called with p2p_mutex locked.
+  void RunStreams(const RunCallback &callback);
+  // Runs the input stream while there are bytes to read.
+  void RunInput();
+  // Runs the output stream until it must wait for room in the byte stream, for a timeout or for
+  // new packets. Then, arms the timer for the next timeout. Must be called with p2p_mutex
+  // locked.
+  void RunOutput();
+  // Runs the output stream of a full-duplex packet stream until Stop() is called.
+  void RunOutputThread();
+  // Wakes up the thread that runs the output stream, e.g. to send a new packet.
+  void WakeOutput();
+  // Arms the timer to expire after `timeout_ns`, or disarms it if it is 0.
+  void ArmTimer(uint64_t timeout_ns);
+  // Adds 1 to the counter of the eventfd `fd`, which wakes up the threads waiting for it.
+  static void SignalEventFd(int fd);
+  // Resets the counter of the eventfd or timerfd `fd`, so that it is not readable until it is
+  // signaled or expires again.
+  static void ClearCounterFd(int fd);
+
+  static void OnPacketCommitted(const P2PPacket &packet, void *self_ptr);
+
+  P2PByteStreamLinux &byte_stream_;
+  P2PPacketStreamLinux &p2p_stream_;
+  std::mutex &p2p_mutex_;
+  // Events of the output stream, and also of the input stream if the packet stream is not
+  // full duplex.
+  int epoll_fd_;
+  int timer_fd_;
+  int event_fd_;
+  // Events of the input stream of a full-duplex packet stream, or -1.
+  int input_epoll_fd_;
+  int input_event_fd_;
+  // The byte stream has signaled bytes to read or room to write since the last time that the
+  // streams found it drained or full. Only the thread of the respective stream uses each.
+  bool can_read_;
+  bool can_write_;
+  // True while the output stream runs, so that the packets committed meanwhile do not wake the
+  // reactor. Guarded by p2p_mutex_.
+  bool is_running_streams_;
+  std::atomic<bool> stop_requested_;
+  std::atomic<uint64_t> num_wake_ups_;
+};
+
+#endif  // P2P_LINK_REACTOR_INCLUDED_
@@ -1,12 +1,17 @@
 #ifndef P2P_PACKET_STREAM_LINUX_INCLUDED__
 #define P2P_PACKET_STREAM_LINUX_INCLUDED__
 
+#include "p2p_byte_stream_linux.h"
 #include "p2p_packet_stream.h"
+#include "p2p_message_aggregator.h"
+#include "p2p_message_fragmenter.h"
 
 #define kP2PInputCapacity 16
 #define kP2POutputCapacity 16
 #define kP2PLocalEndianness kLittleEndian
 
-using P2PPacketStreamLinux = P2PPacketStream<kP2PInputCapacity, kP2POutputCapacity, kP2PLocalEndianness>;
+using P2PPacketStreamLinux = P2PPacketStream<kP2PInputCapacity, kP2POutputCapacity, kP2PLocalEndianness, P2PByteStreamLinux>;
+using P2PMessageAggregatorLinux = P2PMessageAggregator<kP2POutputCapacity, kP2PLocalEndianness, P2PByteStreamLinux>;
+using P2PMessageFragmenterLinux = P2PMessageFragmenter<kP2POutputCapacity, kP2PLocalEndianness, P2PByteStreamLinux>;
 
 #endif  // P2P_PACKET_STREAM_LINUX_INCLUDED__
\ No newline at end of file
@@ -79,11 +79,11 @@ bool Uart::CanRead(int timeout_ms) {
 bool Uart::CanWrite(int timeout_ms) {
     struct pollfd serial_poll;
     serial_poll.fd = fd_;
-    serial_poll.events = POLLIN;
+    serial_poll.events = POLLOUT;
     serial_poll.revents = 0;
 
     int poll_res = poll(&serial_poll, 1, timeout_ms);
     ASSERT(poll_res != -1);
 
-    return serial_poll.revents & POLLIN;
+    return serial_poll.revents & POLLOUT;
 }